@@ -0,0 +1,671 @@
+#define _POSIX_C_SOURCE 200809L
+/*****************************************************************************
+ * bench.c
+ *
+ * A headless benchmark of the editor. It generates files of several
+ * shapes, loads each one, feeds streams of events through update() as
+ * though they had been typed, and reports how long each event took,
+ * how many events went through per second, and the peak memory used.
+ * Rendering is timed on a screen held in memory, which also counts the
+ * output a terminal would have been sent.
+ *
+ * Usage: bench [--scale N] [--jobs N]
+ *
+ * The scale multiplies the size of every generated file.
+ *
+ ****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <buffer.h>
+#include <common.h>
+#include <files.h>
+#include <jobs.h>
+#include <render.h>
+#include <screen.h>
+#include <state.h>
+#include <stats.h>
+
+// The most latencies kept for a single workload
+const size_t max_samples = 1 << 20;
+
+// Text typed and pasted by the workloads
+const char* const typed_text = "the quick brown fox jumps over the lazy dog ";
+const size_t paste_size = 1 << 16;
+
+// The size of the screen rendered to
+const size_t screen_height = 50;
+const size_t screen_width = 160;
+
+typedef struct samples_t
+{
+  long long* latencies;
+  size_t count;
+  long long total;
+  size_t bytes;
+
+  // Anything else the workload has to report
+  char note[128];
+} samples_t;
+
+/*
+ * A file to benchmark against: lines of line_length bytes, or of
+ * lengths up to line_length if ragged, indented with tabs if indented.
+ */
+typedef struct file_shape_t
+{
+  const char* name;
+  size_t lines;
+  size_t line_length;
+  bool ragged;
+  bool indented;
+  bool utf8;
+} file_shape_t;
+
+typedef struct workload_t
+{
+  const char* name;
+  error_t (*run)(editor_state_t* const state, samples_t* const samples);
+} workload_t;
+
+/*
+ * Write a file of the given shape, scaled, to filename, and set size to
+ * the number of bytes written.
+ */
+bool
+generate_file(const char* const filename,
+              const file_shape_t* const shape,
+              const size_t scale,
+              size_t* const size);
+
+/*
+ * Feed an event to the editor, and write any edit it makes to the
+ * journal if one is kept, as the event loop would, timing both.
+ */
+error_t
+send_event(editor_state_t* const state,
+           samples_t* const samples,
+           const event_t event);
+
+/*
+ * Feed each character of keys to the editor as an event.
+ */
+error_t
+send_keys(editor_state_t* const state,
+          samples_t* const samples,
+          const char* const keys);
+
+/*
+ * Record how long an event took.
+ */
+void
+add_sample(samples_t* const samples, const long long latency);
+
+/*
+ * Print the percentiles of the samples, and their throughput.
+ */
+void
+report_samples(const char* const shape,
+               const char* const workload,
+               samples_t* const samples);
+
+/*
+ * The peak resident set size of the process so far, in kilobytes.
+ */
+long
+peak_rss(void);
+
+int
+compare_latencies(const void* a, const void* b);
+
+/*
+ * Workloads
+ */
+error_t
+type_text(editor_state_t* const state, samples_t* const samples);
+error_t
+paste_lines(editor_state_t* const state, samples_t* const samples);
+error_t
+scroll_lines(editor_state_t* const state, samples_t* const samples);
+error_t
+jump_lines(editor_state_t* const state, samples_t* const samples);
+error_t
+save_file(editor_state_t* const state, samples_t* const samples);
+error_t
+save_in_background(editor_state_t* const state, samples_t* const samples);
+error_t
+patch_file(editor_state_t* const state, samples_t* const samples);
+error_t
+type_journalled(editor_state_t* const state, samples_t* const samples);
+error_t
+render_frames(editor_state_t* const state, samples_t* const samples);
+error_t
+locate_top_lines(editor_state_t* const state, samples_t* const samples);
+
+const file_shape_t shapes[] = {
+  { "short-lines", 200000, 40, false, false, false },
+  { "long-lines", 2000, 4000, false, false, false },
+  { "source", 100000, 100, true, true, false },
+  { "utf8", 50000, 80, true, false, true },
+  { "one-line", 1, 1 << 22, false, false, false },
+};
+
+const workload_t workloads[] = {
+  { "type", type_text },       { "paste", paste_lines },
+  { "scroll", scroll_lines },  { "jump", jump_lines },
+  { "save", save_file },       { "bgsave", save_in_background },
+  { "patch", patch_file },     { "journal", type_journalled },
+  { "render", render_frames }, { "locate", locate_top_lines },
+};
+
+int
+main(int argc, char* argv[])
+{
+  size_t scale = 1;
+  size_t jobs = default_jobs();
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    const size_t value = strtoul(argv[i + 1], NULL, 10);
+    if (strcmp(argv[i], "--scale") == 0 && value > 0) {
+      scale = value;
+    } else if (strcmp(argv[i], "--jobs") == 0 && value > 0) {
+      jobs = value;
+    } else {
+      fprintf(stderr, "Usage: %s [--scale N] [--jobs N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  const char* tmpdir = getenv("TMPDIR");
+  char filename[4096];
+  snprintf(filename,
+           sizeof(filename),
+           "%s/v-bench-%ld.txt",
+           tmpdir ? tmpdir : "/tmp",
+           (long)getpid());
+
+  samples_t samples = { 0 };
+  samples.latencies = malloc(max_samples * sizeof(*samples.latencies));
+  if (!samples.latencies) {
+    return 1;
+  }
+
+  printf("%-12s %-8s %8s %9s %9s %9s %9s %10s %10s\n",
+         "file",
+         "workload",
+         "events",
+         "p50 us",
+         "p90 us",
+         "p99 us",
+         "max us",
+         "events/s",
+         "MB/s");
+
+  int status = 0;
+
+  for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]) && !status; i++) {
+    for (size_t j = 0; j < sizeof(workloads) / sizeof(workloads[0]); j++) {
+      size_t file_size;
+      if (!generate_file(filename, &shapes[i], scale, &file_size)) {
+        fprintf(stderr, "Could not write %s\n", filename);
+        status = 1;
+        break;
+      }
+
+      editor_state_t* const state = new_editor_state(filename);
+      if (!state) {
+        status = 1;
+        break;
+      }
+      state->jobs = jobs;
+      // Saves are timed without syncing, so they measure the editor
+      // rather than the disk
+      state->sync_mode = SYNC_NONE;
+
+      // Loading is timed as an event of its own, once per file
+      const long long start = monotonic_time();
+      error_t ret =
+        read_file_into_editor(state->point, filename, jobs, &state->origin);
+      if (j == 0) {
+        samples.count = 0;
+        samples.total = 0;
+        samples.bytes = file_size;
+        add_sample(&samples, monotonic_time() - start);
+        report_samples(shapes[i].name, "load", &samples);
+      }
+
+      samples.count = 0;
+      samples.total = 0;
+      samples.bytes = 0;
+      samples.note[0] = '\0';
+
+      if (ret == SUCCESS) {
+        ret = workloads[j].run(state, &samples);
+      }
+      destroy_editor_state(state);
+
+      if (ret != SUCCESS) {
+        fprintf(stderr, "%s failed on %s\n", workloads[j].name, shapes[i].name);
+        status = 1;
+        break;
+      }
+      report_samples(shapes[i].name, workloads[j].name, &samples);
+      if (samples.note[0]) {
+        printf("%-21s %s\n", "", samples.note);
+      }
+    }
+  }
+
+  unlink(filename);
+  free(samples.latencies);
+
+  printf("peak RSS %ld kB\n", peak_rss());
+
+  return status;
+}
+
+bool
+generate_file(const char* const filename,
+              const file_shape_t* const shape,
+              const size_t scale,
+              size_t* const size)
+{
+  FILE* const fp = fopen(filename, "w");
+  if (!fp) {
+    return false;
+  }
+
+  // Lines repeat the same text, so only their lengths need to vary
+  const char* const ascii = "lorem ipsum dolor sit amet, consectetur; ";
+  const char* const utf8 = "grüße, ωμέγα, 漢字 ";
+  const char* const text = shape->utf8 ? utf8 : ascii;
+  const size_t text_length = strlen(text);
+
+  // Scaling adds lines, except to a file of a single line, which gets
+  // longer instead
+  const bool one_line = shape->lines == 1;
+  const size_t lines = shape->lines * (one_line ? 1 : scale);
+  const size_t line_length = shape->line_length * (one_line ? scale : 1);
+  unsigned int seed = 1;
+  *size = 0;
+
+  for (size_t line = 0; line < lines; line++) {
+    size_t length = line_length;
+    if (shape->ragged) {
+      seed = seed * 1103515245 + 12345;
+      length = (seed >> 16) % (line_length + 1);
+    }
+
+    size_t written = 0;
+    if (shape->indented) {
+      for (size_t tabs = line % 4; tabs > 0 && written < length; tabs--) {
+        fputc('\t', fp);
+        written++;
+      }
+    }
+    // Lines may end part way through a UTF-8 character, as they can in
+    // files on disk
+    while (written < length) {
+      const size_t count = min(text_length, length - written);
+      fwrite(text, 1, count, fp);
+      written += count;
+    }
+    fputc('\n', fp);
+    *size += length + 1;
+  }
+
+  return fclose(fp) == 0;
+}
+
+error_t
+send_event(editor_state_t* const state,
+           samples_t* const samples,
+           const event_t event)
+{
+  const long long start = monotonic_time();
+  const error_t ret = update(event, state);
+  update_journal(state);
+  add_sample(samples, monotonic_time() - start);
+  return ret;
+}
+
+error_t
+send_keys(editor_state_t* const state,
+          samples_t* const samples,
+          const char* const keys)
+{
+  for (const char* key = keys; *key; key++) {
+    const error_t ret = send_event(state, samples, (unsigned char)*key);
+    if (ret != SUCCESS) {
+      return ret;
+    }
+  }
+  return SUCCESS;
+}
+
+void
+add_sample(samples_t* const samples, const long long latency)
+{
+  if (samples->count < max_samples) {
+    samples->latencies[samples->count++] = latency;
+  }
+  samples->total += latency;
+}
+
+void
+report_samples(const char* const shape,
+               const char* const workload,
+               samples_t* const samples)
+{
+  const size_t count = samples->count;
+  if (count == 0) {
+    return;
+  }
+
+  qsort(samples->latencies, count, sizeof(long long), compare_latencies);
+
+  const long long* const sorted = samples->latencies;
+  const double seconds = samples->total / 1e9;
+
+  printf("%-12s %-8s %8zu %9.1f %9.1f %9.1f %9.1f %10.0f ",
+         shape,
+         workload,
+         count,
+         sorted[count / 2] / 1e3,
+         sorted[count * 9 / 10] / 1e3,
+         sorted[count * 99 / 100] / 1e3,
+         sorted[count - 1] / 1e3,
+         seconds > 0 ? count / seconds : 0);
+
+  if (samples->bytes > 0 && seconds > 0) {
+    printf("%10.1f\n", samples->bytes / seconds / (1 << 20));
+  } else {
+    printf("%10s\n", "-");
+  }
+  fflush(stdout);
+}
+
+long
+peak_rss(void)
+{
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_maxrss;
+}
+
+int
+compare_latencies(const void* a, const void* b)
+{
+  const long long x = *(const long long*)a;
+  const long long y = *(const long long*)b;
+  return (x > y) - (x < y);
+}
+
+error_t
+type_text(editor_state_t* const state, samples_t* const samples)
+{
+  // Type into the middle of the file, where the buffer has the most
+  // lines on either side
+  move_cursor_to_line(state, line_number(state->point) + 1000000000);
+  move_cursor_to_line(state, line_number(state->point) / 2);
+
+  error_t ret = send_event(state, samples, 'i');
+
+  for (size_t i = 0; i < 50 && ret == SUCCESS; i++) {
+    ret = send_keys(state, samples, typed_text);
+    // Take a few characters back, then start a new line
+    for (size_t j = 0; j < 4 && ret == SUCCESS; j++) {
+      ret = send_event(state, samples, 127);
+    }
+    if (ret == SUCCESS) {
+      ret = send_event(state, samples, '\n');
+    }
+  }
+
+  if (ret == SUCCESS) {
+    ret = send_event(state, samples, KEY_ESCAPE);
+  }
+  return ret;
+}
+
+error_t
+type_journalled(editor_state_t* const state, samples_t* const samples)
+{
+  size_t replayed = 0;
+  bool partial = false;
+  bool stale = false;
+  state->journal =
+    open_journal(state->point, state->filename, &replayed, &partial, &stale);
+  if (!state->journal) {
+    return WRITE_ERROR;
+  }
+
+  // The journal grows with the typing, whatever the size of the file
+  const error_t ret = type_text(state, samples);
+  snprintf(samples->note,
+           sizeof(samples->note),
+           "journal: %zu bytes for %zu events",
+           journal_position(state->journal),
+           samples->count);
+
+  return ret;
+}
+
+error_t
+paste_lines(editor_state_t* const state, samples_t* const samples)
+{
+  char* const text = malloc(paste_size);
+  if (!text) {
+    return ALLOC_ERROR;
+  }
+
+  const size_t typed_length = strlen(typed_text);
+  for (size_t i = 0; i < paste_size; i++) {
+    text[i] = i % 80 == 79 ? '\n' : typed_text[i % typed_length];
+  }
+
+  move_cursor_to_line(state, 1000000000);
+  move_cursor_to_line(state, line_number(state->point) / 2);
+
+  error_t ret = update('i', state);
+
+  for (size_t i = 0; i < 64 && ret == SUCCESS; i++) {
+    const long long start = monotonic_time();
+    ret = paste_text(state, text, paste_size);
+    add_sample(samples, monotonic_time() - start);
+    samples->bytes += paste_size;
+  }
+
+  if (ret == SUCCESS) {
+    ret = update(KEY_ESCAPE, state);
+  }
+
+  free(text);
+  return ret;
+}
+
+error_t
+scroll_lines(editor_state_t* const state, samples_t* const samples)
+{
+  error_t ret = SUCCESS;
+
+  for (size_t pass = 0; pass < 4 && ret == SUCCESS; pass++) {
+    for (size_t i = 0; i < 5000 && ret == SUCCESS; i++) {
+      ret = send_event(state, samples, 'j');
+    }
+    for (size_t i = 0; i < 5000 && ret == SUCCESS; i++) {
+      ret = send_event(state, samples, 'k');
+    }
+  }
+  return ret;
+}
+
+error_t
+jump_lines(editor_state_t* const state, samples_t* const samples)
+{
+  error_t ret = SUCCESS;
+
+  for (size_t i = 0; i < 100 && ret == SUCCESS; i++) {
+    ret = send_event(state, samples, 'G');
+    if (ret == SUCCESS) {
+      ret = send_keys(state, samples, ":1\n");
+    }
+    if (ret == SUCCESS) {
+      ret = send_keys(state, samples, "1000G");
+    }
+  }
+  return ret;
+}
+
+error_t
+save_file(editor_state_t* const state, samples_t* const samples)
+{
+  error_t ret = SUCCESS;
+
+  for (size_t i = 0; i < 5 && ret == SUCCESS; i++) {
+    // Edit the file each time, so there is always something to write.
+    // Only the write itself is timed.
+    const char* const keys = "ix\x1b:w";
+    for (const char* key = keys; *key && ret == SUCCESS; key++) {
+      ret = update(*key, state);
+    }
+
+    if (ret == SUCCESS) {
+      const long long start = monotonic_time();
+      ret = update('\n', state);
+      add_sample(samples, monotonic_time() - start);
+    }
+  }
+  return ret;
+}
+
+error_t
+save_in_background(editor_state_t* const state, samples_t* const samples)
+{
+  error_t ret = SUCCESS;
+  state->save_in_background = true;
+
+  for (size_t i = 0; i < 5 && ret == SUCCESS; i++) {
+    const char* const keys = "ix\x1b:w";
+    for (const char* key = keys; *key && ret == SUCCESS; key++) {
+      ret = update(*key, state);
+    }
+
+    // Only starting the save holds up editing, so only that is timed
+    if (ret == SUCCESS) {
+      const long long start = monotonic_time();
+      ret = update('\n', state);
+      add_sample(samples, monotonic_time() - start);
+    }
+    if (ret == SUCCESS && !wait_for_save(state)) {
+      ret = WRITE_ERROR;
+    }
+  }
+  return ret;
+}
+
+error_t
+patch_file(editor_state_t* const state, samples_t* const samples)
+{
+  error_t ret = SUCCESS;
+
+  for (size_t i = 0; i < 5 && ret == SUCCESS; i++) {
+    // A line added at the end leaves the rest of the file in place, so
+    // only the new tail needs writing
+    const char* const keys = "Gox\x1b:w";
+    for (const char* key = keys; *key && ret == SUCCESS; key++) {
+      ret = update(*key, state);
+    }
+
+    if (ret == SUCCESS) {
+      const long long start = monotonic_time();
+      ret = update('\n', state);
+      add_sample(samples, monotonic_time() - start);
+    }
+  }
+  return ret;
+}
+
+error_t
+render_frames(editor_state_t* const state, samples_t* const samples)
+{
+  screen_t* const screen = new_memory_screen(screen_height, screen_width);
+  if (!screen) {
+    return ALLOC_ERROR;
+  }
+
+  render_params_t params = { .screen = screen };
+  update_render_params(&params);
+
+  // Scroll down a page at a time with a frame for each line, then type
+  // a little on each page, drawing a frame per key
+  error_t ret = SUCCESS;
+  for (size_t page = 0; page < 20 && ret == SUCCESS; page++) {
+    for (size_t i = 0; i < screen_height && ret == SUCCESS; i++) {
+      ret = update('j', state);
+
+      const long long start = monotonic_time();
+      render(state, &params);
+      add_sample(samples, monotonic_time() - start);
+    }
+
+    const char* const keys = "ifox\x1b";
+    for (const char* key = keys; *key && ret == SUCCESS; key++) {
+      ret = update(*key, state);
+
+      const long long start = monotonic_time();
+      render(state, &params);
+      add_sample(samples, monotonic_time() - start);
+    }
+  }
+
+  const screen_stats_t* const stats = memory_screen_stats(screen);
+  const size_t frames = max(stats->frames, 1);
+  samples->bytes = stats->bytes;
+  snprintf(samples->note,
+           sizeof(samples->note),
+           "per frame: %zu cells written, %zu changed, %zu bytes out",
+           stats->cells_written / frames,
+           stats->cells_changed / frames,
+           stats->bytes / frames);
+
+  destroy_render_params(&params);
+  screen->destroy(screen);
+  return ret;
+}
+
+error_t
+locate_top_lines(editor_state_t* const state, samples_t* const samples)
+{
+  render_params_t params = { .height = screen_height, .width = screen_width };
+
+  // Jump about the file, as though a frame were drawn after each jump
+  move_cursor_to_line(state, 1000000000);
+  const size_t lines = line_number(state->point) + 1;
+  unsigned int seed = 1;
+
+  for (size_t i = 0; i < 10000; i++) {
+    seed = seed * 1103515245 + 12345;
+    move_cursor_to_line(state, (seed >> 8) % lines);
+
+    buffer_iter_t* render_point = NULL;
+    if (copy_buffer_iter(state->point, &render_point) != SUCCESS) {
+      return ALLOC_ERROR;
+    }
+
+    const long long start = monotonic_time();
+    params.top_line =
+      locate_start_of_render(&params, state->line_map, render_point);
+    add_sample(samples, monotonic_time() - start);
+
+    destroy_buffer_iter(render_point);
+  }
+
+  return SUCCESS;
+}
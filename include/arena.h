@@ -0,0 +1,92 @@
+#pragma once
+/*****************************************************************************
+ * arena.h
+ *
+ * Bulk allocators.
+ *
+ * A slab hands out fixed size objects carved from large blocks, and
+ * reuses objects which are returned to it. An arena hands out byte
+ * ranges of any size from large blocks, which are only ever freed all
+ * at once.
+ *
+ ****************************************************************************/
+
+#include <stddef.h>
+
+typedef struct allocator_block_t allocator_block_t;
+
+typedef struct slab_t
+{
+  size_t object_size;
+  size_t block_objects;
+  allocator_block_t* blocks;
+  size_t block_used;
+  void* free_list;
+
+  // Bytes held in blocks, objects handed out and not returned, and
+  // calls made to malloc
+  size_t reserved;
+  size_t live;
+  size_t allocations;
+} slab_t;
+
+typedef struct arena_t
+{
+  size_t block_size;
+  allocator_block_t* blocks;
+  char* next;
+  char* end;
+
+  // Bytes held in blocks, bytes handed out and still in use, and calls
+  // made to malloc
+  size_t reserved;
+  size_t used;
+  size_t allocations;
+} arena_t;
+
+/*
+ * Slabs
+ */
+void
+init_slab(slab_t* const slab,
+          const size_t object_size,
+          const size_t block_objects);
+void
+destroy_slab(slab_t* const slab);
+void*
+slab_alloc(slab_t* const slab);
+void
+slab_free(slab_t* const slab, void* const object);
+
+/*
+ * Move every object of other, which must hold objects of the same
+ * size, into slab, leaving other empty. Objects keep their addresses.
+ */
+void
+merge_slab(slab_t* const slab, slab_t* const other);
+
+/*
+ * Call fn on every object carved from the slab so far, including those
+ * which have since been returned to it.
+ */
+void
+for_each_slab_object(const slab_t* const slab,
+                     void (*fn)(void* object, void* context),
+                     void* context);
+
+/*
+ * Arenas
+ */
+void
+init_arena(arena_t* const arena, const size_t block_size);
+void
+destroy_arena(arena_t* const arena);
+char*
+arena_alloc(arena_t* const arena, const size_t size);
+
+/*
+ * Record that size bytes handed out by the arena are no longer in use.
+ * The memory itself is only reclaimed when the arena is destroyed.
+ */
+void
+arena_release(arena_t* const arena, const size_t size);
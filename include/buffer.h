@@ -10,9 +10,27 @@
 #include <stdbool.h>
 
 #include <common.h>
+#include <damage.h>
+#include <snapshot.h>
 
 typedef struct buffer_iter_t buffer_iter_t;
 
+/*
+ * Counters describing the memory a buffer is using. Reserved bytes
+ * are held by the buffer's allocators, and used bytes are those
+ * actually holding cells or text.
+ */
+typedef struct buffer_stats_t
+{
+  size_t lines;
+  size_t cell_bytes_reserved;
+  size_t cell_bytes_used;
+  size_t line_bytes_reserved;
+  size_t line_bytes_used;
+  size_t mapped_bytes;
+  size_t allocations;
+} buffer_stats_t;
+
 /*
  * Create and destroy buffers
  */
@@ -21,6 +39,13 @@ new_buffer();
 void
 destroy_buffer(buffer_iter_t* buffer);
 
+/*
+ * Give back the memory the buffer's line storage has to spare. Lines
+ * are packed at their exact length.
+ */
+void
+compact_buffer(buffer_iter_t* const iter);
+
 /*
  * Copy buffer iterators.
  * Note that edits can easily invalidate buffer iterators, so copies
@@ -33,10 +58,55 @@ void
 destroy_buffer_iter(buffer_iter_t* buffer_iter);
 
 /*
- * Get information about the buffer iterator.
+ * Load a memory mapped file into an empty buffer. The buffer takes
+ * ownership of the mapping. Lines remain read only views into the
+ * mapping until they are modified. With a single job, lines are only
+ * split out of the mapping as iterators reach them; with more, the
+ * whole file is split up front on that many threads.
+ */
+error_t
+load_mapped_file(buffer_iter_t* const iter,
+                 char* const data,
+                 size_t length,
+                 const size_t jobs);
+
+/*
+ * Take a snapshot of the whole buffer, whose segments stay valid, and
+ * unchanged by edits, until it is released. The buffer must not be
+ * destroyed or compacted while a snapshot is held; compact_buffer
+ * does nothing until the snapshot is released. Taking and releasing
+ * snapshots must be done on the thread editing the buffer, but the
+ * segments can be read from any thread.
+ */
+error_t
+take_buffer_snapshot(buffer_iter_t* const iter,
+                     buffer_snapshot_t* const snapshot);
+void
+release_buffer_snapshot(buffer_iter_t* const iter,
+                        buffer_snapshot_t* const snapshot);
+
+/*
+ * Called with successive segments of a line, which are not NUL
+ * terminated. Return false to stop visiting the line.
+ */
+typedef bool(segment_visitor_t)(const char* const data,
+                                const size_t length,
+                                void* const context);
+
+/*
+ * Get information about the buffer iterator. Columns count bytes;
+ * line_map.h maps them to characters and screen columns.
+ * current_line returns the line as a C string, which requires the
+ * line to be copied into contiguous editable storage; prefer
+ * visit_line, which passes the line to visitor in place, one segment
+ * at a time, for read only access.
  */
 char*
 current_line(const buffer_iter_t* const iter);
+void
+visit_line(const buffer_iter_t* const iter,
+           segment_visitor_t* const visitor,
+           void* const context);
 size_t
 column(const buffer_iter_t* const iter);
 size_t
@@ -48,6 +118,45 @@ is_last_line(const buffer_iter_t* const iter);
 bool
 is_first_line(const buffer_iter_t* const iter);
 
+/*
+ * Get the memory counters for the buffer iter points into.
+ */
+void
+get_buffer_stats(const buffer_iter_t* const iter, buffer_stats_t* const stats);
+
+/*
+ * Move the damage done to the buffer since damage was last taken from
+ * it into damage. Line numbers are those after the edits.
+ */
+void
+take_damage(buffer_iter_t* const iter, damage_t* const damage);
+
+/*
+ * The number of edits made to the buffer, which lets anything worked
+ * out from its contents tell whether it is out of date.
+ */
+size_t
+buffer_version(const buffer_iter_t* const iter);
+
+// The largest key and value held by the line cache
+#define LINE_CACHE_MAX 65535
+
+/*
+ * Each line can cache a value computed from its contents, such as its
+ * height on screen, along with the key it was computed for, such as
+ * the width of the screen. Changing the line forgets the value. Keys
+ * run from 1 to LINE_CACHE_MAX, and values are capped at
+ * LINE_CACHE_MAX.
+ */
+bool
+get_line_cache(const buffer_iter_t* const iter,
+               const size_t key,
+               size_t* const value);
+void
+set_line_cache(const buffer_iter_t* const iter,
+               const size_t key,
+               const size_t value);
+
 /*
  * Move around the buffer
  */
@@ -63,13 +172,57 @@ void
 move_to_beginning_of_line(buffer_iter_t* const iter);
 
 /*
- * Modify the buffer at the buffer iterator
+ * Move to column of the current line, or to its end if it is not that
+ * long.
+ */
+void
+move_iter_to_column(buffer_iter_t* const iter, const size_t column);
+
+/*
+ * Move to line, counting from 0, or to the last line if there are not
+ * that many. Takes logarithmic time in the number of lines.
+ */
+void
+move_iter_to_line(buffer_iter_t* const iter, const size_t line);
+
+/*
+ * Modify the buffer at the buffer iterator.
+ * The filled variants build a line holding exactly data, in a single
+ * allocation, and are intended for bulk loading.
  */
 error_t
 append_line_at_point(buffer_iter_t* const iter);
 error_t
+append_filled_line_at_point(buffer_iter_t* const iter,
+                            const char* const data,
+                            const size_t length);
+error_t
+fill_line_at_point(buffer_iter_t* const iter,
+                   const char* const data,
+                   const size_t length);
+error_t
 insert_character_at_point(buffer_iter_t* const iter, const char c);
+
+/*
+ * Insert text at the buffer iterator, which moves to the end of it.
+ * Newlines in text split the line, and the lines they make are added
+ * in one go. Either the whole text is inserted, or, on failure, none
+ * of it.
+ */
+error_t
+insert_string_at_point(buffer_iter_t* const iter,
+                       const char* const data,
+                       const size_t length);
 void
 delete_character_at_point(buffer_iter_t* const iter);
 void
 clear_line_at_point(buffer_iter_t* const iter);
+
+/*
+ * Delete the line at the buffer iterator, which moves to the next
+ * line, or the previous line if it was the last. The only line in the
+ * buffer is cleared instead. Other iterators on the line are left
+ * dangling.
+ */
+void
+delete_line_at_point(buffer_iter_t* const iter);
@@ -16,9 +16,20 @@ typedef enum error_t
 
 typedef struct render_params_t
 {
+  // The screen drawn on
+  struct screen_t* screen;
+
   size_t height;
   size_t width;
   size_t top_line;
+
+  // The line drawn on each row of the screen, and the size of the
+  // screen and tab width it was drawn with, so unchanged rows are not
+  // drawn again
+  size_t* drawn_lines;
+  size_t drawn_height;
+  size_t drawn_width;
+  size_t drawn_tab_width;
 } render_params_t;
 
 typedef int event_t;
@@ -0,0 +1,48 @@
+#pragma once
+/*****************************************************************************
+ * damage.h
+ *
+ * Damage records which lines of a buffer have changed since it was
+ * last drawn, so that only those lines need drawing again.
+ *
+ * Damage is a single range of lines. Edits which add or remove lines
+ * move every line after them, so damage the buffer to its end.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// The last line of damage which runs to the end of the buffer
+#define DAMAGE_TO_END ((size_t)-1)
+
+typedef struct damage_t
+{
+  bool damaged;
+  size_t first_line;
+  size_t last_line;
+
+  // The number of times damage has been added, which clearing leaves
+  // alone
+  size_t edits;
+} damage_t;
+
+/*
+ * Add the lines from first_line to last_line inclusive to damage.
+ */
+void
+add_damage(damage_t* const damage,
+           const size_t first_line,
+           const size_t last_line);
+
+/*
+ * Forget all damage, but not the count of edits.
+ */
+void
+clear_damage(damage_t* const damage);
+
+/*
+ * Check whether line has been damaged.
+ */
+bool
+is_line_damaged(const damage_t* const damage, const size_t line);
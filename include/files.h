@@ -2,7 +2,115 @@
 
 #include <buffer.h>
 
+/*
+ * How hard a save works to get the file onto disk before it replaces
+ * the original: not at all, syncing the file's data, or syncing the
+ * file and then the directory holding it, so the rename itself
+ * survives a crash.
+ */
+typedef enum sync_mode_t
+{
+  SYNC_NONE,
+  SYNC_DATA,
+  SYNC_FULL
+} sync_mode_t;
+
+/*
+ * The file a buffer was loaded from, as it was when it was mapped or
+ * last patched in place: where it is mapped, how long it is, and what
+ * identifies it on disk. While the file still matches, a save need
+ * only write the bytes which differ from it.
+ */
+typedef struct file_origin_t
+{
+  bool valid;
+  const char* mapping;
+  size_t mapping_length;
+  size_t size;
+  unsigned long long device;
+  unsigned long long inode;
+  long long modified;
+} file_origin_t;
+
+typedef struct background_save_t background_save_t;
+
+/*
+ * Regular files are memory mapped, and split into lines on up to jobs
+ * threads; anything else is read through read_stream_into_editor. A
+ * mapped file is described in origin, if it is given, for later saves.
+ */
+error_t
+read_file_into_editor(buffer_iter_t* const iter,
+                      const char* const filename,
+                      const size_t jobs,
+                      file_origin_t* const origin);
+
+/*
+ * Read everything from fd into the buffer in large blocks. This works
+ * for pipes and terminals, which can not be mapped.
+ */
+error_t
+read_stream_into_editor(buffer_iter_t* const iter, const int fd);
+
+/*
+ * Write the buffer to filename, syncing it as sync asks.
+ *
+ * If filename is still the file described by origin, and the buffer
+ * keeps most of it where it was, only the bytes which differ are
+ * written, in place, and origin is brought up to date. Such a save is
+ * not atomic, so the bytes it writes over are first saved to
+ * FILE.undo, and a save cut short is undone by undo_unfinished_patch.
+ *
+ * Otherwise the buffer is written to a swap file next to filename,
+ * copying long unchanged stretches straight from the original where
+ * the file system can, and moved over filename. If anything fails the
+ * swap file is removed and filename is left as it was. The new file is
+ * not the one mapped, so origin is marked invalid.
+ *
+ * origin may be NULL.
+ */
+error_t
+write_buffer_to_disk(buffer_iter_t* const iter,
+                     const char* const filename,
+                     const sync_mode_t sync,
+                     file_origin_t* const origin);
+
+/*
+ * Put filename back as it was before a save which patched it in place
+ * was cut short, if one was, setting undone. Its size and modification
+ * time go back too, so a journal kept for it applies again.
+ */
 error_t
-read_file_into_editor(buffer_iter_t* const iter, const char* const filename);
+undo_unfinished_patch(const char* const filename, bool* const undone);
+
+/*
+ * Take a snapshot of the buffer, and write it out as
+ * write_buffer_to_disk would on a thread of its own, so editing can
+ * carry on while the file is written. Returns NULL if the save could
+ * not be started.
+ */
+background_save_t*
+start_background_save(buffer_iter_t* const iter,
+                      const char* const filename,
+                      const sync_mode_t sync,
+                      const file_origin_t* const origin);
+
+/*
+ * Get the bytes of the snapshot written so far, and the bytes in it.
+ * Returns true once the save has finished, when finishing it will not
+ * wait.
+ */
+bool
+background_save_progress(background_save_t* const save,
+                         size_t* const written,
+                         size_t* const total);
+
+/*
+ * Wait for a background save to finish, give its snapshot back to the
+ * buffer iter points into, and update origin as write_buffer_to_disk
+ * would. Returns the result of the save.
+ */
 error_t
-write_buffer_to_disk(buffer_iter_t* const iter, const char* const filename);
+finish_background_save(buffer_iter_t* const iter,
+                       background_save_t* const save,
+                       file_origin_t* const origin);
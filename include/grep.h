@@ -0,0 +1,42 @@
+#pragma once
+/*****************************************************************************
+ * grep.h
+ *
+ * Find the lines of a buffer which match a regular expression. Large
+ * buffers are split into runs of lines, and the runs searched by a
+ * number of threads at once, each with its own DFA.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <buffer.h>
+#include <common.h>
+#include <regexp.h>
+
+/*
+ * Find the first line matching regexp, starting with the line after the
+ * one at iter and wrapping around at the end of the buffer. The search
+ * runs on up to jobs threads.
+ *
+ * interrupted is called now and then while the search runs, and the
+ * search stops if it returns true.
+ *
+ * Returns the matching line, or SEARCH_NOT_FOUND if there is none or
+ * the search was interrupted, when was_interrupted is set.
+ */
+size_t
+grep_buffer(const buffer_iter_t* const iter,
+            const regexp_t* const regexp,
+            const size_t jobs,
+            bool (*interrupted)(void),
+            bool* const was_interrupted);
+
+/*
+ * Find the column the first match of regexp in the line at iter starts
+ * at, or SEARCH_NOT_FOUND if there is none.
+ */
+size_t
+find_match_in_line(const buffer_iter_t* const iter,
+                   const regexp_t* const regexp);
@@ -0,0 +1,70 @@
+#pragma once
+/*****************************************************************************
+ * highlight.h
+ *
+ * Syntax highlighting, between the buffer and the screen.
+ *
+ * The lexer state each line ends in is kept, so a line can be lexed
+ * without lexing the lines before it. Edits only make the states from
+ * the edited line on out of date, and lines are lexed again from there
+ * only until a line ends in the state it ended in before, after which
+ * the old states still hold. Lines are lexed as they are drawn, and a
+ * background thread lexes the lines below the screen while the editor
+ * waits for input, so scrolling finds them ready.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+
+#include <buffer.h>
+#include <common.h>
+#include <damage.h>
+#include <syntax.h>
+
+typedef struct highlighter_t highlighter_t;
+
+/*
+ * Create a highlighter for the buffer holding filename. Files in no
+ * known language get a highlighter which highlights nothing. Returns
+ * NULL if there is no memory.
+ */
+highlighter_t*
+new_highlighter(const char* const filename);
+void
+destroy_highlighter(highlighter_t* highlighter);
+
+/*
+ * Tell the highlighter about the damage taken from the buffer before
+ * drawing a frame.
+ */
+void
+damage_highlighting(highlighter_t* const highlighter,
+                    const damage_t* const damage);
+
+/*
+ * Check whether the highlighting of the line at iter may have changed
+ * since the last frame because a line above it was edited.
+ */
+bool
+is_highlighting_damaged(highlighter_t* const highlighter,
+                        const buffer_iter_t* const iter);
+
+/*
+ * Highlight the line at iter. Returns its spans, which stay valid until
+ * the next call, and sets count to the number of them.
+ */
+const highlight_span_t*
+highlight_line(highlighter_t* const highlighter,
+               const buffer_iter_t* const iter,
+               size_t* const count);
+
+/*
+ * Lex ahead of the lines last drawn on a thread of its own, until
+ * pause_highlighting is called. Nothing may touch the buffer iter
+ * points into in between.
+ */
+void
+resume_highlighting(highlighter_t* const highlighter,
+                    const buffer_iter_t* const iter);
+void
+pause_highlighting(highlighter_t* const highlighter);
@@ -0,0 +1,28 @@
+#pragma once
+/*****************************************************************************
+ * jobs.h
+ *
+ * Running independent pieces of work on threads of their own.
+ *
+ ****************************************************************************/
+
+#include <stddef.h>
+
+/*
+ * The number of jobs to run at once when none is asked for: one per
+ * processor online.
+ */
+size_t
+default_jobs(void);
+
+/*
+ * Call job on each of the count contexts, which are size bytes apart,
+ * and wait for them all to return. The first context is handled on the
+ * calling thread and the rest on threads of their own, or on the
+ * calling thread too if a thread can not be started.
+ */
+void
+run_jobs(void* (*job)(void*),
+         void* const contexts,
+         const size_t size,
+         const size_t count);
@@ -0,0 +1,103 @@
+#pragma once
+/*****************************************************************************
+ * journal.h
+ *
+ * An append-only record of the edits made to a file since it was last
+ * saved, kept next to it as FILE.journal, so that after a crash the
+ * edits can be replayed against the file. Each edit is a few bytes
+ * plus any text inserted, so keeping the journal costs as much as the
+ * typing does, however large the file.
+ *
+ * Edits are gathered in memory and written once per turn of the event
+ * loop, and the journal is synced at most once a second. A save starts
+ * the journal afresh, and a clean exit removes it, unless it holds
+ * edits recovered from it which have not been saved since.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <buffer.h>
+
+typedef struct journal_t journal_t;
+
+/*
+ * Open the journal of filename, whose text iter holds as it was
+ * loaded. A journal left behind for the file as it is now has its
+ * edits replayed into the buffer, counted in replayed, and is carried
+ * on with. If an edit in it does not apply, replaying stops there,
+ * setting partial: the journal is moved aside to FILE.journal.old, and
+ * the edits which did apply start a new one. One left for the file as
+ * it was before is moved aside too, setting stale, and a new journal
+ * is started. Returns NULL if there is no journal to write to.
+ */
+journal_t*
+open_journal(buffer_iter_t* const iter,
+             const char* const filename,
+             size_t* const replayed,
+             bool* const partial,
+             bool* const stale);
+
+/*
+ * Record an edit: text inserted at a line and column; count characters
+ * deleted before a line and column, as by delete_character_at_point;
+ * count lines deleted from line on; or a line opened after line.
+ * Nothing is recorded if journal is NULL.
+ */
+void
+record_insert(journal_t* const journal,
+              const size_t line,
+              const size_t column,
+              const char* const data,
+              const size_t length);
+void
+record_delete(journal_t* const journal,
+              const size_t line,
+              const size_t column,
+              const size_t count);
+void
+record_delete_lines(journal_t* const journal,
+                    const size_t line,
+                    const size_t count);
+void
+record_open_line(journal_t* const journal, const size_t line);
+
+/*
+ * Write the edits recorded since the last call, and sync the journal
+ * if sync is set and it has not been synced for a while. Returns any
+ * error met writing or recording edits since the journal was opened.
+ */
+error_t
+flush_journal(journal_t* const journal, const bool sync);
+
+/*
+ * The milliseconds until flush_journal would next sync the journal, or
+ * -1 if everything recorded is already synced, or syncing is off.
+ */
+int
+journal_sync_timeout(const journal_t* const journal);
+
+/*
+ * Where the journal has got to, to be passed to restart_journal once
+ * the text as it is now has been saved.
+ */
+size_t
+journal_position(const journal_t* const journal);
+
+/*
+ * Start the journal afresh for the file as it is now on disk, keeping
+ * the edits recorded after position, as made while a save in the
+ * background was running. The new journal replaces the old one in one
+ * go, synced first if sync is set.
+ */
+error_t
+restart_journal(journal_t* const journal,
+                const size_t position,
+                const bool sync);
+
+/*
+ * Close the journal, and remove it unless keep is set.
+ */
+void
+close_journal(journal_t* const journal, const bool keep);
@@ -0,0 +1,138 @@
+#pragma once
+/*****************************************************************************
+ * line_map.h
+ *
+ * Buffers hold bytes, and columns in a buffer count bytes. A line map
+ * records where each character of a line starts, and the screen column
+ * it is drawn at, so the cursor can move a character at a time and be
+ * placed on the screen without decoding the line again.
+ *
+ * Characters are UTF-8. Combining marks belong to the character before
+ * them, so the cursor never stops on one. A malformed sequence is taken
+ * as a single character. Tabs run to the next tab stop.
+ *
+ * A map covers one line, and is built as far along it as has been asked
+ * about, a chunk at a time, so a long line is not decoded past the
+ * cursor. Edits passed to edit_line_map keep the map before them, and
+ * the width of the line. Any other edit, or asking about a different
+ * line, starts the map afresh. When it can not be built, every byte is
+ * taken to be a character one column wide.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <buffer.h>
+#include <common.h>
+
+// Tab stops are this many columns apart unless set otherwise, and at
+// most TAB_WIDTH_MAX apart
+#define DEFAULT_TAB_WIDTH 8
+#define TAB_WIDTH_MAX 32
+
+typedef struct line_map_t
+{
+  size_t tab_width;
+
+  // The line mapped, and the buffer version it was mapped at
+  bool valid;
+  size_t line;
+  size_t version;
+
+  // The byte offset and screen column each character starts at, up to
+  // the last entry, which is the end of the line once the map is
+  // complete, and otherwise the character mapping carries on from
+  size_t* offsets;
+  size_t* columns;
+  size_t count;
+  size_t capacity;
+  bool complete;
+
+  // The screen columns the whole line takes, once measured, and an
+  // offset with no tab at or after it, past which text moves without
+  // changing width
+  bool width_known;
+  size_t width;
+  size_t tab_end;
+
+  // The entry last looked up, which the next lookup usually lands on
+  // or next to
+  size_t hint;
+} line_map_t;
+
+void
+init_line_map(line_map_t* const map);
+void
+destroy_line_map(line_map_t* const map);
+
+/*
+ * Set the distance between tab stops, which forgets the line mapped.
+ */
+void
+set_line_map_tab_width(line_map_t* const map, const size_t tab_width);
+
+/*
+ * The screen column the character at iter's column is drawn at,
+ * counting from the start of the line rather than the start of a row.
+ */
+size_t
+screen_column(line_map_t* const map, const buffer_iter_t* const iter);
+
+/*
+ * The columns of the characters count after and before the one at iter,
+ * which stop at either end of the line.
+ */
+size_t
+next_char_column(line_map_t* const map,
+                 const buffer_iter_t* const iter,
+                 const size_t count);
+size_t
+previous_char_column(line_map_t* const map,
+                     const buffer_iter_t* const iter,
+                     const size_t count);
+
+/*
+ * The column of the character on iter's line which covers
+ * screen_column, or of the end of the line if it is not that wide.
+ */
+size_t
+column_at_screen_column(line_map_t* const map,
+                        const buffer_iter_t* const iter,
+                        const size_t screen_column);
+
+/*
+ * Account for an edit to the line mapped, made since the buffer was at
+ * version: removed bytes deleted from column of iter's line, and
+ * inserted bytes put in their place, none of them newlines.
+ */
+void
+edit_line_map(line_map_t* const map,
+              const buffer_iter_t* const iter,
+              const size_t version,
+              const size_t column,
+              const size_t removed,
+              const size_t inserted);
+
+/*
+ * The number of screen columns the line at iter takes, decoded in
+ * place without building a map.
+ */
+size_t
+line_width(const buffer_iter_t* const iter, const size_t tab_width);
+
+/*
+ * The width of the line at iter, as line_width, kept by the map if it
+ * covers the line, so that edits to it need not measure it again.
+ */
+size_t
+mapped_line_width(line_map_t* const map, const buffer_iter_t* const iter);
+
+/*
+ * The screen columns codepoint takes when drawn at screen_column.
+ */
+size_t
+char_display_width(const uint32_t codepoint,
+                   const size_t screen_column,
+                   const size_t tab_width);
@@ -0,0 +1,59 @@
+#pragma once
+/*****************************************************************************
+ * regexp.h
+ *
+ * Regular expressions, matched a line at a time by a DFA which is built
+ * lazily as lines are scanned, so matching takes time linear in the
+ * length of the line, with no backtracking.
+ *
+ * The syntax is a byte oriented subset of POSIX extended expressions:
+ * literals, ., [classes] and [^negated classes] with ranges, the
+ * escapes \d \w \s and their negations \D \W \S, grouping with (),
+ * alternation with |, the repetitions * + and ?, and ^ and $ anchoring
+ * the pattern to the start and end of the line.
+ *
+ * A compiled expression is read only, and can be shared between
+ * threads. Each thread matches with a DFA of its own.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <buffer.h>
+#include <common.h>
+
+typedef struct regexp_t regexp_t;
+typedef struct dfa_t dfa_t;
+
+/*
+ * Compile pattern. Returns NULL on failure, with error describing what
+ * went wrong.
+ */
+regexp_t*
+new_regexp(const char* const pattern, const char** const error);
+void
+destroy_regexp(regexp_t* regexp);
+
+/*
+ * Create a DFA for regexp, which must outlive it. Unanchored DFAs look
+ * for a match anywhere in a line, and anchored ones for a match which
+ * starts where matching starts.
+ */
+dfa_t*
+new_dfa(const regexp_t* const regexp, const bool anchored);
+void
+destroy_dfa(dfa_t* dfa);
+
+/*
+ * Check whether the line at iter holds a match, with an unanchored DFA.
+ */
+bool
+line_matches(dfa_t* const dfa, const buffer_iter_t* const iter);
+
+/*
+ * Find where the first match in data starts, with an anchored DFA.
+ * Returns SEARCH_NOT_FOUND if there is no match.
+ */
+size_t
+find_match_start(dfa_t* const dfa, const char* const data, const size_t length);
@@ -1,15 +1,33 @@
 #pragma once
 
+#include <buffer.h>
 #include <common.h>
+#include <line_map.h>
 
 /*
- * Render the current editor state to sceen.
+ * Render the current editor state to the screen in the render
+ * parameters.
  */
 void
 render(const editor_state_t* const state, render_params_t* const params);
 
 /*
- * Update the render parameters.
+ * locate_start_of_render locates the line where the editor should
+ * start drawing to screen.
+ */
+size_t
+locate_start_of_render(const render_params_t* const params,
+                       line_map_t* const line_map,
+                       buffer_iter_t* render_point);
+
+/*
+ * Update the render parameters to the size of their screen.
  */
 void
 update_render_params(render_params_t* const render_params);
+
+/*
+ * Free the memory held by the render parameters.
+ */
+void
+destroy_render_params(render_params_t* const render_params);
@@ -0,0 +1,96 @@
+#pragma once
+/*****************************************************************************
+ * screen.h
+ *
+ * The screens the editor draws on. Rendering only ever draws through a
+ * screen_t, which may be the terminal, driven through curses, or a
+ * framebuffer in memory, which needs no terminal and keeps count of
+ * what is drawn on it.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <syntax.h>
+
+// Text is drawn in the style of a class of highlighted text, or in the
+// modeline's
+#define STYLE_MODELINE HIGHLIGHT_CLASSES
+#define SCREEN_STYLES (HIGHLIGHT_CLASSES + 1)
+
+/*
+ * A screen, drawn on through its operations. As with curses, text is
+ * drawn at the cursor, wraps onto the next row at the edge of the
+ * screen, and only shows once the screen is refreshed. A screen is
+ * cleaned up by its own destroy operation.
+ */
+typedef struct screen_t screen_t;
+struct screen_t
+{
+  const char* name;
+
+  void (*size)(screen_t* const screen,
+               size_t* const height,
+               size_t* const width);
+  void (*erase)(screen_t* const screen);
+  void (*move)(screen_t* const screen, const size_t row, const size_t column);
+  void (*clear_to_eol)(screen_t* const screen);
+  void (*add_text)(screen_t* const screen,
+                   const char* const text,
+                   const size_t length);
+  void (*set_style)(screen_t* const screen, const size_t style);
+  void (*refresh)(screen_t* const screen);
+  void (*destroy)(screen_t* const screen);
+};
+
+/*
+ * What has been drawn on a memory screen.
+ */
+typedef struct screen_stats_t
+{
+  size_t frames;
+
+  // Cells drawn with text, and cells cleared, whether or not they
+  // changed
+  size_t cells_written;
+  size_t cells_cleared;
+
+  // Cells which differed from the last frame when the screen was
+  // refreshed, and the bytes a terminal would have been sent to show
+  // them
+  size_t cells_changed;
+  size_t bytes;
+} screen_stats_t;
+
+/*
+ * Start curses, and draw on the terminal. Returns NULL if the screen
+ * can not be allocated.
+ */
+screen_t*
+new_curses_screen(void);
+
+/*
+ * Create a screen of height rows and width columns held in memory.
+ * Returns NULL if it can not be allocated.
+ */
+screen_t*
+new_memory_screen(const size_t height, const size_t width);
+
+/*
+ * The counts kept by a screen made by new_memory_screen.
+ */
+const screen_stats_t*
+memory_screen_stats(const screen_t* const screen);
+
+/*
+ * Copy the text shown on a row of a screen made by new_memory_screen
+ * into text, as UTF-8 with trailing blanks left out, truncating it to
+ * size bytes including the terminating null.
+ */
+void
+memory_screen_row(const screen_t* const screen,
+                  const size_t row,
+                  char* const text,
+                  const size_t size);
@@ -0,0 +1,99 @@
+#pragma once
+/*****************************************************************************
+ * search.h
+ *
+ * Literal substring search, over plain memory, over the lines of a
+ * buffer and over snapshots of a whole buffer. Text is searched in
+ * place, a segment at a time, so it is never copied or joined.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <buffer.h>
+#include <common.h>
+#include <snapshot.h>
+
+// Returned when there is no match
+#define SEARCH_NOT_FOUND ((size_t)-1)
+
+typedef enum search_result_t
+{
+  SEARCH_FOUND,
+  SEARCH_NO_MATCH,
+  SEARCH_INTERRUPTED
+} search_result_t;
+
+/*
+ * A pattern prepared for searching. Patterns are found by scanning for
+ * their first byte with memchr, which is fastest while that byte is
+ * rare. Long patterns whose first byte turns out to be common switch
+ * to Horspool's algorithm, which skips ahead by up to the length of the
+ * pattern on a mismatch.
+ */
+typedef struct search_t
+{
+  char* pattern;
+  size_t length;
+  size_t shift[256];
+
+  // Room to join the ends of two segments of a line, where a match can
+  // be split between them
+  char* window;
+} search_t;
+
+/*
+ * Prepare to search for pattern, which must not be empty.
+ */
+error_t
+init_search(search_t* const search,
+            const char* const pattern,
+            const size_t length);
+
+/*
+ * Free the memory held by a search.
+ */
+void
+destroy_search(search_t* const search);
+
+/*
+ * Find the first match in data.
+ */
+size_t
+find_substring(const search_t* const search,
+               const char* const data,
+               const size_t length);
+
+/*
+ * Find the nth match, counting from 1, of those in the line at iter
+ * which start at or after from and before before. If last is set they
+ * are counted back from the last one. When there are fewer than n,
+ * SEARCH_NOT_FOUND is returned and the number there are is left in
+ * matches.
+ */
+size_t
+find_in_line(search_t* const search,
+             const buffer_iter_t* const iter,
+             const size_t from,
+             const size_t before,
+             const bool last,
+             const size_t n,
+             size_t* const matches);
+
+/*
+ * As find_in_line, over the whole text of a snapshot, with offsets
+ * counted from its start. interrupted, if set, is called now and then
+ * while the search runs, and the search stops once it returns true,
+ * setting was_interrupted.
+ */
+size_t
+find_in_snapshot(search_t* const search,
+                 const buffer_snapshot_t* const snapshot,
+                 const size_t from,
+                 const size_t before,
+                 const bool last,
+                 const size_t n,
+                 size_t* const matches,
+                 bool (*interrupted)(void),
+                 bool* const was_interrupted);
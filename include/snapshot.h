@@ -0,0 +1,78 @@
+#pragma once
+/*****************************************************************************
+ * snapshot.h
+ *
+ * A snapshot is the text of a buffer at one moment, as a list of
+ * segments pointing into the buffer's own storage, each line followed
+ * by its newline. Taking one copies no text. The buffer keeps every
+ * segment as it is until the snapshot is released, copying lines
+ * before they are edited, so the snapshot can be read on another
+ * thread while editing carries on.
+ *
+ ****************************************************************************/
+
+#include <stddef.h>
+
+#include <common.h>
+
+typedef struct text_segment_t
+{
+  const char* data;
+  size_t length;
+} text_segment_t;
+
+typedef struct buffer_snapshot_t
+{
+  text_segment_t* segments;
+  size_t count;
+  size_t capacity;
+
+  // The bytes in all of the segments
+  size_t bytes;
+} buffer_snapshot_t;
+
+/*
+ * Add a segment to the end of the snapshot. A segment following
+ * straight on from the last one in memory is merged with it, as is one
+ * which follows a newline lying between it and the segment before.
+ */
+error_t
+add_snapshot_segment(buffer_snapshot_t* const snapshot,
+                     const char* const data,
+                     const size_t length);
+
+/*
+ * Add the newline ending a line to the snapshot.
+ */
+error_t
+add_snapshot_newline(buffer_snapshot_t* const snapshot);
+
+/*
+ * The offset just past the count'th newline at or after from in the
+ * snapshot's text, which is the start of the line count lines on from
+ * the one holding from. If there are not enough lines, the end of the
+ * text.
+ */
+size_t
+skip_snapshot_lines(const buffer_snapshot_t* const snapshot,
+                    const size_t from,
+                    const size_t count);
+
+/*
+ * The number of newlines at or after from and before offset in the
+ * snapshot's text. line_start is set to the offset just past the last
+ * of them, where the line holding offset starts, or to from if there
+ * are none.
+ */
+size_t
+count_snapshot_lines(const buffer_snapshot_t* const snapshot,
+                     const size_t from,
+                     const size_t offset,
+                     size_t* const line_start);
+
+/*
+ * Free the snapshot's segments. The storage they point into belongs
+ * to the buffer.
+ */
+void
+destroy_snapshot(buffer_snapshot_t* const snapshot);
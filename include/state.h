@@ -2,7 +2,13 @@
 
 #include <buffer.h>
 #include <common.h>
+#include <files.h>
+#include <highlight.h>
+#include <journal.h>
+#include <line_map.h>
 #include <mode.h>
+#include <regexp.h>
+#include <search.h>
 
 /*
  * editor_state_t is the structure containing the state of the
@@ -15,6 +21,63 @@ struct editor_state_t
   const mode_t* mode;
   const char* filename;
   bool terminate;
+
+  // Where the characters of the cursor's line start on the screen
+  line_map_t* line_map;
+
+  // The lexer states of the buffer's lines, for syntax highlighting
+  highlighter_t* highlighter;
+
+  // The screen column vertical motion aims for, which it keeps while
+  // the cursor stays where the last vertical motion left it
+  bool has_goal;
+  size_t goal_column;
+  size_t goal_line;
+  size_t goal_offset;
+  size_t goal_version;
+
+  // The count typed before a normal mode command, and the first key of
+  // a command which takes two
+  size_t count;
+  event_t pending;
+
+  // The last pattern searched for, and which way
+  search_t search;
+  bool search_backwards;
+
+  // The last regular expression grepped for
+  regexp_t* regexp;
+
+  // A message for the user, shown until the next event
+  char message[256];
+
+  // The most threads long operations such as loading and grep use
+  size_t jobs;
+
+  // How hard :w works to get the file onto disk
+  sync_mode_t sync_mode;
+
+  // The file as it was loaded, so :w can patch it in place
+  file_origin_t origin;
+
+  // Whether :w writes the file on a thread of its own, and the save
+  // running there, if any
+  bool save_in_background;
+  background_save_t* save;
+
+  // The journal of edits since the file was saved, if one is kept, and
+  // where it had got to when the running save took its snapshot
+  journal_t* journal;
+  size_t save_journal_position;
+
+  // Whether the buffer holds edits recovered from the journal which
+  // have not been saved since, in which case the journal is kept when
+  // the editor exits
+  bool recovered;
+
+  // Long operations call this now and then, and stop early if it
+  // returns true
+  bool (*interrupted)(void);
 };
 
 /*
@@ -29,6 +92,12 @@ new_editor_state(const char* const filename);
 void
 destroy_editor_state(editor_state_t* state);
 
+/*
+ * Takes an event and updates the editor state accordingly.
+ */
+error_t
+update(const event_t event, editor_state_t* const state);
+
 /*
  * Should quite returns false if and only if the editor has been
  * signalled to quit.
@@ -49,7 +118,29 @@ error_t
 open_line(editor_state_t* const state);
 
 /*
- * Move the cursor up a line.
+ * Insert a character typed at the cursor.
+ */
+error_t
+type_character(editor_state_t* const state, const char c);
+
+/*
+ * Move the cursor count characters left or right along its line,
+ * stopping at either end.
+ */
+void
+move_cursor_left(editor_state_t* const state, const size_t count);
+void
+move_cursor_right(editor_state_t* const state, const size_t count);
+
+/*
+ * Delete the character before the cursor, however many bytes it takes.
+ */
+void
+delete_char_before_cursor(editor_state_t* const state);
+
+/*
+ * Move the cursor up a line, keeping to the screen column it was on
+ * before it moved up or down.
  */
 void
 move_cursor_up(editor_state_t* const state);
@@ -59,3 +150,94 @@ move_cursor_up(editor_state_t* const state);
  */
 void
 move_cursor_down(editor_state_t* const state);
+
+/*
+ * Move the cursor to line, counting from 0, or to the last line if
+ * there are not that many, keeping to the same screen column as
+ * move_cursor_up does.
+ */
+void
+move_cursor_to_line(editor_state_t* const state, const size_t line);
+
+/*
+ * Delete count lines, starting with the line under the cursor.
+ */
+void
+delete_lines(editor_state_t* const state, size_t count);
+
+/*
+ * Paste text, which goes into the buffer in one go. Text pasted into a
+ * command is taken as though it were typed.
+ */
+error_t
+paste_text(editor_state_t* const state,
+           const char* const text,
+           const size_t length);
+
+/*
+ * Search for pattern, or for the last pattern searched for if pattern
+ * is empty, and move the cursor to the next match.
+ */
+void
+search_for(editor_state_t* const state,
+           const char* const pattern,
+           const bool backwards);
+
+/*
+ * Move the cursor to the count'th match of the last search from it,
+ * going the other way if reverse is set. The search wraps around at
+ * either end of the buffer.
+ */
+search_result_t
+repeat_search(editor_state_t* const state,
+              const bool reverse,
+              const size_t count);
+
+/*
+ * Move the cursor to the first match of the regular expression pattern
+ * on a line after the cursor, wrapping around at the end of the buffer.
+ * An empty pattern repeats the last grep.
+ */
+void
+grep_for(editor_state_t* const state, const char* const pattern);
+
+/*
+ * Set the distance between tab stops, from 1 to TAB_WIDTH_MAX columns.
+ */
+void
+set_tab_width(editor_state_t* const state, const size_t tab_width);
+
+/*
+ * Write the buffer to the file being edited, or start writing it in
+ * the background if saves are made there, once any save already
+ * running has finished. Returns false, having told the user, if the
+ * file could not be written or the save could not be started.
+ */
+bool
+save_buffer(editor_state_t* const state);
+
+/*
+ * Tell the user how a background save went once it has finished.
+ */
+void
+check_background_save(editor_state_t* const state);
+
+/*
+ * Wait for any background save to finish. Returns false, having told
+ * the user, if it failed.
+ */
+bool
+wait_for_save(editor_state_t* const state);
+
+/*
+ * Write the edits recorded since the last call to the journal. If that
+ * fails, the user is told and the journal is given up on.
+ */
+void
+update_journal(editor_state_t* const state);
+
+/*
+ * Set the message shown to the user.
+ */
+void
+set_message(editor_state_t* const state, const char* const format, ...);
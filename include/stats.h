@@ -0,0 +1,77 @@
+#pragma once
+/*****************************************************************************
+ * stats.h
+ *
+ * Timings of the editor's main operations, kept as histograms with a
+ * bucket for each power of two nanoseconds, so they cost no more than
+ * reading the clock and can be left on all the time.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <buffer.h>
+
+// Bucket i counts timings from 2^i up to 2^(i+1) nanoseconds; the last
+// bucket counts everything longer
+#define STATS_BUCKETS 40
+
+typedef enum timed_op_t
+{
+  TIMED_UPDATE,
+  TIMED_RENDER,
+  TIMED_LOAD,
+  TIMED_SAVE,
+  TIMED_OPS
+} timed_op_t;
+
+typedef struct histogram_t
+{
+  size_t count;
+  long long total;
+  long long max;
+  size_t buckets[STATS_BUCKETS];
+} histogram_t;
+
+/*
+ * Nanoseconds on a clock which only ever goes forwards.
+ */
+long long
+monotonic_time(void);
+
+/*
+ * Record that op took from start, a time from monotonic_time, until
+ * now. Timings are only recorded from the thread handling events.
+ */
+void
+record_time(const timed_op_t op, const long long start);
+
+/*
+ * The timings recorded for op.
+ */
+const histogram_t*
+get_histogram(const timed_op_t op);
+
+/*
+ * An upper bound on the time the given fraction of the timings in
+ * histogram took no longer than, in nanoseconds.
+ */
+long long
+histogram_percentile(const histogram_t* const histogram,
+                     const double fraction);
+
+/*
+ * Write a line summing up the timings and the memory used by the
+ * buffer iter points into to text, truncated to size bytes.
+ */
+void
+format_stats_summary(const buffer_iter_t* const iter,
+                     char* const text,
+                     const size_t size);
+
+/*
+ * Write every timing histogram and buffer counter to filename.
+ */
+error_t
+write_stats(const buffer_iter_t* const iter, const char* const filename);
@@ -0,0 +1,80 @@
+#pragma once
+/*****************************************************************************
+ * syntax.h
+ *
+ * Lexing lines of source for highlighting.
+ *
+ * Lines are lexed one at a time, in place. The only thing carried from
+ * one line to the next is a small lexer state, such as being inside a
+ * block comment, so a line can be lexed knowing only the state the line
+ * before it ended in.
+ *
+ ****************************************************************************/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <buffer.h>
+#include <common.h>
+
+// The state lexing starts in, and which lines not ending inside a
+// comment leave it in
+#define LEX_INITIAL 0
+
+typedef uint8_t lex_state_t;
+typedef struct language_t language_t;
+
+/*
+ * The kinds of text drawn differently.
+ */
+typedef enum highlight_class_t
+{
+  HIGHLIGHT_NONE,
+  HIGHLIGHT_COMMENT,
+  HIGHLIGHT_KEYWORD,
+  HIGHLIGHT_TYPE,
+  HIGHLIGHT_STRING,
+  HIGHLIGHT_NUMBER,
+  HIGHLIGHT_PREPROCESSOR,
+  HIGHLIGHT_SECTION,
+  HIGHLIGHT_KEY,
+  HIGHLIGHT_CLASSES
+} highlight_class_t;
+
+/*
+ * A span of a line, which starts at the byte offset start and runs up
+ * to the start of the next span or the end of the line.
+ */
+typedef struct highlight_span_t
+{
+  size_t start;
+  highlight_class_t class;
+} highlight_span_t;
+
+typedef struct span_list_t
+{
+  highlight_span_t* spans;
+  size_t count;
+  size_t capacity;
+} span_list_t;
+
+/*
+ * Find the language of filename, by its name or extension. Returns NULL
+ * for files which are not highlighted.
+ */
+const language_t*
+find_language(const char* const filename);
+
+/*
+ * Lex the line at iter, starting in state, and return the state it ends
+ * in. The line's spans are stored in spans unless it is NULL; spans
+ * which do not fit in memory are left out.
+ */
+lex_state_t
+lex_line(const language_t* const language,
+         const buffer_iter_t* const iter,
+         const lex_state_t state,
+         span_list_t* const spans);
+
+void
+destroy_span_list(span_list_t* const spans);
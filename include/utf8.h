@@ -0,0 +1,74 @@
+#pragma once
+/*****************************************************************************
+ * utf8.h
+ *
+ * Decoding UTF-8 a byte at a time, so that text held in segments can
+ * be decoded in place, and the widths characters take on a terminal.
+ *
+ ****************************************************************************/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Malformed sequences decode as this
+#define UTF8_REPLACEMENT 0xFFFD
+
+/*
+ * A decoded character, and the number of bytes it was encoded in.
+ */
+typedef struct utf8_char_t
+{
+  uint32_t codepoint;
+  size_t length;
+} utf8_char_t;
+
+/*
+ * The state of a decoder part way through a sequence.
+ */
+typedef struct utf8_decoder_t
+{
+  uint32_t codepoint;
+  size_t length;
+  size_t needed;
+} utf8_decoder_t;
+
+/*
+ * Feed the next byte of the text to decoder, storing the characters it
+ * completes in decoded. Returns how many there are, up to two: a
+ * sequence cut short by byte decodes as a replacement character taking
+ * the bytes it had, ahead of byte itself.
+ */
+size_t
+decode_utf8_byte(utf8_decoder_t* const decoder,
+                 const char byte,
+                 utf8_char_t* const decoded);
+
+/*
+ * Finish decoding at the end of the text, storing any sequence cut
+ * short in decoded. Returns how many characters were stored.
+ */
+size_t
+finish_utf8(utf8_decoder_t* const decoder, utf8_char_t* const decoded);
+
+/*
+ * Check whether decoder is between characters.
+ */
+bool
+is_utf8_boundary(const utf8_decoder_t* const decoder);
+
+/*
+ * Encode codepoint, which must be valid, into text, which has room for
+ * four bytes. Returns the number of bytes used.
+ */
+size_t
+encode_utf8(const uint32_t codepoint, char* const text);
+
+/*
+ * The columns codepoint takes on a terminal: none for combining marks,
+ * two for wide East Asian characters and emoji, and two for control
+ * characters, which curses draws as ^X. Tabs depend on where they are
+ * drawn, and are left to the caller.
+ */
+size_t
+codepoint_width(const uint32_t codepoint);
@@ -0,0 +1,232 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <arena.h>
+#include <common.h>
+
+struct allocator_block_t
+{
+  allocator_block_t* next;
+  size_t size;
+  max_align_t data[];
+};
+
+// Allocations this much larger than an arena block get their own block
+const size_t arena_large_fraction = 4;
+
+allocator_block_t*
+new_allocator_block(const size_t size);
+
+/*****************************************************************************/
+/* Slabs                                                                     */
+/*****************************************************************************/
+void
+init_slab(slab_t* const slab,
+          const size_t object_size,
+          const size_t block_objects)
+{
+  // Returned objects hold the free list link, so must fit a pointer,
+  // and every object must stay aligned
+  const size_t align = sizeof(void*);
+  const size_t size = max(object_size, sizeof(void*));
+
+  *slab = (slab_t){ 0 };
+  slab->object_size = (size + align - 1) / align * align;
+  slab->block_objects = block_objects;
+  slab->block_used = block_objects;
+}
+
+void
+destroy_slab(slab_t* const slab)
+{
+  allocator_block_t* block = slab->blocks;
+
+  while (block) {
+    allocator_block_t* const next = block->next;
+    free(block);
+    block = next;
+  }
+
+  init_slab(slab, slab->object_size, slab->block_objects);
+}
+
+void*
+slab_alloc(slab_t* const slab)
+{
+  void* object = NULL;
+
+  if (slab->free_list) {
+    object = slab->free_list;
+    slab->free_list = *(void**)object;
+  } else {
+    if (slab->block_used == slab->block_objects) {
+      const size_t size = slab->object_size * slab->block_objects;
+      allocator_block_t* const block = new_allocator_block(size);
+      if (!block) {
+        return NULL;
+      }
+
+      block->next = slab->blocks;
+      slab->blocks = block;
+      slab->block_used = 0;
+      slab->reserved += size;
+      slab->allocations++;
+    }
+
+    object = (char*)slab->blocks->data + slab->object_size * slab->block_used;
+    slab->block_used++;
+  }
+
+  slab->live++;
+  return object;
+}
+
+void
+slab_free(slab_t* const slab, void* const object)
+{
+  *(void**)object = slab->free_list;
+  slab->free_list = object;
+  slab->live--;
+}
+
+void
+for_each_slab_object(const slab_t* const slab,
+                     void (*fn)(void* object, void* context),
+                     void* context)
+{
+  size_t objects = slab->block_used;
+
+  // Blocks behind the first are full, apart from those taken over from
+  // another slab, whose size is cut down to the objects they hold
+  for (allocator_block_t* block = slab->blocks; block; block = block->next) {
+    char* const data = (char*)block->data;
+    for (size_t i = 0; i < objects; ++i) {
+      fn(data + slab->object_size * i, context);
+    }
+    objects = block->next ? block->next->size / slab->object_size : 0;
+  }
+}
+
+void
+merge_slab(slab_t* const slab, slab_t* const other)
+{
+  if (!slab->blocks) {
+    slab->blocks = other->blocks;
+    slab->block_used = other->block_used;
+  } else if (other->blocks) {
+    // Keep carving up the slab's own first block
+    other->blocks->size = other->object_size * other->block_used;
+
+    allocator_block_t* last = other->blocks;
+    while (last->next) {
+      last = last->next;
+    }
+    last->next = slab->blocks->next;
+    slab->blocks->next = other->blocks;
+  }
+
+  if (other->free_list) {
+    void** last = other->free_list;
+    while (*last) {
+      last = *last;
+    }
+    *last = slab->free_list;
+    slab->free_list = other->free_list;
+  }
+
+  slab->reserved += other->reserved;
+  slab->live += other->live;
+  slab->allocations += other->allocations;
+  init_slab(other, other->object_size, other->block_objects);
+}
+
+/*****************************************************************************/
+/* Arenas                                                                    */
+/*****************************************************************************/
+void
+init_arena(arena_t* const arena, const size_t block_size)
+{
+  *arena = (arena_t){ 0 };
+  arena->block_size = block_size;
+}
+
+void
+destroy_arena(arena_t* const arena)
+{
+  allocator_block_t* block = arena->blocks;
+
+  while (block) {
+    allocator_block_t* const next = block->next;
+    free(block);
+    block = next;
+  }
+
+  init_arena(arena, arena->block_size);
+}
+
+char*
+arena_alloc(arena_t* const arena, const size_t size)
+{
+  if (size > arena->block_size / arena_large_fraction) {
+    // Large allocations get a block to themselves, which goes behind
+    // the block currently being carved up
+    allocator_block_t* const block = new_allocator_block(size);
+    if (!block) {
+      return NULL;
+    }
+
+    if (arena->blocks) {
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    } else {
+      arena->blocks = block;
+    }
+
+    arena->reserved += size;
+    arena->used += size;
+    arena->allocations++;
+    return (char*)block->data;
+  }
+
+  if ((size_t)(arena->end - arena->next) < size) {
+    allocator_block_t* const block = new_allocator_block(arena->block_size);
+    if (!block) {
+      return NULL;
+    }
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+    arena->next = (char*)block->data;
+    arena->end = arena->next + arena->block_size;
+    arena->reserved += arena->block_size;
+    arena->allocations++;
+  }
+
+  char* const bytes = arena->next;
+  arena->next += size;
+  arena->used += size;
+
+  return bytes;
+}
+
+void
+arena_release(arena_t* const arena, const size_t size)
+{
+  arena->used -= size;
+}
+
+/*****************************************************************************/
+/* Helper functions                                                          */
+/*****************************************************************************/
+allocator_block_t*
+new_allocator_block(const size_t size)
+{
+  allocator_block_t* const block = malloc(sizeof(allocator_block_t) + size);
+
+  if (block) {
+    block->next = NULL;
+    block->size = size;
+  }
+
+  return block;
+}
@@ -1,31 +1,193 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
+#include <arena.h>
 #include <buffer.h>
+#include <damage.h>
+#include <jobs.h>
 
-// The most a line buffer can expand by
+// The smallest a line buffer is allocated with
 const size_t default_line_buffer_length = 120;
-const size_t max_buffer_growth = 240;
+
+// Editable lines longer than this are split into chunks
+const size_t long_line_length = 1 << 16;
+// The size of each chunk, and how full chunks are when a line is split
+const size_t line_chunk_size = 1 << 14;
+const size_t line_chunk_fill = 3 * (1 << 12);
+
+// New and cleared lines view this until they are first edited
+const char* const empty_line = "";
+
+// Cells are allocated this many at a time
+const size_t cells_per_slab_block = 1024;
+// The line index holds up to this many lines in each of its blocks
+const size_t max_lines_per_block = 128;
+const size_t line_blocks_per_slab_block = 256;
+// Packed line storage is carved from arena blocks of this size
+const size_t line_arena_block_size = 1 << 20;
+// Each thread splitting a mapped file into lines takes at least this
+// many bytes of it
+const size_t min_split_range = 1 << 20;
 
 typedef struct buffer_cell_t buffer_cell_t;
 typedef buffer_cell_t* xorptr_t;
+typedef struct line_block_t line_block_t;
+
+/*
+ * A line's storage is either an allocation of its own, packed into the
+ * buffer's line arena with no room to spare, or a read only view into
+ * a mapped file. Views and packed lines are moved into storage of
+ * their own when they need room to grow.
+ *
+ * Lines which can be edited are gap buffers: the room to spare in the
+ * line sits at gap, and is moved to where characters are inserted or
+ * deleted, so edits near the cursor do not move the rest of the line.
+ * The line is contiguous whenever the gap is at the end.
+ *
+ * Very long lines are split into chunks, each a gap buffer of its own,
+ * so that an edit only moves text within one chunk. The length of a
+ * chunked line is the room in all of its chunks.
+ */
+typedef enum line_storage_t
+{
+  LINE_HEAP,
+  LINE_PACKED,
+  LINE_VIEW,
+  LINE_CHUNKED
+} line_storage_t;
+
+typedef struct chunk_list_t chunk_list_t;
 
 typedef struct line_t
 {
   size_t used;
   size_t length;
-  char* buffer;
+  size_t gap;
+  union
+  {
+    char* buffer;
+    chunk_list_t* chunks;
+  };
+  // A line_storage_t, kept to a byte so the flag and the line cache
+  // fit in the space left after it
+  uint8_t storage;
+
+  // Set when a snapshot was taken of the line's storage, which is then
+  // left as it is while the snapshot is held
+  bool shared;
+
+  // The line cache
+  uint16_t cache_key;
+  uint16_t cache_value;
 } line_t;
 
+/*
+ * A chunk is a heap line of line_chunk_size bytes whose storage
+ * follows it.
+ */
+typedef struct line_chunk_t
+{
+  line_t line;
+  char data[];
+} line_chunk_t;
+
+/*
+ * The chunks of a line, in order. Only the last chunk of a line may be
+ * empty. The chunk last used and the offset of its first character
+ * are kept, so edits near the cursor find their chunk directly.
+ */
+struct chunk_list_t
+{
+  line_chunk_t** chunks;
+  size_t count;
+  size_t capacity;
+  size_t hint;
+  size_t hint_start;
+};
+
 struct buffer_cell_t
 {
   line_t line;
   xorptr_t neighbours;
+  line_block_t* block;
+};
+
+/*
+ * The line index splits the buffer into blocks of consecutive cells,
+ * kept in a treap ordered by position, with the number of lines under
+ * each node. The block holding a line, and the line a block starts
+ * at, are found in logarithmic time. Blocks are also linked in order,
+ * as walking into a block needs the cell before its first cell.
+ */
+struct line_block_t
+{
+  line_block_t* left;
+  line_block_t* right;
+  line_block_t* parent;
+  uint32_t priority;
+
+  line_block_t* previous;
+  line_block_t* next;
+
+  buffer_cell_t* first;
+  buffer_cell_t* last;
+  size_t lines;
+
+  // Lines in the subtree rooted at this block
+  size_t subtree_lines;
 };
 
+/*
+ * buffer_t holds the state shared by all iterators into a buffer.
+ */
+typedef struct buffer_t
+{
+  // The file mapping owned by the buffer, if any
+  char* mapping;
+  size_t mapping_length;
+
+  // The part of the mapping which has not yet been split into lines
+  const char* pending;
+  const char* pending_end;
+
+  // Cells come from the slab, and packed lines from the arena
+  slab_t cells;
+  arena_t lines;
+
+  // The root of the line index, and the state of its priorities
+  slab_t blocks;
+  line_block_t* index;
+  uint32_t seed;
+
+  // Counters for lines with storage of their own
+  size_t heap_lines;
+  size_t heap_bytes;
+  size_t heap_allocations;
+
+  // Bytes of text held in heap and packed lines
+  size_t text_bytes;
+
+  // The cell last edited, whose line may have room to spare
+  buffer_cell_t* focus;
+
+  // The number of snapshots held, and the storage of shared lines
+  // given up while they are, which is freed when the last is released
+  size_t snapshots;
+  line_t* retired;
+  size_t retired_count;
+  size_t retired_capacity;
+
+  // Lines changed since damage was last taken
+  damage_t damage;
+} buffer_t;
+
 struct buffer_iter_t
 {
+  buffer_t* buffer;
   buffer_cell_t* current;
   buffer_cell_t* next;
   buffer_cell_t* previous;
@@ -35,10 +197,16 @@ struct buffer_iter_t
 
 // Buffer helper function declarations
 buffer_cell_t*
-new_buffer_cell();
+new_buffer_cell(buffer_t* const buffer);
+
+void
+destroy_buffer_cell(buffer_t* const buffer, buffer_cell_t* const buffer_cell);
+
+void
+free_heap_line(void* object, void* context);
 
 void
-destroy_buffer_cell(buffer_cell_t* const buffer_cell);
+free_line_storage(line_t* const line);
 
 xorptr_t
 encode_pair(const buffer_cell_t* const a, const buffer_cell_t* b);
@@ -46,24 +214,234 @@ encode_pair(const buffer_cell_t* const a, const buffer_cell_t* b);
 buffer_cell_t*
 decode_with(const xorptr_t encoded, const buffer_cell_t* v);
 
+buffer_cell_t*
+next_cell(const buffer_iter_t* const iter);
+
+void
+link_cell_after_point(buffer_iter_t* const iter, buffer_cell_t* const cell);
+
+void
+destroy_cells(buffer_t* const buffer, buffer_cell_t* const last);
+
+error_t
+chain_filled_cell(buffer_t* const buffer,
+                  buffer_cell_t** const last,
+                  const char* const data,
+                  const size_t length);
+
+error_t
+insert_lines_at_point(buffer_iter_t* const iter,
+                      const char* const data,
+                      const size_t length);
+
+bool
+has_pending_lines(const buffer_t* const buffer);
+
+error_t
+split_pending_line(buffer_iter_t* const iter);
+
+/*
+ * A range of a mapped file split into lines by a thread of its own, as
+ * a chain of cells and a list of index blocks, allocated from slabs of
+ * its own.
+ */
+typedef struct split_range_t
+{
+  const char* start;
+  const char* end;
+  slab_t cells;
+  slab_t blocks;
+  uint32_t seed;
+
+  buffer_cell_t* first;
+  buffer_cell_t* last;
+  line_block_t* first_block;
+  error_t result;
+} split_range_t;
+
+error_t
+split_pending_lines(buffer_iter_t* const iter, const size_t jobs);
+
+void*
+split_range(void* const context);
+
+void
+append_split_range(buffer_t* const buffer,
+                   split_range_t* const range,
+                   buffer_cell_t** const last,
+                   line_block_t** const last_block);
+
+void
+focus_cell(buffer_t* const buffer, buffer_cell_t* const cell);
+
+void
+damage_line_at_point(buffer_iter_t* const iter);
+
+buffer_cell_t*
+first_cell(const buffer_iter_t* const iter);
+
+void
+unlink_cell_at_point(buffer_iter_t* const iter);
+
+// Line index helper function declarations
+line_block_t*
+new_line_block(buffer_t* const buffer);
+
+line_block_t*
+allocate_line_block(slab_t* const blocks, uint32_t* const seed);
+
+size_t
+subtree_lines(const line_block_t* const block);
+
+void
+update_block_counts(line_block_t* block);
+
+void
+rotate_block_up(buffer_t* const buffer, line_block_t* const block);
+
+void
+insert_block_after(buffer_t* const buffer,
+                   line_block_t* const block,
+                   line_block_t* const new_block);
+
+void
+remove_block(buffer_t* const buffer, line_block_t* const block);
+
+void
+split_block(buffer_t* const buffer, line_block_t* const block);
+
+void
+index_cell_after(buffer_t* const buffer,
+                 buffer_cell_t* const after,
+                 buffer_cell_t* const cell);
+
+void
+unindex_cell(buffer_t* const buffer,
+             buffer_cell_t* const cell,
+             buffer_cell_t* const previous,
+             buffer_cell_t* const next);
+
+line_block_t*
+find_block(const buffer_t* const buffer, size_t* const line);
+
+buffer_cell_t*
+cell_before_block(const line_block_t* const block);
+
 // Line helper function declarations
 error_t
-allocate_line(line_t* const line);
+allocate_filled_line(buffer_t* const buffer,
+                     line_t* const line,
+                     const char* const data,
+                     const size_t length);
+
+void
+deallocate_line(buffer_t* const buffer, line_t* const line);
+
+bool
+is_line_shared(const buffer_t* const buffer, const line_t* const line);
+
+void
+retire_line(buffer_t* const buffer, const line_t* const line);
+
+void
+free_retired_lines(buffer_t* const buffer);
+
+error_t
+unshare_line(buffer_t* const buffer, line_t* const line);
+
+bool
+snapshot_segment(const char* const data,
+                 const size_t length,
+                 void* const context);
+
+error_t
+insert_character(buffer_t* const buffer,
+                 line_t* const line,
+                 const char c,
+                 const size_t ix);
+
+error_t
+insert_characters(buffer_t* const buffer,
+                  line_t* const line,
+                  const char* const data,
+                  const size_t length,
+                  size_t ix);
+
+void
+delete_character(buffer_t* const buffer, line_t* const line, size_t ix);
+
+void
+clear_line(buffer_t* const buffer, line_t* const line);
+
+void
+view_line(line_t* const line, const char* const data, const size_t length);
+
+error_t
+make_line_editable(buffer_t* const buffer, line_t* const line);
+
+size_t
+gap_length(const line_t* const line);
 
 void
-deallocate_line(line_t* const line);
+move_gap(line_t* const line, const size_t ix);
+
+void
+flush_gap(line_t* const line);
+
+void
+copy_line_contents(const line_t* const line, char* const dst);
+
+bool
+visit_gap_buffer(const line_t* const line,
+                 segment_visitor_t* const visitor,
+                 void* const context);
+
+// Chunked line helper function declarations
+line_chunk_t*
+new_line_chunk(buffer_t* const buffer);
 
 error_t
-insert_character(line_t* const line, const char c, const size_t ix);
+insert_line_chunk(buffer_t* const buffer,
+                  line_t* const line,
+                  const size_t ix,
+                  line_chunk_t* const chunk);
+
+void
+remove_line_chunk(buffer_t* const buffer, line_t* const line, const size_t ix);
 
 void
-delete_character(line_t* const line, size_t ix);
+free_chunks(chunk_list_t* const chunks);
+
+error_t
+chunk_line(buffer_t* const buffer, line_t* const line);
+
+size_t
+find_chunk(chunk_list_t* const chunks, const size_t ix);
 
 error_t
-grow_buffer(line_t* const line);
+insert_chunked_character(buffer_t* const buffer,
+                         line_t* const line,
+                         const char c,
+                         const size_t ix);
+
+void
+delete_chunked_character(buffer_t* const buffer,
+                         line_t* const line,
+                         const size_t ix);
+
+void
+shrink_line(buffer_t* const buffer, line_t* const line);
 
 void
-clear_line(line_t* const line);
+pack_line(buffer_t* const buffer, arena_t* const arena, line_t* const line);
+
+error_t
+move_line_to_heap(buffer_t* const buffer,
+                  line_t* const line,
+                  const size_t length);
+
+error_t
+resize_line(buffer_t* const buffer, line_t* const line, const size_t length);
 
 /*****************************************************************************/
 /* Buffer lifecycle                                                          */
@@ -72,28 +450,73 @@ buffer_iter_t*
 new_buffer()
 {
   buffer_iter_t* buffer = NULL;
-  buffer_cell_t* buffer_cell = new_buffer_cell();
+  buffer_cell_t* buffer_cell = NULL;
+  buffer_t* shared = calloc(sizeof(buffer_t), 1);
+
+  if (shared) {
+    init_slab(&shared->cells, sizeof(buffer_cell_t), cells_per_slab_block);
+    init_arena(&shared->lines, line_arena_block_size);
+    init_slab(
+      &shared->blocks, sizeof(line_block_t), line_blocks_per_slab_block);
+    shared->seed = 2463534242u;
+    buffer_cell = new_buffer_cell(shared);
+    shared->index = buffer_cell ? new_line_block(shared) : NULL;
+  }
+
+  if (buffer_cell && shared->index) {
+    line_block_t* const block = shared->index;
+    block->first = buffer_cell;
+    block->last = buffer_cell;
+    block->lines = 1;
+    block->subtree_lines = 1;
+    buffer_cell->block = block;
 
-  if (buffer_cell) {
     buffer = calloc(sizeof(buffer_iter_t), 1);
     if (buffer) {
+      buffer->buffer = shared;
       buffer->current = buffer_cell;
       buffer->previous = NULL;
       buffer->next = NULL;
       buffer->column = 0;
-    } else {
-      destroy_buffer_cell(buffer_cell);
     }
   }
 
+  if (!buffer && shared) {
+    if (buffer_cell) {
+      destroy_buffer_cell(shared, buffer_cell);
+    }
+    destroy_slab(&shared->cells);
+    destroy_slab(&shared->blocks);
+    free(shared);
+  }
+
   return buffer;
 }
 
 void
 destroy_buffer(buffer_iter_t* buffer)
 {
-  // TODO - do a bidirectional free
-  return;
+  if (!buffer) {
+    return;
+  }
+
+  buffer_t* const shared = buffer->buffer;
+
+  // Only lines with storage of their own need visiting; everything
+  // else goes with the slab and arena blocks
+  if (shared->heap_lines > 0) {
+    for_each_slab_object(&shared->cells, free_heap_line, NULL);
+  }
+  free_retired_lines(shared);
+  destroy_slab(&shared->cells);
+  destroy_slab(&shared->blocks);
+  destroy_arena(&shared->lines);
+
+  if (shared->mapping) {
+    munmap(shared->mapping, shared->mapping_length);
+  }
+  free(shared);
+  free(buffer);
 }
 
 void
@@ -105,7 +528,7 @@ destroy_buffer_iter(buffer_iter_t* buffer_iter)
 error_t
 copy_buffer_iter(const buffer_iter_t* const src, buffer_iter_t** const dst)
 {
-  buffer_iter_t* copy = new_buffer();
+  buffer_iter_t* copy = malloc(sizeof(buffer_iter_t));
   if (copy) {
     *dst = copy;
     *copy = *src;
@@ -114,13 +537,172 @@ copy_buffer_iter(const buffer_iter_t* const src, buffer_iter_t** const dst)
   return copy ? SUCCESS : ALLOC_ERROR;
 }
 
+error_t
+load_mapped_file(buffer_iter_t* const iter,
+                 char* const data,
+                 size_t length,
+                 const size_t jobs)
+{
+  buffer_t* const buffer = iter->buffer;
+
+  if (buffer->mapping || !is_first_line(iter) || !is_last_line(iter) ||
+      chars_in_line(iter) > 0) {
+    return READ_ERROR;
+  }
+
+  buffer->mapping = data;
+  buffer->mapping_length = length;
+  buffer->pending = data;
+  buffer->pending_end = data + length;
+
+  // The first line lives in the cell the buffer was created with
+  const char* const newline = memchr(data, '\n', length);
+  const size_t first_length = newline ? (size_t)(newline - data) : length;
+
+  deallocate_line(buffer, &iter->current->line);
+  view_line(&iter->current->line, data, first_length);
+  buffer->pending = newline ? newline + 1 : buffer->pending_end;
+  add_damage(&buffer->damage, 0, DAMAGE_TO_END);
+
+  // If the rest can not be split up front, it is split lazily as ever
+  if (jobs > 1) {
+    split_pending_lines(iter, jobs);
+  }
+
+  return SUCCESS;
+}
+
+void
+compact_buffer(buffer_iter_t* const iter)
+{
+  buffer_t* const buffer = iter->buffer;
+
+  // Snapshots may point into the arena
+  if (buffer->snapshots > 0) {
+    return;
+  }
+
+  arena_t packed;
+  init_arena(&packed, line_arena_block_size);
+
+  // Repack in line order, so the arena follows the buffer
+  buffer_cell_t* previous = NULL;
+  buffer_cell_t* current = first_cell(iter);
+  while (current) {
+    pack_line(buffer, &packed, &current->line);
+
+    buffer_cell_t* const next = decode_with(current->neighbours, previous);
+    previous = current;
+    current = next;
+  }
+
+  destroy_arena(&buffer->lines);
+  buffer->lines = packed;
+  buffer->focus = NULL;
+}
+
+error_t
+take_buffer_snapshot(buffer_iter_t* const iter,
+                     buffer_snapshot_t* const snapshot)
+{
+  buffer_t* const buffer = iter->buffer;
+  *snapshot = (buffer_snapshot_t){ 0 };
+  error_t ret = SUCCESS;
+
+  // Lines split so far are marked, so they are copied before they are
+  // changed, and the unsplit part of the mapping is taken as it is
+  buffer_cell_t* previous = NULL;
+  buffer_cell_t* current = first_cell(iter);
+  while (current && ret == SUCCESS) {
+    line_t* const line = &current->line;
+    line->shared = line->storage != LINE_VIEW;
+
+    bool added = true;
+    if (line->storage != LINE_CHUNKED) {
+      added = visit_gap_buffer(line, snapshot_segment, snapshot);
+    } else {
+      for (size_t i = 0; added && i < line->chunks->count; i++) {
+        added = visit_gap_buffer(
+          &line->chunks->chunks[i]->line, snapshot_segment, snapshot);
+      }
+    }
+    ret = added ? add_snapshot_newline(snapshot) : ALLOC_ERROR;
+
+    buffer_cell_t* const next = decode_with(current->neighbours, previous);
+    previous = current;
+    current = next;
+  }
+
+  const size_t pending = buffer->pending_end - buffer->pending;
+  if (ret == SUCCESS && pending > 0) {
+    ret = add_snapshot_segment(snapshot, buffer->pending, pending);
+  }
+  if (ret == SUCCESS && pending > 0 && buffer->pending_end[-1] != '\n') {
+    ret = add_snapshot_newline(snapshot);
+  }
+
+  if (ret != SUCCESS) {
+    destroy_snapshot(snapshot);
+    return ret;
+  }
+
+  buffer->snapshots++;
+
+  return SUCCESS;
+}
+
+void
+release_buffer_snapshot(buffer_iter_t* const iter,
+                        buffer_snapshot_t* const snapshot)
+{
+  buffer_t* const buffer = iter->buffer;
+
+  destroy_snapshot(snapshot);
+  if (--buffer->snapshots == 0) {
+    free_retired_lines(buffer);
+  }
+}
+
 /*****************************************************************************/
 /* Get information about the buffer                                          */
 /*****************************************************************************/
 char*
 current_line(const buffer_iter_t* const iter)
 {
-  return iter->current->line.buffer;
+  line_t* const line = &iter->current->line;
+
+  if (make_line_editable(iter->buffer, line) != SUCCESS) {
+    return NULL;
+  }
+
+  // C strings have to be contiguous, so chunked lines are joined
+  if (line->storage == LINE_CHUNKED &&
+      move_line_to_heap(iter->buffer, line, line->used) != SUCCESS) {
+    return NULL;
+  }
+  flush_gap(line);
+
+  return line->buffer;
+}
+
+void
+visit_line(const buffer_iter_t* const iter,
+           segment_visitor_t* const visitor,
+           void* const context)
+{
+  const line_t* const line = &iter->current->line;
+
+  if (line->storage != LINE_CHUNKED) {
+    visit_gap_buffer(line, visitor, context);
+    return;
+  }
+
+  const chunk_list_t* const chunks = line->chunks;
+  for (size_t i = 0; i < chunks->count; i++) {
+    if (!visit_gap_buffer(&chunks->chunks[i]->line, visitor, context)) {
+      return;
+    }
+  }
 }
 
 size_t
@@ -144,7 +726,7 @@ chars_in_line(const buffer_iter_t* const iter)
 bool
 is_last_line(const buffer_iter_t* const iter)
 {
-  return iter->next == NULL;
+  return next_cell(iter) == NULL && !has_pending_lines(iter->buffer);
 }
 
 bool
@@ -153,12 +735,75 @@ is_first_line(const buffer_iter_t* const iter)
   return iter->previous == NULL;
 }
 
+void
+get_buffer_stats(const buffer_iter_t* const iter, buffer_stats_t* const stats)
+{
+  const buffer_t* const buffer = iter->buffer;
+
+  stats->lines = buffer->cells.live;
+  stats->cell_bytes_reserved = buffer->cells.reserved;
+  stats->cell_bytes_used = buffer->cells.live * buffer->cells.object_size;
+  stats->line_bytes_reserved = buffer->lines.reserved + buffer->heap_bytes;
+  stats->line_bytes_used = buffer->text_bytes;
+  stats->mapped_bytes = buffer->mapping_length;
+  stats->allocations = buffer->cells.allocations + buffer->blocks.allocations +
+                       buffer->lines.allocations + buffer->heap_allocations;
+}
+
+void
+take_damage(buffer_iter_t* const iter, damage_t* const damage)
+{
+  *damage = iter->buffer->damage;
+  clear_damage(&iter->buffer->damage);
+}
+
+size_t
+buffer_version(const buffer_iter_t* const iter)
+{
+  return iter->buffer->damage.edits;
+}
+
+bool
+get_line_cache(const buffer_iter_t* const iter,
+               const size_t key,
+               size_t* const value)
+{
+  const line_t* const line = &iter->current->line;
+
+  if (key == 0 || line->cache_key != key) {
+    return false;
+  }
+
+  *value = line->cache_value;
+  return true;
+}
+
+void
+set_line_cache(const buffer_iter_t* const iter,
+               const size_t key,
+               const size_t value)
+{
+  line_t* const line = &iter->current->line;
+
+  if (key <= LINE_CACHE_MAX) {
+    line->cache_key = key;
+    line->cache_value = min(value, LINE_CACHE_MAX);
+  }
+}
+
 /*****************************************************************************/
 /* Buffer movement functions                                                 */
 /*****************************************************************************/
 void
 move_iter_down_line(buffer_iter_t* const iter)
 {
+  // Another iterator may have split further lines from the mapping
+  // since this iterator last looked at its neighbours
+  iter->next = next_cell(iter);
+  if (!iter->next && has_pending_lines(iter->buffer)) {
+    split_pending_line(iter);
+  }
+
   if (iter->next) {
     buffer_cell_t* next_next =
       decode_with(iter->next->neighbours, iter->current);
@@ -202,48 +847,163 @@ move_to_beginning_of_line(buffer_iter_t* const iter)
   iter->column = 0;
 }
 
+void
+move_iter_to_column(buffer_iter_t* const iter, const size_t column)
+{
+  iter->column = min(column, iter->current->line.used);
+}
+
+void
+move_iter_to_line(buffer_iter_t* const iter, const size_t line)
+{
+  buffer_t* const buffer = iter->buffer;
+  size_t offset = line;
+  line_block_t* block = find_block(buffer, &offset);
+
+  // Lines past the end of the index have not been split from the
+  // mapping yet, so walk to them from the last line
+  if (!block) {
+    for (block = buffer->index; block->right; block = block->right) {
+    }
+    offset = block->lines - 1;
+  }
+
+  iter->previous = cell_before_block(block);
+  iter->current = block->first;
+  for (size_t i = 0; i < offset; i++) {
+    buffer_cell_t* const next = next_cell(iter);
+    iter->previous = iter->current;
+    iter->current = next;
+  }
+  iter->next = next_cell(iter);
+  iter->line = min(line, subtree_lines(buffer->index) - 1);
+
+  while (iter->line < line && !is_last_line(iter)) {
+    move_iter_down_line(iter);
+  }
+}
+
 /*****************************************************************************/
 /* Buffer movement functions                                                 */
 /*****************************************************************************/
 error_t
 append_line_at_point(buffer_iter_t* const iter)
 {
-  buffer_cell_t* new_cell = new_buffer_cell();
+  buffer_cell_t* new_cell = new_buffer_cell(iter->buffer);
 
   if (new_cell) {
-    new_cell->neighbours = encode_pair(iter->current, iter->next);
-    iter->current->neighbours = encode_pair(iter->previous, new_cell);
-
-    if (iter->next) {
-      const buffer_cell_t* nexts_next =
-        decode_with(iter->next->neighbours, iter->current);
-      iter->next->neighbours = encode_pair(new_cell, nexts_next);
-    }
-
-    iter->next = new_cell;
+    link_cell_after_point(iter, new_cell);
+    add_damage(&iter->buffer->damage, iter->line + 1, DAMAGE_TO_END);
   }
 
   return new_cell ? SUCCESS : ALLOC_ERROR;
 }
 
 error_t
-insert_character_at_point(buffer_iter_t* const iter, char c)
+append_filled_line_at_point(buffer_iter_t* const iter,
+                            const char* const data,
+                            const size_t length)
 {
-  return insert_character(&iter->current->line, c, iter->column++);
-}
+  buffer_t* const buffer = iter->buffer;
+  buffer_cell_t* const new_cell = slab_alloc(&buffer->cells);
+  if (!new_cell) {
+    return ALLOC_ERROR;
+  }
+
+  const error_t ret =
+    allocate_filled_line(buffer, &new_cell->line, data, length);
+  if (ret == SUCCESS) {
+    link_cell_after_point(iter, new_cell);
+    add_damage(&buffer->damage, iter->line + 1, DAMAGE_TO_END);
+  } else {
+    slab_free(&buffer->cells, new_cell);
+  }
+
+  return ret;
+}
+
+error_t
+fill_line_at_point(buffer_iter_t* const iter,
+                   const char* const data,
+                   const size_t length)
+{
+  line_t line = { 0 };
+  const error_t ret = allocate_filled_line(iter->buffer, &line, data, length);
+
+  if (ret == SUCCESS) {
+    deallocate_line(iter->buffer, &iter->current->line);
+    iter->current->line = line;
+    damage_line_at_point(iter);
+  }
+
+  return ret;
+}
+
+error_t
+insert_character_at_point(buffer_iter_t* const iter, char c)
+{
+  focus_cell(iter->buffer, iter->current);
+  damage_line_at_point(iter);
+  return insert_character(
+    iter->buffer, &iter->current->line, c, iter->column++);
+}
+
+error_t
+insert_string_at_point(buffer_iter_t* const iter,
+                       const char* const data,
+                       const size_t length)
+{
+  if (length == 0) {
+    return SUCCESS;
+  }
+
+  if (memchr(data, '\n', length)) {
+    return insert_lines_at_point(iter, data, length);
+  }
+
+  const size_t ix = column(iter);
+  focus_cell(iter->buffer, iter->current);
+  damage_line_at_point(iter);
+  const error_t ret =
+    insert_characters(iter->buffer, &iter->current->line, data, length, ix);
+
+  if (ret == SUCCESS) {
+    iter->column = ix + length;
+  }
+
+  return ret;
+}
 
 void
 delete_character_at_point(buffer_iter_t* const iter)
 {
   size_t ix = column(iter);
   move_iter_back_char(iter);
-  delete_character(&iter->current->line, ix);
+  focus_cell(iter->buffer, iter->current);
+  damage_line_at_point(iter);
+  delete_character(iter->buffer, &iter->current->line, ix);
 }
 
 void
 clear_line_at_point(buffer_iter_t* const iter)
 {
-  clear_line(&iter->current->line);
+  focus_cell(iter->buffer, iter->current);
+  damage_line_at_point(iter);
+  clear_line(iter->buffer, &iter->current->line);
+}
+
+void
+delete_line_at_point(buffer_iter_t* const iter)
+{
+  if (is_first_line(iter) && is_last_line(iter)) {
+    clear_line_at_point(iter);
+    return;
+  }
+
+  buffer_cell_t* const cell = iter->current;
+  add_damage(&iter->buffer->damage, iter->line, DAMAGE_TO_END);
+  unlink_cell_at_point(iter);
+  destroy_buffer_cell(iter->buffer, cell);
 }
 
 /*****************************************************************************/
@@ -254,61 +1014,552 @@ clear_line_at_point(buffer_iter_t* const iter)
 /* Buffer cell lifecycle and management                                      */
 /* ------------------------------------------------------------------------- */
 buffer_cell_t*
-new_buffer_cell()
+new_buffer_cell(buffer_t* const buffer)
 {
-  buffer_cell_t* buffer_cell = calloc(sizeof(buffer_cell_t), 1);
+  buffer_cell_t* buffer_cell = slab_alloc(&buffer->cells);
 
   if (buffer_cell) {
-    const error_t alloc_ret = allocate_line(&buffer_cell->line);
-    if (alloc_ret == SUCCESS) {
-      buffer_cell->neighbours = NULL;
-    } else {
-      free(buffer_cell);
-      buffer_cell = NULL;
-    }
+    view_line(&buffer_cell->line, empty_line, 0);
+    buffer_cell->neighbours = NULL;
   }
 
   return buffer_cell;
 }
 
 void
-destroy_buffer_cell(buffer_cell_t* const buffer_cell)
+destroy_buffer_cell(buffer_t* const buffer, buffer_cell_t* const buffer_cell)
+{
+  if (buffer->focus == buffer_cell) {
+    buffer->focus = NULL;
+  }
+  deallocate_line(buffer, &buffer_cell->line);
+  slab_free(&buffer->cells, buffer_cell);
+}
+
+/*
+ * Free the storage of a cell's line if it is a heap line. Cells which
+ * have been returned to the slab have no storage, so this is safe to
+ * call on every object in the slab.
+ */
+void
+free_heap_line(void* object, void* context)
+{
+  free_line_storage(&((buffer_cell_t*)object)->line);
+}
+
+/*
+ * Free a line's storage if it has storage of its own, without
+ * touching the buffer's counters.
+ */
+void
+free_line_storage(line_t* const line)
 {
-  deallocate_line(&buffer_cell->line);
-  free(buffer_cell);
+  if (line->storage == LINE_HEAP) {
+    free(line->buffer);
+  } else if (line->storage == LINE_CHUNKED) {
+    free_chunks(line->chunks);
+  }
 }
 
+/*
+ * Make cell the focus of editing. The line previously in focus no
+ * longer needs room to grow, so is shrunk to fit.
+ */
+void
+focus_cell(buffer_t* const buffer, buffer_cell_t* const cell)
+{
+  if (buffer->focus != cell) {
+    if (buffer->focus) {
+      shrink_line(buffer, &buffer->focus->line);
+    }
+    buffer->focus = cell;
+  }
+}
+
+/*
+ * Record that the line at point has changed, and forget the value
+ * cached for it.
+ */
+void
+damage_line_at_point(buffer_iter_t* const iter)
+{
+  add_damage(&iter->buffer->damage, iter->line, iter->line);
+  iter->current->line.cache_key = 0;
+}
+
+/*
+ * Find the first cell in the buffer.
+ */
+buffer_cell_t*
+first_cell(const buffer_iter_t* const iter)
+{
+  size_t line = 0;
+  return find_block(iter->buffer, &line)->first;
+}
+
+/*
+ * Take the cell at point out of the list and the index, leaving point
+ * on the following line, or the previous line if there is none. The
+ * cell must not be the only one in the buffer.
+ */
+void
+unlink_cell_at_point(buffer_iter_t* const iter)
+{
+  buffer_cell_t* const cell = iter->current;
+
+  // The next line may still be in the mapping
+  iter->next = next_cell(iter);
+  if (!iter->next && has_pending_lines(iter->buffer)) {
+    split_pending_line(iter);
+  }
+
+  buffer_cell_t* const previous = iter->previous;
+  buffer_cell_t* const next = iter->next;
+  buffer_cell_t* const next_next =
+    next ? decode_with(next->neighbours, cell) : NULL;
+  buffer_cell_t* const previous_previous =
+    previous ? decode_with(previous->neighbours, cell) : NULL;
+
+  if (previous) {
+    previous->neighbours = encode_pair(previous_previous, next);
+  }
+  if (next) {
+    next->neighbours = encode_pair(previous, next_next);
+  }
+  unindex_cell(iter->buffer, cell, previous, next);
+
+  if (next) {
+    iter->current = next;
+    iter->next = next_next;
+  } else {
+    iter->current = previous;
+    iter->previous = previous_previous;
+    iter->next = NULL;
+    iter->line--;
+  }
+}
+
+/*
+ * Insert text holding at least one newline at point. The line at
+ * point is split at the cursor, and every line the text makes is built
+ * before the buffer is changed, so that a failed allocation leaves it
+ * as it was. The new lines are then linked in, in a single pass.
+ */
 error_t
-allocate_line(line_t* const line)
+insert_lines_at_point(buffer_iter_t* const iter,
+                      const char* const data,
+                      const size_t length)
 {
-  line->buffer = calloc(sizeof(char), default_line_buffer_length + 1);
+  buffer_t* const buffer = iter->buffer;
+  line_t* const line = &iter->current->line;
+  const size_t ix = column(iter);
+  const size_t tail = line->used - ix;
+  const char* const end = data + length;
+  const size_t head = (const char*)memchr(data, '\n', length) - data;
+
+  // The line's contents, followed by room to build the first and last
+  // lines in
+  char* const contents = malloc(2 * line->used + length + 1);
+  if (!contents) {
+    return ALLOC_ERROR;
+  }
+  copy_line_contents(line, contents);
+
+  error_t ret = SUCCESS;
+  buffer_cell_t* first = NULL;
+  buffer_cell_t* last = NULL;
+  const char* start = data + head + 1;
+
+  for (const char* newline;
+       ret == SUCCESS && (newline = memchr(start, '\n', end - start));
+       start = newline + 1) {
+    ret = chain_filled_cell(buffer, &last, start, newline - start);
+    first = first ? first : last;
+  }
+
+  // The last line ends with the text which followed the cursor, and
+  // the first starts with the text which preceded it
+  char* const scratch = contents + line->used;
+  const size_t last_length = end - start;
+  if (ret == SUCCESS) {
+    memcpy(scratch, start, last_length);
+    memcpy(scratch + last_length, contents + ix, tail);
+    ret = chain_filled_cell(buffer, &last, scratch, last_length + tail);
+    first = first ? first : last;
+  }
+
+  line_t split = { 0 };
+  if (ret == SUCCESS) {
+    memcpy(scratch, contents, ix);
+    memcpy(scratch + ix, data, head);
+    ret = allocate_filled_line(buffer, &split, scratch, ix + head);
+  }
+  free(contents);
+
+  if (ret != SUCCESS) {
+    destroy_cells(buffer, last);
+    return ret;
+  }
+
+  deallocate_line(buffer, line);
+  *line = split;
+  add_damage(&buffer->damage, iter->line, DAMAGE_TO_END);
+
+  buffer_cell_t* previous = NULL;
+  for (buffer_cell_t* cell = first; cell;) {
+    buffer_cell_t* const next = decode_with(cell->neighbours, previous);
+    link_cell_after_point(iter, cell);
+    move_iter_down_line(iter);
+    previous = cell;
+    cell = next;
+  }
+  iter->column = last_length;
+
+  return SUCCESS;
+}
+
+/*
+ * Build a cell holding exactly data, and link it after last, which is
+ * the end of a chain of cells not yet in the buffer, if there is one.
+ */
+error_t
+chain_filled_cell(buffer_t* const buffer,
+                  buffer_cell_t** const last,
+                  const char* const data,
+                  const size_t length)
+{
+  buffer_cell_t* const cell = slab_alloc(&buffer->cells);
+  if (!cell) {
+    return ALLOC_ERROR;
+  }
+
+  if (length == 0) {
+    view_line(&cell->line, empty_line, 0);
+  } else if (allocate_filled_line(buffer, &cell->line, data, length) !=
+             SUCCESS) {
+    slab_free(&buffer->cells, cell);
+    return ALLOC_ERROR;
+  }
+
+  cell->neighbours = *last;
+  if (*last) {
+    (*last)->neighbours = encode_pair((*last)->neighbours, cell);
+  }
+  *last = cell;
+
+  return SUCCESS;
+}
+
+/*
+ * Allocate line storage holding exactly data, with no room to spare,
+ * packed into the buffer's line arena.
+ */
+error_t
+allocate_filled_line(buffer_t* const buffer,
+                     line_t* const line,
+                     const char* const data,
+                     const size_t length)
+{
+  line->buffer = arena_alloc(&buffer->lines, length + 1);
 
   if (line->buffer) {
-    line->length = default_line_buffer_length;
+    memcpy(line->buffer, data, length);
+    line->buffer[length] = '\0';
+    line->used = length;
+    line->length = length;
+    line->gap = length;
+    line->storage = LINE_PACKED;
+    line->shared = false;
+    line->cache_key = 0;
+    buffer->text_bytes += length;
+  } else {
+    // The cell goes back to the slab, where destroy_buffer takes a
+    // heap line with no buffer to have nothing to free
+    line->storage = LINE_HEAP;
   }
 
   return line->buffer ? SUCCESS : ALLOC_ERROR;
 }
 
 void
-deallocate_line(line_t* const line)
+deallocate_line(buffer_t* const buffer, line_t* const line)
 {
-  free(line->buffer);
+  // Storage a snapshot may be reading is kept until it is released.
+  // Packed storage is only freed along with the arena anyway.
+  const bool shared =
+    is_line_shared(buffer, line) && line->storage != LINE_PACKED;
+  if (shared) {
+    retire_line(buffer, line);
+  }
+
+  switch (line->storage) {
+    case LINE_HEAP:
+      if (line->buffer) {
+        if (!shared) {
+          free(line->buffer);
+        }
+        buffer->heap_lines--;
+        buffer->heap_bytes -= line->length + 1;
+        buffer->text_bytes -= line->used;
+      }
+      break;
+    case LINE_PACKED:
+      arena_release(&buffer->lines, line->length + 1);
+      buffer->text_bytes -= line->used;
+      break;
+    case LINE_VIEW:
+      break;
+    case LINE_CHUNKED:
+      if (!shared) {
+        free_chunks(line->chunks);
+      }
+      buffer->heap_lines--;
+      buffer->heap_bytes -= line->length;
+      buffer->text_bytes -= line->used;
+      break;
+  }
+
   line->buffer = NULL;
+  line->used = 0;
   line->length = 0;
+  line->gap = 0;
+  line->storage = LINE_HEAP;
+  line->shared = false;
+  line->cache_key = 0;
+}
+
+void
+view_line(line_t* const line, const char* const data, const size_t length)
+{
+  line->buffer = (char*)data;
+  line->used = length;
+  line->length = length;
+  line->gap = length;
+  line->storage = LINE_VIEW;
+  line->shared = false;
+  line->cache_key = 0;
+}
+
+/*
+ * Whether a snapshot still held may be reading the line's storage.
+ * Lines are marked when a snapshot is taken, and the mark is only
+ * cleared when the line is next changed, so it counts for nothing
+ * once every snapshot has been released.
+ */
+bool
+is_line_shared(const buffer_t* const buffer, const line_t* const line)
+{
+  return line->shared && buffer->snapshots > 0;
+}
+
+/*
+ * Keep the storage of a shared line until the last snapshot is
+ * released. If there is no room to keep track of it, it is never
+ * freed, as freeing it now could pull it from under a snapshot.
+ */
+void
+retire_line(buffer_t* const buffer, const line_t* const line)
+{
+  if (buffer->retired_count == buffer->retired_capacity) {
+    const size_t new_capacity = max(2 * buffer->retired_capacity, 16);
+    line_t* const new_retired =
+      realloc(buffer->retired, sizeof(line_t) * new_capacity);
+    if (!new_retired) {
+      return;
+    }
+    buffer->heap_allocations++;
+    buffer->retired = new_retired;
+    buffer->retired_capacity = new_capacity;
+  }
+
+  buffer->retired[buffer->retired_count++] = *line;
+}
+
+void
+free_retired_lines(buffer_t* const buffer)
+{
+  for (size_t i = 0; i < buffer->retired_count; i++) {
+    free_line_storage(&buffer->retired[i]);
+  }
+  free(buffer->retired);
+  buffer->retired = NULL;
+  buffer->retired_count = 0;
+  buffer->retired_capacity = 0;
 }
 
+/*
+ * Move a shared line into storage of its own, leaving the storage the
+ * snapshot reads alone, so the line can be edited in place.
+ */
 error_t
-grow_buffer(line_t* const line)
+unshare_line(buffer_t* const buffer, line_t* const line)
+{
+  if (line->used < long_line_length) {
+    return move_line_to_heap(
+      buffer, line, max(line->used, default_line_buffer_length));
+  }
+
+  // Chunked lines are joined, and then chunked again
+  const error_t ret = move_line_to_heap(buffer, line, line->used);
+  return ret == SUCCESS ? chunk_line(buffer, line) : ret;
+}
+
+/*
+ * Give back the room a heap line has to spare.
+ */
+void
+shrink_line(buffer_t* const buffer, line_t* const line)
 {
-  const size_t new_size =
-    min(max_buffer_growth + line->length, 2 * line->length);
+  if (line->storage != LINE_HEAP || line->length == line->used ||
+      is_line_shared(buffer, line)) {
+    return;
+  }
+
+  if (line->used == 0) {
+    deallocate_line(buffer, line);
+    view_line(line, empty_line, 0);
+    return;
+  }
 
-  char* const new_buffer = realloc(line->buffer, new_size + 1);
+  flush_gap(line);
+  char* const new_buffer = realloc(line->buffer, line->used + 1);
   if (new_buffer) {
-    memset(new_buffer + line->length, 0, new_size - line->length + 1);
+    buffer->heap_bytes -= line->length - line->used;
+    buffer->heap_allocations++;
     line->buffer = new_buffer;
-    line->length = new_size;
+    line->length = line->used;
+  }
+}
+
+/*
+ * Move an owned line into arena at its exact length. Empty lines are
+ * turned into views, and take no storage at all. Chunked lines stay
+ * as they are.
+ */
+void
+pack_line(buffer_t* const buffer, arena_t* const arena, line_t* const line)
+{
+  if (line->storage == LINE_VIEW || line->storage == LINE_CHUNKED) {
+    return;
+  }
+
+  const size_t used = line->used;
+  char* const packed = used ? arena_alloc(arena, used + 1) : NULL;
+  if (used && !packed) {
+    return;
+  }
+
+  if (packed) {
+    copy_line_contents(line, packed);
+    packed[used] = '\0';
+  }
+
+  // Packed lines in the old arena are accounted for when it is freed
+  if (line->storage == LINE_HEAP) {
+    deallocate_line(buffer, line);
+  } else {
+    buffer->text_bytes -= used;
+  }
+
+  if (packed) {
+    line->buffer = packed;
+    line->used = used;
+    line->length = used;
+    line->gap = used;
+    line->storage = LINE_PACKED;
+    buffer->text_bytes += used;
+  } else {
+    view_line(line, empty_line, 0);
+  }
+}
+
+/*
+ * Views are read only, so are copied before they are modified, as are
+ * lines a snapshot shares. Packed lines can be modified in place, as
+ * long as they do not grow.
+ */
+error_t
+make_line_editable(buffer_t* const buffer, line_t* const line)
+{
+  if (is_line_shared(buffer, line)) {
+    return unshare_line(buffer, line);
+  }
+
+  if (line->storage != LINE_VIEW) {
+    return SUCCESS;
+  }
+
+  if (line->used >= long_line_length) {
+    return chunk_line(buffer, line);
+  }
+
+  return move_line_to_heap(
+    buffer, line, max(line->used, default_line_buffer_length));
+}
+
+/*
+ * Move a line into a heap allocation with room for length bytes.
+ */
+error_t
+move_line_to_heap(buffer_t* const buffer,
+                  line_t* const line,
+                  const size_t length)
+{
+  char* const new_buffer = calloc(sizeof(char), length + 1);
+  if (!new_buffer) {
+    return ALLOC_ERROR;
+  }
+
+  const size_t used = line->used;
+  copy_line_contents(line, new_buffer);
+  deallocate_line(buffer, line);
+
+  line->buffer = new_buffer;
+  line->used = used;
+  line->length = length;
+  line->gap = used;
+  line->storage = LINE_HEAP;
+  buffer->heap_lines++;
+  buffer->heap_bytes += length + 1;
+  buffer->heap_allocations++;
+  buffer->text_bytes += used;
+
+  return SUCCESS;
+}
+
+error_t
+grow_buffer(buffer_t* const buffer, line_t* const line)
+{
+  if (line->used >= long_line_length) {
+    return chunk_line(buffer, line);
+  }
+
+  // Lines can be allocated with no spare room, so always grow by a
+  // sensible amount
+  const size_t new_size = max(default_line_buffer_length, 2 * line->length);
+
+  return resize_line(buffer, line, new_size);
+}
+
+/*
+ * Give a line which is not chunked room for length bytes.
+ */
+error_t
+resize_line(buffer_t* const buffer, line_t* const line, const size_t length)
+{
+  if (line->storage != LINE_HEAP) {
+    return move_line_to_heap(buffer, line, length);
+  }
+
+  char* const new_buffer = realloc(line->buffer, length + 1);
+  if (new_buffer) {
+    // The text after the gap stays at the end of the line
+    const size_t tail = line->used - line->gap;
+    memmove(new_buffer + length - tail, new_buffer + line->length - tail, tail);
+    buffer->heap_bytes += length - line->length;
+    buffer->heap_allocations++;
+    line->buffer = new_buffer;
+    line->length = length;
   }
 
   return new_buffer ? SUCCESS : ALLOC_ERROR;
@@ -318,38 +1569,426 @@ grow_buffer(line_t* const line)
 /* Buffer cell character operations                                          */
 /* ------------------------------------------------------------------------- */
 error_t
-insert_character(line_t* const line, const char c, size_t ix)
+insert_character(buffer_t* const buffer,
+                 line_t* const line,
+                 const char c,
+                 size_t ix)
 {
+  const error_t editable_ret = make_line_editable(buffer, line);
+  if (editable_ret != SUCCESS) {
+    return editable_ret;
+  }
+
   ix = min(ix, line->used);
-  if (line->used < line->length) { // TODO Check
-    // Make space for the new character
-    memmove(line->buffer + ix + 1, line->buffer + ix, line->used - ix);
+  if (line->storage == LINE_CHUNKED) {
+    return insert_chunked_character(buffer, line, c, ix);
+  }
 
-    line->buffer[ix] = c;
+  if (gap_length(line) > 0) {
+    move_gap(line, ix);
+    line->buffer[line->gap++] = c;
     line->used++;
+    buffer->text_bytes++;
 
     return SUCCESS;
   }
 
-  const error_t grow_ret = grow_buffer(line);
-  return grow_ret == SUCCESS ? insert_character(line, c, ix) : grow_ret;
+  const error_t grow_ret = grow_buffer(buffer, line);
+  return grow_ret == SUCCESS ? insert_character(buffer, line, c, ix)
+                             : grow_ret;
+}
+
+/*
+ * Insert length characters before ix, making room for all of them at
+ * once. Lines which would become too long are chunked first.
+ */
+error_t
+insert_characters(buffer_t* const buffer,
+                  line_t* const line,
+                  const char* const data,
+                  const size_t length,
+                  size_t ix)
+{
+  error_t ret = make_line_editable(buffer, line);
+  if (ret == SUCCESS && line->storage != LINE_CHUNKED &&
+      line->used + length >= long_line_length) {
+    ret = chunk_line(buffer, line);
+  }
+  if (ret != SUCCESS) {
+    return ret;
+  }
+
+  ix = min(ix, line->used);
+  if (line->storage == LINE_CHUNKED) {
+    for (size_t i = 0; i < length && ret == SUCCESS; i++) {
+      ret = insert_chunked_character(buffer, line, data[i], ix + i);
+    }
+    return ret;
+  }
+
+  if (gap_length(line) < length) {
+    const size_t doubled = 2 * line->length;
+    ret = resize_line(buffer, line, max(line->used + length, doubled));
+  }
+
+  if (ret == SUCCESS) {
+    move_gap(line, ix);
+    memcpy(line->buffer + line->gap, data, length);
+    line->gap += length;
+    line->used += length;
+    buffer->text_bytes += length;
+  }
+
+  return ret;
 }
 
 void
-delete_character(line_t* const line, size_t ix)
+delete_character(buffer_t* const buffer, line_t* const line, size_t ix)
 {
-  if (ix) {
-    memmove(line->buffer + ix - 1, line->buffer + ix, line->used - ix);
-    line->buffer[line->used - 1] = '\0';
+  ix = min(ix, line->used);
+  if (!ix || make_line_editable(buffer, line) != SUCCESS) {
+    return;
+  }
+
+  if (line->storage == LINE_CHUNKED) {
+    delete_chunked_character(buffer, line, ix);
+  } else {
+    move_gap(line, ix);
+    line->gap--;
     line->used--;
+    buffer->text_bytes--;
   }
 }
 
 void
-clear_line(line_t* const line)
+clear_line(buffer_t* const buffer, line_t* const line)
 {
+  if (line->storage == LINE_VIEW || line->storage == LINE_CHUNKED ||
+      is_line_shared(buffer, line)) {
+    // There is nothing worth keeping from the view or the chunks, and
+    // a snapshot's storage must be left alone
+    deallocate_line(buffer, line);
+    view_line(line, empty_line, 0);
+    return;
+  }
+
   memset(line->buffer, 0, line->length);
+  buffer->text_bytes -= line->used;
   line->used = 0;
+  line->gap = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Gap buffer operations                                                     */
+/* ------------------------------------------------------------------------- */
+size_t
+gap_length(const line_t* const line)
+{
+  return line->length - line->used;
+}
+
+/*
+ * Move the gap to sit before the character at ix, which costs the
+ * distance moved.
+ */
+void
+move_gap(line_t* const line, const size_t ix)
+{
+  const size_t gap = gap_length(line);
+
+  if (ix < line->gap) {
+    memmove(line->buffer + ix + gap, line->buffer + ix, line->gap - ix);
+  } else if (ix > line->gap) {
+    memmove(line->buffer + line->gap, line->buffer + line->gap + gap,
+            ix - line->gap);
+  }
+
+  line->gap = ix;
+}
+
+/*
+ * Make an editable line contiguous and NUL terminated.
+ */
+void
+flush_gap(line_t* const line)
+{
+  move_gap(line, line->used);
+  line->buffer[line->used] = '\0';
+}
+
+bool
+copy_segment(const char* const data, const size_t length, void* const context)
+{
+  char** const dst = context;
+  memcpy(*dst, data, length);
+  *dst += length;
+  return true;
+}
+
+void
+copy_line_contents(const line_t* const line, char* const dst)
+{
+  char* end = dst;
+
+  if (line->storage != LINE_CHUNKED) {
+    visit_gap_buffer(line, copy_segment, &end);
+    return;
+  }
+
+  for (size_t i = 0; i < line->chunks->count; i++) {
+    visit_gap_buffer(&line->chunks->chunks[i]->line, copy_segment, &end);
+  }
+}
+
+/*
+ * Pass the text either side of a line's gap to visitor. Returns false
+ * if the visitor asked to stop.
+ */
+bool
+visit_gap_buffer(const line_t* const line,
+                 segment_visitor_t* const visitor,
+                 void* const context)
+{
+  const size_t tail = line->used - line->gap;
+
+  if (line->gap > 0 && !visitor(line->buffer, line->gap, context)) {
+    return false;
+  }
+
+  return tail == 0 || visitor(line->buffer + line->length - tail, tail, context);
+}
+
+/*
+ * Segment visitor adding to the buffer_snapshot_t in context. Stops
+ * if the segment can not be added.
+ */
+bool
+snapshot_segment(const char* const data,
+                 const size_t length,
+                 void* const context)
+{
+  return add_snapshot_segment(context, data, length) == SUCCESS;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Chunked line operations                                                   */
+/* ------------------------------------------------------------------------- */
+line_chunk_t*
+new_line_chunk(buffer_t* const buffer)
+{
+  line_chunk_t* const chunk =
+    malloc(sizeof(line_chunk_t) + line_chunk_size + 1);
+
+  if (chunk) {
+    chunk->line.buffer = chunk->data;
+    chunk->line.used = 0;
+    chunk->line.length = line_chunk_size;
+    chunk->line.gap = 0;
+    chunk->line.storage = LINE_HEAP;
+    buffer->heap_allocations++;
+  }
+
+  return chunk;
+}
+
+/*
+ * Insert chunk into a chunked line before the chunk at ix.
+ */
+error_t
+insert_line_chunk(buffer_t* const buffer,
+                  line_t* const line,
+                  const size_t ix,
+                  line_chunk_t* const chunk)
+{
+  chunk_list_t* const chunks = line->chunks;
+
+  if (chunks->count == chunks->capacity) {
+    const size_t new_capacity = max(2 * chunks->capacity, 16);
+    line_chunk_t** const new_chunks =
+      realloc(chunks->chunks, sizeof(line_chunk_t*) * new_capacity);
+    if (!new_chunks) {
+      return ALLOC_ERROR;
+    }
+    buffer->heap_allocations++;
+    chunks->chunks = new_chunks;
+    chunks->capacity = new_capacity;
+  }
+
+  memmove(chunks->chunks + ix + 1,
+          chunks->chunks + ix,
+          sizeof(line_chunk_t*) * (chunks->count - ix));
+  chunks->chunks[ix] = chunk;
+  chunks->count++;
+
+  line->length += line_chunk_size;
+  buffer->heap_bytes += line_chunk_size;
+
+  return SUCCESS;
+}
+
+/*
+ * Remove and free the chunk at ix, which must be empty.
+ */
+void
+remove_line_chunk(buffer_t* const buffer, line_t* const line, const size_t ix)
+{
+  chunk_list_t* const chunks = line->chunks;
+
+  free(chunks->chunks[ix]);
+  chunks->count--;
+  memmove(chunks->chunks + ix,
+          chunks->chunks + ix + 1,
+          sizeof(line_chunk_t*) * (chunks->count - ix));
+
+  line->length -= line_chunk_size;
+  buffer->heap_bytes -= line_chunk_size;
+
+  // The chunk after the removed one starts where it did
+  if (chunks->hint == chunks->count) {
+    chunks->hint--;
+    chunks->hint_start -= chunks->chunks[chunks->hint]->line.used;
+  }
+}
+
+void
+free_chunks(chunk_list_t* const chunks)
+{
+  for (size_t i = 0; i < chunks->count; i++) {
+    free(chunks->chunks[i]);
+  }
+  free(chunks->chunks);
+  free(chunks);
+}
+
+/*
+ * Split a line into chunks, leaving room in each for edits.
+ */
+error_t
+chunk_line(buffer_t* const buffer, line_t* const line)
+{
+  chunk_list_t* const chunks = calloc(1, sizeof(chunk_list_t));
+  if (!chunks) {
+    return ALLOC_ERROR;
+  }
+  buffer->heap_allocations++;
+
+  // Lines with storage of their own may not be contiguous
+  if (line->storage == LINE_HEAP) {
+    move_gap(line, line->used);
+  }
+
+  line_t chunked = { .storage = LINE_CHUNKED, .chunks = chunks };
+  for (size_t start = 0; start < line->used || chunks->count == 0;
+       start += line_chunk_fill) {
+    line_chunk_t* const chunk = new_line_chunk(buffer);
+    if (!chunk || insert_line_chunk(buffer, &chunked, chunks->count, chunk) !=
+                    SUCCESS) {
+      buffer->heap_bytes -= chunked.length;
+      free(chunk);
+      free_chunks(chunks);
+      return ALLOC_ERROR;
+    }
+
+    const size_t length = min(line_chunk_fill, line->used - start);
+    memcpy(chunk->data, line->buffer + start, length);
+    chunk->line.used = length;
+    chunk->line.gap = length;
+    chunked.used += length;
+  }
+
+  deallocate_line(buffer, line);
+  *line = chunked;
+  buffer->heap_lines++;
+  buffer->text_bytes += line->used;
+
+  return SUCCESS;
+}
+
+/*
+ * Find the chunk holding the character at ix, or the last chunk if ix
+ * is the end of the line. Starts looking from the chunk last used.
+ */
+size_t
+find_chunk(chunk_list_t* const chunks, const size_t ix)
+{
+  size_t i = chunks->hint;
+  size_t start = chunks->hint_start;
+
+  while (ix < start) {
+    i--;
+    start -= chunks->chunks[i]->line.used;
+  }
+  while (ix >= start + chunks->chunks[i]->line.used && i + 1 < chunks->count) {
+    start += chunks->chunks[i]->line.used;
+    i++;
+  }
+
+  chunks->hint = i;
+  chunks->hint_start = start;
+
+  return i;
+}
+
+error_t
+insert_chunked_character(buffer_t* const buffer,
+                         line_t* const line,
+                         const char c,
+                         const size_t ix)
+{
+  chunk_list_t* const chunks = line->chunks;
+  size_t i = find_chunk(chunks, ix);
+  line_t* chunk = &chunks->chunks[i]->line;
+
+  // Full chunks give their second half to a new chunk
+  if (chunk->used == line_chunk_size) {
+    line_chunk_t* const next = new_line_chunk(buffer);
+    if (!next || insert_line_chunk(buffer, line, i + 1, next) != SUCCESS) {
+      free(next);
+      return ALLOC_ERROR;
+    }
+
+    const size_t half = chunk->used / 2;
+    move_gap(chunk, chunk->used);
+    memcpy(next->data, chunk->buffer + half, chunk->used - half);
+    next->line.used = chunk->used - half;
+    next->line.gap = next->line.used;
+    chunk->used = half;
+    chunk->gap = half;
+
+    i = find_chunk(chunks, ix);
+    chunk = &chunks->chunks[i]->line;
+  }
+
+  move_gap(chunk, ix - chunks->hint_start);
+  chunk->buffer[chunk->gap++] = c;
+  chunk->used++;
+  line->used++;
+  buffer->text_bytes++;
+
+  return SUCCESS;
+}
+
+/*
+ * Delete the character before ix from a chunked line.
+ */
+void
+delete_chunked_character(buffer_t* const buffer,
+                         line_t* const line,
+                         const size_t ix)
+{
+  chunk_list_t* const chunks = line->chunks;
+  const size_t i = find_chunk(chunks, ix - 1);
+  line_t* const chunk = &chunks->chunks[i]->line;
+
+  move_gap(chunk, ix - chunks->hint_start);
+  chunk->gap--;
+  chunk->used--;
+  line->used--;
+  buffer->text_bytes--;
+
+  if (chunk->used == 0 && chunks->count > 1) {
+    remove_line_chunk(buffer, line, i);
+  }
 }
 
 /* ------------------------------------------------------------------------- */
@@ -366,3 +2005,524 @@ decode_with(const xorptr_t encoded, const buffer_cell_t* const v)
 {
   return (buffer_cell_t*)((uintptr_t)encoded ^ (uintptr_t)v);
 }
+
+buffer_cell_t*
+next_cell(const buffer_iter_t* const iter)
+{
+  return decode_with(iter->current->neighbours, iter->previous);
+}
+
+void
+link_cell_after_point(buffer_iter_t* const iter, buffer_cell_t* const cell)
+{
+  iter->next = next_cell(iter);
+  index_cell_after(iter->buffer, iter->current, cell);
+  cell->neighbours = encode_pair(iter->current, iter->next);
+  iter->current->neighbours = encode_pair(iter->previous, cell);
+
+  if (iter->next) {
+    const buffer_cell_t* nexts_next =
+      decode_with(iter->next->neighbours, iter->current);
+    iter->next->neighbours = encode_pair(cell, nexts_next);
+  }
+
+  iter->next = cell;
+}
+
+/*
+ * Free the cells linked to each other up to last, which have not been
+ * linked into the buffer.
+ */
+void
+destroy_cells(buffer_t* const buffer, buffer_cell_t* const last)
+{
+  buffer_cell_t* next = NULL;
+  for (buffer_cell_t* cell = last; cell;) {
+    buffer_cell_t* const previous = decode_with(cell->neighbours, next);
+    destroy_buffer_cell(buffer, cell);
+    next = cell;
+    cell = previous;
+  }
+}
+
+/* ------------------------------------------------------------------------- */
+/* Line index                                                                */
+/* ------------------------------------------------------------------------- */
+line_block_t*
+new_line_block(buffer_t* const buffer)
+{
+  return allocate_line_block(&buffer->blocks, &buffer->seed);
+}
+
+/*
+ * Allocate a block from blocks, taking its priority from seed.
+ */
+line_block_t*
+allocate_line_block(slab_t* const blocks, uint32_t* const seed)
+{
+  line_block_t* const block = slab_alloc(blocks);
+
+  if (block) {
+    *block = (line_block_t){ 0 };
+    // xorshift32
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    block->priority = *seed;
+  }
+
+  return block;
+}
+
+size_t
+subtree_lines(const line_block_t* const block)
+{
+  return block ? block->subtree_lines : 0;
+}
+
+/*
+ * Recount the lines under block and each of its ancestors.
+ */
+void
+update_block_counts(line_block_t* block)
+{
+  for (; block; block = block->parent) {
+    block->subtree_lines =
+      block->lines + subtree_lines(block->left) + subtree_lines(block->right);
+  }
+}
+
+/*
+ * Rotate block above its parent, keeping the order of the blocks.
+ */
+void
+rotate_block_up(buffer_t* const buffer, line_block_t* const block)
+{
+  line_block_t* const parent = block->parent;
+  line_block_t* const grandparent = parent->parent;
+
+  if (block == parent->left) {
+    parent->left = block->right;
+    if (block->right) {
+      block->right->parent = parent;
+    }
+    block->right = parent;
+  } else {
+    parent->right = block->left;
+    if (block->left) {
+      block->left->parent = parent;
+    }
+    block->left = parent;
+  }
+
+  parent->parent = block;
+  block->parent = grandparent;
+  if (!grandparent) {
+    buffer->index = block;
+  } else if (grandparent->left == parent) {
+    grandparent->left = block;
+  } else {
+    grandparent->right = block;
+  }
+
+  parent->subtree_lines = parent->lines + subtree_lines(parent->left) +
+                          subtree_lines(parent->right);
+  block->subtree_lines = block->lines + subtree_lines(block->left) +
+                         subtree_lines(block->right);
+}
+
+/*
+ * Add new_block to the index, straight after block.
+ */
+void
+insert_block_after(buffer_t* const buffer,
+                   line_block_t* const block,
+                   line_block_t* const new_block)
+{
+  new_block->previous = block;
+  new_block->next = block->next;
+  if (block->next) {
+    block->next->previous = new_block;
+  }
+  block->next = new_block;
+
+  if (!block->right) {
+    block->right = new_block;
+    new_block->parent = block;
+  } else {
+    line_block_t* parent = block->right;
+    while (parent->left) {
+      parent = parent->left;
+    }
+    parent->left = new_block;
+    new_block->parent = parent;
+  }
+
+  update_block_counts(new_block);
+  while (new_block->parent &&
+         new_block->priority > new_block->parent->priority) {
+    rotate_block_up(buffer, new_block);
+  }
+}
+
+/*
+ * Take an empty block out of the index and free it.
+ */
+void
+remove_block(buffer_t* const buffer, line_block_t* const block)
+{
+  if (block->previous) {
+    block->previous->next = block->next;
+  }
+  if (block->next) {
+    block->next->previous = block->previous;
+  }
+
+  // Rotate the block down to a leaf, where it can be cut off
+  while (block->left || block->right) {
+    line_block_t* const child =
+      !block->right || (block->left &&
+                        block->left->priority > block->right->priority)
+        ? block->left
+        : block->right;
+    rotate_block_up(buffer, child);
+  }
+
+  line_block_t* const parent = block->parent;
+  if (!parent) {
+    buffer->index = NULL;
+  } else if (parent->left == block) {
+    parent->left = NULL;
+  } else {
+    parent->right = NULL;
+  }
+  update_block_counts(parent);
+
+  slab_free(&buffer->blocks, block);
+}
+
+/*
+ * Move the second half of a block's lines into a block of their own.
+ * The index stays correct if no block can be allocated; the block is
+ * just left larger than usual.
+ */
+void
+split_block(buffer_t* const buffer, line_block_t* const block)
+{
+  line_block_t* const new_block = new_line_block(buffer);
+  if (!new_block) {
+    return;
+  }
+
+  const size_t kept = block->lines / 2;
+  buffer_cell_t* previous = cell_before_block(block);
+  buffer_cell_t* current = block->first;
+  for (size_t i = 0; i < block->lines; i++) {
+    buffer_cell_t* const next = decode_with(current->neighbours, previous);
+    if (i == kept) {
+      new_block->first = current;
+      block->last = previous;
+    }
+    if (i >= kept) {
+      current->block = new_block;
+    }
+    previous = current;
+    current = next;
+  }
+
+  new_block->last = previous;
+  new_block->lines = block->lines - kept;
+  block->lines = kept;
+  update_block_counts(block);
+  insert_block_after(buffer, block, new_block);
+}
+
+/*
+ * Add cell to the index, straight after the cell after.
+ */
+void
+index_cell_after(buffer_t* const buffer,
+                 buffer_cell_t* const after,
+                 buffer_cell_t* const cell)
+{
+  line_block_t* block = after->block;
+
+  if (block->lines >= max_lines_per_block) {
+    // Lines added at the end of a block, as when loading a file, start
+    // a new block rather than splitting a full one
+    line_block_t* const new_block =
+      after == block->last ? new_line_block(buffer) : NULL;
+    if (new_block) {
+      new_block->first = cell;
+      new_block->last = cell;
+      new_block->lines = 1;
+      cell->block = new_block;
+      insert_block_after(buffer, block, new_block);
+      return;
+    }
+
+    split_block(buffer, block);
+    block = after->block;
+  }
+
+  cell->block = block;
+  block->lines++;
+  if (block->last == after) {
+    block->last = cell;
+  }
+  update_block_counts(block);
+}
+
+/*
+ * Remove cell from the index, given its neighbours in the list.
+ */
+void
+unindex_cell(buffer_t* const buffer,
+             buffer_cell_t* const cell,
+             buffer_cell_t* const previous,
+             buffer_cell_t* const next)
+{
+  line_block_t* const block = cell->block;
+
+  block->lines--;
+  if (block->lines == 0) {
+    remove_block(buffer, block);
+    return;
+  }
+
+  if (block->first == cell) {
+    block->first = next;
+  }
+  if (block->last == cell) {
+    block->last = previous;
+  }
+  update_block_counts(block);
+}
+
+/*
+ * Find the block holding line, and replace line with its offset in
+ * the block. Returns NULL if line is past the end of the index.
+ */
+line_block_t*
+find_block(const buffer_t* const buffer, size_t* const line)
+{
+  line_block_t* block = buffer->index;
+
+  while (block) {
+    const size_t left_lines = subtree_lines(block->left);
+
+    if (*line < left_lines) {
+      block = block->left;
+    } else if (*line < left_lines + block->lines) {
+      *line -= left_lines;
+      return block;
+    } else {
+      *line -= left_lines + block->lines;
+      block = block->right;
+    }
+  }
+
+  return NULL;
+}
+
+buffer_cell_t*
+cell_before_block(const line_block_t* const block)
+{
+  return block->previous ? block->previous->last : NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Lazily splitting mapped files into lines                                  */
+/* ------------------------------------------------------------------------- */
+bool
+has_pending_lines(const buffer_t* const buffer)
+{
+  return buffer->pending != buffer->pending_end;
+}
+
+/*
+ * Split the next line off the unsplit part of the mapping, and link
+ * it in after iter, which must be at the last line split so far.
+ */
+error_t
+split_pending_line(buffer_iter_t* const iter)
+{
+  buffer_t* const buffer = iter->buffer;
+  const char* const start = buffer->pending;
+  const size_t remaining = buffer->pending_end - start;
+
+  buffer_cell_t* const new_cell = slab_alloc(&buffer->cells);
+  if (!new_cell) {
+    return ALLOC_ERROR;
+  }
+
+  const char* const newline = memchr(start, '\n', remaining);
+  const size_t length = newline ? (size_t)(newline - start) : remaining;
+  view_line(&new_cell->line, start, length);
+  link_cell_after_point(iter, new_cell);
+
+  buffer->pending = newline ? newline + 1 : buffer->pending_end;
+
+  return SUCCESS;
+}
+
+/*
+ * Split every pending line at once, cutting the pending part of the
+ * mapping into ranges which end at newlines, and splitting each range
+ * on a thread of its own. The chains of cells and lists of blocks the
+ * threads build are then joined up and added to the index in order.
+ * iter must be at the last line split so far.
+ */
+error_t
+split_pending_lines(buffer_iter_t* const iter, const size_t jobs)
+{
+  buffer_t* const buffer = iter->buffer;
+  const char* const end = buffer->pending_end;
+  const size_t remaining = end - buffer->pending;
+  const size_t wanted = min(jobs, remaining / min_split_range);
+  const size_t count = max(wanted, 1);
+
+  split_range_t* const ranges = calloc(count, sizeof(split_range_t));
+  if (!ranges) {
+    return ALLOC_ERROR;
+  }
+
+  const char* start = buffer->pending;
+  for (size_t i = 0; i < count; i++) {
+    const char* range_end = end;
+    if (i + 1 < count) {
+      const char* const even = buffer->pending + remaining / count * (i + 1);
+      const char* const cut = max(even, start);
+      const char* const newline = memchr(cut, '\n', end - cut);
+      range_end = newline ? newline + 1 : end;
+    }
+
+    split_range_t* const range = &ranges[i];
+    range->start = start;
+    range->end = range_end;
+    init_slab(&range->cells, sizeof(buffer_cell_t), cells_per_slab_block);
+    init_slab(
+      &range->blocks, sizeof(line_block_t), line_blocks_per_slab_block);
+    range->seed = (buffer->seed + i * 2654435761u) | 1;
+    start = range_end;
+  }
+
+  run_jobs(split_range, ranges, sizeof(split_range_t), count);
+
+  error_t ret = SUCCESS;
+  for (size_t i = 0; i < count; i++) {
+    if (ranges[i].result != SUCCESS) {
+      ret = ranges[i].result;
+    }
+  }
+
+  if (ret == SUCCESS) {
+    line_block_t* last_block = buffer->index;
+    while (last_block->right) {
+      last_block = last_block->right;
+    }
+    buffer_cell_t* last = last_block->last;
+
+    for (size_t i = 0; i < count; i++) {
+      append_split_range(buffer, &ranges[i], &last, &last_block);
+    }
+    buffer->pending = end;
+    iter->next = next_cell(iter);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    destroy_slab(&ranges[i].cells);
+    destroy_slab(&ranges[i].blocks);
+  }
+  free(ranges);
+
+  return ret;
+}
+
+void*
+split_range(void* const context)
+{
+  split_range_t* const range = context;
+  buffer_cell_t* previous = NULL;
+  line_block_t* block = NULL;
+
+  for (const char* start = range->start; start < range->end;) {
+    buffer_cell_t* const cell = slab_alloc(&range->cells);
+    if (!cell) {
+      range->result = ALLOC_ERROR;
+      return NULL;
+    }
+
+    const char* const newline = memchr(start, '\n', range->end - start);
+    const size_t length = newline ? (size_t)(newline - start) : range->end - start;
+    view_line(&cell->line, start, length);
+    start = newline ? newline + 1 : range->end;
+
+    // The chain ends are linked to NULL until the ranges are joined
+    cell->neighbours = encode_pair(previous, NULL);
+    if (previous) {
+      previous->neighbours =
+        encode_pair(decode_with(previous->neighbours, NULL), cell);
+    } else {
+      range->first = cell;
+    }
+    previous = cell;
+
+    if (!block || block->lines == max_lines_per_block) {
+      line_block_t* const new_block =
+        allocate_line_block(&range->blocks, &range->seed);
+      if (!new_block) {
+        range->result = ALLOC_ERROR;
+        return NULL;
+      }
+
+      new_block->first = cell;
+      if (block) {
+        block->next = new_block;
+      } else {
+        range->first_block = new_block;
+      }
+      block = new_block;
+    }
+    block->last = cell;
+    block->lines++;
+    cell->block = block;
+  }
+
+  range->last = previous;
+  return NULL;
+}
+
+/*
+ * Link the chain of cells split from range after last, and add its
+ * blocks to the index after last_block, moving both on to the end of
+ * the range. The range's slabs are merged into the buffer's.
+ */
+void
+append_split_range(buffer_t* const buffer,
+                   split_range_t* const range,
+                   buffer_cell_t** const last,
+                   line_block_t** const last_block)
+{
+  if (!range->first) {
+    return;
+  }
+
+  buffer_cell_t* const tail = *last;
+  tail->neighbours = encode_pair(decode_with(tail->neighbours, NULL), range->first);
+  range->first->neighbours =
+    encode_pair(tail, decode_with(range->first->neighbours, NULL));
+  *last = range->last;
+
+  for (line_block_t* block = range->first_block; block;) {
+    line_block_t* const next = block->next;
+    block->next = NULL;
+    block->subtree_lines = block->lines;
+    insert_block_after(buffer, *last_block, block);
+    *last_block = block;
+    block = next;
+  }
+
+  merge_slab(&buffer->cells, &range->cells);
+  merge_slab(&buffer->blocks, &range->blocks);
+}
@@ -1,6 +1,10 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include <files.h>
 #include <mode.h>
 #include <state.h>
+#include <stats.h>
 
 /*
  * Execute the command in the command buffer.
@@ -8,6 +12,43 @@
 void
 execute_command(editor_state_t* const state);
 
+/*
+ * Commands which are run by name, rather than letter by letter. The
+ * rest of the command after the name and any spaces is passed as the
+ * command's argument.
+ */
+typedef struct named_command_t
+{
+  const char* const name;
+  void (*const run)(editor_state_t* const state, const char* const argument);
+} named_command_t;
+
+void
+compact_command(editor_state_t* const state, const char* const argument);
+void
+grep_command(editor_state_t* const state, const char* const argument);
+void
+tabstop_command(editor_state_t* const state, const char* const argument);
+void
+stats_command(editor_state_t* const state, const char* const argument);
+void
+sync_command(editor_state_t* const state, const char* const argument);
+void
+save_command(editor_state_t* const state, const char* const argument);
+
+static const named_command_t named_commands[] = {
+  { .name = "compact", .run = compact_command },
+  { .name = "grep", .run = grep_command },
+  { .name = "save", .run = save_command },
+  { .name = "stats", .run = stats_command },
+  { .name = "sync", .run = sync_command },
+  { .name = "tabstop", .run = tabstop_command },
+  { .name = "ts", .run = tabstop_command },
+};
+
+static const size_t named_command_count =
+  sizeof(named_commands) / sizeof(named_commands[0]);
+
 error_t
 command_mode_handler(event_t event, struct editor_state_t* const state)
 {
@@ -33,18 +74,63 @@ void
 execute_command(editor_state_t* const state)
 {
   const char* cmd = current_line(state->command_buffer);
-  cmd++; // Skip initial ':'
 
-  while (*cmd != '\0' && !should_quit(state)) {
+  // The command can not be read without memory to copy it into
+  if (!cmd) {
+    set_message(state, "Out of memory");
+    clear_line_at_point(state->command_buffer);
+    switch_mode(state, NORMAL);
+    return;
+  }
+
+  // Searches are typed after a / or ?, and commands after a :
+  if (*cmd == '/' || *cmd == '?') {
+    search_for(state, cmd + 1, *cmd == '?');
+    cmd = "";
+  } else {
+    cmd++;
+  }
+
+  // A line number on its own jumps to that line, counting from 1
+  char* end = NULL;
+  const size_t line = strtoul(cmd, &end, 10);
+  if (end != cmd && *end == '\0' && *cmd >= '0' && *cmd <= '9') {
+    move_cursor_to_line(state, line > 0 ? line - 1 : 0);
+    cmd = "";
+  }
+
+  for (size_t i = 0; i < named_command_count; ++i) {
+    const size_t length = strlen(named_commands[i].name);
+    if (strncmp(cmd, named_commands[i].name, length) == 0 &&
+        (cmd[length] == '\0' || cmd[length] == ' ')) {
+      const char* argument = cmd + length;
+      while (*argument == ' ') {
+        argument++;
+      }
+      named_commands[i].run(state, argument);
+      cmd = "";
+      break;
+    }
+  }
+
+  // Stay open if the file could not be written, whatever follows
+  bool failed = false;
+
+  while (*cmd != '\0' && !should_quit(state) && !failed) {
     switch (*cmd) {
 
       case 'q':
+        // A save in the background is seen through first
+        if (!wait_for_save(state)) {
+          failed = true;
+          break;
+        }
         state->terminate = true;
         break;
 
       case 'w':
-        if (state->filename) {
-          write_buffer_to_disk(state->point, state->filename);
+        if (state->filename && !save_buffer(state)) {
+          failed = true;
         }
         break;
 
@@ -57,3 +143,97 @@ execute_command(editor_state_t* const state)
   clear_line_at_point(state->command_buffer);
   switch_mode(state, NORMAL);
 }
+
+void
+compact_command(editor_state_t* const state, const char* const argument)
+{
+  // The save's snapshot shares the storage compacting would move
+  if (state->save) {
+    set_message(state, "Can not compact while writing %s", state->filename);
+    return;
+  }
+
+  compact_buffer(state->point);
+}
+
+void
+grep_command(editor_state_t* const state, const char* const argument)
+{
+  grep_for(state, argument);
+}
+
+void
+tabstop_command(editor_state_t* const state, const char* const argument)
+{
+  if (*argument == '\0') {
+    set_message(state, "tabstop=%zu", state->line_map->tab_width);
+    return;
+  }
+
+  char* end = NULL;
+  const size_t tab_width = strtoul(argument, &end, 10);
+  if (*argument < '0' || *argument > '9' || *end != '\0' || tab_width == 0 ||
+      tab_width > TAB_WIDTH_MAX) {
+    set_message(state, "Tab width must be from 1 to %d", TAB_WIDTH_MAX);
+    return;
+  }
+
+  set_tab_width(state, tab_width);
+}
+
+void
+stats_command(editor_state_t* const state, const char* const argument)
+{
+  // With a file name, everything is written to the file; otherwise a
+  // summary is shown
+  if (*argument != '\0') {
+    if (write_stats(state->point, argument) != SUCCESS) {
+      set_message(state, "Could not write %s", argument);
+    }
+    return;
+  }
+
+  format_stats_summary(state->point, state->message, sizeof(state->message));
+}
+
+void
+sync_command(editor_state_t* const state, const char* const argument)
+{
+  static const char* const names[] = {
+    [SYNC_NONE] = "none",
+    [SYNC_DATA] = "data",
+    [SYNC_FULL] = "full",
+  };
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(argument, names[i]) == 0) {
+      state->sync_mode = i;
+      return;
+    }
+  }
+
+  if (*argument == '\0') {
+    set_message(state, "sync=%s", names[state->sync_mode]);
+  } else {
+    set_message(state, "Sync must be none, data or full");
+  }
+}
+
+void
+save_command(editor_state_t* const state, const char* const argument)
+{
+  static const char* const names[] = { "foreground", "background" };
+
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(argument, names[i]) == 0) {
+      state->save_in_background = i;
+      return;
+    }
+  }
+
+  if (*argument == '\0') {
+    set_message(state, "save=%s", names[state->save_in_background]);
+  } else {
+    set_message(state, "Save must be foreground or background");
+  }
+}
@@ -0,0 +1,150 @@
+#include <ncurses.h>
+#include <stdlib.h>
+
+#include <screen.h>
+
+// The attributes text is drawn with in each style
+static attr_t style_attributes[SCREEN_STYLES];
+
+// The colours each class of highlighted text is drawn in, where the
+// terminal has colours
+static const short highlight_colors[HIGHLIGHT_CLASSES] = {
+  [HIGHLIGHT_COMMENT] = COLOR_CYAN,   [HIGHLIGHT_KEYWORD] = COLOR_YELLOW,
+  [HIGHLIGHT_TYPE] = COLOR_GREEN,     [HIGHLIGHT_STRING] = COLOR_MAGENTA,
+  [HIGHLIGHT_NUMBER] = COLOR_RED,     [HIGHLIGHT_PREPROCESSOR] = COLOR_BLUE,
+  [HIGHLIGHT_SECTION] = COLOR_YELLOW, [HIGHLIGHT_KEY] = COLOR_BLUE,
+};
+
+/*
+ * Pick the attributes each style is drawn with, once curses has
+ * started.
+ */
+void
+init_curses_styles(void);
+
+/*
+ * Screen operations, which draw on stdscr.
+ */
+void
+curses_screen_size(screen_t* const screen,
+                   size_t* const height,
+                   size_t* const width);
+void
+curses_screen_erase(screen_t* const screen);
+void
+curses_screen_move(screen_t* const screen,
+                   const size_t row,
+                   const size_t column);
+void
+curses_screen_clear_to_eol(screen_t* const screen);
+void
+curses_screen_add_text(screen_t* const screen,
+                       const char* const text,
+                       const size_t length);
+void
+curses_screen_set_style(screen_t* const screen, const size_t style);
+void
+curses_screen_refresh(screen_t* const screen);
+void
+curses_screen_destroy(screen_t* const screen);
+
+screen_t*
+new_curses_screen(void)
+{
+  screen_t* const screen = malloc(sizeof(screen_t));
+  if (!screen) {
+    return NULL;
+  }
+
+  *screen = (screen_t){ .name = "curses",
+                        .size = curses_screen_size,
+                        .erase = curses_screen_erase,
+                        .move = curses_screen_move,
+                        .clear_to_eol = curses_screen_clear_to_eol,
+                        .add_text = curses_screen_add_text,
+                        .set_style = curses_screen_set_style,
+                        .refresh = curses_screen_refresh,
+                        .destroy = curses_screen_destroy };
+
+  initscr();
+  noecho();
+  init_curses_styles();
+
+  return screen;
+}
+
+void
+init_curses_styles(void)
+{
+  style_attributes[STYLE_MODELINE] = A_BOLD;
+
+  if (!has_colors() || start_color() == ERR) {
+    style_attributes[HIGHLIGHT_COMMENT] = A_DIM;
+    style_attributes[HIGHLIGHT_KEYWORD] = A_BOLD;
+    style_attributes[HIGHLIGHT_SECTION] = A_BOLD;
+    return;
+  }
+
+  // Keep the terminal's own background where it allows
+  const short background = use_default_colors() == OK ? -1 : COLOR_BLACK;
+  for (short i = 1; i < HIGHLIGHT_CLASSES; i++) {
+    init_pair(i, highlight_colors[i], background);
+    style_attributes[i] = COLOR_PAIR(i);
+  }
+  style_attributes[HIGHLIGHT_SECTION] |= A_BOLD;
+}
+
+void
+curses_screen_size(screen_t* const screen,
+                   size_t* const height,
+                   size_t* const width)
+{
+  getmaxyx(stdscr, *height, *width);
+}
+
+void
+curses_screen_erase(screen_t* const screen)
+{
+  erase();
+}
+
+void
+curses_screen_move(screen_t* const screen,
+                   const size_t row,
+                   const size_t column)
+{
+  move(row, column);
+}
+
+void
+curses_screen_clear_to_eol(screen_t* const screen)
+{
+  clrtoeol();
+}
+
+void
+curses_screen_add_text(screen_t* const screen,
+                       const char* const text,
+                       const size_t length)
+{
+  addnstr(text, length);
+}
+
+void
+curses_screen_set_style(screen_t* const screen, const size_t style)
+{
+  attrset(style_attributes[style]);
+}
+
+void
+curses_screen_refresh(screen_t* const screen)
+{
+  refresh();
+}
+
+void
+curses_screen_destroy(screen_t* const screen)
+{
+  endwin();
+  free(screen);
+}
@@ -0,0 +1,35 @@
+#include <common.h>
+#include <damage.h>
+
+void
+add_damage(damage_t* const damage,
+           const size_t first_line,
+           const size_t last_line)
+{
+  damage->edits++;
+
+  if (!damage->damaged) {
+    damage->damaged = true;
+    damage->first_line = first_line;
+    damage->last_line = last_line;
+    return;
+  }
+
+  damage->first_line = min(damage->first_line, first_line);
+  damage->last_line = max(damage->last_line, last_line);
+}
+
+void
+clear_damage(damage_t* const damage)
+{
+  damage->damaged = false;
+  damage->first_line = 0;
+  damage->last_line = 0;
+}
+
+bool
+is_line_damaged(const damage_t* const damage, const size_t line)
+{
+  return damage->damaged && damage->first_line <= line &&
+         line <= damage->last_line;
+}
@@ -1,92 +1,1296 @@
+#define _POSIX_C_SOURCE 200809L
+// For pwritev and syscall. _GNU_SOURCE would bring in copy_file_range,
+// but also a definition of error_t.
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <files.h>
+#include <stats.h>
+
+// The size of the blocks read by read_stream_into_editor
+static const size_t read_block_size = 1 << 20;
+
+// Unchanged stretches of the original file at least this long are
+// copied by the kernel rather than written from the mapping
+static const size_t min_copy_length = 1 << 20;
+
+// The most ranges gathered into a single writev, which is as many as
+// Linux takes
+#define WRITE_BATCH_SIZE 1024
+
+// Before a file is patched in place, the bytes about to be written over
+// are saved in FILE.undo. It starts with a magic number, then the size,
+// modification time and inode of the file as it was, eight bytes each.
+// Each range saved follows as its place in the file and its length,
+// eight bytes each, and then its bytes.
+#define UNDO_HEADER_SIZE 32
+#define UNDO_RANGE_SIZE 16
+static const char undo_magic[8] = "vundolog";
+
+/*
+ * What a save writes, and where.
+ */
+typedef struct save_job_t
+{
+  const buffer_snapshot_t* snapshot;
+  const char* filename;
+  sync_mode_t sync;
+
+  // The file the snapshot was loaded from, if it is known
+  file_origin_t* origin;
+
+  // Counts the bytes written, for another thread to read, if set
+  atomic_size_t* written;
+} save_job_t;
+
+/*
+ * Ranges of the buffer's storage waiting to be written to fd in one
+ * go.
+ */
+typedef struct write_batch_t
+{
+  int fd;
+  struct iovec ranges[WRITE_BATCH_SIZE];
+  size_t count;
+  error_t error;
+
+  // Where in fd the ranges go, or -1 to write them at fd's offset
+  off_t position;
+
+  // The original file, open on source, from which ranges of its
+  // mapping are copied; source is -1 if they are not
+  int source;
+  const file_origin_t* origin;
+
+  // Counts the bytes written, for another thread to read, if set
+  atomic_size_t* written;
+} write_batch_t;
+
+/*
+ * Working out whether the original file can be patched in place, and
+ * then patching it: the segments of the snapshot are walked in order,
+ * tracking where each lands in the file.
+ */
+typedef struct patch_t
+{
+  const file_origin_t* origin;
+  size_t position;
+
+  // False once a segment from the mapping is found away from its place
+  // in the file, as writing over it would change the buffer
+  bool fits;
+
+  // The bytes which differ from the file
+  size_t changed;
+
+  // Where the ranges differing are written, once it is decided to, and
+  // the place in the file just past the last of them
+  atomic_size_t* written;
+  write_batch_t* batch;
+  size_t end;
+
+  // Where the bytes the ranges differing write over are saved, before
+  // the file is written to, and the range of the file waiting to be
+  // saved there
+  write_batch_t* undo;
+  size_t undo_start;
+  size_t undo_end;
+  char undo_range[UNDO_RANGE_SIZE];
+} patch_t;
+
+/*
+ * A save running on a thread of its own, from a snapshot of the
+ * buffer.
+ */
+struct background_save_t
+{
+  buffer_snapshot_t snapshot;
+  char* filename;
+  file_origin_t origin;
+  save_job_t job;
+  pthread_t thread;
+
+  atomic_size_t written;
+  atomic_bool finished;
+  error_t result;
+};
+
+/*
+ * Map the file open on fd into memory and hand the mapping to the
+ * buffer. Returns READ_ERROR if the file can not be mapped, e.g.
+ * because it is empty or not a regular file.
+ */
+error_t
+map_file_into_editor(buffer_iter_t* const iter,
+                     const int fd,
+                     const size_t jobs,
+                     file_origin_t* const origin);
+
+/*
+ * Add a line read from a stream to the buffer, filling the buffer's
+ * initial line first.
+ */
+error_t
+add_loaded_line(buffer_iter_t* const iter,
+                bool* const first_line,
+                const char* const data,
+                const size_t length);
+
+/*
+ * Fill in a write_batch_t, with no ranges, writing to fd at its offset.
+ */
+void
+init_write_batch(write_batch_t* const batch,
+                 const int fd,
+                 atomic_size_t* const written);
+
+/*
+ * Add a range to the batch, writing the batch out first if it is full.
+ * A range following straight on from the last one in memory is merged
+ * with it, so text held contiguously, as in a mapped file, goes out in
+ * a few large writes.
+ */
+void
+add_write_range(write_batch_t* const batch,
+                const char* const data,
+                const size_t length);
+
+/*
+ * Write out every range in the batch, however many calls to writev it
+ * takes, copying those which can be from the original file.
+ */
+void
+flush_write_batch(write_batch_t* const batch);
+
+/*
+ * Write out count ranges from the batch.
+ */
+void
+write_ranges(write_batch_t* const batch,
+             struct iovec* ranges,
+             size_t count);
+
+/*
+ * Whether range is a long stretch of the original file's mapping, to
+ * be copied from the file.
+ */
+bool
+is_copied_range(const write_batch_t* const batch,
+                const struct iovec* const range);
+
+/*
+ * Have the kernel copy range from the original file, sharing its
+ * blocks where the file system can, or write it if it will not.
+ */
+void
+copy_range(write_batch_t* const batch, struct iovec* const range);
+
+/*
+ * Write a snapshot to filename, patching the original in place if it
+ * can be, and through a swap file if not.
+ */
+error_t
+save_snapshot(const save_job_t* const job);
+
+/*
+ * Open filename with flags, if it is still the file described by
+ * origin. Returns -1 if not.
+ */
+int
+open_origin(const file_origin_t* const origin,
+            const char* const filename,
+            const int flags);
+
+/*
+ * Describe the file open on fd, mapped at mapping, in origin.
+ */
+bool
+describe_origin(file_origin_t* const origin,
+                const int fd,
+                const char* const mapping,
+                const size_t mapping_length);
+
+/*
+ * Patch the original file in place, if the snapshot keeps most of it
+ * where it was. Sets patched if it tried; errors are only returned
+ * once the file has been written to.
+ */
+error_t
+patch_in_place(const save_job_t* const job, bool* const patched);
+
+/*
+ * Pass the segments of the snapshot to patch_segment in turn.
+ */
+void
+visit_patch(const buffer_snapshot_t* const snapshot, patch_t* const patch);
+
+/*
+ * Check a segment against the original file, counting it as changed,
+ * and adding it to the patch's batch if there is one, if it differs.
+ */
+bool
+patch_segment(patch_t* const patch,
+              const char* const data,
+              const size_t length);
+
+/*
+ * Save the bytes of the original file which patching it would write
+ * over, and its size and modification time, to undo_file, synced as the
+ * job asks, so a patch cut short can be undone.
+ */
+error_t
+write_patch_undo(const save_job_t* const job, const char* const undo_file);
+
+/*
+ * Save the original bytes of the file in a range about to be written
+ * over, joining it to the range waiting to be saved if it follows on.
+ */
+bool
+add_undo_range(patch_t* const patch,
+               const size_t position,
+               const size_t length);
+
+/*
+ * Save the range waiting to be saved, if any.
+ */
+bool
+flush_undo_range(patch_t* const patch);
+
+/*
+ * Put the ranges saved in the undo file open on undo back into the
+ * file open on fd.
+ */
+error_t
+restore_undo_ranges(const int undo, const int fd);
+
+/*
+ * The name of the undo file of filename, to be freed.
+ */
+char*
+undo_file_name(const char* const filename);
+
+/*
+ * Write value to data as eight bytes, low bits first, and read it back.
+ */
+void
+put_undo_number(char* const data, const uint64_t value);
+uint64_t
+get_undo_number(const char* const data);
+
+/*
+ * Write the snapshot of a job to a swap file next to its filename, and
+ * move it over filename, removing the swap file if anything fails.
+ */
+error_t
+save_through_swap_file(const save_job_t* const job);
+
+/*
+ * The body of a background save's thread.
+ */
+void*
+run_background_save(void* const context);
+
+/*
+ * Sync the directory holding filename, so a rename into it is on disk.
+ */
+error_t
+sync_directory(const char* const filename);
+
+/*
+ * Write the job's snapshot to swap_file, sync it, and move it over the
+ * job's filename.
+ */
+error_t
+write_swap_file(const save_job_t* const job, const char* const swap_file);
+
+/*
+ * Append data to the line being carried between blocks.
+ */
+error_t
+append_partial_line(char** const partial,
+                    size_t* const used,
+                    size_t* const length,
+                    const char* const data,
+                    const size_t data_length);
+
+error_t
+read_file_into_editor(buffer_iter_t* const iter,
+                      const char* const filename,
+                      const size_t jobs,
+                      file_origin_t* const origin)
+{
+  const long long start = monotonic_time();
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return READ_ERROR;
+  }
+
+  // Pipes can only be opened once, so decide how to read on one
+  // descriptor
+  error_t ret = map_file_into_editor(iter, fd, jobs, origin);
+  if (ret != SUCCESS) {
+    ret = read_stream_into_editor(iter, fd);
+  }
+  close(fd);
+  record_time(TIMED_LOAD, start);
+
+  return ret;
+}
 
 error_t
-read_file_into_editor(buffer_iter_t* const iter, const char* const filename)
+read_stream_into_editor(buffer_iter_t* const iter, const int fd)
 {
-  FILE* fp = NULL;
-  char c;
   error_t ret = SUCCESS;
+  bool first_line = true;
 
-  fp = fopen(filename, "r");
-  if (!fp) {
-    return READ_ERROR;
+  // A line which runs over the end of a block is gathered in partial
+  char* partial = NULL;
+  size_t partial_used = 0;
+  size_t partial_length = 0;
+
+  char* const block = malloc(read_block_size);
+  if (!block) {
+    return ALLOC_ERROR;
   }
 
-  while ((c = fgetc(fp)) != EOF && ret == SUCCESS) {
-    switch (c) {
-      case '\n':
-        ret = append_line_at_point(iter);
-        move_iter_down_line(iter);
-        move_to_beginning_of_line(iter);
-        break;
-      default:
-        ret = insert_character_at_point(iter, c);
-        break;
+  while (ret == SUCCESS) {
+    const ssize_t bytes = read(fd, block, read_block_size);
+
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes < 0) {
+      ret = READ_ERROR;
+      break;
+    } else if (bytes == 0) {
+      break;
+    }
+
+    const char* start = block;
+    const char* const end = block + bytes;
+    const char* newline = NULL;
+
+    while (ret == SUCCESS && (newline = memchr(start, '\n', end - start))) {
+      if (partial_used > 0) {
+        ret = append_partial_line(
+          &partial, &partial_used, &partial_length, start, newline - start);
+        if (ret == SUCCESS) {
+          ret = add_loaded_line(iter, &first_line, partial, partial_used);
+        }
+        partial_used = 0;
+      } else {
+        ret = add_loaded_line(iter, &first_line, start, newline - start);
+      }
+      start = newline + 1;
+    }
+
+    if (ret == SUCCESS && start != end) {
+      ret = append_partial_line(
+        &partial, &partial_used, &partial_length, start, end - start);
     }
   }
 
-  fclose(fp);
+  // The last line need not end with a newline
+  if (ret == SUCCESS && partial_used > 0) {
+    ret = add_loaded_line(iter, &first_line, partial, partial_used);
+  }
+
+  free(partial);
+  free(block);
 
   while (!is_first_line(iter)) {
     move_iter_up_line(iter);
   }
 
+  return ret;
+}
+
+error_t
+add_loaded_line(buffer_iter_t* const iter,
+                bool* const first_line,
+                const char* const data,
+                const size_t length)
+{
+  if (*first_line) {
+    *first_line = false;
+    return fill_line_at_point(iter, data, length);
+  }
+
+  const error_t ret = append_filled_line_at_point(iter, data, length);
+  if (ret == SUCCESS) {
+    move_iter_down_line(iter);
+  }
+
+  return ret;
+}
+
+error_t
+append_partial_line(char** const partial,
+                    size_t* const used,
+                    size_t* const length,
+                    const char* const data,
+                    const size_t data_length)
+{
+  if (*used + data_length > *length) {
+    const size_t new_length = max(2 * *length, *used + data_length);
+    char* const new_partial = realloc(*partial, new_length);
+    if (!new_partial) {
+      return ALLOC_ERROR;
+    }
+    *partial = new_partial;
+    *length = new_length;
+  }
+
+  memcpy(*partial + *used, data, data_length);
+  *used += data_length;
+
   return SUCCESS;
 }
 
 error_t
-write_buffer_to_disk(buffer_iter_t* const iter, const char* const filename)
+map_file_into_editor(buffer_iter_t* const iter,
+                     const int fd,
+                     const size_t jobs,
+                     file_origin_t* const origin)
+{
+  struct stat st;
+
+  if (origin) {
+    origin->valid = false;
+  }
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return READ_ERROR;
+  }
+
+  // The mapping stays valid once the descriptor is closed
+  void* const data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if (data == MAP_FAILED) {
+    return READ_ERROR;
+  }
+
+  const error_t ret = load_mapped_file(iter, data, st.st_size, jobs);
+  if (ret != SUCCESS) {
+    munmap(data, st.st_size);
+  } else if (origin) {
+    describe_origin(origin, fd, data, st.st_size);
+  }
+
+  return ret;
+}
+
+error_t
+write_buffer_to_disk(buffer_iter_t* const iter,
+                     const char* const filename,
+                     const sync_mode_t sync,
+                     file_origin_t* const origin)
+{
+  const long long start = monotonic_time();
+
+  // The snapshot takes the unsplit part of a mapped file as it is, so
+  // the save costs nothing for the lines never looked at
+  buffer_snapshot_t snapshot;
+  error_t ret = take_buffer_snapshot(iter, &snapshot);
+  if (ret == SUCCESS) {
+    const save_job_t job = {
+      .snapshot = &snapshot,
+      .filename = filename,
+      .sync = sync,
+      .origin = origin,
+    };
+    ret = save_snapshot(&job);
+    release_buffer_snapshot(iter, &snapshot);
+  }
+  record_time(TIMED_SAVE, start);
+
+  return ret;
+}
+
+background_save_t*
+start_background_save(buffer_iter_t* const iter,
+                      const char* const filename,
+                      const sync_mode_t sync,
+                      const file_origin_t* const origin)
+{
+  const long long start = monotonic_time();
+  background_save_t* const save = calloc(1, sizeof(background_save_t));
+  if (!save) {
+    return NULL;
+  }
+
+  save->filename = strdup(filename);
+  if (origin) {
+    save->origin = *origin;
+  }
+  save->job = (save_job_t){
+    .snapshot = &save->snapshot,
+    .filename = save->filename,
+    .sync = sync,
+    .origin = &save->origin,
+    .written = &save->written,
+  };
+  atomic_init(&save->written, 0);
+  atomic_init(&save->finished, false);
+
+  if (!save->filename ||
+      take_buffer_snapshot(iter, &save->snapshot) != SUCCESS) {
+    free(save->filename);
+    free(save);
+    return NULL;
+  }
+
+  if (pthread_create(&save->thread, NULL, run_background_save, save) != 0) {
+    release_buffer_snapshot(iter, &save->snapshot);
+    free(save->filename);
+    free(save);
+    return NULL;
+  }
+
+  // The editor only waits for the snapshot
+  record_time(TIMED_SAVE, start);
+
+  return save;
+}
+
+bool
+background_save_progress(background_save_t* const save,
+                         size_t* const written,
+                         size_t* const total)
+{
+  *written = atomic_load(&save->written);
+  *total = save->snapshot.bytes;
+  return atomic_load(&save->finished);
+}
+
+error_t
+finish_background_save(buffer_iter_t* const iter,
+                       background_save_t* const save,
+                       file_origin_t* const origin)
+{
+  pthread_join(save->thread, NULL);
+  const error_t ret = save->result;
+
+  if (origin) {
+    *origin = save->origin;
+  }
+
+  release_buffer_snapshot(iter, &save->snapshot);
+  free(save->filename);
+  free(save);
+
+  return ret;
+}
+
+void*
+run_background_save(void* const context)
+{
+  background_save_t* const save = context;
+
+  save->result = save_snapshot(&save->job);
+  atomic_store(&save->finished, true);
+
+  return NULL;
+}
+
+error_t
+save_snapshot(const save_job_t* const job)
+{
+  bool patched = false;
+  error_t ret = patch_in_place(job, &patched);
+
+  if (!patched) {
+    ret = save_through_swap_file(job);
+  }
+
+  // After a full rewrite the file is a new one, which the mapping does
+  // not show, and after a failed save what it holds is not known
+  if (job->origin && !(patched && ret == SUCCESS)) {
+    job->origin->valid = false;
+  }
+
+  return ret;
+}
+
+int
+open_origin(const file_origin_t* const origin,
+            const char* const filename,
+            const int flags)
+{
+  if (!origin || !origin->valid) {
+    return -1;
+  }
+
+  const int fd = open(filename, flags);
+  if (fd < 0) {
+    return -1;
+  }
+
+  // Anything else having written to the file since shows up here
+  file_origin_t now;
+  if (!describe_origin(&now, fd, origin->mapping, origin->mapping_length) ||
+      now.device != origin->device || now.inode != origin->inode ||
+      now.size != origin->size || now.modified != origin->modified) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool
+describe_origin(file_origin_t* const origin,
+                const int fd,
+                const char* const mapping,
+                const size_t mapping_length)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    origin->valid = false;
+    return false;
+  }
+
+  *origin = (file_origin_t){
+    .valid = true,
+    .mapping = mapping,
+    .mapping_length = mapping_length,
+    .size = st.st_size,
+    .device = st.st_dev,
+    .inode = st.st_ino,
+    .modified = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec,
+  };
+
+  return true;
+}
+
+error_t
+patch_in_place(const save_job_t* const job, bool* const patched)
+{
+  const buffer_snapshot_t* const snapshot = job->snapshot;
+  file_origin_t* const origin = job->origin;
+
+  const int fd = open_origin(origin, job->filename, O_RDWR);
+  if (fd < 0) {
+    return SUCCESS;
+  }
+
+  // Look first, as there is no going back once the file is written to.
+  // Patching is only worth giving up the atomic rename for if most of
+  // the file stays as it is.
+  patch_t patch = { .origin = origin, .fits = true };
+  visit_patch(snapshot, &patch);
+  write_batch_t* const batch =
+    patch.fits && 2 * patch.changed <= snapshot->bytes
+      ? malloc(sizeof(write_batch_t))
+      : NULL;
+  char* const undo_file = batch ? undo_file_name(job->filename) : NULL;
+
+  // A patch cut short leaves the file neither as it was nor as it should
+  // be, so what it writes over is saved first, and without that the file
+  // is saved through a swap file instead
+  if (!undo_file || write_patch_undo(job, undo_file) != SUCCESS) {
+    if (undo_file) {
+      unlink(undo_file);
+    }
+    free(undo_file);
+    free(batch);
+    close(fd);
+    return SUCCESS;
+  }
+  *patched = true;
+  init_write_batch(batch, fd, job->written);
+  batch->position = 0;
+
+  patch = (patch_t){
+    .origin = origin,
+    .fits = true,
+    .written = job->written,
+    .batch = batch,
+  };
+  visit_patch(snapshot, &patch);
+  flush_write_batch(batch);
+  error_t ret = batch->error;
+  free(batch);
+
+  if (ret == SUCCESS && snapshot->bytes < origin->size &&
+      ftruncate(fd, snapshot->bytes) != 0) {
+    ret = WRITE_ERROR;
+  }
+
+  // The file was not renamed, so there is no directory to sync
+  if (ret == SUCCESS && job->sync == SYNC_DATA && fdatasync(fd) != 0) {
+    ret = WRITE_ERROR;
+  } else if (ret == SUCCESS && job->sync == SYNC_FULL && fsync(fd) != 0) {
+    ret = WRITE_ERROR;
+  }
+
+  // The bytes left as they were are still those mapped, so the next
+  // save can patch the file again
+  if (ret == SUCCESS &&
+      !describe_origin(origin, fd, origin->mapping, origin->mapping_length)) {
+    ret = WRITE_ERROR;
+  }
+
+  if (close(fd) != 0 && ret == SUCCESS) {
+    ret = WRITE_ERROR;
+  }
+
+  // Once the patch is on disk it is not to be undone. After a failure
+  // the undo file is kept, to put the file back when it is next opened.
+  if (ret == SUCCESS && unlink(undo_file) != 0) {
+    ret = WRITE_ERROR;
+  }
+  if (ret == SUCCESS && job->sync != SYNC_NONE) {
+    ret = sync_directory(job->filename);
+  }
+  free(undo_file);
+
+  return ret;
+}
+
+error_t
+write_patch_undo(const save_job_t* const job, const char* const undo_file)
+{
+  const file_origin_t* const origin = job->origin;
+
+  // The undo file holds some of the text, so it is kept private
+  const int fd = open(undo_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    return WRITE_ERROR;
+  }
+
+  write_batch_t* const batch = malloc(sizeof(write_batch_t));
+  if (!batch) {
+    close(fd);
+    return ALLOC_ERROR;
+  }
+  init_write_batch(batch, fd, NULL);
+
+  char header[UNDO_HEADER_SIZE];
+  memcpy(header, undo_magic, sizeof(undo_magic));
+  put_undo_number(header + 8, origin->size);
+  put_undo_number(header + 16, origin->modified);
+  put_undo_number(header + 24, origin->inode);
+  add_write_range(batch, header, UNDO_HEADER_SIZE);
+  flush_write_batch(batch);
+
+  // A file left shorter loses its tail, which is saved too
+  patch_t patch = { .origin = origin, .fits = true, .undo = batch };
+  visit_patch(job->snapshot, &patch);
+  if (job->snapshot->bytes < origin->size) {
+    add_undo_range(&patch,
+                   job->snapshot->bytes,
+                   origin->size - job->snapshot->bytes);
+  }
+  flush_undo_range(&patch);
+  error_t ret = batch->error;
+  free(batch);
+
+  // The undo file has to be on disk before any of the patch is
+  if (ret == SUCCESS && job->sync != SYNC_NONE && fdatasync(fd) != 0) {
+    ret = WRITE_ERROR;
+  }
+  if (close(fd) != 0 && ret == SUCCESS) {
+    ret = WRITE_ERROR;
+  }
+  if (ret == SUCCESS && job->sync != SYNC_NONE) {
+    ret = sync_directory(job->filename);
+  }
+
+  return ret;
+}
+
+bool
+add_undo_range(patch_t* const patch,
+               const size_t position,
+               const size_t length)
+{
+  // Past the end of the file there is nothing to save, as undoing the
+  // patch cuts the file back to its old size
+  const file_origin_t* const origin = patch->origin;
+  const size_t readable = min(origin->size, origin->mapping_length);
+  if (position >= readable) {
+    return true;
+  }
+  const size_t saved = min(length, readable - position);
+  const size_t end = position + saved;
+
+  if (patch->undo_end == position && patch->undo_end > patch->undo_start) {
+    patch->undo_end = end;
+    return true;
+  }
+
+  if (!flush_undo_range(patch)) {
+    return false;
+  }
+  patch->undo_start = position;
+  patch->undo_end = end;
+
+  return true;
+}
+
+bool
+flush_undo_range(patch_t* const patch)
+{
+  write_batch_t* const undo = patch->undo;
+  const size_t length = patch->undo_end - patch->undo_start;
+  if (length == 0) {
+    return undo->error == SUCCESS;
+  }
+
+  put_undo_number(patch->undo_range, patch->undo_start);
+  put_undo_number(patch->undo_range + 8, length);
+  add_write_range(undo, patch->undo_range, UNDO_RANGE_SIZE);
+  add_write_range(undo, patch->origin->mapping + patch->undo_start, length);
+  flush_write_batch(undo);
+  patch->undo_start = patch->undo_end;
+
+  return undo->error == SUCCESS;
+}
+
+error_t
+undo_unfinished_patch(const char* const filename, bool* const undone)
 {
-  FILE* fp = NULL;
+  *undone = false;
+
+  char* const undo_file = undo_file_name(filename);
+  if (!undo_file) {
+    return ALLOC_ERROR;
+  }
+  const int undo = open(undo_file, O_RDONLY);
+  if (undo < 0) {
+    free(undo_file);
+    return SUCCESS;
+  }
+
+  // An undo file cut short before its header was written was left
+  // before the file was touched, and one for a file since replaced by
+  // another is of no use, so both are just removed
   error_t ret = SUCCESS;
+  char header[UNDO_HEADER_SIZE];
+  struct stat st;
+  const int fd = open(filename, O_RDWR);
+  if (fd >= 0 && fstat(fd, &st) == 0 &&
+      pread(undo, header, UNDO_HEADER_SIZE, 0) == UNDO_HEADER_SIZE &&
+      memcmp(header, undo_magic, sizeof(undo_magic)) == 0 &&
+      get_undo_number(header + 24) == (uint64_t)st.st_ino) {
+    ret = restore_undo_ranges(undo, fd);
+
+    // The modification time goes back too, so the file matches the
+    // description of it in its journal
+    const long long modified = get_undo_number(header + 16);
+    const struct timespec times[2] = {
+      { .tv_nsec = UTIME_OMIT },
+      { .tv_sec = modified / 1000000000, .tv_nsec = modified % 1000000000 },
+    };
+    if (ret == SUCCESS &&
+        (ftruncate(fd, get_undo_number(header + 8)) != 0 ||
+         fsync(fd) != 0 || futimens(fd, times) != 0 || fsync(fd) != 0)) {
+      ret = WRITE_ERROR;
+    }
+    *undone = ret == SUCCESS;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  close(undo);
+
+  if (ret == SUCCESS) {
+    unlink(undo_file);
+  }
+  free(undo_file);
+
+  return ret;
+}
+
+error_t
+restore_undo_ranges(const int undo, const int fd)
+{
+  char* const block = malloc(read_block_size);
+  if (!block) {
+    return ALLOC_ERROR;
+  }
+
+  // Saving the ranges finished before the file was written to, so one
+  // cut short ends them
+  off_t offset = UNDO_HEADER_SIZE;
+  char range[UNDO_RANGE_SIZE];
+  error_t ret = SUCCESS;
+  while (ret == SUCCESS &&
+         pread(undo, range, UNDO_RANGE_SIZE, offset) == UNDO_RANGE_SIZE) {
+    off_t position = get_undo_number(range);
+    size_t left = get_undo_number(range + 8);
+    offset += UNDO_RANGE_SIZE;
+
+    while (ret == SUCCESS && left > 0) {
+      const size_t wanted = min(left, read_block_size);
+      const ssize_t count = pread(undo, block, wanted, offset);
+      if (count <= 0) {
+        break;
+      }
+      if (pwrite(fd, block, count, position) != count) {
+        ret = WRITE_ERROR;
+      }
+      offset += count;
+      position += count;
+      left -= count;
+    }
+    if (left > 0) {
+      break;
+    }
+  }
+  free(block);
+
+  return ret;
+}
+
+char*
+undo_file_name(const char* const filename)
+{
+  const size_t length = strlen(filename);
+  char* const undo_file = malloc(length + sizeof(".undo"));
+  if (undo_file) {
+    memcpy(undo_file, filename, length);
+    memcpy(undo_file + length, ".undo", sizeof(".undo"));
+  }
+
+  return undo_file;
+}
+
+void
+put_undo_number(char* const data, const uint64_t value)
+{
+  for (size_t i = 0; i < 8; i++) {
+    data[i] = (char)(value >> (8 * i));
+  }
+}
+
+uint64_t
+get_undo_number(const char* const data)
+{
+  uint64_t value = 0;
+  for (size_t i = 0; i < 8; i++) {
+    value |= (uint64_t)(unsigned char)data[i] << (8 * i);
+  }
 
-  size_t len = strlen(filename);
-  char* swap_file = calloc(sizeof(char), len + 4);
+  return value;
+}
+
+void
+visit_patch(const buffer_snapshot_t* const snapshot, patch_t* const patch)
+{
+  for (size_t i = 0; i < snapshot->count; i++) {
+    if (!patch_segment(
+          patch, snapshot->segments[i].data, snapshot->segments[i].length)) {
+      break;
+    }
+  }
+}
+
+bool
+patch_segment(patch_t* const patch,
+              const char* const data,
+              const size_t length)
+{
+  const file_origin_t* const origin = patch->origin;
+  const char* const mapping = origin->mapping;
+  const size_t position = patch->position;
+  patch->position += length;
+
+  // Past the end of the file, the mapping can not be read
+  const size_t readable = min(origin->size, origin->mapping_length);
+
+  // Text still in the mapping is only left alone where it is already in
+  // the right place. Anywhere else it would be written over by what
+  // belongs there, pulling it from under the buffer.
+  if (data >= mapping && data < mapping + origin->mapping_length) {
+    patch->fits = data == mapping + position && position + length <= readable;
+    if (patch->fits && patch->written) {
+      atomic_fetch_add(patch->written, length);
+    }
+    return patch->fits;
+  }
+
+  // Anything else, such as a line edited back to how it was, is only
+  // written if it differs from the file
+  if (position + length <= readable &&
+      memcmp(mapping + position, data, length) == 0) {
+    if (patch->written) {
+      atomic_fetch_add(patch->written, length);
+    }
+    return true;
+  }
+  patch->changed += length;
+
+  if (patch->undo) {
+    return add_undo_range(patch, position, length);
+  }
+
+  write_batch_t* const batch = patch->batch;
+  if (!batch) {
+    return true;
+  }
+
+  // The batch is written at one place in the file, so a change
+  // further on starts a new one
+  if (patch->end != position) {
+    flush_write_batch(batch);
+    batch->position = position;
+  }
+  add_write_range(batch, data, length);
+  patch->end = position + length;
+
+  return batch->error == SUCCESS;
+}
 
+error_t
+save_through_swap_file(const save_job_t* const job)
+{
+  const size_t length = strlen(job->filename);
+  char* const swap_file = malloc(length + 5);
   if (!swap_file) {
     return ALLOC_ERROR;
   }
+  memcpy(swap_file, job->filename, length);
+  memcpy(swap_file + length, ".swp", 5);
 
-  memcpy(swap_file, filename, len);
-  strncat(swap_file, ".swp", len + 4);
+  const error_t ret = write_swap_file(job, swap_file);
+  if (ret != SUCCESS) {
+    unlink(swap_file);
+  }
+  free(swap_file);
 
-  fp = fopen(swap_file, "w");
+  return ret;
+}
 
-  if (fp == NULL) {
-    free(swap_file);
+error_t
+write_swap_file(const save_job_t* const job, const char* const swap_file)
+{
+  const int fd = open(swap_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
     return WRITE_ERROR;
   }
 
-  buffer_iter_t* write_iter = NULL;
-  ret = copy_buffer_iter(iter, &write_iter);
+  // Keep the permissions of the file being replaced
+  struct stat st;
+  if (stat(job->filename, &st) == 0) {
+    fchmod(fd, st.st_mode & 07777);
+  }
 
-  if (ret != SUCCESS) {
-    fclose(fp);
-    free(swap_file);
+  write_batch_t* const batch = malloc(sizeof(write_batch_t));
+  if (!batch) {
+    close(fd);
     return ALLOC_ERROR;
   }
+  init_write_batch(batch, fd, job->written);
+
+  // Unchanged stretches of the original can be copied from it, so long
+  // as it is still the file which was mapped
+  batch->source = open_origin(job->origin, job->filename, O_RDONLY);
+  batch->origin = job->origin;
+
+  const buffer_snapshot_t* const snapshot = job->snapshot;
+  for (size_t i = 0; i < snapshot->count && batch->error == SUCCESS; i++) {
+    add_write_range(
+      batch, snapshot->segments[i].data, snapshot->segments[i].length);
+  }
+  flush_write_batch(batch);
+
+  error_t ret = batch->error;
+  if (batch->source >= 0) {
+    close(batch->source);
+  }
+  free(batch);
+
+  if (ret == SUCCESS && job->sync == SYNC_DATA && fdatasync(fd) != 0) {
+    ret = WRITE_ERROR;
+  } else if (ret == SUCCESS && job->sync == SYNC_FULL && fsync(fd) != 0) {
+    ret = WRITE_ERROR;
+  }
+
+  if (close(fd) != 0 && ret == SUCCESS) {
+    ret = WRITE_ERROR;
+  }
+
+  if (ret == SUCCESS && rename(swap_file, job->filename) != 0) {
+    ret = WRITE_ERROR;
+  }
+
+  if (ret == SUCCESS && job->sync == SYNC_FULL) {
+    ret = sync_directory(job->filename);
+  }
+
+  return ret;
+}
+
+void
+init_write_batch(write_batch_t* const batch,
+                 const int fd,
+                 atomic_size_t* const written)
+{
+  batch->fd = fd;
+  batch->count = 0;
+  batch->error = SUCCESS;
+  batch->position = -1;
+  batch->source = -1;
+  batch->origin = NULL;
+  batch->written = written;
+}
+
+void
+add_write_range(write_batch_t* const batch,
+                const char* const data,
+                const size_t length)
+{
+  if (length == 0) {
+    return;
+  }
+
+  struct iovec* const last =
+    batch->count > 0 ? &batch->ranges[batch->count - 1] : NULL;
+  if (last && (const char*)last->iov_base + last->iov_len == data) {
+    last->iov_len += length;
+    return;
+  }
 
-  while (!is_first_line(write_iter)) {
-    move_iter_up_line(write_iter);
+  if (batch->count == WRITE_BATCH_SIZE) {
+    flush_write_batch(batch);
   }
 
-  while (true) {
-    fprintf(fp, "%s\n", current_line(write_iter));
-    if (is_last_line(write_iter)) {
+  batch->ranges[batch->count++] =
+    (struct iovec){ .iov_base = (void*)data, .iov_len = length };
+}
+
+void
+flush_write_batch(write_batch_t* const batch)
+{
+  // Long stretches of the original go to the kernel to copy, and the
+  // ranges between them are written as they are
+  size_t done = 0;
+  for (size_t i = 0; i < batch->count; i++) {
+    if (is_copied_range(batch, &batch->ranges[i])) {
+      write_ranges(batch, batch->ranges + done, i - done);
+      copy_range(batch, &batch->ranges[i]);
+      done = i + 1;
+    }
+  }
+  write_ranges(batch, batch->ranges + done, batch->count - done);
+  batch->count = 0;
+}
+
+void
+write_ranges(write_batch_t* const batch,
+             struct iovec* ranges,
+             size_t count)
+{
+  while (batch->error == SUCCESS && count > 0) {
+    ssize_t written =
+      batch->position < 0
+        ? writev(batch->fd, ranges, count)
+        : pwritev(batch->fd, ranges, count, batch->position);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written <= 0) {
+      batch->error = WRITE_ERROR;
       break;
     }
-    move_iter_down_line(write_iter);
+    if (batch->position >= 0) {
+      batch->position += written;
+    }
+    if (batch->written) {
+      atomic_fetch_add(batch->written, written);
+    }
+
+    // Writes can stop short, part way through a range
+    while (count > 0 && (size_t)written >= ranges->iov_len) {
+      written -= ranges->iov_len;
+      ranges++;
+      count--;
+    }
+    if (count > 0) {
+      ranges->iov_base = (char*)ranges->iov_base + written;
+      ranges->iov_len -= written;
+    }
   }
+}
 
-  destroy_buffer_iter(write_iter);
-  fclose(fp);
+bool
+is_copied_range(const write_batch_t* const batch,
+                const struct iovec* const range)
+{
+  if (batch->source < 0 || range->iov_len < min_copy_length) {
+    return false;
+  }
 
-  rename(swap_file, filename);
+  const char* const mapping = batch->origin->mapping;
+  const char* const data = range->iov_base;
+  const size_t readable =
+    min(batch->origin->size, batch->origin->mapping_length);
 
-  free(swap_file);
+  return data >= mapping && data + range->iov_len <= mapping + readable;
+}
+
+void
+copy_range(write_batch_t* const batch, struct iovec* const range)
+{
+  off_t offset = (const char*)range->iov_base - batch->origin->mapping;
+
+  while (batch->error == SUCCESS && range->iov_len > 0) {
+    const ssize_t copied = syscall(SYS_copy_file_range,
+                                   batch->source,
+                                   &offset,
+                                   batch->fd,
+                                   NULL,
+                                   range->iov_len,
+                                   0);
+    if (copied < 0 && errno == EINTR) {
+      continue;
+    } else if (copied <= 0) {
+      // Not every file system copies between files, so the rest of
+      // this range and any others are written from memory
+      close(batch->source);
+      batch->source = -1;
+      write_ranges(batch, range, 1);
+      return;
+    }
+    if (batch->written) {
+      atomic_fetch_add(batch->written, copied);
+    }
+
+    range->iov_base = (char*)range->iov_base + copied;
+    range->iov_len -= copied;
+  }
+}
+
+error_t
+sync_directory(const char* const filename)
+{
+  const char* const slash = strrchr(filename, '/');
+  char* const directory = slash ? strndup(filename, max(slash - filename, 1))
+                                : strdup(".");
+  if (!directory) {
+    return ALLOC_ERROR;
+  }
+
+  const int fd = open(directory, O_RDONLY | O_DIRECTORY);
+  free(directory);
+  if (fd < 0) {
+    return WRITE_ERROR;
+  }
+
+  const error_t ret = fsync(fd) == 0 ? SUCCESS : WRITE_ERROR;
+  close(fd);
 
   return ret;
 }
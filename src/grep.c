@@ -0,0 +1,318 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <grep.h>
+#include <search.h>
+
+// Buffers with fewer lines than this are searched on the calling thread,
+// as starting threads would take longer than the search
+const size_t parallel_grep_lines = 1 << 16;
+// Threads take lines to search in runs of this many
+const size_t grep_run_lines = 1 << 14;
+// How often, in milliseconds, the calling thread checks whether the
+// search has been interrupted while threads run it
+const long grep_poll_interval = 20;
+
+/*
+ * A search shared between threads. Lines are numbered from the line
+ * the search starts at, so the first match in that order is the one
+ * with the lowest number.
+ */
+typedef struct grep_t
+{
+  const buffer_iter_t* iter;
+  const regexp_t* regexp;
+  size_t first;
+  size_t lines;
+
+  // Only called by the calling thread
+  bool (*interrupted)(void);
+
+  atomic_size_t next_run;
+  atomic_size_t found;
+  atomic_bool cancelled;
+
+  // Signalled by each thread as it finishes
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+  size_t running;
+} grep_t;
+
+/*
+ * Search runs of lines until there are none left which could hold an
+ * earlier match than one already found, calling interrupted between
+ * runs if it is not NULL.
+ */
+void
+grep_runs(grep_t* const grep,
+          dfa_t* const dfa,
+          buffer_iter_t* const iter,
+          bool (*interrupted)(void));
+
+/*
+ * Search the lines of a run, returning whether a match was found.
+ */
+bool
+grep_run(grep_t* const grep,
+         dfa_t* const dfa,
+         buffer_iter_t* const iter,
+         const size_t start,
+         const size_t end);
+
+/*
+ * Record a match at position, unless an earlier one has been found.
+ */
+void
+record_grep_match(grep_t* const grep, const size_t position);
+
+/*
+ * Thread entry point, searching with a DFA and iterator of its own.
+ */
+void*
+grep_thread(void* const context);
+
+/*
+ * Search on the calling thread, or on threads started for the search.
+ */
+void
+grep_here(grep_t* const grep);
+void
+grep_in_threads(grep_t* const grep, const size_t jobs);
+
+/*
+ * Segment visitor appending to the char* pointed to by context.
+ */
+bool
+append_segment(const char* const data, const size_t length, void* const context);
+
+size_t
+grep_buffer(const buffer_iter_t* const iter,
+            const regexp_t* const regexp,
+            const size_t jobs,
+            bool (*interrupted)(void),
+            bool* const was_interrupted)
+{
+  buffer_iter_t* last = NULL;
+  if (copy_buffer_iter(iter, &last) != SUCCESS) {
+    return SEARCH_NOT_FOUND;
+  }
+
+  // Reaching the last line splits every line of a mapped file, after
+  // which the threads only ever read the buffer
+  move_iter_to_line(last, SIZE_MAX);
+
+  grep_t grep = { .iter = iter,
+                  .regexp = regexp,
+                  .lines = line_number(last) + 1,
+                  .interrupted = interrupted,
+                  .running = 0 };
+  grep.first = (line_number(iter) + 1) % grep.lines;
+  atomic_init(&grep.next_run, 0);
+  atomic_init(&grep.found, SIZE_MAX);
+  atomic_init(&grep.cancelled, false);
+  destroy_buffer_iter(last);
+
+  if (jobs == 1 || grep.lines < parallel_grep_lines) {
+    grep_here(&grep);
+  } else {
+    grep_in_threads(&grep, jobs);
+  }
+
+  *was_interrupted = atomic_load(&grep.cancelled);
+  const size_t found = atomic_load(&grep.found);
+  if (*was_interrupted || found == SIZE_MAX) {
+    return SEARCH_NOT_FOUND;
+  }
+
+  return (grep.first + found) % grep.lines;
+}
+
+size_t
+find_match_in_line(const buffer_iter_t* const iter,
+                   const regexp_t* const regexp)
+{
+  char* const line = malloc(chars_in_line(iter) + 1);
+  dfa_t* const dfa = new_dfa(regexp, true);
+  size_t found = SEARCH_NOT_FOUND;
+
+  if (line && dfa) {
+    char* end = line;
+    visit_line(iter, append_segment, &end);
+    found = find_match_start(dfa, line, end - line);
+  }
+
+  free(line);
+  destroy_dfa(dfa);
+
+  return found;
+}
+
+void
+grep_here(grep_t* const grep)
+{
+  buffer_iter_t* iter = NULL;
+  dfa_t* const dfa = new_dfa(grep->regexp, false);
+
+  if (dfa && copy_buffer_iter(grep->iter, &iter) == SUCCESS) {
+    grep_runs(grep, dfa, iter, grep->interrupted);
+    destroy_buffer_iter(iter);
+  }
+  destroy_dfa(dfa);
+}
+
+void
+grep_in_threads(grep_t* const grep, const size_t jobs)
+{
+  pthread_t* const threads = malloc(jobs * sizeof(pthread_t));
+  if (!threads) {
+    grep_here(grep);
+    return;
+  }
+
+  pthread_mutex_init(&grep->lock, NULL);
+  pthread_cond_init(&grep->finished, NULL);
+
+  size_t started = 0;
+  pthread_mutex_lock(&grep->lock);
+  for (; started < jobs; started++) {
+    if (pthread_create(&threads[started], NULL, grep_thread, grep) != 0) {
+      break;
+    }
+    grep->running++;
+  }
+
+  // Wait for the threads, waking now and then to check whether the
+  // search has been interrupted
+  while (grep->running > 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += grep_poll_interval * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&grep->finished, &grep->lock, &deadline);
+
+    if (grep->running > 0 && grep->interrupted) {
+      pthread_mutex_unlock(&grep->lock);
+      if (grep->interrupted()) {
+        atomic_store(&grep->cancelled, true);
+      }
+      pthread_mutex_lock(&grep->lock);
+    }
+  }
+  pthread_mutex_unlock(&grep->lock);
+
+  for (size_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  // If no thread could be started, search here instead
+  if (started == 0) {
+    grep_here(grep);
+  }
+
+  pthread_cond_destroy(&grep->finished);
+  pthread_mutex_destroy(&grep->lock);
+  free(threads);
+}
+
+void*
+grep_thread(void* const context)
+{
+  grep_t* const grep = context;
+  buffer_iter_t* iter = NULL;
+  dfa_t* const dfa = new_dfa(grep->regexp, false);
+
+  // The calling thread checks for interruption while it waits
+  if (dfa && copy_buffer_iter(grep->iter, &iter) == SUCCESS) {
+    grep_runs(grep, dfa, iter, NULL);
+    destroy_buffer_iter(iter);
+  }
+  destroy_dfa(dfa);
+
+  pthread_mutex_lock(&grep->lock);
+  grep->running--;
+  pthread_cond_signal(&grep->finished);
+  pthread_mutex_unlock(&grep->lock);
+
+  return NULL;
+}
+
+void
+grep_runs(grep_t* const grep,
+          dfa_t* const dfa,
+          buffer_iter_t* const iter,
+          bool (*interrupted)(void))
+{
+  for (;;) {
+    // Runs are taken in order, so once a run starts after a match,
+    // every later one does too
+    const size_t start = atomic_fetch_add(&grep->next_run, 1) * grep_run_lines;
+    if (start >= grep->lines || start >= atomic_load(&grep->found) ||
+        atomic_load(&grep->cancelled)) {
+      return;
+    }
+
+    const size_t end = min(start + grep_run_lines, grep->lines);
+    if (grep_run(grep, dfa, iter, start, end)) {
+      return;
+    }
+
+    if (interrupted && interrupted()) {
+      atomic_store(&grep->cancelled, true);
+      return;
+    }
+  }
+}
+
+bool
+grep_run(grep_t* const grep,
+         dfa_t* const dfa,
+         buffer_iter_t* const iter,
+         const size_t start,
+         const size_t end)
+{
+  size_t line = (grep->first + start) % grep->lines;
+  move_iter_to_line(iter, line);
+
+  for (size_t position = start; position < end; position++) {
+    if (line_matches(dfa, iter)) {
+      record_grep_match(grep, position);
+      return true;
+    }
+
+    if (++line == grep->lines) {
+      line = 0;
+      move_iter_to_line(iter, 0);
+    } else {
+      move_iter_down_line(iter);
+    }
+  }
+
+  return false;
+}
+
+void
+record_grep_match(grep_t* const grep, const size_t position)
+{
+  size_t found = atomic_load(&grep->found);
+  while (position < found &&
+         !atomic_compare_exchange_weak(&grep->found, &found, position)) {
+  }
+}
+
+bool
+append_segment(const char* const data, const size_t length, void* const context)
+{
+  char** const end = context;
+  memcpy(*end, data, length);
+  *end += length;
+
+  return true;
+}
@@ -0,0 +1,366 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include <highlight.h>
+
+// The background thread lexes this many lines past the last line drawn
+const size_t highlight_lookahead = 1 << 14;
+// The state array starts with room for this many lines
+const size_t initial_state_capacity = 1024;
+
+struct highlighter_t
+{
+  const language_t* language;
+
+  // The lexer state each line ends in. The first valid states are up to
+  // date, and those up to stored were before the lines in dirty were
+  // edited
+  lex_state_t* states;
+  size_t capacity;
+  size_t valid;
+  size_t stored;
+  damage_t dirty;
+
+  // Lines whose start state has changed since the last frame, and the
+  // last line asked about while drawing it
+  damage_t changed;
+  size_t drawn;
+
+  span_list_t spans;
+
+  // The background thread only touches the highlighter, through an
+  // iterator of its own, while running is set, and is busy until it
+  // notices running is clear
+  pthread_t thread;
+  bool started;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  atomic_bool running;
+  bool busy;
+  bool quit;
+  buffer_iter_t* iter;
+  size_t target;
+};
+
+/*
+ * Lex lines with iter, which is moved as needed, until the state of
+ * every line before line is up to date, or running is cleared. Returns
+ * false if the end of the buffer was reached first, or there was no
+ * memory for the states.
+ */
+bool
+lex_lines(highlighter_t* const highlighter,
+          buffer_iter_t* const iter,
+          const size_t line,
+          atomic_bool* const running);
+
+/*
+ * Bring the states of the lines before the line at iter up to date,
+ * returning false if that could not be done.
+ */
+bool
+catch_up(highlighter_t* const highlighter, const buffer_iter_t* const iter);
+
+/*
+ * Record the state the first line whose state is out of date ends in.
+ */
+bool
+record_state(highlighter_t* const highlighter,
+             const size_t line,
+             const lex_state_t state);
+
+/*
+ * The state the line starts in, which must be up to date.
+ */
+lex_state_t
+line_start_state(const highlighter_t* const highlighter, const size_t line);
+
+/*
+ * Thread entry point for lexing in the background.
+ */
+void*
+highlight_thread(void* const context);
+
+highlighter_t*
+new_highlighter(const char* const filename)
+{
+  highlighter_t* const highlighter = calloc(1, sizeof(highlighter_t));
+  if (!highlighter) {
+    return NULL;
+  }
+
+  highlighter->language = find_language(filename);
+  pthread_mutex_init(&highlighter->lock, NULL);
+  pthread_cond_init(&highlighter->wake, NULL);
+  pthread_cond_init(&highlighter->idle, NULL);
+  atomic_init(&highlighter->running, false);
+
+  return highlighter;
+}
+
+void
+destroy_highlighter(highlighter_t* highlighter)
+{
+  if (!highlighter) {
+    return;
+  }
+
+  pause_highlighting(highlighter);
+  if (highlighter->started) {
+    pthread_mutex_lock(&highlighter->lock);
+    highlighter->quit = true;
+    pthread_cond_signal(&highlighter->wake);
+    pthread_mutex_unlock(&highlighter->lock);
+    pthread_join(highlighter->thread, NULL);
+  }
+
+  pthread_mutex_destroy(&highlighter->lock);
+  pthread_cond_destroy(&highlighter->wake);
+  pthread_cond_destroy(&highlighter->idle);
+  destroy_span_list(&highlighter->spans);
+  free(highlighter->states);
+  free(highlighter);
+}
+
+void
+damage_highlighting(highlighter_t* const highlighter,
+                    const damage_t* const damage)
+{
+  clear_damage(&highlighter->changed);
+  if (!damage->damaged) {
+    return;
+  }
+
+  const size_t first = damage->first_line;
+  highlighter->valid = min(highlighter->valid, first);
+
+  // Lines which moved keep no states, as there is no telling where they
+  // moved from
+  if (damage->last_line == DAMAGE_TO_END) {
+    highlighter->stored = min(highlighter->stored, first);
+  } else {
+    add_damage(&highlighter->dirty, first, damage->last_line);
+  }
+}
+
+bool
+is_highlighting_damaged(highlighter_t* const highlighter,
+                        const buffer_iter_t* const iter)
+{
+  if (!highlighter->language || !catch_up(highlighter, iter)) {
+    return false;
+  }
+
+  return is_line_damaged(&highlighter->changed, line_number(iter));
+}
+
+const highlight_span_t*
+highlight_line(highlighter_t* const highlighter,
+               const buffer_iter_t* const iter,
+               size_t* const count)
+{
+  *count = 0;
+  if (!highlighter->language || !catch_up(highlighter, iter)) {
+    return NULL;
+  }
+
+  const size_t line = line_number(iter);
+  const lex_state_t state = lex_line(highlighter->language,
+                                     iter,
+                                     line_start_state(highlighter, line),
+                                     &highlighter->spans);
+  if (highlighter->valid == line) {
+    record_state(highlighter, line, state);
+  }
+
+  *count = highlighter->spans.count;
+  return highlighter->spans.spans;
+}
+
+void
+resume_highlighting(highlighter_t* const highlighter,
+                    const buffer_iter_t* const iter)
+{
+  const size_t target = highlighter->drawn + highlight_lookahead;
+
+  if (!highlighter->language || highlighter->valid >= target) {
+    return;
+  }
+
+  if (!highlighter->started) {
+    highlighter->started = pthread_create(&highlighter->thread,
+                                          NULL,
+                                          highlight_thread,
+                                          highlighter) == 0;
+  }
+  if (!highlighter->started ||
+      copy_buffer_iter(iter, &highlighter->iter) != SUCCESS) {
+    return;
+  }
+
+  pthread_mutex_lock(&highlighter->lock);
+  highlighter->target = target;
+  atomic_store(&highlighter->running, true);
+  pthread_cond_signal(&highlighter->wake);
+  pthread_mutex_unlock(&highlighter->lock);
+}
+
+void
+pause_highlighting(highlighter_t* const highlighter)
+{
+  if (!highlighter->iter) {
+    return;
+  }
+
+  atomic_store(&highlighter->running, false);
+
+  pthread_mutex_lock(&highlighter->lock);
+  while (highlighter->busy) {
+    pthread_cond_wait(&highlighter->idle, &highlighter->lock);
+  }
+  pthread_mutex_unlock(&highlighter->lock);
+
+  destroy_buffer_iter(highlighter->iter);
+  highlighter->iter = NULL;
+}
+
+bool
+lex_lines(highlighter_t* const highlighter,
+          buffer_iter_t* const iter,
+          const size_t line,
+          atomic_bool* const running)
+{
+  while (highlighter->valid < line && (!running || atomic_load(running))) {
+    const size_t next = highlighter->valid;
+
+    // Lines whose states still hold are skipped
+    if (line_number(iter) + 1 == next && !is_last_line(iter)) {
+      move_iter_down_line(iter);
+    } else if (line_number(iter) != next) {
+      move_iter_to_line(iter, next);
+    }
+    if (line_number(iter) != next) {
+      return false;
+    }
+
+    const lex_state_t state = lex_line(
+      highlighter->language, iter, line_start_state(highlighter, next), NULL);
+    if (!record_state(highlighter, next, state)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool
+catch_up(highlighter_t* const highlighter, const buffer_iter_t* const iter)
+{
+  const size_t line = line_number(iter);
+  highlighter->drawn = line;
+
+  if (highlighter->valid >= line) {
+    return true;
+  }
+
+  buffer_iter_t* copy = NULL;
+  if (copy_buffer_iter(iter, &copy) != SUCCESS) {
+    return false;
+  }
+
+  lex_lines(highlighter, copy, line, NULL);
+  destroy_buffer_iter(copy);
+
+  return highlighter->valid >= line;
+}
+
+bool
+record_state(highlighter_t* const highlighter,
+             const size_t line,
+             const lex_state_t state)
+{
+  damage_t* const dirty = &highlighter->dirty;
+
+  if (line < highlighter->stored && highlighter->states[line] == state) {
+    // The lines after are as they were, up to the next edited line
+    if (!dirty->damaged || line >= dirty->last_line) {
+      highlighter->valid = highlighter->stored;
+    } else if (line < dirty->first_line) {
+      highlighter->valid = dirty->first_line;
+    } else {
+      highlighter->valid = line + 1;
+    }
+  } else {
+    if (line >= highlighter->capacity) {
+      const size_t capacity = highlighter->capacity
+                                ? 2 * highlighter->capacity
+                                : initial_state_capacity;
+      lex_state_t* const states =
+        realloc(highlighter->states, sizeof(lex_state_t) * capacity);
+      if (!states) {
+        return false;
+      }
+      highlighter->states = states;
+      highlighter->capacity = capacity;
+    }
+
+    // The states stored after a changed one were lexed from the old one,
+    // and only hold again once a line ends as it did before
+    if (line < highlighter->stored) {
+      add_damage(dirty, line + 1, line + 1);
+    }
+
+    highlighter->states[line] = state;
+    highlighter->valid = line + 1;
+    highlighter->stored = max(highlighter->stored, line + 1);
+    add_damage(&highlighter->changed, line + 1, line + 1);
+  }
+
+  if (highlighter->valid >= highlighter->stored) {
+    clear_damage(dirty);
+  }
+
+  return true;
+}
+
+lex_state_t
+line_start_state(const highlighter_t* const highlighter, const size_t line)
+{
+  return line > 0 ? highlighter->states[line - 1] : LEX_INITIAL;
+}
+
+void*
+highlight_thread(void* const context)
+{
+  highlighter_t* const highlighter = context;
+
+  pthread_mutex_lock(&highlighter->lock);
+  while (!highlighter->quit) {
+    if (!atomic_load(&highlighter->running) ||
+        highlighter->valid >= highlighter->target) {
+      pthread_cond_wait(&highlighter->wake, &highlighter->lock);
+      continue;
+    }
+
+    highlighter->busy = true;
+    pthread_mutex_unlock(&highlighter->lock);
+
+    const bool more = lex_lines(highlighter,
+                                highlighter->iter,
+                                highlighter->target,
+                                &highlighter->running);
+
+    pthread_mutex_lock(&highlighter->lock);
+    if (!more) {
+      highlighter->target = highlighter->valid;
+    }
+    highlighter->busy = false;
+    pthread_cond_broadcast(&highlighter->idle);
+  }
+  pthread_mutex_unlock(&highlighter->lock);
+
+  return NULL;
+}
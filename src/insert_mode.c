@@ -11,13 +11,13 @@ insert_mode_handler(event_t event, struct editor_state_t* const state)
       switch_mode(state, NORMAL);
       break;
     case 127: // TODO Why is this not KEY_BACKSPACE?
-      delete_character_at_point(state->point);
+      delete_char_before_cursor(state);
       break;
     case '\n':
       ret = open_line(state);
       break;
     default:
-      ret = insert_character_at_point(state->point, event);
+      ret = type_character(state, event);
       break;
   }
 
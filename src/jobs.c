@@ -0,0 +1,46 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <jobs.h>
+
+size_t
+default_jobs(void)
+{
+  const long processors = sysconf(_SC_NPROCESSORS_ONLN);
+  return processors > 0 ? processors : 1;
+}
+
+void
+run_jobs(void* (*job)(void*),
+         void* const contexts,
+         const size_t size,
+         const size_t count)
+{
+  char* const context = contexts;
+  pthread_t* const threads = count > 1 ? malloc(count * sizeof(pthread_t)) : NULL;
+  bool* const started = count > 1 ? calloc(count, sizeof(bool)) : NULL;
+
+  if (threads && started) {
+    for (size_t i = 1; i < count; i++) {
+      started[i] =
+        pthread_create(&threads[i], NULL, job, context + i * size) == 0;
+    }
+  }
+
+  job(context);
+
+  for (size_t i = 1; i < count; i++) {
+    if (started && started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      job(context + i * size);
+    }
+  }
+
+  free(threads);
+  free(started);
+}
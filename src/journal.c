@@ -0,0 +1,681 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <journal.h>
+#include <stats.h>
+
+// A journal starts with a magic number, then the size, modification
+// time and inode of the file its edits apply to, eight bytes each
+#define JOURNAL_HEADER_SIZE 32
+static const char journal_magic[8] = "vjournal";
+
+// The journal is synced at most this often, in milliseconds
+static const int journal_sync_interval = 1000;
+
+// The most bytes a number takes in a record
+#define VARINT_SIZE 10
+
+/*
+ * Each record starts with one of these, followed by its numbers, each
+ * seven bits to a byte, low bits first, and then any text it inserts.
+ * None is 0, so the zeros a crash can leave at the end of a file end
+ * the journal.
+ */
+typedef enum journal_op_t
+{
+  // Line, column, length, and the text
+  JOURNAL_INSERT = 'i',
+  // Line, column, and the characters deleted before it
+  JOURNAL_DELETE = 'd',
+  // Line, and the lines deleted from it
+  JOURNAL_DELETE_LINES = 'D',
+  // The line opened after
+  JOURNAL_OPEN_LINE = 'o'
+} journal_op_t;
+
+struct journal_t
+{
+  int fd;
+  char* path;
+  char* filename;
+
+  // Records not yet written, and the bytes in the file
+  char* pending;
+  size_t used;
+  size_t capacity;
+  size_t written;
+
+  // Whether anything written is not yet synced, and when the journal
+  // was last synced
+  bool unsynced;
+  long long synced_at;
+
+  error_t error;
+};
+
+/*
+ * Describe filename as it is now, as a journal header.
+ */
+bool
+describe_file(const char* const filename,
+              char header[JOURNAL_HEADER_SIZE]);
+
+/*
+ * Write a journal holding header and then records to a new file, and
+ * move it over path. Returns the new journal's descriptor, open for
+ * appending, or -1.
+ */
+int
+write_new_journal(const char* const path,
+                  const char header[JOURNAL_HEADER_SIZE],
+                  const char* const records,
+                  const size_t length,
+                  const bool sync);
+
+/*
+ * Apply the records in data to the buffer, counting them in replayed.
+ * Returns the bytes of whole records, after which a crash may have cut
+ * one short. Replaying stops at a record which does not fit the text or
+ * could not be applied, setting failed.
+ */
+size_t
+replay_records(buffer_iter_t* const iter,
+               const char* const data,
+               const size_t length,
+               size_t* const replayed,
+               bool* const failed);
+
+/*
+ * Move to line and the column offset, returning false if the buffer has
+ * no such place.
+ */
+bool
+move_iter_to_place(buffer_iter_t* const iter,
+                   const size_t line,
+                   const size_t offset);
+
+/*
+ * Move the journal aside to FILE.journal.old.
+ */
+bool
+move_journal_aside(journal_t* const journal);
+
+/*
+ * Read the whole of the file open on fd into memory, setting length.
+ */
+char*
+read_whole_file(const int fd, size_t* const length);
+
+/*
+ * Write all of data to fd at its offset.
+ */
+error_t
+write_fully(const int fd, const char* const data, size_t length);
+
+/*
+ * Make room for a record of up to length bytes at the end of the
+ * pending records.
+ */
+bool
+reserve_record(journal_t* const journal, const size_t length);
+
+/*
+ * Add a number to the pending records, which must have room for it.
+ */
+void
+put_number(journal_t* const journal, uint64_t value);
+
+/*
+ * Take a number from the bytes at *data, before end, moving *data past
+ * it. Returns false if the number is cut short.
+ */
+bool
+get_number(const char** const data, const char* const end, size_t* const value);
+
+journal_t*
+open_journal(buffer_iter_t* const iter,
+             const char* const filename,
+             size_t* const replayed,
+             bool* const partial,
+             bool* const stale)
+{
+  *replayed = 0;
+  *partial = false;
+  *stale = false;
+
+  journal_t* const journal = calloc(1, sizeof(journal_t));
+  if (!journal) {
+    return NULL;
+  }
+  journal->fd = -1;
+  journal->error = SUCCESS;
+  journal->synced_at = monotonic_time();
+
+  const size_t length = strlen(filename);
+  journal->filename = strdup(filename);
+  journal->path = malloc(length + sizeof(".journal"));
+  char header[JOURNAL_HEADER_SIZE];
+  if (!journal->filename || !journal->path ||
+      !describe_file(filename, header)) {
+    close_journal(journal, true);
+    return NULL;
+  }
+  memcpy(journal->path, filename, length);
+  memcpy(journal->path + length, ".journal", sizeof(".journal"));
+
+  // A journal for the file as it is was left by an editor which did
+  // not exit cleanly. Its edits are applied, and it carries on from the
+  // last whole record.
+  const int fd = open(journal->path, O_RDWR | O_APPEND);
+  if (fd >= 0) {
+    size_t journal_length = 0;
+    char* const data = read_whole_file(fd, &journal_length);
+
+    if (data && journal_length >= JOURNAL_HEADER_SIZE &&
+        memcmp(data, header, JOURNAL_HEADER_SIZE) == 0) {
+      const size_t replayed_length =
+        replay_records(iter,
+                       data + JOURNAL_HEADER_SIZE,
+                       journal_length - JOURNAL_HEADER_SIZE,
+                       replayed,
+                       partial);
+      journal->written = JOURNAL_HEADER_SIZE + replayed_length;
+      move_iter_to_line(iter, 0);
+      move_to_beginning_of_line(iter);
+
+      // The whole journal is kept aside, and a new one carries on from
+      // the records which did apply, which match the buffer
+      if (*partial) {
+        close(fd);
+        if (move_journal_aside(journal)) {
+          journal->fd = write_new_journal(journal->path,
+                                          header,
+                                          data + JOURNAL_HEADER_SIZE,
+                                          replayed_length,
+                                          true);
+        }
+        free(data);
+        if (journal->fd < 0) {
+          close_journal(journal, true);
+          return NULL;
+        }
+        return journal;
+      }
+      free(data);
+
+      if (ftruncate(fd, journal->written) == 0) {
+        journal->fd = fd;
+        return journal;
+      }
+      close(fd);
+      close_journal(journal, true);
+      return NULL;
+    }
+    free(data);
+    close(fd);
+
+    // Anything else is from before the file was last written, and is
+    // kept out of the way rather than thrown away
+    *stale = move_journal_aside(journal);
+  }
+
+  journal->fd = write_new_journal(journal->path, header, NULL, 0, false);
+  if (journal->fd < 0) {
+    close_journal(journal, true);
+    return NULL;
+  }
+  journal->written = JOURNAL_HEADER_SIZE;
+
+  return journal;
+}
+
+void
+record_insert(journal_t* const journal,
+              const size_t line,
+              const size_t column,
+              const char* const data,
+              const size_t length)
+{
+  if (!journal || !reserve_record(journal, 1 + 3 * VARINT_SIZE + length)) {
+    return;
+  }
+
+  journal->pending[journal->used++] = JOURNAL_INSERT;
+  put_number(journal, line);
+  put_number(journal, column);
+  put_number(journal, length);
+  memcpy(journal->pending + journal->used, data, length);
+  journal->used += length;
+}
+
+void
+record_delete(journal_t* const journal,
+              const size_t line,
+              const size_t column,
+              const size_t count)
+{
+  if (!journal || !reserve_record(journal, 1 + 3 * VARINT_SIZE)) {
+    return;
+  }
+
+  journal->pending[journal->used++] = JOURNAL_DELETE;
+  put_number(journal, line);
+  put_number(journal, column);
+  put_number(journal, count);
+}
+
+void
+record_delete_lines(journal_t* const journal,
+                    const size_t line,
+                    const size_t count)
+{
+  if (!journal || !reserve_record(journal, 1 + 2 * VARINT_SIZE)) {
+    return;
+  }
+
+  journal->pending[journal->used++] = JOURNAL_DELETE_LINES;
+  put_number(journal, line);
+  put_number(journal, count);
+}
+
+void
+record_open_line(journal_t* const journal, const size_t line)
+{
+  if (!journal || !reserve_record(journal, 1 + VARINT_SIZE)) {
+    return;
+  }
+
+  journal->pending[journal->used++] = JOURNAL_OPEN_LINE;
+  put_number(journal, line);
+}
+
+error_t
+flush_journal(journal_t* const journal, const bool sync)
+{
+  if (!journal) {
+    return SUCCESS;
+  }
+
+  if (journal->error == SUCCESS && journal->used > 0) {
+    journal->error = write_fully(journal->fd, journal->pending, journal->used);
+    if (journal->error == SUCCESS) {
+      journal->written += journal->used;
+      journal->used = 0;
+      journal->unsynced = true;
+    }
+  }
+
+  // With syncing off nothing is left waiting to be synced, or the event
+  // loop would keep waking for it.
+  if (!sync) {
+    journal->unsynced = false;
+  }
+
+  if (journal->error == SUCCESS && sync && journal_sync_timeout(journal) == 0) {
+    if (fdatasync(journal->fd) != 0) {
+      journal->error = WRITE_ERROR;
+    }
+    journal->unsynced = false;
+    journal->synced_at = monotonic_time();
+  }
+
+  return journal->error;
+}
+
+int
+journal_sync_timeout(const journal_t* const journal)
+{
+  if (!journal || (!journal->unsynced && journal->used == 0)) {
+    return -1;
+  }
+
+  const long long since = (monotonic_time() - journal->synced_at) / 1000000;
+  return since >= journal_sync_interval ? 0 : journal_sync_interval - since;
+}
+
+size_t
+journal_position(const journal_t* const journal)
+{
+  return journal ? journal->written + journal->used : 0;
+}
+
+error_t
+restart_journal(journal_t* const journal,
+                const size_t position,
+                const bool sync)
+{
+  if (!journal || flush_journal(journal, false) != SUCCESS) {
+    return journal ? journal->error : SUCCESS;
+  }
+
+  char header[JOURNAL_HEADER_SIZE];
+  if (!describe_file(journal->filename, header)) {
+    return journal->error = WRITE_ERROR;
+  }
+
+  // The edits made since position are not in the file, and go into the
+  // new journal. There are only as many as were typed during a save.
+  const size_t length = journal->written - position;
+  char* const records = malloc(max(length, 1));
+  if (!records) {
+    return journal->error = ALLOC_ERROR;
+  }
+  if (length > 0 &&
+      pread(journal->fd, records, length, position) != (ssize_t)length) {
+    free(records);
+    return journal->error = WRITE_ERROR;
+  }
+
+  const int fd =
+    write_new_journal(journal->path, header, records, length, sync);
+  free(records);
+  if (fd < 0) {
+    return journal->error = WRITE_ERROR;
+  }
+
+  close(journal->fd);
+  journal->fd = fd;
+  journal->written = JOURNAL_HEADER_SIZE + length;
+  journal->unsynced = false;
+
+  return SUCCESS;
+}
+
+bool
+move_journal_aside(journal_t* const journal)
+{
+  const size_t path_length = strlen(journal->path);
+  char* const old_path = malloc(path_length + 5);
+  if (!old_path) {
+    return false;
+  }
+
+  memcpy(old_path, journal->path, path_length);
+  memcpy(old_path + path_length, ".old", 5);
+  const bool moved = rename(journal->path, old_path) == 0;
+  free(old_path);
+
+  return moved;
+}
+
+void
+close_journal(journal_t* const journal, const bool keep)
+{
+  if (!journal) {
+    return;
+  }
+
+  if (journal->fd >= 0) {
+    close(journal->fd);
+    if (!keep) {
+      unlink(journal->path);
+    }
+  }
+  free(journal->pending);
+  free(journal->path);
+  free(journal->filename);
+  free(journal);
+}
+
+bool
+describe_file(const char* const filename, char header[JOURNAL_HEADER_SIZE])
+{
+  struct stat st;
+  if (stat(filename, &st) != 0) {
+    return false;
+  }
+
+  const uint64_t fields[3] = {
+    st.st_size,
+    st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+    st.st_ino,
+  };
+
+  memcpy(header, journal_magic, sizeof(journal_magic));
+  for (size_t i = 0; i < 3; i++) {
+    for (size_t j = 0; j < 8; j++) {
+      header[8 * (i + 1) + j] = (char)(fields[i] >> (8 * j));
+    }
+  }
+
+  return true;
+}
+
+int
+write_new_journal(const char* const path,
+                  const char header[JOURNAL_HEADER_SIZE],
+                  const char* const records,
+                  const size_t length,
+                  const bool sync)
+{
+  const size_t path_length = strlen(path);
+  char* const new_path = malloc(path_length + 5);
+  if (!new_path) {
+    return -1;
+  }
+  memcpy(new_path, path, path_length);
+  memcpy(new_path + path_length, ".new", 5);
+
+  // The journal holds the text typed, so it is kept private
+  int fd = open(new_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd >= 0 &&
+      (write_fully(fd, header, JOURNAL_HEADER_SIZE) != SUCCESS ||
+       write_fully(fd, records, length) != SUCCESS ||
+       (sync && fdatasync(fd) != 0) || rename(new_path, path) != 0)) {
+    close(fd);
+    unlink(new_path);
+    fd = -1;
+  }
+  free(new_path);
+
+  return fd;
+}
+
+size_t
+replay_records(buffer_iter_t* const iter,
+               const char* const data,
+               const size_t length,
+               size_t* const replayed,
+               bool* const failed)
+{
+  const char* const end = data + length;
+  const char* record = data;
+
+  // Each record is applied as the editor made the edit, so the buffer
+  // ends up as it was. One which does not fit the text was not made to
+  // it, and nothing after it can be trusted.
+  while (record < end) {
+    const char* next = record + 1;
+    size_t line = 0;
+    size_t column = 0;
+    size_t count = 0;
+    bool applied = true;
+
+    switch ((journal_op_t)*record) {
+      case JOURNAL_INSERT:
+        if (!get_number(&next, end, &line) ||
+            !get_number(&next, end, &column) ||
+            !get_number(&next, end, &count) ||
+            (size_t)(end - next) < count) {
+          return record - data;
+        }
+        applied = move_iter_to_place(iter, line, column) &&
+                  insert_string_at_point(iter, next, count) == SUCCESS;
+        next += count;
+        break;
+
+      case JOURNAL_DELETE:
+        if (!get_number(&next, end, &line) ||
+            !get_number(&next, end, &column) ||
+            !get_number(&next, end, &count)) {
+          return record - data;
+        }
+        // Deleting at the start of a line does nothing, as it did when
+        // the editor recorded it
+        applied = move_iter_to_place(iter, line, column) &&
+                  (column == 0 || count <= column);
+        if (applied && column > 0) {
+          const size_t length = chars_in_line(iter);
+          for (size_t i = 0; i < count; i++) {
+            delete_character_at_point(iter);
+          }
+          applied = chars_in_line(iter) == length - count;
+        }
+        break;
+
+      case JOURNAL_DELETE_LINES:
+        if (!get_number(&next, end, &line) ||
+            !get_number(&next, end, &count)) {
+          return record - data;
+        }
+        // The editor stops at the last line, so the lines deleted are
+        // all there
+        applied = count == 0 || (count - 1 <= SIZE_MAX - line &&
+                                 move_iter_to_place(iter, line + count - 1, 0));
+        move_iter_to_line(iter, line);
+        for (size_t i = 0; applied && i < count; i++) {
+          delete_line_at_point(iter);
+        }
+        break;
+
+      case JOURNAL_OPEN_LINE:
+        if (!get_number(&next, end, &line)) {
+          return record - data;
+        }
+        applied = move_iter_to_place(iter, line, 0) &&
+                  append_line_at_point(iter) == SUCCESS;
+        break;
+
+      default:
+        // Zeros are left by a crash, anything else was never written
+        *failed = *record != 0;
+        return record - data;
+    }
+
+    if (!applied) {
+      *failed = true;
+      return record - data;
+    }
+    (*replayed)++;
+    record = next;
+  }
+
+  return record - data;
+}
+
+bool
+move_iter_to_place(buffer_iter_t* const iter,
+                   const size_t line,
+                   const size_t offset)
+{
+  move_iter_to_line(iter, line);
+  if (line_number(iter) != line) {
+    return false;
+  }
+  move_iter_to_column(iter, offset);
+
+  return column(iter) == offset;
+}
+
+char*
+read_whole_file(const int fd, size_t* const length)
+{
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return NULL;
+  }
+
+  char* const data = malloc(max((size_t)st.st_size, 1));
+  if (!data) {
+    return NULL;
+  }
+
+  size_t used = 0;
+  while (used < (size_t)st.st_size) {
+    const ssize_t bytes = pread(fd, data + used, st.st_size - used, used);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    } else if (bytes <= 0) {
+      break;
+    }
+    used += bytes;
+  }
+  *length = used;
+
+  return data;
+}
+
+error_t
+write_fully(const int fd, const char* const data, size_t length)
+{
+  const char* start = data;
+
+  while (length > 0) {
+    const ssize_t written = write(fd, start, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    } else if (written <= 0) {
+      return WRITE_ERROR;
+    }
+    start += written;
+    length -= written;
+  }
+
+  return SUCCESS;
+}
+
+bool
+reserve_record(journal_t* const journal, const size_t length)
+{
+  if (journal->error != SUCCESS) {
+    return false;
+  }
+
+  if (journal->used + length > journal->capacity) {
+    const size_t wanted = max(2 * journal->capacity, 4096);
+    const size_t new_capacity = max(wanted, journal->used + length);
+    char* const new_pending = realloc(journal->pending, new_capacity);
+    if (!new_pending) {
+      journal->error = ALLOC_ERROR;
+      return false;
+    }
+    journal->pending = new_pending;
+    journal->capacity = new_capacity;
+  }
+
+  return true;
+}
+
+void
+put_number(journal_t* const journal, uint64_t value)
+{
+  while (value >= 0x80) {
+    journal->pending[journal->used++] = (char)(value | 0x80);
+    value >>= 7;
+  }
+  journal->pending[journal->used++] = (char)value;
+}
+
+bool
+get_number(const char** const data, const char* const end, size_t* const value)
+{
+  uint64_t result = 0;
+
+  for (unsigned shift = 0; *data < end && shift < 64; shift += 7) {
+    const unsigned char byte = *(*data)++;
+    result |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+
+#include <line_map.h>
+#include <utf8.h>
+
+// The number of entries a map starts with
+static const size_t initial_map_capacity = 64;
+
+// How many bytes past the character asked about a map is built
+static const size_t map_chunk_size = 4096;
+
+/*
+ * The state of a line being decoded, a segment at a time.
+ */
+typedef struct line_decode_t
+{
+  line_map_t* map;
+  size_t tab_width;
+  utf8_decoder_t decoder;
+  bool failed;
+
+  // Where the next character starts, and the screen column it starts at
+  size_t offset;
+  size_t width;
+
+  // Where the last tab decoded ends
+  size_t tab_end;
+
+  // The bytes of the line to pass over before decoding, and the offset
+  // and screen column which, once a character starts past both, stop
+  // the decoding
+  size_t skip;
+  size_t stop_offset;
+  size_t stop_column;
+  bool stopped;
+} line_decode_t;
+
+/*
+ * Make sure the map is of the line at iter as it is now, starting it
+ * afresh if not. Returns false if it can not be, for want of memory.
+ */
+bool
+update_line_map(line_map_t* const map, const buffer_iter_t* const iter);
+
+/*
+ * Make sure the map covers the character at offset, and those before
+ * screen_column, building it a chunk further if not. Returns false if
+ * it can not, for want of memory.
+ */
+bool
+map_line_up_to(line_map_t* const map,
+               const buffer_iter_t* const iter,
+               const size_t offset,
+               const size_t screen_column);
+
+/*
+ * Append an entry to the map.
+ */
+bool
+add_map_entry(line_map_t* const map, const size_t offset, const size_t column);
+
+/*
+ * Account for the characters decoded, adding them to the map if there
+ * is one, until one starts past both the stop offset and column.
+ */
+void
+add_decoded_chars(line_decode_t* const decode,
+                  const utf8_char_t* const decoded,
+                  const size_t count);
+
+/*
+ * Segment visitor decoding part of a line.
+ */
+bool
+decode_segment(const char* const data, const size_t length, void* const context);
+
+/*
+ * Find the entry for the character covering offset.
+ */
+size_t
+find_offset_entry(line_map_t* const map, const size_t offset);
+
+void
+init_line_map(line_map_t* const map)
+{
+  *map = (line_map_t){ .tab_width = DEFAULT_TAB_WIDTH };
+}
+
+void
+destroy_line_map(line_map_t* const map)
+{
+  free(map->offsets);
+  free(map->columns);
+  init_line_map(map);
+}
+
+void
+set_line_map_tab_width(line_map_t* const map, const size_t tab_width)
+{
+  map->tab_width = tab_width;
+  map->valid = false;
+}
+
+size_t
+screen_column(line_map_t* const map, const buffer_iter_t* const iter)
+{
+  if (!map_line_up_to(map, iter, column(iter), 0)) {
+    return column(iter);
+  }
+
+  return map->columns[find_offset_entry(map, column(iter))];
+}
+
+size_t
+next_char_column(line_map_t* const map,
+                 const buffer_iter_t* const iter,
+                 const size_t count)
+{
+  // A line has no more characters than bytes, which keeps the columns
+  // worked out below from overflowing
+  const size_t room = chars_in_line(iter) - column(iter);
+  const size_t steps = min(count, room);
+
+  // Each character takes a byte at least, so the map is first built as
+  // far as steps bytes on, then on until it holds steps more entries
+  if (!map_line_up_to(map, iter, column(iter) + steps, 0)) {
+    return column(iter) + steps;
+  }
+  const size_t entry = find_offset_entry(map, column(iter));
+  while (!map->complete && map->count - 1 - entry <= steps) {
+    if (!map_line_up_to(map, iter, map->offsets[map->count - 1], 0)) {
+      return column(iter) + steps;
+    }
+  }
+
+  const size_t last = map->count - 1 - entry;
+  const size_t moved = min(steps, last);
+  map->hint = entry + moved;
+  return map->offsets[map->hint];
+}
+
+size_t
+previous_char_column(line_map_t* const map,
+                     const buffer_iter_t* const iter,
+                     const size_t count)
+{
+  if (!map_line_up_to(map, iter, column(iter), 0)) {
+    const size_t steps = min(count, column(iter));
+    return column(iter) - steps;
+  }
+
+  // A column part way through a character moves to its start first
+  const size_t entry = find_offset_entry(map, column(iter));
+  const size_t steps =
+    map->offsets[entry] == column(iter) ? count : count - 1;
+  const size_t moved = min(steps, entry);
+  map->hint = entry - moved;
+  return map->offsets[map->hint];
+}
+
+size_t
+column_at_screen_column(line_map_t* const map,
+                        const buffer_iter_t* const iter,
+                        const size_t screen_column)
+{
+  if (!map_line_up_to(map, iter, 0, screen_column + 1)) {
+    return min(screen_column, chars_in_line(iter));
+  }
+
+  size_t low = 0;
+  size_t high = map->count;
+
+  // Find the last character starting at or before screen_column
+  while (high - low > 1) {
+    const size_t middle = low + (high - low) / 2;
+    if (map->columns[middle] <= screen_column) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  map->hint = low;
+  return map->offsets[low];
+}
+
+size_t
+line_width(const buffer_iter_t* const iter, const size_t tab_width)
+{
+  line_decode_t decode = { .tab_width = tab_width };
+  utf8_char_t decoded[2];
+
+  visit_line(iter, decode_segment, &decode);
+  add_decoded_chars(&decode, decoded, finish_utf8(&decode.decoder, decoded));
+
+  return decode.width;
+}
+
+void
+edit_line_map(line_map_t* const map,
+              const buffer_iter_t* const iter,
+              const size_t version,
+              const size_t column,
+              const size_t removed,
+              const size_t inserted)
+{
+  if (!map->valid || map->line != line_number(iter) ||
+      map->version != version) {
+    map->valid = false;
+    return;
+  }
+
+  // The width of the line moves by as much as the edited text's does,
+  // when the edit ends where a character mapped starts and no tab
+  // after it moves to a different stop
+  const size_t old_end = column + removed;
+  const size_t old_entry = find_offset_entry(map, old_end);
+  const bool measured =
+    map->width_known && map->offsets[old_entry] == old_end;
+  const size_t old_end_column = map->columns[old_entry];
+  const bool tabs_after = map->tab_end > old_end;
+
+  if (tabs_after) {
+    map->tab_end = map->tab_end - removed + inserted;
+  } else if (map->tab_end > column) {
+    map->tab_end = column;
+  }
+
+  // Keep the characters before the one ahead of the edit, which the
+  // text inserted may join on to
+  const size_t kept = column > 0 ? find_offset_entry(map, column - 1) : 0;
+  map->count = kept + 1;
+  map->hint = kept;
+  map->complete = false;
+  map->version = buffer_version(iter);
+
+  const size_t new_end = column + inserted;
+  if (!measured || !map_line_up_to(map, iter, new_end, 0)) {
+    map->width_known = false;
+    return;
+  }
+
+  const size_t new_entry = find_offset_entry(map, new_end);
+  const size_t new_end_column = map->columns[new_entry];
+  const size_t moved = new_end_column > old_end_column
+                         ? new_end_column - old_end_column
+                         : old_end_column - new_end_column;
+  if (map->offsets[new_entry] != new_end ||
+      (tabs_after && moved % map->tab_width != 0)) {
+    map->width_known = false;
+    return;
+  }
+
+  map->width = map->width - old_end_column + new_end_column;
+}
+
+size_t
+mapped_line_width(line_map_t* const map, const buffer_iter_t* const iter)
+{
+  if (!map->valid || map->line != line_number(iter) ||
+      map->version != buffer_version(iter)) {
+    return line_width(iter, map->tab_width);
+  }
+
+  if (!map->width_known) {
+    line_decode_t decode = { .tab_width = map->tab_width };
+    utf8_char_t decoded[2];
+
+    visit_line(iter, decode_segment, &decode);
+    add_decoded_chars(
+      &decode, decoded, finish_utf8(&decode.decoder, decoded));
+
+    map->width_known = true;
+    map->width = decode.width;
+    map->tab_end = decode.tab_end;
+  }
+
+  return map->width;
+}
+
+size_t
+char_display_width(const uint32_t codepoint,
+                   const size_t screen_column,
+                   const size_t tab_width)
+{
+  if (codepoint == '\t') {
+    return tab_width - screen_column % tab_width;
+  }
+
+  return codepoint_width(codepoint);
+}
+
+bool
+update_line_map(line_map_t* const map, const buffer_iter_t* const iter)
+{
+  const size_t line = line_number(iter);
+  const size_t version = buffer_version(iter);
+
+  if (map->valid && map->line == line && map->version == version) {
+    return true;
+  }
+
+  // Mapping starts from the beginning of the line
+  map->count = 0;
+  map->hint = 0;
+  map->complete = false;
+  map->width_known = false;
+  map->valid = add_map_entry(map, 0, 0);
+  map->line = line;
+  map->version = version;
+
+  return map->valid;
+}
+
+bool
+map_line_up_to(line_map_t* const map,
+               const buffer_iter_t* const iter,
+               const size_t offset,
+               const size_t screen_column)
+{
+  if (!update_line_map(map, iter)) {
+    return false;
+  }
+
+  const size_t last = map->count - 1;
+  if (map->complete ||
+      (map->offsets[last] > offset && map->columns[last] >= screen_column)) {
+    return true;
+  }
+
+  // Carry on from the last entry, whose character may have marks after
+  // it not yet seen
+  map->count = last;
+  map->hint = min(map->hint, last);
+  line_decode_t decode = { .map = map,
+                           .tab_width = map->tab_width,
+                           .offset = map->offsets[last],
+                           .width = map->columns[last],
+                           .skip = map->offsets[last],
+                           .stop_offset = offset + map_chunk_size,
+                           .stop_column = screen_column };
+  utf8_char_t decoded[2];
+
+  visit_line(iter, decode_segment, &decode);
+  if (!decode.stopped) {
+    add_decoded_chars(
+      &decode, decoded, finish_utf8(&decode.decoder, decoded));
+  }
+
+  if (decode.failed ||
+      (!decode.stopped && !add_map_entry(map, decode.offset, decode.width))) {
+    map->valid = false;
+    return false;
+  }
+
+  map->complete = !decode.stopped;
+  if (map->width_known && decode.tab_end > map->tab_end) {
+    map->tab_end = decode.tab_end;
+  }
+
+  return true;
+}
+
+bool
+add_map_entry(line_map_t* const map, const size_t offset, const size_t column)
+{
+  if (map->count == map->capacity) {
+    const size_t capacity =
+      map->capacity ? 2 * map->capacity : initial_map_capacity;
+    size_t* const offsets = realloc(map->offsets, sizeof(size_t) * capacity);
+    if (offsets) {
+      map->offsets = offsets;
+    }
+    size_t* const columns = realloc(map->columns, sizeof(size_t) * capacity);
+    if (columns) {
+      map->columns = columns;
+    }
+    if (!offsets || !columns) {
+      return false;
+    }
+    map->capacity = capacity;
+  }
+
+  map->offsets[map->count] = offset;
+  map->columns[map->count] = column;
+  map->count++;
+
+  return true;
+}
+
+void
+add_decoded_chars(line_decode_t* const decode,
+                  const utf8_char_t* const decoded,
+                  const size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    const size_t width = char_display_width(
+      decoded[i].codepoint, decode->width, decode->tab_width);
+
+    // Marks which take no room of their own join the character before
+    // them
+    const bool joins = width == 0 && decode->offset > 0;
+    if (decode->map && !joins && !decode->failed) {
+      if (!add_map_entry(decode->map, decode->offset, decode->width)) {
+        decode->failed = true;
+      } else if (decode->offset > decode->stop_offset &&
+                 decode->width >= decode->stop_column) {
+        // The character just added is where mapping carries on from
+        decode->stopped = true;
+        break;
+      }
+    }
+
+    if (decoded[i].codepoint == '\t') {
+      decode->tab_end = decode->offset + decoded[i].length;
+    }
+
+    decode->offset += decoded[i].length;
+    decode->width += width;
+  }
+}
+
+bool
+decode_segment(const char* const data, const size_t length, void* const context)
+{
+  line_decode_t* const decode = context;
+  utf8_char_t decoded[2];
+
+  if (decode->skip >= length) {
+    decode->skip -= length;
+    return true;
+  }
+
+  for (size_t i = decode->skip; i < length && !decode->stopped; i++) {
+    add_decoded_chars(
+      decode, decoded, decode_utf8_byte(&decode->decoder, data[i], decoded));
+  }
+  decode->skip = 0;
+
+  return !decode->failed && !decode->stopped;
+}
+
+size_t
+find_offset_entry(line_map_t* const map, const size_t offset)
+{
+  size_t entry = map->hint;
+
+  // Motion a character at a time looks up the entry last used or one
+  // next to it
+  if (entry + 1 < map->count && map->offsets[entry] <= offset &&
+      offset < map->offsets[entry + 1]) {
+    return entry;
+  }
+  if (entry + 2 < map->count && map->offsets[entry + 1] <= offset &&
+      offset < map->offsets[entry + 2]) {
+    map->hint = entry + 1;
+    return map->hint;
+  }
+  if (entry > 0 && entry < map->count && map->offsets[entry - 1] <= offset &&
+      offset < map->offsets[entry]) {
+    map->hint = entry - 1;
+    return map->hint;
+  }
+
+  size_t low = 0;
+  size_t high = map->count;
+
+  while (high - low > 1) {
+    const size_t middle = low + (high - low) / 2;
+    if (map->offsets[middle] <= offset) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+
+  map->hint = low;
+  return low;
+}
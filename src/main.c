@@ -1,60 +1,600 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <locale.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <buffer.h>
 #include <common.h>
 #include <files.h>
+#include <jobs.h>
 #include <mode.h>
 #include <render.h>
+#include <screen.h>
 #include <state.h>
+#include <stats.h>
+
+// How long to keep handling waiting input before drawing a frame
+const long long frame_budget = 16 * 1000 * 1000;
+// How often, in milliseconds, the screen is redrawn to show how a save
+// in the background is getting on
+const int save_poll_interval = 100;
+
+// In bracketed paste mode, terminals mark the start and end of pasted
+// text with these
+const char* const paste_start = "\x1b[200~";
+const char* const paste_end = "\x1b[201~";
+const size_t paste_marker_length = 6;
+// Pasted text is read this much at a time, and a paste whose end has
+// not arrived after paste_timeout milliseconds is taken as it is
+const size_t paste_read_size = 1 << 16;
+const int paste_timeout = 1000;
+
+// The most keys looked at when checking whether Escape has been
+// pressed, past which only the rest of a paste marker is read
+const size_t escape_lookahead = 16;
+
+// Input handed back to be read again, last in first out as with
+// ungetch, which is read before anything curses has. Curses only has
+// room to take back a few keys, and the text typed after a paste can be
+// more than that.
+event_t* held_events = NULL;
+size_t held_count = 0;
+size_t held_capacity = 0;
+const size_t initial_held_capacity = 64;
+
+/*
+ * Wait for an event, then handle it and any others already waiting,
+ * until the input runs dry or a frame's worth of time has passed, so a
+ * paste or fast key repeat is rendered once rather than once per key.
+ * While a save is running in the background, waiting gives up after
+ * save_poll_interval, so the screen can be redrawn, and while the
+ * journal has edits to sync it gives up in time to sync them.
+ */
+error_t
+handle_events(editor_state_t* const state);
+
+/*
+ * Handle a single event, or a whole paste if the event starts one.
+ */
+error_t
+handle_event(const event_t event, editor_state_t* const state);
+
+/*
+ * Read the next event, from the input handed back if there is any, or
+ * else from curses.
+ */
+event_t
+read_event(void);
+
+/*
+ * Hand an event back, to be read before any handed back already.
+ * Returns ALLOC_ERROR if there is no room to hold it.
+ */
+error_t
+unread_event(const event_t event);
+
+/*
+ * Hand events back, in order, to be read after any handed back already.
+ * Returns ALLOC_ERROR if there is no room to hold them.
+ */
+error_t
+queue_events(const event_t* const events, const size_t count);
+
+/*
+ * Make room to hold count more events.
+ */
+error_t
+reserve_held_events(const size_t count);
+
+/*
+ * Check whether the last of the input handed back is the start of a
+ * paste.
+ */
+bool
+holding_paste_start(void);
+
+/*
+ * Check whether the input waiting starts with marker, and take it from
+ * the input if so.
+ */
+bool
+read_marker(const char* const marker);
+
+/*
+ * Read pasted text up to the marker at its end, and paste it.
+ */
+error_t
+read_paste(editor_state_t* const state);
+
+/*
+ * Find the end of paste marker in data, or return NULL.
+ */
+char*
+find_paste_end(char* const data, const size_t length);
+
+/*
+ * Turn "\r\n" and lone '\r' into '\n', as terminals send pasted
+ * newlines as carriage returns. Returns the new length of text.
+ */
+size_t
+normalise_newlines(char* const text, const size_t length);
+
+/*
+ * Ask the terminal to mark pasted text, or to stop doing so.
+ */
+void
+set_bracketed_paste(const bool enabled);
+
+/*
+ * Check whether Escape has been pressed since the event loop last read
+ * input, for long operations to stop on. It is taken from the input,
+ * and the keys before it are left for the event loop, after any it has
+ * been handed back. An Escape with more input straight behind it
+ * starts a sequence such as a paste, and is left too.
+ */
+bool
+escape_pressed(void);
 
 /*
- * Takes an event and updates the editor state accordingly.
+ * Read the buffer from standard input, and then take input from the
+ * terminal instead.
  */
 error_t
-update(const event_t event, editor_state_t* const state);
+read_stdin_into_editor(editor_state_t* const state);
+
+/*
+ * Take the file to edit, the number of threads to use given with
+ * --jobs N, and the file to write statistics to on exit given with
+ * --stats FILE, from the command line.
+ */
+void
+parse_arguments(const int argc,
+                char* argv[],
+                const char** const filename,
+                size_t* const jobs,
+                const char** const stats_file);
 
 int
 main(int argc, char* argv[])
 {
-  const char* const filename = argc > 1 ? argv[1] : NULL;
+  const char* argument = NULL;
+  size_t jobs = default_jobs();
+  const char* stats_file = NULL;
+  parse_arguments(argc, argv, &argument, &jobs, &stats_file);
 
-  initscr();
-  noecho();
+  const bool from_stdin =
+    argument ? strcmp(argument, "-") == 0 : !isatty(STDIN_FILENO);
+  const char* const filename = from_stdin ? NULL : argument;
 
   editor_state_t* state = new_editor_state(filename);
 
   if (!state) {
-    endwin();
     return 1;
   }
+  state->interrupted = escape_pressed;
+  state->jobs = jobs;
+
+  // Load before starting curses, which takes over standard input
+  if (from_stdin && read_stdin_into_editor(state) != SUCCESS) {
+    return 1;
+  }
+
+  // A save cut short part way through patching the file is undone
+  // before the file is read, leaving it as its journal expects
+  bool undone = false;
+  if (filename && undo_unfinished_patch(filename, &undone) != SUCCESS) {
+    set_message(state, "Could not undo an unfinished save of %s", filename);
+  } else if (undone) {
+    set_message(state, "Undid an unfinished save of %s", filename);
+  }
+
+  if (filename &&
+      read_file_into_editor(state->point, filename, jobs, &state->origin) !=
+        SUCCESS) {
+    return 1;
+  }
+
+  // Edits left in the journal by a crash are replayed over the file
+  if (filename) {
+    size_t replayed = 0;
+    bool partial = false;
+    bool stale = false;
+    state->journal =
+      open_journal(state->point, filename, &replayed, &partial, &stale);
+    state->recovered = replayed > 0;
+    if (!state->journal) {
+      set_message(state, "Could not open a journal; edits are not recorded");
+    } else if (partial) {
+      set_message(state,
+                  "Recovered %zu edits; the rest of the journal did not "
+                  "apply and is in %s.journal.old",
+                  replayed,
+                  filename);
+    } else if (replayed > 0) {
+      set_message(state, "Recovered %zu edits from the journal", replayed);
+    } else if (stale) {
+      set_message(state,
+                  "Moved an out of date journal to %s.journal.old",
+                  filename);
+    }
+  }
 
-  if (filename && read_file_into_editor(state->point, filename) != SUCCESS) {
-    endwin();
+  // Curses only draws UTF-8 in a UTF-8 locale
+  setlocale(LC_ALL, "");
+  screen_t* const screen = new_curses_screen();
+  if (!screen) {
     return 1;
   }
+  set_bracketed_paste(true);
 
-  render_params_t render_params = { 0 };
+  render_params_t render_params = { .screen = screen };
 
   do {
+    check_background_save(state);
+    update_journal(state);
     update_render_params(&render_params);
     render(state, &render_params);
 
-    const event_t event = getch();
-
-    if (update(event, state) != SUCCESS) {
-      endwin();
+    if (handle_events(state) != SUCCESS) {
+      set_bracketed_paste(false);
+      screen->destroy(screen);
       exit(1);
     }
   } while (!should_quit(state));
 
-  endwin();
+  set_bracketed_paste(false);
+  screen->destroy(screen);
+  destroy_render_params(&render_params);
+  free(held_events);
+
+  if (stats_file) {
+    write_stats(state->point, stats_file);
+  }
   destroy_editor_state(state);
 
   return 0;
 }
 
 error_t
-update(const event_t event, editor_state_t* const state)
+handle_events(editor_state_t* const state)
+{
+  // While a save is running, stop waiting now and then to show how it
+  // is getting on, and stop in time to sync the journal
+  int wait = journal_sync_timeout(state->journal);
+  if (state->save && (wait < 0 || wait > save_poll_interval)) {
+    wait = save_poll_interval;
+  }
+  if (wait >= 0) {
+    timeout(wait);
+  } else {
+    nodelay(stdscr, FALSE);
+  }
+
+  // Lex ahead of the screen while waiting, and stop before the event
+  // can touch the buffer
+  resume_highlighting(state->highlighter, state->point);
+  event_t event = read_event();
+  pause_highlighting(state->highlighter);
+  if (event == ERR) {
+    return SUCCESS;
+  }
+  const long long deadline = monotonic_time() + frame_budget;
+
+  // Further reads only take what has already arrived
+  nodelay(stdscr, TRUE);
+
+  do {
+    const error_t ret = handle_event(event, state);
+    if (ret != SUCCESS) {
+      return ret;
+    }
+  } while (!should_quit(state) && monotonic_time() < deadline &&
+           (event = read_event()) != ERR);
+
+  return SUCCESS;
+}
+
+error_t
+handle_event(const event_t event, editor_state_t* const state)
+{
+  if (event == KEY_ESCAPE && read_marker(paste_start + 1)) {
+    return read_paste(state);
+  }
+
+  // The end of a paste which was given up on waiting for arrives on its
+  // own, and is not taken as keys
+  if (event == KEY_ESCAPE && read_marker(paste_end + 1)) {
+    return SUCCESS;
+  }
+
+  return update(event, state);
+}
+
+event_t
+read_event(void)
+{
+  return held_count > 0 ? held_events[--held_count] : getch();
+}
+
+error_t
+unread_event(const event_t event)
+{
+  if (reserve_held_events(1) != SUCCESS) {
+    return ALLOC_ERROR;
+  }
+
+  held_events[held_count++] = event;
+
+  return SUCCESS;
+}
+
+error_t
+queue_events(const event_t* const events, const size_t count)
+{
+  if (reserve_held_events(count) != SUCCESS) {
+    return ALLOC_ERROR;
+  }
+
+  // The next event to read is at the top, so these go underneath
+  memmove(held_events + count, held_events, sizeof(event_t) * held_count);
+  for (size_t i = 0; i < count; i++) {
+    held_events[count - 1 - i] = events[i];
+  }
+  held_count += count;
+
+  return SUCCESS;
+}
+
+bool
+holding_paste_start(void)
+{
+  if (held_count < paste_marker_length) {
+    return false;
+  }
+
+  // The last event to be read is at the bottom
+  for (size_t i = 0; i < paste_marker_length; i++) {
+    if (held_events[paste_marker_length - 1 - i] != paste_start[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+error_t
+reserve_held_events(const size_t count)
+{
+  size_t capacity = held_capacity;
+  while (held_count + count > capacity) {
+    capacity = capacity > 0 ? 2 * capacity : initial_held_capacity;
+  }
+  if (capacity == held_capacity) {
+    return SUCCESS;
+  }
+
+  event_t* const events = realloc(held_events, sizeof(event_t) * capacity);
+  if (!events) {
+    return ALLOC_ERROR;
+  }
+  held_events = events;
+  held_capacity = capacity;
+
+  return SUCCESS;
+}
+
+bool
+read_marker(const char* const marker)
+{
+  const size_t length = strlen(marker);
+  event_t read[length];
+  size_t matched = 0;
+
+  for (; matched < length; matched++) {
+    read[matched] = read_event();
+    if (read[matched] != marker[matched]) {
+      break;
+    }
+  }
+
+  if (matched == length) {
+    return true;
+  }
+
+  // Hand back what was read, last first, to be read again in order
+  for (size_t i = matched + 1; i > 0; i--) {
+    if (read[i - 1] != ERR && unread_event(read[i - 1]) != SUCCESS) {
+      break;
+    }
+  }
+
+  return false;
+}
+
+error_t
+read_paste(editor_state_t* const state)
+{
+  // Curses reads a byte at a time, so the rest of the paste is still
+  // waiting, and is read in bulk
+  size_t capacity = 0;
+  size_t used = 0;
+  char* text = NULL;
+  char* end = NULL;
+
+  while (!end) {
+    if (used + paste_read_size > capacity) {
+      capacity = 2 * capacity + paste_read_size;
+      char* const new_text = realloc(text, capacity);
+      if (!new_text) {
+        free(text);
+        return ALLOC_ERROR;
+      }
+      text = new_text;
+    }
+
+    struct pollfd input = { .fd = fileno(stdin), .events = POLLIN };
+    const ssize_t count = poll(&input, 1, paste_timeout) > 0
+                            ? read(input.fd, text + used, paste_read_size)
+                            : 0;
+    if (count <= 0) {
+      break;
+    }
+
+    // The marker can be split between reads
+    const size_t from =
+      used > paste_marker_length ? used - paste_marker_length : 0;
+    used += count;
+    end = find_paste_end(text + from, used - from);
+  }
+
+  // Anything typed after the paste is handed back to the event loop,
+  // with carriage returns turned into newlines as curses does
+  const size_t length = end ? (size_t)(end - text) : used;
+  for (char* c = text + used; end && c > end + paste_marker_length;) {
+    const unsigned char key = *--c;
+    if (unread_event(key == '\r' ? '\n' : key) != SUCCESS) {
+      free(text);
+      return ALLOC_ERROR;
+    }
+  }
+
+  const error_t ret =
+    paste_text(state, text, normalise_newlines(text, length));
+  free(text);
+
+  return ret;
+}
+
+char*
+find_paste_end(char* const data, const size_t length)
+{
+  char* const limit = data + length;
+
+  for (char* c = data; (c = memchr(c, paste_end[0], limit - c)); c++) {
+    if ((size_t)(limit - c) >= paste_marker_length &&
+        memcmp(c, paste_end, paste_marker_length) == 0) {
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+size_t
+normalise_newlines(char* const text, const size_t length)
+{
+  size_t used = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    if (text[i] == '\r') {
+      text[used++] = '\n';
+      if (i + 1 < length && text[i + 1] == '\n') {
+        i++;
+      }
+    } else {
+      text[used++] = text[i];
+    }
+  }
+
+  return used;
+}
+
+void
+set_bracketed_paste(const bool enabled)
+{
+  fputs(enabled ? "\x1b[?2004h" : "\x1b[?2004l", stdout);
+  fflush(stdout);
+}
+
+bool
+escape_pressed(void)
+{
+  event_t waiting[escape_lookahead + paste_marker_length];
+  size_t count = 0;
+  bool found = false;
+
+  // The text of a paste whose start has been read is left waiting
+  if (holding_paste_start()) {
+    return false;
+  }
+
+  // Input handed back has been seen by the event loop already, so only
+  // what has arrived since is read, straight from curses. matched
+  // counts the bytes of a paste marker which end what has been read
+  nodelay(stdscr, TRUE);
+  for (size_t matched = 0; count < escape_lookahead || matched > 0;) {
+    const event_t event = getch();
+    if (event == ERR) {
+      // The rest of a sequence arrives with its Escape, so one with
+      // nothing behind it was pressed on its own
+      found = matched == 1;
+      count -= found;
+      break;
+    }
+
+    waiting[count++] = event;
+    if (event == paste_start[matched]) {
+      matched++;
+    } else {
+      matched = event == KEY_ESCAPE;
+    }
+
+    // The pasted text is left waiting, for read_paste to read in bulk
+    // once the event loop reaches its start
+    if (matched == paste_marker_length) {
+      break;
+    }
+  }
+
+  queue_events(waiting, count);
+
+  return found;
+}
+
+error_t
+read_stdin_into_editor(editor_state_t* const state)
+{
+  const long long start = monotonic_time();
+  const error_t ret = read_stream_into_editor(state->point, STDIN_FILENO);
+  record_time(TIMED_LOAD, start);
+
+  if (ret == SUCCESS && !freopen("/dev/tty", "r", stdin)) {
+    return READ_ERROR;
+  }
+
+  return ret;
+}
+
+void
+parse_arguments(const int argc,
+                char* argv[],
+                const char** const filename,
+                size_t* const jobs,
+                const char** const stats_file)
 {
-  return (state->mode->handler)(event, state);
+  for (int i = 1; i < argc; i++) {
+    const char* count = NULL;
+    if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+      count = argv[++i];
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      count = argv[i] + 7;
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      *stats_file = argv[++i];
+      continue;
+    } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+      *stats_file = argv[i] + 8;
+      continue;
+    } else {
+      *filename = argv[i];
+      continue;
+    }
+
+    const size_t requested = strtoul(count, NULL, 10);
+    *jobs = requested > 0 ? requested : 1;
+  }
 }
@@ -0,0 +1,482 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common.h>
+#include <screen.h>
+#include <utf8.h>
+
+// The bytes a cell holds: a character and the combining marks after it
+#define CELL_TEXT_SIZE 16
+
+// Curses draws tabs to stops this far apart
+static const size_t curses_tab_width = 8;
+
+// The bytes of the sequences an ANSI terminal is sent to clear the
+// rest of a row, and to set a style; moving the cursor takes more the
+// further down and across it goes
+static const size_t clear_sequence_length = 3;
+static const size_t plain_style_sequence_length = 4;
+static const size_t style_sequence_length = 8;
+
+/*
+ * A cell of a memory screen. The second cell of a wide character holds
+ * no text of its own.
+ */
+typedef struct screen_cell_t
+{
+  char text[CELL_TEXT_SIZE];
+  uint8_t length;
+  uint8_t style;
+} screen_cell_t;
+
+typedef struct memory_screen_t
+{
+  // The operations come first, so a screen_t* is a memory_screen_t*
+  screen_t screen;
+
+  size_t height;
+  size_t width;
+
+  // The cells as drawn, and as shown when the screen was last
+  // refreshed
+  screen_cell_t* cells;
+  screen_cell_t* shown;
+
+  // Where drawing has reached, and whether it has run off the bottom of
+  // the screen. A character cut across calls to add_text is kept in the
+  // decoder.
+  size_t row;
+  size_t column;
+  bool full;
+  uint8_t style;
+  utf8_decoder_t decoder;
+
+  // Where the terminal's cursor, and its style, would be after the
+  // last refresh
+  size_t shown_row;
+  size_t shown_column;
+  uint8_t shown_style;
+
+  screen_stats_t stats;
+} memory_screen_t;
+
+static const screen_cell_t blank_cell = { .text = " ", .length = 1 };
+
+/*
+ * Screen operations.
+ */
+void
+memory_screen_size(screen_t* const screen,
+                   size_t* const height,
+                   size_t* const width);
+void
+memory_screen_erase(screen_t* const screen);
+void
+memory_screen_move(screen_t* const screen,
+                   const size_t row,
+                   const size_t column);
+void
+memory_screen_clear_to_eol(screen_t* const screen);
+void
+memory_screen_add_text(screen_t* const screen,
+                       const char* const text,
+                       const size_t length);
+void
+memory_screen_set_style(screen_t* const screen, const size_t style);
+void
+memory_screen_refresh(screen_t* const screen);
+void
+memory_screen_destroy(screen_t* const screen);
+
+/*
+ * Draw a character, taking width cells, at the cursor and move past
+ * it, wrapping onto the next row as curses does.
+ */
+void
+put_cell(memory_screen_t* const screen,
+         const char* const text,
+         const size_t length,
+         const size_t width);
+
+/*
+ * Add a combining mark to the character before the cursor.
+ */
+void
+add_to_last_cell(memory_screen_t* const screen,
+                 const char* const text,
+                 const size_t length);
+
+/*
+ * Draw a decoded character as curses would: tabs as blanks up to the
+ * next tab stop, and control characters as ^X.
+ */
+void
+put_char(memory_screen_t* const screen, const uint32_t codepoint);
+
+/*
+ * Count the bytes a terminal would be sent to move its cursor from
+ * where the last refresh left it to row and column.
+ */
+void
+emit_move(memory_screen_t* const screen, const size_t row, const size_t column);
+
+/*
+ * Count the bytes a terminal would be sent to switch to style.
+ */
+void
+emit_style(memory_screen_t* const screen, const uint8_t style);
+
+bool
+same_cell(const screen_cell_t* const a, const screen_cell_t* const b);
+
+screen_t*
+new_memory_screen(const size_t height, const size_t width)
+{
+  memory_screen_t* const screen = calloc(1, sizeof(memory_screen_t));
+  if (!screen) {
+    return NULL;
+  }
+
+  const size_t cells = max(height * width, 1);
+  screen->cells = malloc(cells * sizeof(screen_cell_t));
+  screen->shown = malloc(cells * sizeof(screen_cell_t));
+  if (!screen->cells || !screen->shown) {
+    free(screen->cells);
+    free(screen->shown);
+    free(screen);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < cells; i++) {
+    screen->cells[i] = blank_cell;
+    screen->shown[i] = blank_cell;
+  }
+
+  screen->screen = (screen_t){ .name = "memory",
+                               .size = memory_screen_size,
+                               .erase = memory_screen_erase,
+                               .move = memory_screen_move,
+                               .clear_to_eol = memory_screen_clear_to_eol,
+                               .add_text = memory_screen_add_text,
+                               .set_style = memory_screen_set_style,
+                               .refresh = memory_screen_refresh,
+                               .destroy = memory_screen_destroy };
+  screen->height = height;
+  screen->width = width;
+
+  return &screen->screen;
+}
+
+const screen_stats_t*
+memory_screen_stats(const screen_t* const screen)
+{
+  return &((const memory_screen_t*)screen)->stats;
+}
+
+void
+memory_screen_row(const screen_t* const screen,
+                  const size_t row,
+                  char* const text,
+                  const size_t size)
+{
+  const memory_screen_t* const memory = (const memory_screen_t*)screen;
+  size_t used = 0;
+  size_t end = 0;
+
+  for (size_t column = 0; row < memory->height && column < memory->width;
+       column++) {
+    const screen_cell_t* const cell =
+      &memory->shown[row * memory->width + column];
+    if (used + cell->length >= size) {
+      break;
+    }
+
+    memcpy(text + used, cell->text, cell->length);
+    used += cell->length;
+    if (!same_cell(cell, &blank_cell)) {
+      end = used;
+    }
+  }
+
+  if (size > 0) {
+    text[end] = '\0';
+  }
+}
+
+void
+memory_screen_size(screen_t* const screen,
+                   size_t* const height,
+                   size_t* const width)
+{
+  const memory_screen_t* const memory = (const memory_screen_t*)screen;
+  *height = memory->height;
+  *width = memory->width;
+}
+
+void
+memory_screen_erase(screen_t* const screen)
+{
+  memory_screen_t* const memory = (memory_screen_t*)screen;
+
+  for (size_t i = 0; i < memory->height * memory->width; i++) {
+    memory->cells[i] = blank_cell;
+  }
+  memory->stats.cells_cleared += memory->height * memory->width;
+  memory_screen_move(screen, 0, 0);
+}
+
+void
+memory_screen_move(screen_t* const screen,
+                   const size_t row,
+                   const size_t column)
+{
+  memory_screen_t* const memory = (memory_screen_t*)screen;
+
+  // Curses refuses to move off the screen
+  if (row >= memory->height || column >= memory->width) {
+    return;
+  }
+
+  memory->row = row;
+  memory->column = column;
+  memory->full = false;
+  memory->decoder = (utf8_decoder_t){ 0 };
+}
+
+void
+memory_screen_clear_to_eol(screen_t* const screen)
+{
+  memory_screen_t* const memory = (memory_screen_t*)screen;
+  if (memory->full || memory->row >= memory->height) {
+    return;
+  }
+
+  screen_cell_t* const row = &memory->cells[memory->row * memory->width];
+  for (size_t column = memory->column; column < memory->width; column++) {
+    row[column] = blank_cell;
+  }
+  memory->stats.cells_cleared += memory->width - memory->column;
+}
+
+void
+memory_screen_add_text(screen_t* const screen,
+                       const char* const text,
+                       const size_t length)
+{
+  memory_screen_t* const memory = (memory_screen_t*)screen;
+  utf8_char_t decoded[2];
+
+  for (size_t i = 0; i < length && !memory->full; i++) {
+    const size_t chars = decode_utf8_byte(&memory->decoder, text[i], decoded);
+    for (size_t j = 0; j < chars; j++) {
+      put_char(memory, decoded[j].codepoint);
+    }
+  }
+}
+
+void
+memory_screen_set_style(screen_t* const screen, const size_t style)
+{
+  ((memory_screen_t*)screen)->style = style;
+}
+
+void
+memory_screen_refresh(screen_t* const screen)
+{
+  memory_screen_t* const memory = (memory_screen_t*)screen;
+
+  // As curses does, send only the cells which have changed since the
+  // last refresh
+  for (size_t row = 0; row < memory->height; row++) {
+    const screen_cell_t* const cells = &memory->cells[row * memory->width];
+    const screen_cell_t* const shown = &memory->shown[row * memory->width];
+
+    // Past the last cell with text, a row is cleared rather than
+    // written out
+    size_t end = memory->width;
+    while (end > 0 && same_cell(&cells[end - 1], &blank_cell)) {
+      end--;
+    }
+
+    for (size_t column = 0; column < memory->width; column++) {
+      if (same_cell(&cells[column], &shown[column])) {
+        continue;
+      }
+
+      if (column >= end) {
+        emit_move(memory, row, column);
+        emit_style(memory, HIGHLIGHT_NONE);
+        memory->stats.bytes += clear_sequence_length;
+        for (; column < memory->width; column++) {
+          memory->stats.cells_changed +=
+            !same_cell(&cells[column], &shown[column]);
+        }
+        break;
+      }
+
+      memory->stats.cells_changed++;
+
+      // The second cell of a wide character is sent with the first
+      if (cells[column].length == 0) {
+        continue;
+      }
+
+      emit_move(memory, row, column);
+      emit_style(memory, cells[column].style);
+      memory->stats.bytes += cells[column].length;
+
+      // A terminal leaves its cursor past a character, or at the edge
+      // of the screen after the last column, where it is not to be
+      // relied on
+      const bool wide =
+        column + 1 < memory->width && cells[column + 1].length == 0;
+      memory->shown_column = column + (wide ? 2 : 1);
+    }
+  }
+
+  emit_move(memory, memory->row, memory->column);
+  memcpy(memory->shown,
+         memory->cells,
+         memory->height * memory->width * sizeof(screen_cell_t));
+  memory->stats.frames++;
+}
+
+void
+memory_screen_destroy(screen_t* const screen)
+{
+  memory_screen_t* const memory = (memory_screen_t*)screen;
+  free(memory->cells);
+  free(memory->shown);
+  free(memory);
+}
+
+void
+put_char(memory_screen_t* const screen, const uint32_t codepoint)
+{
+  if (codepoint == '\t') {
+    do {
+      put_cell(screen, " ", 1, 1);
+    } while (!screen->full && screen->column % curses_tab_width != 0);
+    return;
+  }
+
+  if (codepoint < 0x20 || codepoint == 0x7F) {
+    const char control[2] = { '^', codepoint == 0x7F ? '?' : codepoint + '@' };
+    put_cell(screen, control, 1, 1);
+    put_cell(screen, control + 1, 1, 1);
+    return;
+  }
+
+  char text[4];
+  const size_t length = encode_utf8(codepoint, text);
+  const size_t width = codepoint_width(codepoint);
+
+  if (width == 0) {
+    add_to_last_cell(screen, text, length);
+  } else {
+    put_cell(screen, text, length, width);
+  }
+}
+
+void
+put_cell(memory_screen_t* const screen,
+         const char* const text,
+         const size_t length,
+         const size_t width)
+{
+  if (screen->full) {
+    return;
+  }
+
+  // A wide character does not split across rows; the row is filled
+  // with a blank and it goes on the next one
+  if (width > 1 && screen->column + width > screen->width) {
+    put_cell(screen, " ", 1, 1);
+    if (screen->full || width > screen->width) {
+      return;
+    }
+  }
+
+  screen_cell_t* const cell =
+    &screen->cells[screen->row * screen->width + screen->column];
+  memcpy(cell->text, text, length);
+  cell->length = length;
+  cell->style = screen->style;
+  for (size_t i = 1; i < width; i++) {
+    cell[i] = (screen_cell_t){ .style = screen->style };
+  }
+  screen->stats.cells_written += width;
+
+  screen->column += width;
+  if (screen->column < screen->width) {
+    return;
+  }
+
+  // Curses does not scroll the screen, so drawing stops at its end
+  if (screen->row + 1 < screen->height) {
+    screen->row++;
+    screen->column = 0;
+  } else {
+    screen->column = screen->width - 1;
+    screen->full = true;
+  }
+}
+
+void
+add_to_last_cell(memory_screen_t* const screen,
+                 const char* const text,
+                 const size_t length)
+{
+  size_t i = screen->row * screen->width + screen->column;
+  if (screen->full) {
+    i++;
+  }
+
+  // Step back over the second cell of a wide character
+  while (i > 0 && screen->cells[i - 1].length == 0) {
+    i--;
+  }
+  if (i == 0) {
+    return;
+  }
+
+  screen_cell_t* const cell = &screen->cells[i - 1];
+  if (cell->length + length <= CELL_TEXT_SIZE) {
+    memcpy(cell->text + cell->length, text, length);
+    cell->length += length;
+  }
+}
+
+void
+emit_move(memory_screen_t* const screen, const size_t row, const size_t column)
+{
+  if (row == screen->shown_row && column == screen->shown_column) {
+    return;
+  }
+
+  // ESC [ row ; column H, counting from 1
+  screen->stats.bytes +=
+    snprintf(NULL, 0, "\x1b[%zu;%zuH", row + 1, column + 1);
+  screen->shown_row = row;
+  screen->shown_column = column;
+}
+
+void
+emit_style(memory_screen_t* const screen, const uint8_t style)
+{
+  if (style == screen->shown_style) {
+    return;
+  }
+
+  screen->stats.bytes += style == HIGHLIGHT_NONE ? plain_style_sequence_length
+                                                 : style_sequence_length;
+  screen->shown_style = style;
+}
+
+bool
+same_cell(const screen_cell_t* const a, const screen_cell_t* const b)
+{
+  return a->length == b->length && a->style == b->style &&
+         memcmp(a->text, b->text, a->length) == 0;
+}
@@ -1,3 +1,5 @@
+#include <stdint.h>
+
 #include <mode.h>
 #include <state.h>
 
@@ -6,25 +8,71 @@ normal_mode_handler(event_t event, struct editor_state_t* const state)
 {
   error_t ret = SUCCESS;
 
+  // Digits build up a count for the next command; 0 can not start one.
+  // A count too large to hold stays at the largest there is, which is
+  // past the end of any line or buffer.
+  if (event >= '0' && event <= '9' && (event != '0' || state->count > 0)) {
+    const size_t digit = event - '0';
+    state->count = state->count <= (SIZE_MAX - digit) / 10
+                     ? 10 * state->count + digit
+                     : SIZE_MAX;
+    return ret;
+  }
+
+  const bool counted = state->count > 0;
+  const size_t count = counted ? state->count : 1;
+  const size_t line = line_number(state->point);
+  const event_t pending = state->pending;
+  state->count = 0;
+  state->pending = 0;
+
   switch (event) {
     case 'i':
       switch_mode(state, INSERT);
       break;
     case ':':
-      ret = insert_character_at_point(state->command_buffer, ':');
+    case '/':
+    case '?':
+      ret = insert_character_at_point(state->command_buffer, event);
       switch_mode(state, COMMAND);
       break;
+    case 'n':
+    case 'N':
+      repeat_search(state, event == 'N', count);
+      break;
     case 'h':
-      move_iter_back_char(state->point);
+      move_cursor_left(state, count);
       break;
     case 'j':
-      move_cursor_down(state);
+      if (counted) {
+        move_cursor_to_line(state,
+                            count < SIZE_MAX - line ? line + count : SIZE_MAX);
+      } else {
+        move_cursor_down(state);
+      }
       break;
     case 'k':
-      move_cursor_up(state);
+      if (counted) {
+        const size_t up = min(count, line);
+        move_cursor_to_line(state, line - up);
+      } else {
+        move_cursor_up(state);
+      }
       break;
     case 'l':
-      move_iter_forward_char(state->point);
+      move_cursor_right(state, count);
+      break;
+    case 'G':
+      // Lines are numbered from 1, and G on its own goes to the last
+      move_cursor_to_line(state, counted ? count - 1 : SIZE_MAX);
+      break;
+    case 'd':
+      if (pending == 'd') {
+        delete_lines(state, count);
+      } else {
+        state->pending = 'd';
+        state->count = counted ? count : 0;
+      }
       break;
     case 'o':
       ret = open_line(state);
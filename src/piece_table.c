@@ -0,0 +1,1346 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <arena.h>
+#include <buffer.h>
+#include <damage.h>
+#include <jobs.h>
+
+/*****************************************************************************
+ * piece_table.c
+ *
+ * An alternative implementation of buffer.h, selected at build time with
+ * make BUFFER=piece_table.
+ *
+ * The text of the buffer is the concatenation of a sequence of pieces,
+ * each of which refers to a span of one of two sources: the original
+ * file, which is never modified, and the add buffer, which edits are
+ * only ever appended to. Pieces are kept in a treap ordered by position,
+ * where every node records the bytes and newlines in its subtree, so
+ * locating an offset or a line is O(log n) in the number of pieces.
+ *
+ * Lines are separated by '\n', and as with the line list no newline is
+ * stored after the last line.
+ *
+ ****************************************************************************/
+
+// The add buffer starts this large, and doubles when it fills
+const size_t initial_add_length = 4096;
+// Pieces are allocated this many at a time
+const size_t pieces_per_slab_block = 256;
+// Each thread indexing the newlines of a mapped file takes at least
+// this many bytes of it
+const size_t min_index_range = 1 << 20;
+// Lines have no storage of their own to cache values in, so values are
+// cached in a table with this many slots, by line number
+#define LINE_CACHE_SLOTS 1024
+
+typedef enum source_kind_t
+{
+  ORIGINAL = 0,
+  ADD = 1
+} source_kind_t;
+
+typedef struct source_t
+{
+  char* data;
+  size_t used;
+  size_t length;
+
+  // Offsets of every newline in the source, in ascending order
+  size_t* newlines;
+  size_t newlines_used;
+  size_t newlines_length;
+} source_t;
+
+typedef struct line_cache_slot_t
+{
+  size_t line;
+  size_t key;
+  size_t value;
+} line_cache_slot_t;
+
+typedef struct piece_t piece_t;
+
+struct piece_t
+{
+  piece_t* left;
+  piece_t* right;
+  uint32_t priority;
+
+  source_kind_t source;
+  size_t start;
+  size_t length;
+  size_t newlines;
+
+  // Totals over the subtree rooted at this piece
+  size_t subtree_length;
+  size_t subtree_newlines;
+};
+
+typedef struct buffer_t
+{
+  source_t sources[2];
+  piece_t* root;
+  slab_t pieces;
+
+  // Calls made to realloc to grow the sources
+  size_t source_allocations;
+
+  // The number of snapshots held. While there are any the add buffer
+  // is copied rather than moved when it grows, and the blocks it
+  // leaves behind are freed when the last is released.
+  size_t snapshots;
+  char** retired;
+  size_t retired_count;
+  size_t retired_capacity;
+
+  // The file mapping owned by the buffer, if any
+  char* mapping;
+  size_t mapping_length;
+
+  // Lines which span several pieces are joined here
+  char* scratch;
+  size_t scratch_length;
+
+  uint32_t seed;
+
+  // Lines changed since damage was last taken
+  damage_t damage;
+
+  line_cache_slot_t line_cache[LINE_CACHE_SLOTS];
+} buffer_t;
+
+struct buffer_iter_t
+{
+  buffer_t* buffer;
+  size_t line;
+  size_t start;
+  size_t length;
+  size_t column;
+};
+
+// Source helper function declarations
+size_t
+lower_bound(const size_t* const values, const size_t count, const size_t v);
+
+size_t
+count_newlines(const source_t* const source,
+               const size_t start,
+               const size_t length);
+
+error_t
+append_to_add_source(buffer_t* const buffer,
+                     const char* const data,
+                     const size_t length);
+
+// Piece helper function declarations
+piece_t*
+new_piece(buffer_t* const buffer,
+          const source_kind_t source,
+          const size_t start,
+          const size_t length);
+
+void
+destroy_pieces(buffer_t* const buffer, piece_t* const piece);
+
+void
+update_piece(piece_t* const piece);
+
+size_t
+subtree_length(const piece_t* const piece);
+
+size_t
+subtree_newlines(const piece_t* const piece);
+
+void
+split_pieces(const buffer_t* const buffer,
+             piece_t* const piece,
+             const size_t offset,
+             piece_t** const left,
+             piece_t** const right,
+             piece_t** const spare);
+
+piece_t*
+merge_pieces(piece_t* const left, piece_t* const right);
+
+bool
+extend_last_piece(const buffer_t* const buffer,
+                  piece_t* const piece,
+                  const size_t add_start,
+                  const size_t length);
+
+// Text helper function declarations
+error_t
+insert_text(buffer_t* const buffer,
+            const size_t offset,
+            const char* const prefix,
+            const size_t prefix_length,
+            const char* const data,
+            const size_t length);
+
+error_t
+delete_text(buffer_t* const buffer, const size_t offset, const size_t length);
+
+bool
+visit_text(const buffer_t* const buffer,
+           const piece_t* const piece,
+           size_t base,
+           const size_t offset,
+           const size_t length,
+           segment_visitor_t* const visitor,
+           void* const context);
+
+bool
+copy_segment(const char* const data, const size_t length, void* const context);
+
+bool
+snapshot_segment(const char* const data,
+                 const size_t length,
+                 void* const context);
+
+char*
+grow_add_source(buffer_t* const buffer, const size_t new_length);
+
+void
+free_retired_sources(buffer_t* const buffer);
+
+/*
+ * A range of a mapped file whose newlines are counted, and then
+ * indexed, by a thread of its own.
+ */
+typedef struct newline_range_t
+{
+  const char* data;
+  size_t start;
+  size_t end;
+  size_t count;
+  size_t* newlines;
+} newline_range_t;
+
+void*
+count_range_newlines(void* const context);
+
+void*
+index_range_newlines(void* const context);
+
+char*
+join_text(buffer_t* const buffer, const size_t offset, const size_t length);
+
+size_t
+newline_offset(const buffer_t* const buffer, size_t k);
+
+void
+locate_line(buffer_iter_t* const iter);
+
+void
+damage_lines(buffer_t* const buffer,
+             const size_t first_line,
+             const size_t last_line);
+
+/*****************************************************************************/
+/* Buffer lifecycle                                                          */
+/*****************************************************************************/
+buffer_iter_t*
+new_buffer()
+{
+  buffer_iter_t* buffer = NULL;
+  buffer_t* shared = calloc(sizeof(buffer_t), 1);
+
+  if (shared) {
+    shared->seed = 2463534242u;
+    init_slab(&shared->pieces, sizeof(piece_t), pieces_per_slab_block);
+    buffer = calloc(sizeof(buffer_iter_t), 1);
+    if (buffer) {
+      buffer->buffer = shared;
+    } else {
+      free(shared);
+    }
+  }
+
+  return buffer;
+}
+
+void
+destroy_buffer(buffer_iter_t* buffer)
+{
+  if (!buffer) {
+    return;
+  }
+
+  buffer_t* const shared = buffer->buffer;
+  destroy_slab(&shared->pieces);
+  free(shared->sources[ORIGINAL].newlines);
+  free(shared->sources[ADD].newlines);
+  free(shared->sources[ADD].data);
+  free(shared->scratch);
+  free_retired_sources(shared);
+  if (shared->mapping) {
+    munmap(shared->mapping, shared->mapping_length);
+  }
+  free(shared);
+  free(buffer);
+}
+
+void
+destroy_buffer_iter(buffer_iter_t* buffer_iter)
+{
+  free(buffer_iter);
+}
+
+error_t
+copy_buffer_iter(const buffer_iter_t* const src, buffer_iter_t** const dst)
+{
+  buffer_iter_t* copy = malloc(sizeof(buffer_iter_t));
+  if (copy) {
+    *dst = copy;
+    *copy = *src;
+  }
+
+  return copy ? SUCCESS : ALLOC_ERROR;
+}
+
+error_t
+load_mapped_file(buffer_iter_t* const iter,
+                 char* const data,
+                 size_t length,
+                 const size_t jobs)
+{
+  buffer_t* const buffer = iter->buffer;
+
+  if (buffer->mapping || buffer->root) {
+    return READ_ERROR;
+  }
+
+  // As with the line list, the final newline only terminates the last
+  // line
+  const size_t text_length =
+    length > 0 && data[length - 1] == '\n' ? length - 1 : length;
+
+  // The newlines are counted and then indexed in ranges, each on a
+  // thread of its own
+  const size_t wanted = min(jobs, text_length / min_index_range);
+  const size_t range_count = max(wanted, 1);
+  newline_range_t* const ranges = calloc(range_count, sizeof(newline_range_t));
+  if (!ranges) {
+    return ALLOC_ERROR;
+  }
+
+  for (size_t i = 0; i < range_count; i++) {
+    ranges[i].data = data;
+    ranges[i].start = text_length / range_count * i;
+    ranges[i].end =
+      i + 1 == range_count ? text_length : text_length / range_count * (i + 1);
+  }
+  run_jobs(count_range_newlines, ranges, sizeof(newline_range_t), range_count);
+
+  size_t count = 0;
+  for (size_t i = 0; i < range_count; i++) {
+    count += ranges[i].count;
+  }
+
+  source_t* const original = &buffer->sources[ORIGINAL];
+  original->newlines = malloc(sizeof(size_t) * (count ? count : 1));
+  piece_t* const piece =
+    original->newlines ? new_piece(buffer, ORIGINAL, 0, text_length) : NULL;
+  if (!piece) {
+    free(original->newlines);
+    original->newlines = NULL;
+    free(ranges);
+    return ALLOC_ERROR;
+  }
+
+  size_t* newlines = original->newlines;
+  for (size_t i = 0; i < range_count; i++) {
+    ranges[i].newlines = newlines;
+    newlines += ranges[i].count;
+  }
+  run_jobs(index_range_newlines, ranges, sizeof(newline_range_t), range_count);
+  free(ranges);
+
+  original->newlines_used = count;
+  original->newlines_length = count;
+  original->data = data;
+  original->used = text_length;
+  original->length = text_length;
+
+  piece->newlines = count;
+  update_piece(piece);
+  buffer->root = piece;
+  buffer->mapping = data;
+  buffer->mapping_length = length;
+  damage_lines(buffer, 0, DAMAGE_TO_END);
+
+  locate_line(iter);
+
+  return SUCCESS;
+}
+
+/*
+ * The pieces themselves never have room to spare, so compacting only
+ * trims the add buffer and the scratch space.
+ */
+void
+compact_buffer(buffer_iter_t* const iter)
+{
+  buffer_t* const buffer = iter->buffer;
+  source_t* const add = &buffer->sources[ADD];
+
+  // Snapshots may point into the add buffer
+  if (add->used > 0 && add->used < add->length && buffer->snapshots == 0) {
+    char* const data = realloc(add->data, add->used);
+    if (data) {
+      add->data = data;
+      add->length = add->used;
+      buffer->source_allocations++;
+    }
+  }
+
+  if (add->newlines_used > 0 && add->newlines_used < add->newlines_length) {
+    size_t* const newlines =
+      realloc(add->newlines, sizeof(size_t) * add->newlines_used);
+    if (newlines) {
+      add->newlines = newlines;
+      add->newlines_length = add->newlines_used;
+      buffer->source_allocations++;
+    }
+  }
+
+  free(buffer->scratch);
+  buffer->scratch = NULL;
+  buffer->scratch_length = 0;
+}
+
+error_t
+take_buffer_snapshot(buffer_iter_t* const iter,
+                     buffer_snapshot_t* const snapshot)
+{
+  buffer_t* const buffer = iter->buffer;
+  *snapshot = (buffer_snapshot_t){ 0 };
+
+  // The sources are only ever appended to, so the pieces can be taken
+  // as they are
+  const bool added = visit_text(buffer,
+                                buffer->root,
+                                0,
+                                0,
+                                subtree_length(buffer->root),
+                                snapshot_segment,
+                                snapshot);
+  const error_t ret = added ? add_snapshot_newline(snapshot) : ALLOC_ERROR;
+
+  if (ret != SUCCESS) {
+    destroy_snapshot(snapshot);
+    return ret;
+  }
+
+  buffer->snapshots++;
+
+  return SUCCESS;
+}
+
+void
+release_buffer_snapshot(buffer_iter_t* const iter,
+                        buffer_snapshot_t* const snapshot)
+{
+  buffer_t* const buffer = iter->buffer;
+
+  destroy_snapshot(snapshot);
+  if (--buffer->snapshots == 0) {
+    free_retired_sources(buffer);
+  }
+}
+
+/*****************************************************************************/
+/* Get information about the buffer                                          */
+/*****************************************************************************/
+char*
+current_line(const buffer_iter_t* const iter)
+{
+  return join_text(iter->buffer, iter->start, iter->length);
+}
+
+void
+visit_line(const buffer_iter_t* const iter,
+           segment_visitor_t* const visitor,
+           void* const context)
+{
+  visit_text(iter->buffer,
+             iter->buffer->root,
+             0,
+             iter->start,
+             iter->length,
+             visitor,
+             context);
+}
+
+size_t
+column(const buffer_iter_t* const iter)
+{
+  return min(iter->column, iter->length);
+}
+
+size_t
+line_number(const buffer_iter_t* const iter)
+{
+  return iter->line;
+}
+
+size_t
+chars_in_line(const buffer_iter_t* const iter)
+{
+  return iter->length;
+}
+
+bool
+is_last_line(const buffer_iter_t* const iter)
+{
+  return iter->line == subtree_newlines(iter->buffer->root);
+}
+
+bool
+is_first_line(const buffer_iter_t* const iter)
+{
+  return iter->line == 0;
+}
+
+void
+get_buffer_stats(const buffer_iter_t* const iter, buffer_stats_t* const stats)
+{
+  const buffer_t* const buffer = iter->buffer;
+  const source_t* const original = &buffer->sources[ORIGINAL];
+  const source_t* const add = &buffer->sources[ADD];
+
+  stats->lines = subtree_newlines(buffer->root) + 1;
+  stats->cell_bytes_reserved = buffer->pieces.reserved;
+  stats->cell_bytes_used = buffer->pieces.live * buffer->pieces.object_size;
+  stats->line_bytes_reserved =
+    add->length +
+    sizeof(size_t) * (original->newlines_length + add->newlines_length);
+  stats->line_bytes_used =
+    add->used +
+    sizeof(size_t) * (original->newlines_used + add->newlines_used);
+  stats->mapped_bytes = buffer->mapping_length;
+  stats->allocations =
+    buffer->pieces.allocations + buffer->source_allocations;
+}
+
+void
+take_damage(buffer_iter_t* const iter, damage_t* const damage)
+{
+  *damage = iter->buffer->damage;
+  clear_damage(&iter->buffer->damage);
+}
+
+size_t
+buffer_version(const buffer_iter_t* const iter)
+{
+  return iter->buffer->damage.edits;
+}
+
+bool
+get_line_cache(const buffer_iter_t* const iter,
+               const size_t key,
+               size_t* const value)
+{
+  const line_cache_slot_t* const slot =
+    &iter->buffer->line_cache[iter->line % LINE_CACHE_SLOTS];
+
+  if (key == 0 || slot->key != key || slot->line != iter->line) {
+    return false;
+  }
+
+  *value = slot->value;
+  return true;
+}
+
+void
+set_line_cache(const buffer_iter_t* const iter,
+               const size_t key,
+               const size_t value)
+{
+  line_cache_slot_t* const slot =
+    &iter->buffer->line_cache[iter->line % LINE_CACHE_SLOTS];
+
+  if (key <= LINE_CACHE_MAX) {
+    slot->line = iter->line;
+    slot->key = key;
+    slot->value = min(value, LINE_CACHE_MAX);
+  }
+}
+
+/*****************************************************************************/
+/* Buffer movement functions                                                 */
+/*****************************************************************************/
+void
+move_iter_down_line(buffer_iter_t* const iter)
+{
+  if (!is_last_line(iter)) {
+    iter->line++;
+    locate_line(iter);
+  }
+}
+
+void
+move_iter_up_line(buffer_iter_t* const iter)
+{
+  if (!is_first_line(iter)) {
+    iter->line--;
+    locate_line(iter);
+  }
+}
+
+void
+move_iter_back_char(buffer_iter_t* const iter)
+{
+  if (iter->column > 0) {
+    iter->column--;
+  }
+}
+
+void
+move_iter_forward_char(buffer_iter_t* const iter)
+{
+  iter->column = min(iter->column + 1, iter->length);
+}
+
+void
+move_to_beginning_of_line(buffer_iter_t* const iter)
+{
+  iter->column = 0;
+}
+
+void
+move_iter_to_column(buffer_iter_t* const iter, const size_t column)
+{
+  iter->column = min(column, iter->length);
+}
+
+void
+move_iter_to_line(buffer_iter_t* const iter, const size_t line)
+{
+  iter->line = min(line, subtree_newlines(iter->buffer->root));
+  locate_line(iter);
+}
+
+/*****************************************************************************/
+/* Buffer modification functions                                             */
+/*****************************************************************************/
+error_t
+append_line_at_point(buffer_iter_t* const iter)
+{
+  damage_lines(iter->buffer, iter->line + 1, DAMAGE_TO_END);
+  return insert_text(
+    iter->buffer, iter->start + iter->length, "\n", 1, NULL, 0);
+}
+
+error_t
+append_filled_line_at_point(buffer_iter_t* const iter,
+                            const char* const data,
+                            const size_t length)
+{
+  damage_lines(iter->buffer, iter->line + 1, DAMAGE_TO_END);
+  return insert_text(
+    iter->buffer, iter->start + iter->length, "\n", 1, data, length);
+}
+
+error_t
+fill_line_at_point(buffer_iter_t* const iter,
+                   const char* const data,
+                   const size_t length)
+{
+  damage_lines(iter->buffer, iter->line, iter->line);
+  error_t ret = delete_text(iter->buffer, iter->start, iter->length);
+
+  if (ret == SUCCESS) {
+    iter->length = 0;
+    ret = insert_text(iter->buffer, iter->start, NULL, 0, data, length);
+  }
+
+  if (ret == SUCCESS) {
+    iter->length = length;
+  }
+
+  return ret;
+}
+
+error_t
+insert_character_at_point(buffer_iter_t* const iter, char c)
+{
+  const size_t ix = column(iter);
+  damage_lines(iter->buffer, iter->line, iter->line);
+  const error_t ret =
+    insert_text(iter->buffer, iter->start + ix, NULL, 0, &c, 1);
+
+  if (ret == SUCCESS) {
+    iter->length++;
+    iter->column++;
+  }
+
+  return ret;
+}
+
+error_t
+insert_string_at_point(buffer_iter_t* const iter,
+                       const char* const data,
+                       const size_t length)
+{
+  if (length == 0) {
+    return SUCCESS;
+  }
+
+  const char* const end = data + length;
+  const char* last_newline = NULL;
+  size_t newlines = 0;
+  for (const char* p = data; (p = memchr(p, '\n', end - p)); p++) {
+    last_newline = p;
+    newlines++;
+  }
+
+  damage_lines(
+    iter->buffer, iter->line, newlines ? DAMAGE_TO_END : iter->line);
+
+  const size_t ix = column(iter);
+  const error_t ret =
+    insert_text(iter->buffer, iter->start + ix, NULL, 0, data, length);
+
+  if (ret == SUCCESS && newlines) {
+    iter->line += newlines;
+    locate_line(iter);
+    iter->column = end - last_newline - 1;
+  } else if (ret == SUCCESS) {
+    iter->length += length;
+    iter->column = ix + length;
+  }
+
+  return ret;
+}
+
+void
+delete_character_at_point(buffer_iter_t* const iter)
+{
+  const size_t ix = column(iter);
+  move_iter_back_char(iter);
+  damage_lines(iter->buffer, iter->line, iter->line);
+
+  if (ix && delete_text(iter->buffer, iter->start + ix - 1, 1) == SUCCESS) {
+    iter->length--;
+  }
+}
+
+void
+clear_line_at_point(buffer_iter_t* const iter)
+{
+  damage_lines(iter->buffer, iter->line, iter->line);
+  if (delete_text(iter->buffer, iter->start, iter->length) == SUCCESS) {
+    iter->length = 0;
+  }
+}
+
+void
+delete_line_at_point(buffer_iter_t* const iter)
+{
+  if (is_first_line(iter) && is_last_line(iter)) {
+    clear_line_at_point(iter);
+    return;
+  }
+
+  // The last line goes with the newline before it, and any other line
+  // with the newline after it
+  const bool last = is_last_line(iter);
+  damage_lines(iter->buffer, iter->line, DAMAGE_TO_END);
+  const size_t start = last ? iter->start - 1 : iter->start;
+  if (delete_text(iter->buffer, start, iter->length + 1) == SUCCESS) {
+    iter->line -= last;
+    locate_line(iter);
+  }
+}
+
+/*****************************************************************************/
+/* Helper functions and intermediate structures                              */
+/*****************************************************************************/
+
+/* ------------------------------------------------------------------------- */
+/* Sources                                                                   */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Find the index of the first value not less than v.
+ */
+size_t
+lower_bound(const size_t* const values, const size_t count, const size_t v)
+{
+  size_t low = 0;
+  size_t high = count;
+
+  while (low < high) {
+    const size_t mid = low + (high - low) / 2;
+    if (values[mid] < v) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+
+  return low;
+}
+
+size_t
+count_newlines(const source_t* const source,
+               const size_t start,
+               const size_t length)
+{
+  return lower_bound(source->newlines, source->newlines_used, start + length) -
+         lower_bound(source->newlines, source->newlines_used, start);
+}
+
+error_t
+append_to_add_source(buffer_t* const buffer,
+                     const char* const data,
+                     const size_t length)
+{
+  source_t* const add = &buffer->sources[ADD];
+
+  if (length == 0) {
+    return SUCCESS;
+  }
+
+  if (add->used + length > add->length) {
+    size_t new_length = max(add->length, initial_add_length);
+    while (new_length < add->used + length) {
+      new_length *= 2;
+    }
+
+    char* const new_data = grow_add_source(buffer, new_length);
+    if (!new_data) {
+      return ALLOC_ERROR;
+    }
+    buffer->source_allocations++;
+    add->data = new_data;
+    add->length = new_length;
+  }
+
+  for (const char* p = data; (p = memchr(p, '\n', data + length - p)); p++) {
+    if (add->newlines_used == add->newlines_length) {
+      const size_t new_length = max(2 * add->newlines_length, 64);
+      size_t* const new_newlines =
+        realloc(add->newlines, sizeof(size_t) * new_length);
+      if (!new_newlines) {
+        return ALLOC_ERROR;
+      }
+      buffer->source_allocations++;
+      add->newlines = new_newlines;
+      add->newlines_length = new_length;
+    }
+    add->newlines[add->newlines_used++] = add->used + (p - data);
+  }
+
+  memcpy(add->data + add->used, data, length);
+  add->used += length;
+
+  return SUCCESS;
+}
+
+/*
+ * Give the add buffer room for new_length bytes. While a snapshot is
+ * held the old block is kept for it, rather than being moved by
+ * realloc. If there is no room to keep track of the old block, it is
+ * never freed.
+ */
+char*
+grow_add_source(buffer_t* const buffer, const size_t new_length)
+{
+  source_t* const add = &buffer->sources[ADD];
+
+  if (buffer->snapshots == 0 || !add->data) {
+    return realloc(add->data, new_length);
+  }
+
+  char* const new_data = malloc(new_length);
+  if (!new_data) {
+    return NULL;
+  }
+  memcpy(new_data, add->data, add->used);
+
+  if (buffer->retired_count == buffer->retired_capacity) {
+    const size_t new_capacity = max(2 * buffer->retired_capacity, 8);
+    char** const new_retired =
+      realloc(buffer->retired, sizeof(char*) * new_capacity);
+    if (!new_retired) {
+      return new_data;
+    }
+    buffer->retired = new_retired;
+    buffer->retired_capacity = new_capacity;
+  }
+  buffer->retired[buffer->retired_count++] = add->data;
+
+  return new_data;
+}
+
+void
+free_retired_sources(buffer_t* const buffer)
+{
+  for (size_t i = 0; i < buffer->retired_count; i++) {
+    free(buffer->retired[i]);
+  }
+  free(buffer->retired);
+  buffer->retired = NULL;
+  buffer->retired_count = 0;
+  buffer->retired_capacity = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Pieces                                                                    */
+/* ------------------------------------------------------------------------- */
+piece_t*
+new_piece(buffer_t* const buffer,
+          const source_kind_t source,
+          const size_t start,
+          const size_t length)
+{
+  piece_t* const piece = slab_alloc(&buffer->pieces);
+
+  if (piece) {
+    *piece = (piece_t){ 0 };
+    // xorshift32
+    buffer->seed ^= buffer->seed << 13;
+    buffer->seed ^= buffer->seed >> 17;
+    buffer->seed ^= buffer->seed << 5;
+
+    piece->priority = buffer->seed;
+    piece->source = source;
+    piece->start = start;
+    piece->length = length;
+    piece->newlines = count_newlines(&buffer->sources[source], start, length);
+    update_piece(piece);
+  }
+
+  return piece;
+}
+
+void
+destroy_pieces(buffer_t* const buffer, piece_t* const piece)
+{
+  if (piece) {
+    destroy_pieces(buffer, piece->left);
+    destroy_pieces(buffer, piece->right);
+    slab_free(&buffer->pieces, piece);
+  }
+}
+
+size_t
+subtree_length(const piece_t* const piece)
+{
+  return piece ? piece->subtree_length : 0;
+}
+
+size_t
+subtree_newlines(const piece_t* const piece)
+{
+  return piece ? piece->subtree_newlines : 0;
+}
+
+void
+update_piece(piece_t* const piece)
+{
+  piece->subtree_length =
+    subtree_length(piece->left) + piece->length + subtree_length(piece->right);
+  piece->subtree_newlines = subtree_newlines(piece->left) + piece->newlines +
+                            subtree_newlines(piece->right);
+}
+
+/*
+ * Split the pieces into those before offset, and those after. If
+ * offset falls inside a piece, that piece is cut in two, using spare
+ * for the second half.
+ */
+void
+split_pieces(const buffer_t* const buffer,
+             piece_t* const piece,
+             const size_t offset,
+             piece_t** const left,
+             piece_t** const right,
+             piece_t** const spare)
+{
+  if (!piece) {
+    *left = NULL;
+    *right = NULL;
+    return;
+  }
+
+  const size_t left_length = subtree_length(piece->left);
+
+  if (offset <= left_length) {
+    split_pieces(buffer, piece->left, offset, left, &piece->left, spare);
+    update_piece(piece);
+    *right = piece;
+  } else if (offset >= left_length + piece->length) {
+    split_pieces(buffer,
+                 piece->right,
+                 offset - left_length - piece->length,
+                 &piece->right,
+                 right,
+                 spare);
+    update_piece(piece);
+    *left = piece;
+  } else {
+    const size_t cut = offset - left_length;
+    piece_t* const tail = *spare;
+    *spare = NULL;
+
+    tail->left = NULL;
+    tail->right = NULL;
+    tail->source = piece->source;
+    tail->start = piece->start + cut;
+    tail->length = piece->length - cut;
+    tail->newlines =
+      count_newlines(&buffer->sources[tail->source], tail->start, tail->length);
+    update_piece(tail);
+
+    piece->length = cut;
+    piece->newlines -= tail->newlines;
+
+    *right = merge_pieces(tail, piece->right);
+    piece->right = NULL;
+    update_piece(piece);
+    *left = piece;
+  }
+}
+
+piece_t*
+merge_pieces(piece_t* const left, piece_t* const right)
+{
+  if (!left) {
+    return right;
+  } else if (!right) {
+    return left;
+  }
+
+  if (left->priority > right->priority) {
+    left->right = merge_pieces(left->right, right);
+    update_piece(left);
+    return left;
+  } else {
+    right->left = merge_pieces(left, right->left);
+    update_piece(right);
+    return right;
+  }
+}
+
+/*
+ * Text appended to the add buffer directly after the last piece can
+ * extend it rather than needing a new piece, which is the common case
+ * when typing.
+ */
+bool
+extend_last_piece(const buffer_t* const buffer,
+                  piece_t* const piece,
+                  const size_t add_start,
+                  const size_t length)
+{
+  if (!piece) {
+    return false;
+  }
+
+  bool extended = false;
+  if (piece->right) {
+    extended = extend_last_piece(buffer, piece->right, add_start, length);
+  } else if (piece->source == ADD && piece->start + piece->length == add_start) {
+    piece->length += length;
+    piece->newlines +=
+      count_newlines(&buffer->sources[ADD], add_start, length);
+    extended = true;
+  }
+
+  if (extended) {
+    update_piece(piece);
+  }
+
+  return extended;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Text operations                                                           */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Insert prefix followed by data at offset. Either may be empty.
+ */
+error_t
+insert_text(buffer_t* const buffer,
+            const size_t offset,
+            const char* const prefix,
+            const size_t prefix_length,
+            const char* const data,
+            const size_t length)
+{
+  const size_t total_length = prefix_length + length;
+  if (total_length == 0) {
+    return SUCCESS;
+  }
+
+  piece_t* spare = new_piece(buffer, ADD, 0, 0);
+  piece_t* piece = new_piece(buffer, ADD, 0, 0);
+  const size_t add_start = buffer->sources[ADD].used;
+
+  error_t ret = spare && piece ? SUCCESS : ALLOC_ERROR;
+  if (ret == SUCCESS) {
+    ret = append_to_add_source(buffer, prefix, prefix_length);
+  }
+  if (ret == SUCCESS) {
+    ret = append_to_add_source(buffer, data, length);
+  }
+
+  if (ret == SUCCESS) {
+    piece_t* left = NULL;
+    piece_t* right = NULL;
+    split_pieces(buffer, buffer->root, offset, &left, &right, &spare);
+
+    if (extend_last_piece(buffer, left, add_start, total_length)) {
+      buffer->root = merge_pieces(left, right);
+    } else {
+      piece->start = add_start;
+      piece->length = total_length;
+      piece->newlines =
+        count_newlines(&buffer->sources[ADD], add_start, total_length);
+      update_piece(piece);
+      buffer->root = merge_pieces(merge_pieces(left, piece), right);
+      piece = NULL;
+    }
+  }
+
+  destroy_pieces(buffer, spare);
+  destroy_pieces(buffer, piece);
+
+  return ret;
+}
+
+error_t
+delete_text(buffer_t* const buffer, const size_t offset, const size_t length)
+{
+  if (length == 0) {
+    return SUCCESS;
+  }
+
+  piece_t* spares[2] = { new_piece(buffer, ADD, 0, 0),
+                         new_piece(buffer, ADD, 0, 0) };
+  if (!spares[0] || !spares[1]) {
+    destroy_pieces(buffer, spares[0]);
+    destroy_pieces(buffer, spares[1]);
+    return ALLOC_ERROR;
+  }
+
+  piece_t* left = NULL;
+  piece_t* middle = NULL;
+  piece_t* right = NULL;
+  split_pieces(buffer, buffer->root, offset, &left, &middle, &spares[0]);
+  split_pieces(buffer, middle, length, &middle, &right, &spares[1]);
+  buffer->root = merge_pieces(left, right);
+
+  destroy_pieces(buffer, middle);
+  destroy_pieces(buffer, spares[0]);
+  destroy_pieces(buffer, spares[1]);
+
+  return SUCCESS;
+}
+
+/*
+ * Pass the length bytes at offset to visitor a piece at a time, where
+ * base is the offset of the first byte under piece. Returns false once
+ * the visitor has asked to stop.
+ */
+bool
+visit_text(const buffer_t* const buffer,
+           const piece_t* const piece,
+           size_t base,
+           const size_t offset,
+           const size_t length,
+           segment_visitor_t* const visitor,
+           void* const context)
+{
+  if (!piece || offset + length <= base ||
+      offset >= base + piece->subtree_length) {
+    return true;
+  }
+
+  if (!visit_text(buffer, piece->left, base, offset, length, visitor,
+                  context)) {
+    return false;
+  }
+  base += subtree_length(piece->left);
+
+  const size_t from = max(offset, base);
+  const size_t to = min(offset + length, base + piece->length);
+  if (from < to) {
+    const char* const data = buffer->sources[piece->source].data;
+    if (!visitor(data + piece->start + (from - base), to - from, context)) {
+      return false;
+    }
+  }
+
+  return visit_text(buffer, piece->right, base + piece->length, offset,
+                    length, visitor, context);
+}
+
+void*
+count_range_newlines(void* const context)
+{
+  newline_range_t* const range = context;
+  const char* const end = range->data + range->end;
+
+  for (const char* p = range->data + range->start;
+       (p = memchr(p, '\n', end - p));
+       p++) {
+    range->count++;
+  }
+
+  return NULL;
+}
+
+void*
+index_range_newlines(void* const context)
+{
+  newline_range_t* const range = context;
+  const char* const end = range->data + range->end;
+  size_t* newline = range->newlines;
+
+  for (const char* p = range->data + range->start;
+       (p = memchr(p, '\n', end - p));
+       p++) {
+    *newline++ = p - range->data;
+  }
+
+  return NULL;
+}
+
+/*
+ * Segment visitor appending to the char* pointed to by context.
+ */
+bool
+copy_segment(const char* const data, const size_t length, void* const context)
+{
+  char** const dst = context;
+  memcpy(*dst, data, length);
+  *dst += length;
+  return true;
+}
+
+/*
+ * Segment visitor adding to the buffer_snapshot_t in context. Stops
+ * if the segment can not be added.
+ */
+bool
+snapshot_segment(const char* const data,
+                 const size_t length,
+                 void* const context)
+{
+  return add_snapshot_segment(context, data, length) == SUCCESS;
+}
+
+/*
+ * Join the length bytes at offset into the scratch buffer, as a C
+ * string.
+ */
+char*
+join_text(buffer_t* const buffer, const size_t offset, const size_t length)
+{
+  if (length + 1 > buffer->scratch_length) {
+    const size_t new_length = max(length + 1, 2 * buffer->scratch_length);
+    char* const scratch = realloc(buffer->scratch, new_length);
+    if (!scratch) {
+      return NULL;
+    }
+    buffer->scratch = scratch;
+    buffer->scratch_length = new_length;
+  }
+
+  char* dst = buffer->scratch;
+  visit_text(buffer, buffer->root, 0, offset, length, copy_segment, &dst);
+  buffer->scratch[length] = '\0';
+
+  return buffer->scratch;
+}
+
+/*
+ * Find the offset of the k'th newline in the buffer, counting from 0.
+ */
+size_t
+newline_offset(const buffer_t* const buffer, size_t k)
+{
+  size_t base = 0;
+  const piece_t* piece = buffer->root;
+
+  while (piece) {
+    const size_t left_newlines = subtree_newlines(piece->left);
+    const size_t left_length = subtree_length(piece->left);
+
+    if (k < left_newlines) {
+      piece = piece->left;
+      continue;
+    }
+
+    k -= left_newlines;
+    if (k < piece->newlines) {
+      const source_t* const source = &buffer->sources[piece->source];
+      const size_t first =
+        lower_bound(source->newlines, source->newlines_used, piece->start);
+      return base + left_length + source->newlines[first + k] - piece->start;
+    }
+
+    k -= piece->newlines;
+    base += left_length + piece->length;
+    piece = piece->right;
+  }
+
+  return base;
+}
+
+/*
+ * Find the start and length of the iterator's line.
+ */
+void
+locate_line(buffer_iter_t* const iter)
+{
+  const buffer_t* const buffer = iter->buffer;
+
+  iter->start = iter->line ? newline_offset(buffer, iter->line - 1) + 1 : 0;
+  iter->length = iter->line < subtree_newlines(buffer->root)
+                   ? newline_offset(buffer, iter->line) - iter->start
+                   : subtree_length(buffer->root) - iter->start;
+}
+
+/* ------------------------------------------------------------------------- */
+/* Damage and the line cache                                                 */
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Record that lines have changed, and forget the values cached for
+ * them. Lines added or removed renumber every line after them.
+ */
+void
+damage_lines(buffer_t* const buffer,
+             const size_t first_line,
+             const size_t last_line)
+{
+  add_damage(&buffer->damage, first_line, last_line);
+
+  if (last_line == DAMAGE_TO_END) {
+    for (size_t i = 0; i < LINE_CACHE_SLOTS; i++) {
+      if (buffer->line_cache[i].line >= first_line) {
+        buffer->line_cache[i].key = 0;
+      }
+    }
+  } else {
+    for (size_t line = first_line; line <= last_line; line++) {
+      line_cache_slot_t* const slot =
+        &buffer->line_cache[line % LINE_CACHE_SLOTS];
+      if (slot->line == line) {
+        slot->key = 0;
+      }
+    }
+  }
+}
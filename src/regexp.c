@@ -0,0 +1,871 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <regexp.h>
+#include <search.h>
+
+// DFA states are built as they are needed, and all thrown away to start
+// again once there are this many
+const size_t max_dfa_states = 2048;
+// Room is made for this many DFA states to begin with
+const size_t initial_dfa_states = 16;
+
+// Returned in place of a DFA state when one can not be built
+static const size_t no_state = (size_t)-1;
+
+typedef struct byte_set_t
+{
+  uint64_t bits[4];
+} byte_set_t;
+
+/*
+ * Patterns are parsed into a tree, which is then compiled into an NFA.
+ */
+typedef enum node_kind_t
+{
+  NODE_EMPTY,
+  NODE_BYTES,
+  NODE_CONCATENATE,
+  NODE_ALTERNATE,
+  NODE_STAR,
+  NODE_PLUS,
+  NODE_OPTIONAL
+} node_kind_t;
+
+typedef struct node_t node_t;
+
+struct node_t
+{
+  node_kind_t kind;
+  byte_set_t bytes;
+  node_t* left;
+  node_t* right;
+};
+
+typedef struct parser_t
+{
+  const char* at;
+  const char* end;
+
+  // Nodes are allocated from a single array, large enough for any tree
+  // the pattern can make
+  node_t* nodes;
+  size_t used;
+  size_t capacity;
+
+  const char* error;
+} parser_t;
+
+/*
+ * The NFA is a Thompson construction: states either consume a byte in
+ * a set, split into two, or accept.
+ */
+typedef enum nfa_kind_t
+{
+  NFA_BYTES,
+  NFA_SPLIT,
+  NFA_MATCH
+} nfa_kind_t;
+
+typedef struct nfa_state_t
+{
+  nfa_kind_t kind;
+  byte_set_t bytes;
+  size_t out;
+  size_t out1;
+} nfa_state_t;
+
+struct regexp_t
+{
+  nfa_state_t* states;
+  size_t count;
+  size_t start;
+
+  // Whether the pattern was anchored with ^ and $
+  bool anchored_start;
+  bool anchored_end;
+};
+
+/*
+ * Each DFA state is the set of NFA states the NFA could be in, keeping
+ * only those which consume a byte or accept. Transitions are filled in
+ * the first time they are taken.
+ */
+typedef struct dfa_state_t
+{
+  size_t* set;
+  size_t count;
+  bool accepting;
+  bool dead;
+  uint32_t next[256];
+} dfa_state_t;
+
+// A transition which has not been built yet
+static const uint32_t unknown_transition = UINT32_MAX;
+
+struct dfa_t
+{
+  const regexp_t* regexp;
+
+  // Whether a match can start after the first byte
+  bool floating;
+
+  dfa_state_t* states;
+  size_t count;
+  size_t capacity;
+  size_t start;
+
+  // Open addressed table of states, by their sets
+  size_t* table;
+  size_t table_size;
+
+  // Room to build a set of NFA states, marking those already in it
+  size_t* set;
+  size_t set_count;
+  size_t* stack;
+  uint32_t* marks;
+  uint32_t generation;
+};
+
+/*
+ * Parsing, by recursive descent, lowest precedence first.
+ */
+node_t*
+parse_alternation(parser_t* const parser);
+node_t*
+parse_concatenation(parser_t* const parser);
+node_t*
+parse_repetition(parser_t* const parser);
+node_t*
+parse_atom(parser_t* const parser);
+void
+parse_class(parser_t* const parser, byte_set_t* const bytes);
+
+/*
+ * Add the bytes an escape such as \d stands for to bytes.
+ */
+void
+add_escape(const char c, byte_set_t* const bytes);
+
+node_t*
+new_node(parser_t* const parser,
+         const node_kind_t kind,
+         node_t* const left,
+         node_t* const right);
+
+void
+add_byte(byte_set_t* const bytes, const unsigned char c);
+bool
+has_byte(const byte_set_t* const bytes, const unsigned char c);
+
+/*
+ * Compile node into NFA states which go on to next, returning the
+ * state to start from.
+ */
+size_t
+emit_nfa(regexp_t* const regexp, const node_t* const node, const size_t next);
+size_t
+new_nfa_state(regexp_t* const regexp, const nfa_kind_t kind);
+
+/*
+ * Build the set of DFA states up in the DFA's scratch space, and then
+ * find or add the DFA state for it.
+ */
+void
+begin_set(dfa_t* const dfa);
+void
+add_closure(dfa_t* const dfa, const size_t nfa_state);
+size_t
+find_dfa_state(dfa_t* const dfa);
+size_t
+add_dfa_state(dfa_t* const dfa, const size_t hash);
+void
+flush_dfa(dfa_t* const dfa);
+size_t
+hash_set(const size_t* const set, const size_t count);
+int
+compare_states(const void* a, const void* b);
+
+/*
+ * Get the DFA state to start from, and the state after consuming c.
+ * Both return no_state if the state can not be built.
+ */
+size_t
+start_state(dfa_t* const dfa);
+size_t
+step_dfa(dfa_t* const dfa, const size_t state, const unsigned char c);
+
+/*
+ * Segment visitor running an unanchored DFA over a line.
+ */
+bool
+match_segment(const char* const data, const size_t length, void* const context);
+
+/*
+ * Check whether a match starts at the start of data, with an anchored
+ * DFA.
+ */
+bool
+match_at(dfa_t* const dfa, const char* const data, const size_t length);
+
+typedef struct line_match_t
+{
+  dfa_t* dfa;
+  size_t state;
+  bool matched;
+} line_match_t;
+
+/*****************************************************************************/
+/* Compiling                                                                 */
+/*****************************************************************************/
+regexp_t*
+new_regexp(const char* const pattern, const char** const error)
+{
+  const size_t length = strlen(pattern);
+  regexp_t* const regexp = calloc(1, sizeof(regexp_t));
+
+  // Every byte of the pattern adds at most an atom, a repetition and a
+  // concatenation to the tree, and each node at most one NFA state
+  parser_t parser = { .at = pattern,
+                      .end = pattern + length,
+                      .capacity = 3 * length + 2 };
+  parser.nodes = calloc(parser.capacity, sizeof(node_t));
+
+  if (!regexp || !parser.nodes) {
+    free(regexp);
+    free(parser.nodes);
+    *error = "Out of memory";
+    return NULL;
+  }
+
+  if (parser.at < parser.end && *parser.at == '^') {
+    regexp->anchored_start = true;
+    parser.at++;
+  }
+
+  // A $ at the end anchors the pattern, unless it is escaped
+  if (parser.end > parser.at && parser.end[-1] == '$') {
+    size_t backslashes = 0;
+    for (const char* c = parser.end - 1; c > parser.at && c[-1] == '\\'; c--) {
+      backslashes++;
+    }
+    if (backslashes % 2 == 0) {
+      regexp->anchored_end = true;
+      parser.end--;
+    }
+  }
+
+  node_t* const root = parse_alternation(&parser);
+  if (!parser.error && parser.at != parser.end) {
+    parser.error = "Unmatched )";
+  }
+
+  if (!parser.error) {
+    regexp->states = calloc(parser.used + 1, sizeof(nfa_state_t));
+    if (regexp->states) {
+      const size_t match = new_nfa_state(regexp, NFA_MATCH);
+      regexp->start = emit_nfa(regexp, root, match);
+    } else {
+      parser.error = "Out of memory";
+    }
+  }
+
+  free(parser.nodes);
+
+  if (parser.error) {
+    *error = parser.error;
+    destroy_regexp(regexp);
+    return NULL;
+  }
+
+  return regexp;
+}
+
+void
+destroy_regexp(regexp_t* regexp)
+{
+  if (regexp) {
+    free(regexp->states);
+    free(regexp);
+  }
+}
+
+node_t*
+parse_alternation(parser_t* const parser)
+{
+  node_t* node = parse_concatenation(parser);
+
+  while (!parser->error && parser->at < parser->end && *parser->at == '|') {
+    parser->at++;
+    node = new_node(parser, NODE_ALTERNATE, node, parse_concatenation(parser));
+  }
+
+  return node;
+}
+
+node_t*
+parse_concatenation(parser_t* const parser)
+{
+  node_t* node = new_node(parser, NODE_EMPTY, NULL, NULL);
+
+  while (!parser->error && parser->at < parser->end && *parser->at != '|' &&
+         *parser->at != ')') {
+    node = new_node(parser, NODE_CONCATENATE, node, parse_repetition(parser));
+  }
+
+  return node;
+}
+
+node_t*
+parse_repetition(parser_t* const parser)
+{
+  node_t* node = parse_atom(parser);
+
+  while (!parser->error && parser->at < parser->end) {
+    const char c = *parser->at;
+    const node_kind_t kind = c == '*'   ? NODE_STAR
+                             : c == '+' ? NODE_PLUS
+                             : c == '?' ? NODE_OPTIONAL
+                                        : NODE_EMPTY;
+    if (kind == NODE_EMPTY) {
+      break;
+    }
+    parser->at++;
+    node = new_node(parser, kind, node, NULL);
+  }
+
+  return node;
+}
+
+node_t*
+parse_atom(parser_t* const parser)
+{
+  node_t* const node = new_node(parser, NODE_BYTES, NULL, NULL);
+  if (!node) {
+    return NULL;
+  }
+
+  const char c = *parser->at++;
+  switch (c) {
+    case '(': {
+      node_t* const group = parse_alternation(parser);
+      if (!parser->error &&
+          (parser->at == parser->end || *parser->at != ')')) {
+        parser->error = "Unmatched (";
+        return NULL;
+      }
+      parser->at++;
+      return group;
+    }
+    case '*':
+    case '+':
+    case '?':
+      parser->error = "Nothing to repeat";
+      break;
+    case '.':
+      for (size_t i = 0; i < 256; i++) {
+        add_byte(&node->bytes, i);
+      }
+      break;
+    case '[':
+      parse_class(parser, &node->bytes);
+      break;
+    case '\\':
+      if (parser->at == parser->end) {
+        parser->error = "Trailing \\";
+      } else {
+        add_escape(*parser->at++, &node->bytes);
+      }
+      break;
+    default:
+      add_byte(&node->bytes, c);
+      break;
+  }
+
+  return node;
+}
+
+void
+parse_class(parser_t* const parser, byte_set_t* const bytes)
+{
+  byte_set_t set = { { 0 } };
+  const bool negated = parser->at < parser->end && *parser->at == '^';
+  if (negated) {
+    parser->at++;
+  }
+
+  // A ] straight after the [ is part of the class
+  for (bool first = true; parser->at < parser->end; first = false) {
+    const unsigned char c = *parser->at;
+
+    if (c == ']' && !first) {
+      break;
+    } else if (c == '\\' && parser->at + 1 < parser->end) {
+      add_escape(parser->at[1], &set);
+      parser->at += 2;
+    } else if (parser->at + 2 < parser->end && parser->at[1] == '-' &&
+               parser->at[2] != ']') {
+      const unsigned char last = parser->at[2];
+      for (size_t b = c; b <= last; b++) {
+        add_byte(&set, b);
+      }
+      parser->at += 3;
+    } else {
+      add_byte(&set, c);
+      parser->at++;
+    }
+  }
+
+  if (parser->at == parser->end) {
+    parser->error = "Unterminated [";
+    return;
+  }
+  parser->at++;
+
+  for (size_t i = 0; i < 4; i++) {
+    bytes->bits[i] |= negated ? ~set.bits[i] : set.bits[i];
+  }
+}
+
+void
+add_escape(const char c, byte_set_t* const bytes)
+{
+  byte_set_t set = { { 0 } };
+  const char lower = c | 0x20;
+
+  for (size_t b = 0; b < 256; b++) {
+    const bool digit = b >= '0' && b <= '9';
+    const bool word = digit || (b >= 'a' && b <= 'z') ||
+                      (b >= 'A' && b <= 'Z') || b == '_';
+    const bool space = b == ' ' || (b >= '\t' && b <= '\r');
+
+    if ((lower == 'd' && digit) || (lower == 'w' && word) ||
+        (lower == 's' && space)) {
+      add_byte(&set, b);
+    }
+  }
+
+  if (lower != 'd' && lower != 'w' && lower != 's') {
+    add_byte(bytes, c == 't' ? '\t' : c);
+    return;
+  }
+
+  // Upper case escapes match everything the lower case ones do not
+  const bool negated = c != lower;
+  for (size_t i = 0; i < 4; i++) {
+    bytes->bits[i] |= negated ? ~set.bits[i] : set.bits[i];
+  }
+}
+
+node_t*
+new_node(parser_t* const parser,
+         const node_kind_t kind,
+         node_t* const left,
+         node_t* const right)
+{
+  if (parser->error) {
+    return NULL;
+  }
+  if (parser->used == parser->capacity) {
+    parser->error = "Pattern too complex";
+    return NULL;
+  }
+
+  node_t* const node = &parser->nodes[parser->used++];
+  node->kind = kind;
+  node->left = left;
+  node->right = right;
+
+  return node;
+}
+
+void
+add_byte(byte_set_t* const bytes, const unsigned char c)
+{
+  bytes->bits[c / 64] |= (uint64_t)1 << (c % 64);
+}
+
+bool
+has_byte(const byte_set_t* const bytes, const unsigned char c)
+{
+  return (bytes->bits[c / 64] >> (c % 64)) & 1;
+}
+
+size_t
+emit_nfa(regexp_t* const regexp, const node_t* const node, const size_t next)
+{
+  size_t state = next;
+
+  switch (node->kind) {
+    case NODE_EMPTY:
+      break;
+    case NODE_BYTES:
+      state = new_nfa_state(regexp, NFA_BYTES);
+      regexp->states[state].bytes = node->bytes;
+      regexp->states[state].out = next;
+      break;
+    case NODE_CONCATENATE:
+      state = emit_nfa(regexp, node->left, emit_nfa(regexp, node->right, next));
+      break;
+    case NODE_ALTERNATE:
+      state = new_nfa_state(regexp, NFA_SPLIT);
+      regexp->states[state].out = emit_nfa(regexp, node->left, next);
+      regexp->states[state].out1 = emit_nfa(regexp, node->right, next);
+      break;
+    case NODE_OPTIONAL:
+      state = new_nfa_state(regexp, NFA_SPLIT);
+      regexp->states[state].out = emit_nfa(regexp, node->left, next);
+      regexp->states[state].out1 = next;
+      break;
+    case NODE_STAR:
+    case NODE_PLUS: {
+      // The split loops back to the start of the repeated node
+      const size_t split = new_nfa_state(regexp, NFA_SPLIT);
+      const size_t body = emit_nfa(regexp, node->left, split);
+      regexp->states[split].out = body;
+      regexp->states[split].out1 = next;
+      state = node->kind == NODE_STAR ? split : body;
+      break;
+    }
+  }
+
+  return state;
+}
+
+size_t
+new_nfa_state(regexp_t* const regexp, const nfa_kind_t kind)
+{
+  const size_t state = regexp->count++;
+  regexp->states[state].kind = kind;
+  return state;
+}
+
+/*****************************************************************************/
+/* Matching                                                                  */
+/*****************************************************************************/
+dfa_t*
+new_dfa(const regexp_t* const regexp, const bool anchored)
+{
+  dfa_t* const dfa = calloc(1, sizeof(dfa_t));
+  if (!dfa) {
+    return NULL;
+  }
+
+  dfa->regexp = regexp;
+  dfa->floating = !anchored && !regexp->anchored_start;
+  dfa->start = no_state;
+  dfa->table_size = 2 * max_dfa_states;
+  dfa->capacity = initial_dfa_states;
+  dfa->states = malloc(dfa->capacity * sizeof(dfa_state_t));
+  dfa->table = malloc(dfa->table_size * sizeof(size_t));
+  dfa->set = malloc(regexp->count * sizeof(size_t));
+  dfa->stack = malloc(2 * regexp->count * sizeof(size_t));
+  dfa->marks = calloc(regexp->count, sizeof(uint32_t));
+
+  if (!dfa->states || !dfa->table || !dfa->set || !dfa->stack || !dfa->marks) {
+    destroy_dfa(dfa);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < dfa->table_size; i++) {
+    dfa->table[i] = no_state;
+  }
+
+  return dfa;
+}
+
+void
+destroy_dfa(dfa_t* dfa)
+{
+  if (!dfa) {
+    return;
+  }
+
+  if (dfa->states) {
+    flush_dfa(dfa);
+  }
+  free(dfa->states);
+  free(dfa->table);
+  free(dfa->set);
+  free(dfa->stack);
+  free(dfa->marks);
+  free(dfa);
+}
+
+bool
+line_matches(dfa_t* const dfa, const buffer_iter_t* const iter)
+{
+  line_match_t match = { .dfa = dfa, .state = start_state(dfa) };
+  if (match.state == no_state) {
+    return false;
+  }
+
+  const bool anchored_end = dfa->regexp->anchored_end;
+  match.matched = !anchored_end && dfa->states[match.state].accepting;
+  if (!match.matched) {
+    visit_line(iter, match_segment, &match);
+  }
+
+  // Matches anchored to the end of the line are only known at the end
+  if (anchored_end && match.state != no_state) {
+    match.matched = dfa->states[match.state].accepting;
+  }
+
+  return match.matched;
+}
+
+bool
+match_segment(const char* const data, const size_t length, void* const context)
+{
+  line_match_t* const match = context;
+  dfa_t* const dfa = match->dfa;
+  const bool anchored_end = dfa->regexp->anchored_end;
+
+  size_t state = match->state;
+
+  for (size_t i = 0; i < length; i++) {
+    // Transitions which have been taken before are a lookup
+    const unsigned char c = data[i];
+    const uint32_t known = dfa->states[state].next[c];
+    state = known != unknown_transition ? known : step_dfa(dfa, state, c);
+
+    if (state == no_state || dfa->states[state].dead) {
+      match->state = no_state;
+      return false;
+    }
+    if (!anchored_end && dfa->states[state].accepting) {
+      match->state = state;
+      match->matched = true;
+      return false;
+    }
+  }
+
+  match->state = state;
+  return true;
+}
+
+size_t
+find_match_start(dfa_t* const dfa, const char* const data, const size_t length)
+{
+  for (size_t from = 0; from <= length; from++) {
+    if (match_at(dfa, data + from, length - from)) {
+      return from;
+    }
+    if (dfa->regexp->anchored_start) {
+      break;
+    }
+  }
+
+  return SEARCH_NOT_FOUND;
+}
+
+bool
+match_at(dfa_t* const dfa, const char* const data, const size_t length)
+{
+  const bool anchored_end = dfa->regexp->anchored_end;
+  size_t state = start_state(dfa);
+
+  for (size_t i = 0; state != no_state; i++) {
+    const dfa_state_t* const current = &dfa->states[state];
+    if (current->accepting && (!anchored_end || i == length)) {
+      return true;
+    }
+    if (i == length || current->dead) {
+      return false;
+    }
+    state = step_dfa(dfa, state, data[i]);
+  }
+
+  return false;
+}
+
+size_t
+start_state(dfa_t* const dfa)
+{
+  if (dfa->start == no_state) {
+    begin_set(dfa);
+    add_closure(dfa, dfa->regexp->start);
+    dfa->start = find_dfa_state(dfa);
+  }
+
+  return dfa->start;
+}
+
+size_t
+step_dfa(dfa_t* const dfa, const size_t state, const unsigned char c)
+{
+  const uint32_t known = dfa->states[state].next[c];
+  if (known != unknown_transition) {
+    return known;
+  }
+
+  const regexp_t* const regexp = dfa->regexp;
+  const dfa_state_t* const from = &dfa->states[state];
+
+  begin_set(dfa);
+  for (size_t i = 0; i < from->count; i++) {
+    const nfa_state_t* const nfa_state = &regexp->states[from->set[i]];
+    if (nfa_state->kind == NFA_BYTES && has_byte(&nfa_state->bytes, c)) {
+      add_closure(dfa, nfa_state->out);
+    }
+  }
+
+  // An unanchored search can start a new match at every byte
+  if (dfa->floating) {
+    add_closure(dfa, regexp->start);
+  }
+
+  // The table may have been flushed to make room, taking state with it
+  const size_t count = dfa->count;
+  const size_t next = find_dfa_state(dfa);
+  if (next != no_state && dfa->count >= count) {
+    dfa->states[state].next[c] = next;
+  }
+
+  return next;
+}
+
+void
+begin_set(dfa_t* const dfa)
+{
+  dfa->set_count = 0;
+  dfa->generation++;
+
+  // Marks from long ago could be mistaken for new ones once the
+  // generation wraps around
+  if (dfa->generation == 0) {
+    memset(dfa->marks, 0, dfa->regexp->count * sizeof(uint32_t));
+    dfa->generation = 1;
+  }
+}
+
+void
+add_closure(dfa_t* const dfa, const size_t nfa_state)
+{
+  const nfa_state_t* const states = dfa->regexp->states;
+  size_t depth = 0;
+  dfa->stack[depth++] = nfa_state;
+
+  while (depth > 0) {
+    const size_t state = dfa->stack[--depth];
+    if (dfa->marks[state] == dfa->generation) {
+      continue;
+    }
+    dfa->marks[state] = dfa->generation;
+
+    if (states[state].kind == NFA_SPLIT) {
+      dfa->stack[depth++] = states[state].out1;
+      dfa->stack[depth++] = states[state].out;
+    } else {
+      dfa->set[dfa->set_count++] = state;
+    }
+  }
+}
+
+size_t
+find_dfa_state(dfa_t* const dfa)
+{
+  qsort(dfa->set, dfa->set_count, sizeof(size_t), compare_states);
+  const size_t hash = hash_set(dfa->set, dfa->set_count);
+
+  for (size_t i = hash % dfa->table_size;; i = (i + 1) % dfa->table_size) {
+    const size_t state = dfa->table[i];
+    if (state == no_state) {
+      break;
+    }
+
+    const dfa_state_t* const existing = &dfa->states[state];
+    if (existing->count == dfa->set_count &&
+        memcmp(existing->set, dfa->set, dfa->set_count * sizeof(size_t)) ==
+          0) {
+      return state;
+    }
+  }
+
+  if (dfa->count == max_dfa_states) {
+    flush_dfa(dfa);
+  }
+
+  return add_dfa_state(dfa, hash);
+}
+
+size_t
+add_dfa_state(dfa_t* const dfa, const size_t hash)
+{
+  if (dfa->count == dfa->capacity) {
+    const size_t capacity = min(2 * dfa->capacity, max_dfa_states);
+    dfa_state_t* const states =
+      realloc(dfa->states, capacity * sizeof(dfa_state_t));
+    if (!states) {
+      return no_state;
+    }
+    dfa->states = states;
+    dfa->capacity = capacity;
+  }
+
+  const size_t bytes = dfa->set_count * sizeof(size_t);
+  size_t* const set = malloc(bytes ? bytes : 1);
+  if (!set) {
+    return no_state;
+  }
+
+  const size_t state = dfa->count++;
+  dfa_state_t* const new_state = &dfa->states[state];
+  memcpy(set, dfa->set, bytes);
+  new_state->set = set;
+  new_state->count = dfa->set_count;
+  new_state->accepting = false;
+  new_state->dead = !dfa->floating && dfa->set_count == 0;
+  for (size_t i = 0; i < dfa->set_count; i++) {
+    if (dfa->regexp->states[set[i]].kind == NFA_MATCH) {
+      new_state->accepting = true;
+    }
+  }
+  for (size_t i = 0; i < 256; i++) {
+    new_state->next[i] = unknown_transition;
+  }
+
+  size_t i = hash % dfa->table_size;
+  while (dfa->table[i] != no_state) {
+    i = (i + 1) % dfa->table_size;
+  }
+  dfa->table[i] = state;
+
+  return state;
+}
+
+void
+flush_dfa(dfa_t* const dfa)
+{
+  for (size_t i = 0; i < dfa->count; i++) {
+    free(dfa->states[i].set);
+  }
+  for (size_t i = 0; i < dfa->table_size; i++) {
+    dfa->table[i] = no_state;
+  }
+
+  dfa->count = 0;
+  dfa->start = no_state;
+}
+
+size_t
+hash_set(const size_t* const set, const size_t count)
+{
+  // FNV-1a, a state at a time
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < count; i++) {
+    hash = (hash ^ set[i]) * 1099511628211u;
+  }
+
+  return hash;
+}
+
+int
+compare_states(const void* a, const void* b)
+{
+  const size_t x = *(const size_t*)a;
+  const size_t y = *(const size_t*)b;
+
+  return (x > y) - (x < y);
+}
@@ -1,11 +1,48 @@
-#include <ncurses.h>
+#include <stdio.h>
+#include <string.h>
 
 #include <buffer.h>
+#include <highlight.h>
+#include <line_map.h>
 #include <render.h>
+#include <screen.h>
 #include <state.h>
+#include <stats.h>
+#include <utf8.h>
 
 static const size_t modeline_lines = 2;
 
+// Rows of the screen which have nothing drawn on them, and rows which
+// hold the rest of a line wrapped from the row above
+static const size_t no_line = (size_t)-1;
+static const size_t wrapped_line = (size_t)-2;
+
+// Line heights are cached under a key holding the screen width in its
+// low bits and the tab width less one above them
+static const size_t tab_key_shift = 11;
+
+/*
+ * The state of a line being drawn, a segment at a time.
+ */
+typedef struct line_draw_t
+{
+  screen_t* screen;
+  utf8_decoder_t decoder;
+  size_t tab_width;
+
+  // The screen column drawing has reached, and the one it must stop
+  // before
+  size_t column;
+  size_t limit;
+
+  // The line's highlighting, the byte offset reached, and the next span
+  // to start
+  const highlight_span_t* spans;
+  size_t span_count;
+  size_t offset;
+  size_t next_span;
+} line_draw_t;
+
 /*
  * Render the modeline.
  */
@@ -21,97 +58,378 @@ render_command_buffer(const editor_state_t* const state,
                       const render_params_t* const render_params);
 
 /*
- * terminal_lines determines the number of lines on the screen the line
- * at iter will use.
+ * Make sure there is a record of what is drawn on each row of the
+ * screen. Returns true if the screen has changed size, and so needs
+ * drawing again in full.
  */
-size_t
-terminal_lines(size_t terminal_width, const buffer_iter_t* const iter);
+bool
+prepare_drawn_lines(render_params_t* const render_params,
+                    const size_t tab_width);
+
+/*
+ * Check whether the rows from row on already show line, starting on
+ * row.
+ */
+bool
+is_line_drawn(const render_params_t* const render_params,
+              const size_t line,
+              const size_t row,
+              const size_t rows);
+
+/*
+ * Draw the line at iter over the rows from row on.
+ */
+void
+draw_line(render_params_t* const render_params,
+          const buffer_iter_t* const iter,
+          highlighter_t* const highlighter,
+          const size_t tab_width,
+          const size_t row,
+          const size_t rows);
+
+/*
+ * Clear the rows from row up to end which still show a line.
+ */
+void
+clear_rows(render_params_t* const render_params,
+           const size_t row,
+           const size_t end);
+
+/*
+ * Segment visitor drawing a line at the cursor, where context is a
+ * line_draw_t.
+ */
+bool
+draw_segment(const char* const data, const size_t length, void* const context);
+
+/*
+ * Place the cursor on the screen, on the rows from row on which show
+ * the line it is on.
+ */
+void
+place_cursor(const editor_state_t* const state,
+             const render_params_t* const render_params,
+             const size_t row,
+             const size_t rows);
 
 /*
- * locate_start_of_render locates the line where the editor should
- * start drawing to screen.
+ * terminal_lines determines the number of lines on the screen the line
+ * at iter will use. Heights are cached with the line, keyed on the
+ * width of the screen and the tab width, and measured through the line
+ * map, which keeps the width of the line it maps as it is edited.
  */
 size_t
-locate_start_of_render(const render_params_t* const params,
-                       buffer_iter_t* render_point);
+terminal_lines(size_t terminal_width,
+               line_map_t* const line_map,
+               const buffer_iter_t* const iter);
 
 void
 render(const editor_state_t* const state, render_params_t* const render_params)
 {
+  const long long start = monotonic_time();
+  screen_t* const screen = render_params->screen;
   buffer_iter_t* render_point;
   copy_buffer_iter(state->point, &render_point);
 
+  damage_t damage;
+  take_damage(state->point, &damage);
+  damage_highlighting(state->highlighter, &damage);
+
+  // Only lines which have changed, or moved on the screen, are drawn
+  const size_t tab_width = state->line_map->tab_width;
+  const bool redraw = prepare_drawn_lines(render_params, tab_width);
+  if (redraw) {
+    screen->erase(screen);
+  }
+
   size_t current = 0;
   size_t row = 0;
+  size_t cursor_rows = 1;
+  const size_t text_rows = render_params->height > modeline_lines
+                             ? render_params->height - modeline_lines
+                             : 0;
 
-  erase();
-  render_modeline(state, render_params);
+  render_params->top_line =
+    locate_start_of_render(render_params, state->line_map, render_point);
+  while (current < text_rows) {
+    const size_t line = line_number(render_point);
+    const size_t rows_left = text_rows - current;
+    const size_t rows =
+      min(terminal_lines(render_params->width, state->line_map, render_point),
+          rows_left);
 
-  render_params->top_line = locate_start_of_render(render_params, render_point);
-  while (current + modeline_lines < render_params->height) {
-    mvprintw(current, 0, "%s", current_line(render_point));
+    if (redraw || is_line_damaged(&damage, line) ||
+        is_highlighting_damaged(state->highlighter, render_point) ||
+        !is_line_drawn(render_params, line, current, rows)) {
+      draw_line(render_params,
+                render_point,
+                state->highlighter,
+                tab_width,
+                current,
+                rows);
+    }
 
-    if (current_line(render_point) == current_line(state->point)) {
+    if (line == line_number(state->point)) {
       row = current;
+      cursor_rows = rows;
     }
 
+    current += rows;
     if (is_last_line(render_point)) {
       break;
     }
 
-    current += terminal_lines(render_params->width, render_point);
     move_iter_down_line(render_point);
   }
+  clear_rows(render_params, current, text_rows);
 
   destroy_buffer_iter(render_point);
 
+  render_modeline(state, render_params);
   render_command_buffer(state, render_params);
 
-  move(row, column(state->point));
+  place_cursor(state, render_params, row, cursor_rows);
+
+  screen->refresh(screen);
+
+  record_time(TIMED_RENDER, start);
+}
+
+void
+place_cursor(const editor_state_t* const state,
+             const render_params_t* const render_params,
+             const size_t row,
+             const size_t rows)
+{
+  const size_t width = render_params->width > 0 ? render_params->width : 1;
+  const size_t screen = screen_column(state->line_map, state->point);
+
+  // Lines wider than the screen wrap onto the rows below, and the
+  // cursor stays on the last row shown of a line cut off at the bottom
+  const size_t wraps = screen / width;
+  const size_t last_row = rows > 0 ? rows - 1 : 0;
+  const size_t down = min(wraps, last_row);
+
+  render_params->screen->move(render_params->screen,
+                              row + down,
+                              wraps > last_row ? width - 1 : screen % width);
+}
+
+bool
+prepare_drawn_lines(render_params_t* const render_params,
+                    const size_t tab_width)
+{
+  if (render_params->drawn_lines &&
+      render_params->drawn_height == render_params->height &&
+      render_params->drawn_width == render_params->width &&
+      render_params->drawn_tab_width == tab_width) {
+    return false;
+  }
+
+  const size_t rows = max(render_params->height, 1);
+  free(render_params->drawn_lines);
+  render_params->drawn_lines = malloc(sizeof(size_t) * rows);
+  render_params->drawn_height = render_params->height;
+  render_params->drawn_width = render_params->width;
+  render_params->drawn_tab_width = tab_width;
+
+  for (size_t row = 0; render_params->drawn_lines && row < render_params->height;
+       row++) {
+    render_params->drawn_lines[row] = no_line;
+  }
+
+  return true;
+}
+
+bool
+is_line_drawn(const render_params_t* const render_params,
+              const size_t line,
+              const size_t row,
+              const size_t rows)
+{
+  if (render_params->drawn_lines[row] != line) {
+    return false;
+  }
+
+  for (size_t i = row + 1; i < row + rows; i++) {
+    if (render_params->drawn_lines[i] != wrapped_line) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void
+draw_line(render_params_t* const render_params,
+          const buffer_iter_t* const iter,
+          highlighter_t* const highlighter,
+          const size_t tab_width,
+          const size_t row,
+          const size_t rows)
+{
+  screen_t* const screen = render_params->screen;
+
+  for (size_t i = row; i < row + rows; i++) {
+    screen->move(screen, i, 0);
+    screen->clear_to_eol(screen);
+    if (render_params->drawn_lines) {
+      render_params->drawn_lines[i] = i == row ? line_number(iter) : wrapped_line;
+    }
+  }
+
+  // Never hand the screen more of a line than fits on it
+  line_draw_t draw = { .screen = screen,
+                       .tab_width = tab_width,
+                       .limit = rows * render_params->width };
+  draw.spans = highlight_line(highlighter, iter, &draw.span_count);
+  screen->move(screen, row, 0);
+  visit_line(iter, draw_segment, &draw);
+  screen->set_style(screen, HIGHLIGHT_NONE);
+}
+
+void
+clear_rows(render_params_t* const render_params,
+           const size_t row,
+           const size_t end)
+{
+  for (size_t i = row; i < end; i++) {
+    if (render_params->drawn_lines && render_params->drawn_lines[i] != no_line) {
+      render_params->screen->move(render_params->screen, i, 0);
+      render_params->screen->clear_to_eol(render_params->screen);
+      render_params->drawn_lines[i] = no_line;
+    }
+  }
+}
 
-  refresh();
+bool
+draw_segment(const char* const data, const size_t length, void* const context)
+{
+  line_draw_t* const draw = context;
+  screen_t* const screen = draw->screen;
+  utf8_char_t decoded[2];
+  size_t start = 0;
+  size_t i = 0;
+
+  // Stop before the first character which does not fit
+  for (; i < length && draw->column < draw->limit; i++, draw->offset++) {
+    if (draw->next_span < draw->span_count &&
+        draw->spans[draw->next_span].start == draw->offset) {
+      screen->add_text(screen, data + start, i - start);
+      screen->set_style(screen, draw->spans[draw->next_span++].class);
+      start = i;
+    }
+
+    const size_t chars = decode_utf8_byte(&draw->decoder, data[i], decoded);
+    size_t column = draw->column;
+    size_t width = 0;
+    for (size_t j = 0; j < chars; j++) {
+      column += width;
+      width = char_display_width(decoded[j].codepoint, column, draw->tab_width);
+    }
+    if (column + width > draw->limit) {
+      draw->column = draw->limit;
+      break;
+    }
+
+    // Screens have tab stops of their own, so tabs are drawn as spaces
+    if (data[i] == '\t') {
+      screen->add_text(screen, data + start, i - start);
+      for (size_t j = 0; j < width; j++) {
+        screen->add_text(screen, " ", 1);
+      }
+      start = i + 1;
+    }
+    draw->column = column + width;
+  }
+
+  screen->add_text(screen, data + start, i - start);
+
+  return draw->column < draw->limit;
 }
 
 void
 render_modeline(const editor_state_t* const state,
                 const render_params_t* const render_params)
 {
-  attron(A_BOLD);
-  mvprintw(render_params->height - modeline_lines,
-           0,
-           "%d:%d\t%s",
-           line_number(state->point),
-           column(state->point),
-           state->mode->name);
-  attroff(A_BOLD);
+  screen_t* const screen = render_params->screen;
+  char modeline[64];
+  int length = snprintf(modeline,
+                        sizeof(modeline),
+                        "%zu:%zu\t%s",
+                        line_number(state->point),
+                        screen_column(state->line_map, state->point),
+                        state->mode->name);
+
+  // How far a save in the background has got
+  size_t written = 0;
+  size_t total = 0;
+  if (state->save && (size_t)length < sizeof(modeline)) {
+    background_save_progress(state->save, &written, &total);
+    length += snprintf(modeline + length,
+                       sizeof(modeline) - length,
+                       "\twriting %zu%%",
+                       total ? written * 100 / total : 100);
+  }
+
+  screen->move(screen, render_params->height - modeline_lines, 0);
+  screen->clear_to_eol(screen);
+  screen->set_style(screen, STYLE_MODELINE);
+  screen->add_text(screen, modeline, min((size_t)length, sizeof(modeline) - 1));
+  screen->set_style(screen, HIGHLIGHT_NONE);
 }
 
 void
 render_command_buffer(const editor_state_t* const state,
                       const render_params_t* const render_params)
 {
-  mvprintw(
-    render_params->height - 1, 0, "%s", current_line(state->command_buffer));
+  // Messages are shown while no command is being typed
+  screen_t* const screen = render_params->screen;
+  const char* const command = current_line(state->command_buffer);
+  const char* const text = command && *command ? command : state->message;
+
+  screen->move(screen, render_params->height - 1, 0);
+  screen->clear_to_eol(screen);
+  screen->add_text(screen, text, strlen(text));
 }
 
 size_t
-terminal_lines(size_t terminal_width, const buffer_iter_t* const iter)
+terminal_lines(size_t terminal_width,
+               line_map_t* const line_map,
+               const buffer_iter_t* const iter)
 {
-  return chars_in_line(iter) / terminal_width + 1;
+  const size_t tab_width = line_map->tab_width;
+
+  // Screens too wide for the key are not cached, as key 0 never is
+  const size_t key = terminal_width < (1 << tab_key_shift)
+                       ? (tab_width - 1) << tab_key_shift | terminal_width
+                       : 0;
+
+  size_t lines = 0;
+  if (get_line_cache(iter, key, &lines)) {
+    return lines;
+  }
+
+  lines = mapped_line_width(line_map, iter) / terminal_width + 1;
+  set_line_cache(iter, key, lines);
+
+  return lines;
 }
 
 size_t
 locate_start_of_render(const render_params_t* const params,
+                       line_map_t* const line_map,
                        buffer_iter_t* render_point)
 {
   const size_t mintop = min(params->top_line, line_number(render_point));
 
-  for (size_t depth =
-         terminal_lines(params->width, render_point) + modeline_lines;
+  for (size_t depth = terminal_lines(params->width, line_map, render_point) +
+                      modeline_lines;
        line_number(render_point) != mintop;
-       depth += terminal_lines(params->width, render_point)) {
+       depth += terminal_lines(params->width, line_map, render_point)) {
 
-    if (depth + terminal_lines(params->width, render_point) > params->height) {
+    if (depth + terminal_lines(params->width, line_map, render_point) >
+        params->height) {
       break;
     } else {
       move_iter_up_line(render_point);
@@ -124,5 +442,13 @@ locate_start_of_render(const render_params_t* const params,
 void
 update_render_params(render_params_t* const render_params)
 {
-  getmaxyx(stdscr, render_params->height, render_params->width);
+  render_params->screen->size(
+    render_params->screen, &render_params->height, &render_params->width);
+}
+
+void
+destroy_render_params(render_params_t* const render_params)
+{
+  free(render_params->drawn_lines);
+  render_params->drawn_lines = NULL;
 }
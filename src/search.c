@@ -0,0 +1,411 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <search.h>
+
+// Patterns at least this long can fall back on Horspool's algorithm
+// when their first byte turns out to be common
+const size_t horspool_min_length = 8;
+// The first byte is common once one in this many bytes scanned is a
+// false match
+const size_t false_match_ratio = 64;
+// Searches of a snapshot check whether they have been interrupted
+// after scanning this many bytes
+const size_t search_check_bytes = 16 << 20;
+
+/*
+ * The state of a search along a line, which is visited a segment at a
+ * time.
+ */
+typedef struct line_search_t
+{
+  search_t* search;
+
+  // Matches must start at or after from, and before before
+  size_t from;
+  size_t before;
+
+  // Whether to keep looking for the last match, rather than stop at
+  // the nth
+  bool last;
+  size_t nth;
+  size_t matches;
+  size_t found;
+
+  // The column the segment being visited starts at, and the number of
+  // bytes from the end of earlier segments kept in the window
+  size_t offset;
+  size_t carried;
+
+  // Called after every search_check_bytes bytes, if set, and whether
+  // it has stopped the search
+  bool (*interrupted)(void);
+  bool was_interrupted;
+  size_t unchecked;
+} line_search_t;
+
+/*
+ * Find the first match in data with memchr, which libc vectorises,
+ * checking each occurrence of the first byte of the pattern. Long
+ * patterns switch to Horspool's algorithm if the first byte is common.
+ */
+size_t
+find_first_byte(const search_t* const search,
+                const char* const data,
+                const size_t length);
+
+/*
+ * Find the first match in data with Horspool's algorithm.
+ */
+size_t
+find_horspool(const search_t* const search,
+              const char* const data,
+              const size_t length);
+
+/*
+ * Find the nth match in text with search_text, counting back from the
+ * last match if last is set.
+ */
+size_t
+find_nth(line_search_t* const line_search,
+         void (*search_text)(line_search_t* const, const void* const),
+         const void* const text,
+         const bool last,
+         const size_t n,
+         size_t* const matches);
+
+/*
+ * Search the line at iter, for find_nth.
+ */
+void
+search_line(line_search_t* const line_search, const void* const iter);
+
+/*
+ * Search the segments of a snapshot, for find_nth, no more than
+ * search_check_bytes at a time.
+ */
+void
+search_snapshot(line_search_t* const line_search, const void* const snapshot);
+
+/*
+ * Segment visitor searching part of a line.
+ */
+bool
+search_segment(const char* const data, const size_t length, void* const context);
+
+/*
+ * Look for matches in data, which starts at column base, considering
+ * only those which start in the first limit bytes. Returns false once
+ * the search of the line is over.
+ */
+bool
+search_block(line_search_t* const line_search,
+             const char* const data,
+             const size_t length,
+             const size_t base,
+             const size_t limit);
+
+/*
+ * Record a match at column. Returns false once the search of the line
+ * is over.
+ */
+bool
+record_match(line_search_t* const line_search, const size_t column);
+
+error_t
+init_search(search_t* const search,
+            const char* const pattern,
+            const size_t length)
+{
+  char* const copy = malloc(length);
+  char* const window = malloc(2 * length);
+  if (!copy || !window) {
+    free(copy);
+    free(window);
+    return ALLOC_ERROR;
+  }
+
+  memcpy(copy, pattern, length);
+  search->pattern = copy;
+  search->length = length;
+  search->window = window;
+
+  // A window whose last byte is c can be moved along until c lines up
+  // with its last occurrence in the pattern, ignoring the final byte
+  for (size_t c = 0; c < 256; c++) {
+    search->shift[c] = length;
+  }
+  for (size_t i = 0; i + 1 < length; i++) {
+    search->shift[(unsigned char)pattern[i]] = length - 1 - i;
+  }
+
+  return SUCCESS;
+}
+
+void
+destroy_search(search_t* const search)
+{
+  free(search->pattern);
+  free(search->window);
+  search->pattern = NULL;
+  search->window = NULL;
+  search->length = 0;
+}
+
+size_t
+find_substring(const search_t* const search,
+               const char* const data,
+               const size_t length)
+{
+  if (length < search->length) {
+    return SEARCH_NOT_FOUND;
+  }
+
+  return find_first_byte(search, data, length);
+}
+
+size_t
+find_first_byte(const search_t* const search,
+                const char* const data,
+                const size_t length)
+{
+  const char* const pattern = search->pattern;
+  const size_t rest = search->length - 1;
+  const char* const end = data + length - rest;
+  const bool can_switch = search->length >= horspool_min_length;
+  size_t false_matches = 0;
+
+  for (const char* c = data; (c = memchr(c, pattern[0], end - c)); c++) {
+    if (memcmp(c + 1, pattern + 1, rest) == 0) {
+      return c - data;
+    }
+
+    false_matches++;
+    if (can_switch && false_matches * false_match_ratio > (size_t)(c - data) &&
+        false_matches > false_match_ratio) {
+      const size_t found = find_horspool(search, c + 1, data + length - c - 1);
+      return found == SEARCH_NOT_FOUND ? found : found + (c + 1 - data);
+    }
+  }
+
+  return SEARCH_NOT_FOUND;
+}
+
+size_t
+find_horspool(const search_t* const search,
+              const char* const data,
+              const size_t length)
+{
+  const char* const pattern = search->pattern;
+  const size_t rest = search->length - 1;
+  const char last = pattern[rest];
+
+  for (size_t i = 0; i + rest < length;) {
+    const char c = data[i + rest];
+    if (c == last && memcmp(data + i, pattern, rest) == 0) {
+      return i;
+    }
+    i += search->shift[(unsigned char)c];
+  }
+
+  return SEARCH_NOT_FOUND;
+}
+
+size_t
+find_in_line(search_t* const search,
+             const buffer_iter_t* const iter,
+             const size_t from,
+             const size_t before,
+             const bool last,
+             const size_t n,
+             size_t* const matches)
+{
+  line_search_t line_search = { .search = search,
+                                .from = from,
+                                .before = before };
+
+  return find_nth(&line_search, search_line, iter, last, n, matches);
+}
+
+size_t
+find_in_snapshot(search_t* const search,
+                 const buffer_snapshot_t* const snapshot,
+                 const size_t from,
+                 const size_t before,
+                 const bool last,
+                 const size_t n,
+                 size_t* const matches,
+                 bool (*interrupted)(void),
+                 bool* const was_interrupted)
+{
+  line_search_t line_search = { .search = search,
+                                .from = from,
+                                .before = before,
+                                .interrupted = interrupted };
+
+  const size_t found =
+    find_nth(&line_search, search_snapshot, snapshot, last, n, matches);
+  *was_interrupted = line_search.was_interrupted;
+
+  return found;
+}
+
+size_t
+find_nth(line_search_t* const line_search,
+         void (*search_text)(line_search_t* const, const void* const),
+         const void* const text,
+         const bool last,
+         const size_t n,
+         size_t* const matches)
+{
+  line_search->last = last;
+  line_search->nth = n;
+  line_search->found = SEARCH_NOT_FOUND;
+  search_text(line_search, text);
+  *matches = line_search->matches;
+
+  if (!last || line_search->was_interrupted) {
+    return line_search->found;
+  }
+  if (line_search->matches < n) {
+    return SEARCH_NOT_FOUND;
+  }
+  if (n == 1) {
+    return line_search->found;
+  }
+
+  // Counting back needs the number of matches, so the text is searched
+  // again for the one that many from the start
+  line_search->last = false;
+  line_search->nth = line_search->matches - n + 1;
+  line_search->matches = 0;
+  line_search->found = SEARCH_NOT_FOUND;
+  line_search->offset = 0;
+  line_search->carried = 0;
+  search_text(line_search, text);
+
+  return line_search->found;
+}
+
+void
+search_line(line_search_t* const line_search, const void* const iter)
+{
+  visit_line(iter, search_segment, line_search);
+}
+
+void
+search_snapshot(line_search_t* const line_search, const void* const snapshot)
+{
+  const buffer_snapshot_t* const text = snapshot;
+
+  for (size_t i = 0; i < text->count; i++) {
+    const text_segment_t* const segment = &text->segments[i];
+    for (size_t done = 0; done < segment->length;) {
+      const size_t left = segment->length - done;
+      const size_t span = min(left, search_check_bytes);
+      if (!search_segment(segment->data + done, span, line_search)) {
+        return;
+      }
+      done += span;
+    }
+  }
+}
+
+bool
+search_segment(const char* const data, const size_t length, void* const context)
+{
+  line_search_t* const line_search = context;
+  char* const window = line_search->search->window;
+  const size_t keep = line_search->search->length - 1;
+  const size_t carried = line_search->carried;
+
+  if (line_search->offset - carried >= line_search->before) {
+    return false;
+  }
+
+  if (line_search->interrupted) {
+    line_search->unchecked += length;
+    if (line_search->unchecked >= search_check_bytes) {
+      line_search->unchecked = 0;
+      if (line_search->interrupted()) {
+        line_search->was_interrupted = true;
+        return false;
+      }
+    }
+  }
+
+  // Matches which start in earlier segments and end in this one are
+  // found by joining the two in the window
+  const size_t joined = min(keep, length);
+  if (carried > 0) {
+    memcpy(window + carried, data, joined);
+    if (!search_block(line_search,
+                      window,
+                      carried + joined,
+                      line_search->offset - carried,
+                      carried)) {
+      return false;
+    }
+  }
+
+  if (!search_block(line_search, data, length, line_search->offset, length)) {
+    return false;
+  }
+
+  // Keep the end of what has been seen, up to a byte short of a match
+  if (length >= keep) {
+    memcpy(window, data + length - keep, keep);
+    line_search->carried = keep;
+  } else {
+    if (carried == 0) {
+      memcpy(window, data, length);
+    }
+    const size_t total = carried + length;
+    const size_t kept = min(keep, total);
+    memmove(window, window + total - kept, kept);
+    line_search->carried = kept;
+  }
+  line_search->offset += length;
+
+  return true;
+}
+
+bool
+search_block(line_search_t* const line_search,
+             const char* const data,
+             const size_t length,
+             const size_t base,
+             const size_t limit)
+{
+  size_t start = line_search->from > base ? line_search->from - base : 0;
+
+  while (start < limit) {
+    const size_t found =
+      find_substring(line_search->search, data + start, length - start);
+    if (found == SEARCH_NOT_FOUND || start + found >= limit) {
+      return true;
+    }
+    if (!record_match(line_search, base + start + found)) {
+      return false;
+    }
+    start += found + 1;
+  }
+
+  return true;
+}
+
+bool
+record_match(line_search_t* const line_search, const size_t column)
+{
+  if (column >= line_search->before) {
+    return false;
+  }
+
+  line_search->matches++;
+  if (line_search->last || line_search->matches == line_search->nth) {
+    line_search->found = column;
+  }
+
+  return line_search->last || line_search->matches < line_search->nth;
+}
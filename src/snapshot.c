@@ -0,0 +1,124 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <snapshot.h>
+
+// Newlines not already in the buffer's storage are taken from here
+static const char snapshot_newline = '\n';
+
+error_t
+add_snapshot_segment(buffer_snapshot_t* const snapshot,
+                     const char* const data,
+                     const size_t length)
+{
+  if (length == 0) {
+    return SUCCESS;
+  }
+  snapshot->bytes += length;
+
+  text_segment_t* const last =
+    snapshot->count > 0 ? &snapshot->segments[snapshot->count - 1] : NULL;
+  if (last && last->data + last->length == data) {
+    last->length += length;
+    return SUCCESS;
+  }
+
+  // As when writing, the newline between two lines split from a mapped
+  // file can be taken from the file. The byte between two segments
+  // lies in the same object as they do, so it can be read.
+  text_segment_t* const before = snapshot->count > 1 ? last - 1 : NULL;
+  if (before && last->data == &snapshot_newline &&
+      before->data + before->length + 1 == data && data[-1] == '\n') {
+    before->length += length + 1;
+    snapshot->count--;
+    return SUCCESS;
+  }
+
+  if (snapshot->count == snapshot->capacity) {
+    const size_t new_capacity = max(2 * snapshot->capacity, 64);
+    text_segment_t* const new_segments =
+      realloc(snapshot->segments, sizeof(text_segment_t) * new_capacity);
+    if (!new_segments) {
+      snapshot->bytes -= length;
+      return ALLOC_ERROR;
+    }
+    snapshot->segments = new_segments;
+    snapshot->capacity = new_capacity;
+  }
+
+  snapshot->segments[snapshot->count++] =
+    (text_segment_t){ .data = data, .length = length };
+
+  return SUCCESS;
+}
+
+error_t
+add_snapshot_newline(buffer_snapshot_t* const snapshot)
+{
+  return add_snapshot_segment(snapshot, &snapshot_newline, 1);
+}
+
+size_t
+skip_snapshot_lines(const buffer_snapshot_t* const snapshot,
+                    const size_t from,
+                    const size_t count)
+{
+  size_t left = count;
+  size_t base = 0;
+
+  for (size_t i = 0; i < snapshot->count && left > 0; i++) {
+    const text_segment_t* const segment = &snapshot->segments[i];
+    const char* const end = segment->data + segment->length;
+    const size_t ahead = from > base ? from - base : 0;
+    const size_t skipped = min(ahead, segment->length);
+    const char* c = segment->data + skipped;
+    while (left > 0 && (c = memchr(c, '\n', end - c))) {
+      c++;
+      left--;
+    }
+    if (left == 0) {
+      return base + (c - segment->data);
+    }
+    base += segment->length;
+  }
+
+  return count > 0 ? snapshot->bytes : from;
+}
+
+size_t
+count_snapshot_lines(const buffer_snapshot_t* const snapshot,
+                     const size_t from,
+                     const size_t offset,
+                     size_t* const line_start)
+{
+  size_t lines = 0;
+  size_t base = 0;
+  *line_start = from;
+
+  for (size_t i = 0; i < snapshot->count && base < offset; i++) {
+    const text_segment_t* const segment = &snapshot->segments[i];
+    if (base + segment->length > from) {
+      const size_t skipped = from > base ? from - base : 0;
+      const size_t until = offset - base;
+      const size_t length = min(until, segment->length);
+      const char* const end = segment->data + length;
+      for (const char* c = segment->data + skipped;
+           (c = memchr(c, '\n', end - c));
+           lines++) {
+        c++;
+        *line_start = base + (c - segment->data);
+      }
+    }
+    base += segment->length;
+  }
+
+  return lines;
+}
+
+void
+destroy_snapshot(buffer_snapshot_t* const snapshot)
+{
+  free(snapshot->segments);
+  *snapshot = (buffer_snapshot_t){ 0 };
+}
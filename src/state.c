@@ -1,4 +1,48 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <grep.h>
 #include <state.h>
+#include <stats.h>
+
+// Searches look for matches this many lines either side of the cursor
+// line by line. Past them, the whole buffer is searched through a
+// snapshot, which takes a walk of the buffer but then scans its text
+// in large spans
+const size_t nearby_search_lines = 256;
+
+/*
+ * Start the journal afresh once the text as it was at position in the
+ * journal has been saved.
+ */
+void
+restart_journal_after_save(editor_state_t* const state, const size_t position);
+
+/*
+ * Stop journalling after the journal could not be written, telling the
+ * user.
+ */
+void
+give_up_journal(editor_state_t* const state);
+
+/*
+ * Carry on a search for the remaining'th match through a snapshot of
+ * the whole buffer, having passed seen matches in the lines from the
+ * cursor's to searched. Where the match is found is left in found_line
+ * and found_column, and wrapped is set if the search went past the end
+ * of the buffer to get there.
+ */
+search_result_t
+search_whole_buffer(editor_state_t* const state,
+                    const bool backwards,
+                    const size_t searched,
+                    size_t seen,
+                    size_t remaining,
+                    size_t* const found_line,
+                    size_t* const found_column,
+                    bool* const wrapped);
 
 editor_state_t*
 new_editor_state(const char* const filename)
@@ -11,7 +55,14 @@ new_editor_state(const char* const filename)
     if (state) {
       state->point = buffer;
       state->terminate = false;
+      state->jobs = 1;
+      state->sync_mode = SYNC_DATA;
       state->command_buffer = new_buffer();
+      state->line_map = malloc(sizeof(line_map_t));
+      if (state->line_map) {
+        init_line_map(state->line_map);
+      }
+      state->highlighter = new_highlighter(filename);
       switch_mode(state, NORMAL);
     }
   }
@@ -23,11 +74,24 @@ new_editor_state(const char* const filename)
 
   if (state && !state->command_buffer) {
     destroy_buffer(buffer);
+    free(state->line_map);
+    destroy_highlighter(state->highlighter);
     free(state);
     state = NULL;
   }
 
-  state->filename = filename;
+  if (state && (!state->line_map || !state->highlighter)) {
+    destroy_buffer(buffer);
+    destroy_buffer(state->command_buffer);
+    free(state->line_map);
+    destroy_highlighter(state->highlighter);
+    free(state);
+    state = NULL;
+  }
+
+  if (state) {
+    state->filename = filename;
+  }
 
   return state;
 }
@@ -35,9 +99,20 @@ new_editor_state(const char* const filename)
 void
 destroy_editor_state(editor_state_t* state)
 {
-  state->point = NULL;
+  // The threads of the highlighter and of any save must be gone before
+  // the buffer is. The journal is only needed if the editor does not
+  // get this far, or to recover edits from again if they have not been
+  // saved since they were recovered.
+  wait_for_save(state);
+  close_journal(state->journal, state->recovered);
+  destroy_highlighter(state->highlighter);
   destroy_buffer(state->point);
   destroy_buffer(state->command_buffer);
+  destroy_search(&state->search);
+  destroy_regexp(state->regexp);
+  destroy_line_map(state->line_map);
+  free(state->line_map);
+  state->point = NULL;
   free(state);
 }
 
@@ -47,6 +122,17 @@ switch_mode(editor_state_t* const state, editor_mode_t mode)
   state->mode = get_mode_handle(mode);
 }
 
+error_t
+update(const event_t event, editor_state_t* const state)
+{
+  const long long start = monotonic_time();
+  state->message[0] = '\0';
+  const error_t ret = (state->mode->handler)(event, state);
+  record_time(TIMED_UPDATE, start);
+
+  return ret;
+}
+
 bool
 should_quit(const editor_state_t* const state)
 {
@@ -56,22 +142,78 @@ should_quit(const editor_state_t* const state)
 error_t
 open_line(editor_state_t* const state)
 {
+  const size_t line = line_number(state->point);
   error_t ret = append_line_at_point(state->point);
 
   if (ret == SUCCESS) {
+    record_open_line(state->journal, line);
     move_cursor_down(state);
     move_to_beginning_of_line(state->point);
+    state->has_goal = false;
     switch_mode(state, INSERT);
   }
 
   return ret;
 }
 
+error_t
+type_character(editor_state_t* const state, const char c)
+{
+  const size_t line = line_number(state->point);
+  const size_t offset = column(state->point);
+  const size_t version = buffer_version(state->point);
+  const error_t ret = insert_character_at_point(state->point, c);
+
+  if (ret == SUCCESS) {
+    record_insert(state->journal, line, offset, &c, 1);
+    edit_line_map(state->line_map, state->point, version, offset, 0, 1);
+  }
+
+  return ret;
+}
+
+void
+move_cursor_left(editor_state_t* const state, const size_t count)
+{
+  move_iter_to_column(
+    state->point, previous_char_column(state->line_map, state->point, count));
+}
+
+void
+move_cursor_right(editor_state_t* const state, const size_t count)
+{
+  move_iter_to_column(
+    state->point, next_char_column(state->line_map, state->point, count));
+}
+
+void
+delete_char_before_cursor(editor_state_t* const state)
+{
+  const size_t line = line_number(state->point);
+  const size_t end = column(state->point);
+
+  if (end == 0) {
+    delete_character_at_point(state->point);
+    record_delete(state->journal, line, end, 1);
+    return;
+  }
+
+  const size_t start =
+    previous_char_column(state->line_map, state->point, 1);
+  const size_t version = buffer_version(state->point);
+  while (column(state->point) > start) {
+    delete_character_at_point(state->point);
+  }
+  record_delete(state->journal, line, end, end - start);
+  edit_line_map(
+    state->line_map, state->point, version, start, end - start, 0);
+}
+
 void
 move_cursor_up(editor_state_t* const state)
 {
   if (!is_first_line(state->point)) {
-    move_iter_up_line(state->point);
+    move_cursor_to_line(state, line_number(state->point) - 1);
   }
 }
 
@@ -79,6 +221,422 @@ void
 move_cursor_down(editor_state_t* const state)
 {
   if (!is_last_line(state->point)) {
-    move_iter_down_line(state->point);
+    move_cursor_to_line(state, line_number(state->point) + 1);
+  }
+}
+
+void
+move_cursor_to_line(editor_state_t* const state, const size_t line)
+{
+  buffer_iter_t* const point = state->point;
+
+  // Keep the goal of the motion which left the cursor here, which may
+  // be past the end of the line
+  const bool keep_goal = state->has_goal &&
+                         state->goal_line == line_number(point) &&
+                         state->goal_offset == column(point) &&
+                         state->goal_version == buffer_version(point);
+  const size_t goal = keep_goal ? state->goal_column
+                                : screen_column(state->line_map, point);
+
+  // Neighbouring lines are a step away, where the line index is not
+  // needed
+  if (line == line_number(point) + 1 && !is_last_line(point)) {
+    move_iter_down_line(point);
+  } else if (line_number(point) > 0 && line == line_number(point) - 1) {
+    move_iter_up_line(point);
+  } else {
+    move_iter_to_line(point, line);
+  }
+  move_iter_to_column(point,
+                      column_at_screen_column(state->line_map, point, goal));
+
+  state->has_goal = true;
+  state->goal_column = goal;
+  state->goal_line = line_number(point);
+  state->goal_offset = column(point);
+  state->goal_version = buffer_version(point);
+}
+
+void
+delete_lines(editor_state_t* const state, size_t count)
+{
+  const size_t line = line_number(state->point);
+  size_t deleted = 0;
+
+  // Deleting the last line moves the cursor up, so stop there rather
+  // than eating into the lines above
+  for (; count > 0; count--) {
+    const bool last = is_last_line(state->point);
+    delete_line_at_point(state->point);
+    deleted++;
+    if (last) {
+      break;
+    }
+  }
+  record_delete_lines(state->journal, line, deleted);
+}
+
+error_t
+paste_text(editor_state_t* const state,
+           const char* const text,
+           const size_t length)
+{
+  if (state->mode != get_mode_handle(COMMAND)) {
+    const size_t line = line_number(state->point);
+    const size_t offset = column(state->point);
+    const size_t version = buffer_version(state->point);
+    const error_t ret = insert_string_at_point(state->point, text, length);
+    if (ret == SUCCESS) {
+      record_insert(state->journal, line, offset, text, length);
+    }
+    // Text of more than one line leaves the line map to start afresh
+    if (ret == SUCCESS && !memchr(text, '\n', length)) {
+      edit_line_map(state->line_map, state->point, version, offset, 0, length);
+    }
+    return ret;
+  }
+
+  error_t ret = SUCCESS;
+  for (size_t i = 0; i < length && ret == SUCCESS; i++) {
+    ret = (state->mode->handler)((unsigned char)text[i], state);
+  }
+
+  return ret;
+}
+
+void
+search_for(editor_state_t* const state,
+           const char* const pattern,
+           const bool backwards)
+{
+  const size_t length = strlen(pattern);
+
+  if (length > 0) {
+    search_t search;
+    if (init_search(&search, pattern, length) != SUCCESS) {
+      set_message(state, "Out of memory");
+      return;
+    }
+    destroy_search(&state->search);
+    state->search = search;
   }
+
+  state->search_backwards = backwards;
+  repeat_search(state, false, 1);
+}
+
+search_result_t
+repeat_search(editor_state_t* const state,
+              const bool reverse,
+              const size_t count)
+{
+  search_t* const search = &state->search;
+  buffer_iter_t* iter = NULL;
+
+  if (!search->pattern) {
+    set_message(state, "No previous search");
+    return SEARCH_NO_MATCH;
+  }
+  if (copy_buffer_iter(state->point, &iter) != SUCCESS) {
+    set_message(state, "Out of memory");
+    return SEARCH_NO_MATCH;
+  }
+
+  const bool backwards = state->search_backwards != reverse;
+  const size_t start_column = column(iter);
+  const size_t wanted = count > 0 ? count : 1;
+  size_t remaining = wanted;
+  size_t found = SEARCH_NOT_FOUND;
+
+  for (size_t lines = 0;; lines++) {
+    const size_t from = lines == 0 && !backwards ? start_column + 1 : 0;
+    const size_t before = lines == 0 && backwards ? start_column : SIZE_MAX;
+    size_t matches = 0;
+    found =
+      find_in_line(search, iter, from, before, backwards, remaining, &matches);
+    remaining -= matches;
+
+    if (found != SEARCH_NOT_FOUND || lines == nearby_search_lines ||
+        (backwards ? is_first_line(iter) : is_last_line(iter))) {
+      break;
+    }
+    if (backwards) {
+      move_iter_up_line(iter);
+    } else {
+      move_iter_down_line(iter);
+    }
+  }
+
+  size_t line = line_number(iter);
+  bool wrapped = false;
+  destroy_buffer_iter(iter);
+
+  search_result_t result = SEARCH_FOUND;
+  if (found == SEARCH_NOT_FOUND) {
+    result = search_whole_buffer(state,
+                                 backwards,
+                                 line,
+                                 wanted - remaining,
+                                 remaining,
+                                 &line,
+                                 &found,
+                                 &wrapped);
+  }
+
+  if (result == SEARCH_FOUND) {
+    move_cursor_to_line(state, line);
+    move_iter_to_column(state->point, found);
+    if (wrapped) {
+      set_message(state,
+                  backwards ? "Search hit TOP, continuing at BOTTOM"
+                            : "Search hit BOTTOM, continuing at TOP");
+    }
+  }
+
+  return result;
+}
+
+search_result_t
+search_whole_buffer(editor_state_t* const state,
+                    const bool backwards,
+                    const size_t searched,
+                    size_t seen,
+                    size_t remaining,
+                    size_t* const found_line,
+                    size_t* const found_column,
+                    bool* const wrapped)
+{
+  buffer_snapshot_t snapshot;
+  if (take_buffer_snapshot(state->point, &snapshot) != SUCCESS) {
+    set_message(state, "Out of memory");
+    return SEARCH_NO_MATCH;
+  }
+
+  // The search goes round the buffer from the cursor, first through
+  // the text past the lines already searched up to the end of the
+  // buffer, then from the other end back to the cursor. Offsets into
+  // the text are only turned back into lines once a match is found
+  const size_t start = line_number(state->point);
+  const size_t start_column = column(state->point);
+  size_t ranges[2][2];
+  if (backwards) {
+    const size_t edge = skip_snapshot_lines(&snapshot, 0, searched);
+    const size_t cursor =
+      skip_snapshot_lines(&snapshot, edge, start - searched) + start_column;
+    ranges[0][0] = 0;
+    ranges[0][1] = edge;
+    ranges[1][0] = cursor;
+    ranges[1][1] = SIZE_MAX;
+  } else {
+    const size_t line_start = skip_snapshot_lines(&snapshot, 0, start);
+    const size_t cursor = line_start + start_column;
+    ranges[0][0] =
+      skip_snapshot_lines(&snapshot, line_start, searched - start + 1);
+    ranges[0][1] = SIZE_MAX;
+    ranges[1][0] = 0;
+    ranges[1][1] = cursor + 1;
+  }
+
+  // Once the search has been all the way round, it knows how many
+  // matches there are, and goes round once more for the one wanted
+  size_t found = SEARCH_NOT_FOUND;
+  bool interrupted = false;
+  for (size_t round = 0; round < 2; round++) {
+    for (size_t i = 0; i < 2 && found == SEARCH_NOT_FOUND && !interrupted;
+         i++) {
+      size_t matches = 0;
+      found = find_in_snapshot(&state->search,
+                               &snapshot,
+                               ranges[i][0],
+                               ranges[i][1],
+                               backwards,
+                               remaining,
+                               &matches,
+                               state->interrupted,
+                               &interrupted);
+      remaining -= matches;
+      seen += matches;
+      *wrapped = round > 0 || i > 0;
+    }
+    if (found != SEARCH_NOT_FOUND || interrupted || seen == 0) {
+      break;
+    }
+
+    remaining = (remaining - 1) % seen + 1;
+    if (backwards) {
+      ranges[0][1] = ranges[1][0];
+    } else {
+      ranges[0][0] = ranges[1][1];
+    }
+  }
+
+  if (found != SEARCH_NOT_FOUND) {
+    size_t line_start = 0;
+    *found_line = count_snapshot_lines(&snapshot, 0, found, &line_start);
+    *found_column = found - line_start;
+  }
+  release_buffer_snapshot(state->point, &snapshot);
+
+  if (interrupted) {
+    set_message(state, "Search interrupted");
+    return SEARCH_INTERRUPTED;
+  }
+  if (found == SEARCH_NOT_FOUND) {
+    set_message(state,
+                "Pattern not found: %.*s",
+                (int)state->search.length,
+                state->search.pattern);
+    return SEARCH_NO_MATCH;
+  }
+
+  return SEARCH_FOUND;
+}
+
+void
+grep_for(editor_state_t* const state, const char* const pattern)
+{
+  if (*pattern) {
+    const char* error = NULL;
+    regexp_t* const regexp = new_regexp(pattern, &error);
+    if (!regexp) {
+      set_message(state, "Bad pattern: %s", error);
+      return;
+    }
+    destroy_regexp(state->regexp);
+    state->regexp = regexp;
+  } else if (!state->regexp) {
+    set_message(state, "No previous grep");
+    return;
+  }
+
+  bool interrupted = false;
+  const size_t start = line_number(state->point);
+  const size_t line = grep_buffer(
+    state->point, state->regexp, state->jobs, state->interrupted, &interrupted);
+
+  if (line == SEARCH_NOT_FOUND) {
+    set_message(state, interrupted ? "Grep interrupted" : "Pattern not found");
+    return;
+  }
+
+  move_cursor_to_line(state, line);
+  const size_t found = find_match_in_line(state->point, state->regexp);
+  move_iter_to_column(state->point, found == SEARCH_NOT_FOUND ? 0 : found);
+  if (line <= start) {
+    set_message(state, "Search hit BOTTOM, continuing at TOP");
+  }
+}
+
+void
+set_tab_width(editor_state_t* const state, const size_t tab_width)
+{
+  // The goal column was measured with the old tab stops
+  set_line_map_tab_width(state->line_map, tab_width);
+  state->has_goal = false;
+}
+
+void
+set_message(editor_state_t* const state, const char* const format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  vsnprintf(state->message, sizeof(state->message), format, args);
+  va_end(args);
+}
+
+bool
+save_buffer(editor_state_t* const state)
+{
+  // Saves are made in the order they were asked for
+  if (!wait_for_save(state)) {
+    return false;
+  }
+
+  // Once the text as it is now is in the file, the edits which made it
+  // need not be journalled any more
+  const size_t position = journal_position(state->journal);
+
+  if (!state->save_in_background) {
+    const error_t ret = write_buffer_to_disk(
+      state->point, state->filename, state->sync_mode, &state->origin);
+    if (ret != SUCCESS) {
+      set_message(state, "Could not write %s", state->filename);
+    } else {
+      restart_journal_after_save(state, position);
+    }
+    return ret == SUCCESS;
+  }
+
+  state->save = start_background_save(
+    state->point, state->filename, state->sync_mode, &state->origin);
+  if (!state->save) {
+    set_message(state, "Could not start writing %s", state->filename);
+    return false;
+  }
+  state->save_journal_position = position;
+
+  return true;
+}
+
+void
+check_background_save(editor_state_t* const state)
+{
+  size_t written = 0;
+  size_t total = 0;
+
+  if (state->save &&
+      background_save_progress(state->save, &written, &total)) {
+    wait_for_save(state);
+  }
+}
+
+bool
+wait_for_save(editor_state_t* const state)
+{
+  if (!state->save) {
+    return true;
+  }
+
+  const error_t ret =
+    finish_background_save(state->point, state->save, &state->origin);
+  state->save = NULL;
+
+  if (ret != SUCCESS) {
+    set_message(state, "Could not write %s", state->filename);
+    return false;
+  }
+  set_message(state, "Wrote %s", state->filename);
+  restart_journal_after_save(state, state->save_journal_position);
+
+  return true;
+}
+
+void
+restart_journal_after_save(editor_state_t* const state, const size_t position)
+{
+  if (restart_journal(
+        state->journal, position, state->sync_mode != SYNC_NONE) != SUCCESS) {
+    give_up_journal(state);
+    return;
+  }
+  state->recovered = false;
+}
+
+void
+update_journal(editor_state_t* const state)
+{
+  if (flush_journal(state->journal, state->sync_mode != SYNC_NONE) !=
+      SUCCESS) {
+    give_up_journal(state);
+  }
+}
+
+void
+give_up_journal(editor_state_t* const state)
+{
+  // What was written can still be replayed, so it is left in place
+  close_journal(state->journal, true);
+  state->journal = NULL;
+  set_message(state, "Could not write the journal; edits are not recorded");
 }
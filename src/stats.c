@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <time.h>
+
+#include <stats.h>
+
+static histogram_t histograms[TIMED_OPS];
+
+static const char* const timed_op_names[TIMED_OPS] = {
+  [TIMED_UPDATE] = "update",
+  [TIMED_RENDER] = "render",
+  [TIMED_LOAD] = "load",
+  [TIMED_SAVE] = "save",
+};
+
+/*
+ * Write a duration in nanoseconds to text in the largest unit which
+ * keeps it above 1.
+ */
+void
+format_duration(const long long nanoseconds,
+                char* const text,
+                const size_t size);
+
+/*
+ * Write a byte count to text in the largest binary unit which keeps
+ * it above 1.
+ */
+void
+format_bytes(const size_t bytes, char* const text, const size_t size);
+
+long long
+monotonic_time(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void
+record_time(const timed_op_t op, const long long start)
+{
+  const long long elapsed = monotonic_time() - start;
+  histogram_t* const histogram = &histograms[op];
+
+  size_t bucket = 0;
+  for (unsigned long long rest = elapsed > 0 ? elapsed : 1;
+       rest > 1 && bucket + 1 < STATS_BUCKETS;
+       rest >>= 1) {
+    bucket++;
+  }
+
+  histogram->count++;
+  histogram->total += elapsed;
+  histogram->max = max(histogram->max, elapsed);
+  histogram->buckets[bucket]++;
+}
+
+const histogram_t*
+get_histogram(const timed_op_t op)
+{
+  return &histograms[op];
+}
+
+long long
+histogram_percentile(const histogram_t* const histogram,
+                     const double fraction)
+{
+  const double wanted = fraction * histogram->count;
+  size_t seen = 0;
+
+  for (size_t i = 0; i < STATS_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > 0 && seen >= wanted) {
+      const long long bound = 2LL << i;
+      return min(bound, histogram->max);
+    }
+  }
+
+  return histogram->max;
+}
+
+void
+format_stats_summary(const buffer_iter_t* const iter,
+                     char* const text,
+                     const size_t size)
+{
+  size_t used = 0;
+
+  // The median and 99th percentile of each operation which has run
+  for (size_t op = 0; op < TIMED_OPS && used < size; op++) {
+    const histogram_t* const histogram = &histograms[op];
+    if (histogram->count == 0) {
+      continue;
+    }
+
+    char median[16];
+    char high[16];
+    format_duration(
+      histogram_percentile(histogram, 0.5), median, sizeof(median));
+    format_duration(histogram_percentile(histogram, 0.99), high, sizeof(high));
+    used += snprintf(text + used,
+                     size - used,
+                     "%s %s/%s, ",
+                     timed_op_names[op],
+                     median,
+                     high);
+  }
+
+  buffer_stats_t stats;
+  get_buffer_stats(iter, &stats);
+
+  char cells[16];
+  char lines[16];
+  format_bytes(stats.cell_bytes_reserved, cells, sizeof(cells));
+  format_bytes(stats.line_bytes_reserved, lines, sizeof(lines));
+  if (used < size) {
+    snprintf(text + used,
+             size - used,
+             "%zu lines, %s cells, %s text, %zu allocations",
+             stats.lines,
+             cells,
+             lines,
+             stats.allocations);
+  }
+}
+
+error_t
+write_stats(const buffer_iter_t* const iter, const char* const filename)
+{
+  FILE* const fp = fopen(filename, "w");
+  if (!fp) {
+    return WRITE_ERROR;
+  }
+
+  fprintf(fp,
+          "%-8s %10s %12s %10s %10s %10s %10s %10s\n",
+          "op",
+          "count",
+          "total ns",
+          "mean ns",
+          "p50 ns",
+          "p90 ns",
+          "p99 ns",
+          "max ns");
+  for (size_t op = 0; op < TIMED_OPS; op++) {
+    const histogram_t* const histogram = &histograms[op];
+    fprintf(fp,
+            "%-8s %10zu %12lld %10lld %10lld %10lld %10lld %10lld\n",
+            timed_op_names[op],
+            histogram->count,
+            histogram->total,
+            histogram->count ? histogram->total / (long long)histogram->count
+                             : 0,
+            histogram_percentile(histogram, 0.5),
+            histogram_percentile(histogram, 0.9),
+            histogram_percentile(histogram, 0.99),
+            histogram->max);
+  }
+
+  // Each bucket which has counted anything, as the range of times it
+  // covers
+  for (size_t op = 0; op < TIMED_OPS; op++) {
+    fprintf(fp, "\n%s histogram\n", timed_op_names[op]);
+    for (size_t i = 0; i < STATS_BUCKETS; i++) {
+      if (histograms[op].buckets[i] > 0) {
+        fprintf(fp,
+                "  %12lld - %12lld ns %10zu\n",
+                i > 0 ? 1LL << i : 0,
+                (2LL << i) - 1,
+                histograms[op].buckets[i]);
+      }
+    }
+  }
+
+  buffer_stats_t stats;
+  get_buffer_stats(iter, &stats);
+  fprintf(fp,
+          "\nbuffer\n"
+          "  lines %zu\n"
+          "  cell bytes reserved %zu\n"
+          "  cell bytes used %zu\n"
+          "  line bytes reserved %zu\n"
+          "  line bytes used %zu\n"
+          "  mapped bytes %zu\n"
+          "  allocations %zu\n",
+          stats.lines,
+          stats.cell_bytes_reserved,
+          stats.cell_bytes_used,
+          stats.line_bytes_reserved,
+          stats.line_bytes_used,
+          stats.mapped_bytes,
+          stats.allocations);
+
+  return fclose(fp) == 0 ? SUCCESS : WRITE_ERROR;
+}
+
+void
+format_duration(const long long nanoseconds,
+                char* const text,
+                const size_t size)
+{
+  if (nanoseconds < 1000) {
+    snprintf(text, size, "%lldns", nanoseconds);
+  } else if (nanoseconds < 1000000) {
+    snprintf(text, size, "%lldus", nanoseconds / 1000);
+  } else if (nanoseconds < 1000000000) {
+    snprintf(text, size, "%lldms", nanoseconds / 1000000);
+  } else {
+    snprintf(text, size, "%.1fs", nanoseconds / 1e9);
+  }
+}
+
+void
+format_bytes(const size_t bytes, char* const text, const size_t size)
+{
+  if (bytes < 1 << 10) {
+    snprintf(text, size, "%zuB", bytes);
+  } else if (bytes < 1 << 20) {
+    snprintf(text, size, "%zuK", bytes >> 10);
+  } else if (bytes < 1 << 30) {
+    snprintf(text, size, "%.1fM", bytes / (double)(1 << 20));
+  } else {
+    snprintf(text, size, "%.1fG", bytes / (double)(1 << 30));
+  }
+}
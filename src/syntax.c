@@ -0,0 +1,478 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <syntax.h>
+
+// The state lines left inside a block comment end in
+#define LEX_BLOCK_COMMENT 1
+// Words longer than this are never keywords
+#define KEYWORD_LENGTH_MAX 32
+
+// Span lists start with room for this many spans
+static const size_t initial_span_capacity = 16;
+
+/*
+ * What to highlight in a language. C syntax covers block and line
+ * comments and preprocessor directives; INI syntax covers [sections],
+ * comments starting with ; and the keys of key = value pairs.
+ */
+struct language_t
+{
+  const char* const* names;
+  const char* const* extensions;
+  const char* const* keywords;
+  const char* const* types;
+  bool c_syntax;
+  bool hash_comments;
+  bool ini_syntax;
+};
+
+static const char* const c_keywords[] = {
+  "auto",     "break",    "case",     "const",    "continue", "default",
+  "do",       "else",     "enum",     "extern",   "false",    "for",
+  "goto",     "if",       "inline",   "NULL",     "register", "restrict",
+  "return",   "sizeof",   "static",   "struct",   "switch",   "true",
+  "typedef",  "union",    "volatile", "while",    "_Alignas", "_Alignof",
+  "_Atomic",  "_Generic", "_Noreturn", "_Static_assert",      "_Thread_local",
+  NULL,
+};
+
+static const char* const cpp_keywords[] = {
+  "auto",      "break",     "case",     "catch",     "class",    "const",
+  "constexpr", "continue",  "default",  "delete",    "do",       "else",
+  "enum",      "explicit",  "extern",   "false",     "for",      "friend",
+  "goto",      "if",        "inline",   "namespace", "new",      "noexcept",
+  "nullptr",   "operator",  "override", "private",   "protected", "public",
+  "return",    "sizeof",    "static",   "struct",    "switch",   "template",
+  "this",      "throw",     "true",     "try",       "typedef",  "typename",
+  "union",     "using",     "virtual",  "volatile",  "while",    NULL,
+};
+
+static const char* const c_types[] = {
+  "bool",     "char",     "double",    "float",     "int",      "long",
+  "short",    "signed",   "unsigned",  "void",      "_Bool",    "size_t",
+  "ssize_t",  "ptrdiff_t", "intptr_t", "uintptr_t", "int8_t",   "int16_t",
+  "int32_t",  "int64_t",  "uint8_t",   "uint16_t",  "uint32_t", "uint64_t",
+  "FILE",     NULL,
+};
+
+static const char* const config_keywords[] = {
+  "true", "false", "yes", "no", "on", "off", "null", NULL,
+};
+
+static const char* const c_extensions[] = { "c", "h", NULL };
+static const char* const cpp_extensions[] = { "cc",  "cpp", "cxx",
+                                              "hh",  "hpp", "hxx",
+                                              NULL };
+static const char* const config_extensions[] = {
+  "cfg", "conf", "desktop", "ini", "properties", "service", "toml", "yaml",
+  "yml", NULL,
+};
+static const char* const config_names[] = {
+  "Makefile", "makefile", "GNUmakefile", ".editorconfig", ".gitconfig", NULL,
+};
+static const char* const no_names[] = { NULL };
+
+static const language_t languages[] = {
+  { .names = no_names,
+    .extensions = c_extensions,
+    .keywords = c_keywords,
+    .types = c_types,
+    .c_syntax = true },
+  { .names = no_names,
+    .extensions = cpp_extensions,
+    .keywords = cpp_keywords,
+    .types = c_types,
+    .c_syntax = true },
+  { .names = config_names,
+    .extensions = config_extensions,
+    .keywords = config_keywords,
+    .types = no_names,
+    .hash_comments = true,
+    .ini_syntax = true },
+};
+
+static const size_t language_count = sizeof(languages) / sizeof(languages[0]);
+
+/*
+ * The token being lexed.
+ */
+typedef enum token_t
+{
+  TOKEN_NONE,
+  TOKEN_WORD,
+  TOKEN_DIRECTIVE,
+  TOKEN_NUMBER,
+  TOKEN_STRING,
+  TOKEN_SECTION,
+  TOKEN_LINE_COMMENT,
+  TOKEN_BLOCK_COMMENT
+} token_t;
+
+/*
+ * The state of a line being lexed, a byte at a time.
+ */
+typedef struct lexer_t
+{
+  const language_t* language;
+  span_list_t* spans;
+
+  // The offset of the byte being lexed, the byte before it, and whether
+  // there has been nothing but blanks before it
+  size_t offset;
+  char previous;
+  bool blank;
+
+  // The token being lexed, and the start of the word being lexed
+  token_t token;
+  size_t token_start;
+  char word[KEYWORD_LENGTH_MAX];
+  size_t word_length;
+
+  // Strings end at quote, and block comments at a */ which starts at or
+  // after body_start
+  char quote;
+  bool escaped;
+  size_t body_start;
+
+  // Whether the line is an #include, which makes <file> a string
+  bool include;
+
+  // Whether the line could still start with a key, and where it is
+  bool key;
+  size_t key_start;
+  size_t key_end;
+} lexer_t;
+
+/*
+ * Lex the byte c.
+ */
+void
+lex_byte(lexer_t* const lexer, const char c);
+
+/*
+ * Start the token c begins, if it begins one.
+ */
+void
+start_token(lexer_t* const lexer, const char c);
+
+/*
+ * Finish the word or directive being lexed, which ends before the
+ * current byte.
+ */
+void
+end_word(lexer_t* const lexer);
+
+/*
+ * Track the key at the start of an INI style line, highlighting it
+ * once the = or : after it is lexed.
+ */
+void
+lex_key(lexer_t* const lexer, const char c);
+
+/*
+ * Add a span starting at start, which replaces any spans starting at or
+ * after it.
+ */
+void
+add_span(lexer_t* const lexer,
+         const size_t start,
+         const highlight_class_t class);
+
+/*
+ * Segment visitor lexing part of a line.
+ */
+bool
+lex_segment(const char* const data, const size_t length, void* const context);
+
+/*
+ * Check whether the length bytes of word are one of the words in list,
+ * which ends with NULL.
+ */
+bool
+is_listed(const char* const* list, const char* const word, const size_t length);
+
+bool
+is_word_char(const char c);
+
+const language_t*
+find_language(const char* const filename)
+{
+  if (!filename) {
+    return NULL;
+  }
+
+  const char* const slash = strrchr(filename, '/');
+  const char* const name = slash ? slash + 1 : filename;
+  const char* const dot = strrchr(name, '.');
+
+  for (size_t i = 0; i < language_count; i++) {
+    if (is_listed(languages[i].names, name, strlen(name)) ||
+        (dot && dot != name &&
+         is_listed(languages[i].extensions, dot + 1, strlen(dot + 1)))) {
+      return &languages[i];
+    }
+  }
+
+  return NULL;
+}
+
+lex_state_t
+lex_line(const language_t* const language,
+         const buffer_iter_t* const iter,
+         const lex_state_t state,
+         span_list_t* const spans)
+{
+  lexer_t lexer = { .language = language,
+                    .spans = spans,
+                    .blank = true,
+                    .key = language->ini_syntax };
+
+  if (spans) {
+    spans->count = 0;
+  }
+  if (state == LEX_BLOCK_COMMENT) {
+    lexer.token = TOKEN_BLOCK_COMMENT;
+    add_span(&lexer, 0, HIGHLIGHT_COMMENT);
+  }
+
+  visit_line(iter, lex_segment, &lexer);
+
+  if (lexer.token == TOKEN_WORD || lexer.token == TOKEN_DIRECTIVE) {
+    end_word(&lexer);
+  }
+
+  return lexer.token == TOKEN_BLOCK_COMMENT ? LEX_BLOCK_COMMENT : LEX_INITIAL;
+}
+
+void
+destroy_span_list(span_list_t* const spans)
+{
+  free(spans->spans);
+  *spans = (span_list_t){ 0 };
+}
+
+void
+lex_byte(lexer_t* const lexer, const char c)
+{
+  const size_t offset = lexer->offset;
+  const token_t token = lexer->token;
+  char previous = c;
+
+  switch (token) {
+    case TOKEN_NONE:
+      start_token(lexer, c);
+      break;
+    case TOKEN_WORD:
+    case TOKEN_DIRECTIVE:
+      if (is_word_char(c)) {
+        if (lexer->word_length < KEYWORD_LENGTH_MAX) {
+          lexer->word[lexer->word_length] = c;
+        }
+        lexer->word_length++;
+        break;
+      }
+      // Blanks may come between the # and the name of a directive
+      if (token == TOKEN_DIRECTIVE && lexer->word_length == 0 &&
+          (c == ' ' || c == '\t')) {
+        break;
+      }
+      end_word(lexer);
+      start_token(lexer, c);
+      break;
+    case TOKEN_NUMBER:
+      if (is_word_char(c) || c == '.' ||
+          ((c == '+' || c == '-') &&
+           (lexer->previous == 'e' || lexer->previous == 'E' ||
+            lexer->previous == 'p' || lexer->previous == 'P'))) {
+        break;
+      }
+      lexer->token = TOKEN_NONE;
+      add_span(lexer, offset, HIGHLIGHT_NONE);
+      start_token(lexer, c);
+      break;
+    case TOKEN_STRING:
+      if (lexer->escaped) {
+        lexer->escaped = false;
+      } else if (c == '\\' && lexer->quote != '>') {
+        lexer->escaped = true;
+      } else if (c == lexer->quote) {
+        lexer->token = TOKEN_NONE;
+        add_span(lexer, offset + 1, HIGHLIGHT_NONE);
+      }
+      break;
+    case TOKEN_SECTION:
+      if (c == ']') {
+        lexer->token = TOKEN_NONE;
+        add_span(lexer, offset + 1, HIGHLIGHT_NONE);
+      }
+      break;
+    case TOKEN_LINE_COMMENT:
+      break;
+    case TOKEN_BLOCK_COMMENT:
+      if (lexer->previous == '*' && c == '/' && offset > lexer->body_start) {
+        lexer->token = TOKEN_NONE;
+        add_span(lexer, offset + 1, HIGHLIGHT_NONE);
+        // The / can not start another comment
+        previous = '\0';
+      }
+      break;
+  }
+
+  if (lexer->key && token != TOKEN_STRING && token != TOKEN_SECTION &&
+      token != TOKEN_LINE_COMMENT) {
+    lex_key(lexer, c);
+  }
+
+  lexer->previous = previous;
+  lexer->blank = lexer->blank && (c == ' ' || c == '\t');
+  lexer->offset++;
+}
+
+void
+start_token(lexer_t* const lexer, const char c)
+{
+  const language_t* const language = lexer->language;
+  const size_t offset = lexer->offset;
+  const char previous = lexer->previous;
+  const bool after_blank = lexer->blank || previous == ' ' || previous == '\t';
+
+  if (language->c_syntax && previous == '/' && (c == '*' || c == '/')) {
+    lexer->token = c == '*' ? TOKEN_BLOCK_COMMENT : TOKEN_LINE_COMMENT;
+    lexer->body_start = offset + 1;
+    add_span(lexer, offset - 1, HIGHLIGHT_COMMENT);
+  } else if ((language->hash_comments && c == '#' && after_blank) ||
+             (language->ini_syntax && c == ';' && lexer->blank)) {
+    lexer->token = TOKEN_LINE_COMMENT;
+    add_span(lexer, offset, HIGHLIGHT_COMMENT);
+  } else if (language->ini_syntax && c == '[' && lexer->blank) {
+    lexer->token = TOKEN_SECTION;
+    add_span(lexer, offset, HIGHLIGHT_SECTION);
+  } else if (language->c_syntax && c == '#' && lexer->blank) {
+    lexer->token = TOKEN_DIRECTIVE;
+    lexer->word_length = 0;
+    add_span(lexer, offset, HIGHLIGHT_PREPROCESSOR);
+  } else if (c == '"' || (c == '\'' && !is_word_char(previous)) ||
+             (c == '<' && lexer->include)) {
+    lexer->token = TOKEN_STRING;
+    lexer->quote = c == '<' ? '>' : c;
+    lexer->escaped = false;
+    add_span(lexer, offset, HIGHLIGHT_STRING);
+  } else if (c >= '0' && c <= '9') {
+    lexer->token = TOKEN_NUMBER;
+    add_span(lexer, offset, HIGHLIGHT_NUMBER);
+  } else if (is_word_char(c)) {
+    lexer->token = TOKEN_WORD;
+    lexer->token_start = offset;
+    lexer->word[0] = c;
+    lexer->word_length = 1;
+  }
+}
+
+void
+end_word(lexer_t* const lexer)
+{
+  const char* const word = lexer->word;
+  const size_t length = lexer->word_length;
+
+  if (lexer->token == TOKEN_DIRECTIVE) {
+    add_span(lexer, lexer->offset, HIGHLIGHT_NONE);
+    lexer->include = length == 7 && memcmp(word, "include", length) == 0;
+  } else if (is_listed(lexer->language->keywords, word, length)) {
+    add_span(lexer, lexer->token_start, HIGHLIGHT_KEYWORD);
+    add_span(lexer, lexer->offset, HIGHLIGHT_NONE);
+  } else if (is_listed(lexer->language->types, word, length)) {
+    add_span(lexer, lexer->token_start, HIGHLIGHT_TYPE);
+    add_span(lexer, lexer->offset, HIGHLIGHT_NONE);
+  }
+
+  lexer->token = TOKEN_NONE;
+}
+
+void
+lex_key(lexer_t* const lexer, const char c)
+{
+  const size_t offset = lexer->offset;
+
+  if (is_word_char(c) || c == '-' || c == '.') {
+    if (lexer->key_end == 0) {
+      lexer->key_start = offset;
+    }
+    lexer->key_end = offset + 1;
+  } else if ((c == '=' || c == ':') && lexer->key_end > 0) {
+    add_span(lexer, lexer->key_start, HIGHLIGHT_KEY);
+    add_span(lexer, lexer->key_end, HIGHLIGHT_NONE);
+    lexer->key = false;
+  } else if (c != ' ' && c != '\t') {
+    lexer->key = false;
+  }
+}
+
+void
+add_span(lexer_t* const lexer,
+         const size_t start,
+         const highlight_class_t class)
+{
+  span_list_t* const spans = lexer->spans;
+  if (!spans) {
+    return;
+  }
+
+  while (spans->count > 0 && spans->spans[spans->count - 1].start >= start) {
+    spans->count--;
+  }
+
+  const highlight_class_t last =
+    spans->count > 0 ? spans->spans[spans->count - 1].class : HIGHLIGHT_NONE;
+  if (class == last) {
+    return;
+  }
+
+  if (spans->count == spans->capacity) {
+    const size_t capacity =
+      spans->capacity ? 2 * spans->capacity : initial_span_capacity;
+    highlight_span_t* const grown =
+      realloc(spans->spans, sizeof(highlight_span_t) * capacity);
+    if (!grown) {
+      return;
+    }
+    spans->spans = grown;
+    spans->capacity = capacity;
+  }
+
+  spans->spans[spans->count++] = (highlight_span_t){ start, class };
+}
+
+bool
+lex_segment(const char* const data, const size_t length, void* const context)
+{
+  for (size_t i = 0; i < length; i++) {
+    lex_byte(context, data[i]);
+  }
+
+  return true;
+}
+
+bool
+is_listed(const char* const* list, const char* const word, const size_t length)
+{
+  if (length > KEYWORD_LENGTH_MAX) {
+    return false;
+  }
+
+  for (; *list; list++) {
+    if (strncmp(*list, word, length) == 0 && (*list)[length] == '\0') {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool
+is_word_char(const char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '_';
+}
@@ -0,0 +1,206 @@
+#include <utf8.h>
+
+/*
+ * Ranges of codepoints, inclusive, in ascending order.
+ */
+typedef struct codepoint_range_t
+{
+  uint32_t first;
+  uint32_t last;
+} codepoint_range_t;
+
+// Combining marks and other characters drawn over the one before them
+static const codepoint_range_t zero_width[] = {
+  { 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD },
+  { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 },
+  { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x064B, 0x065F },
+  { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+  { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0900, 0x0902 },
+  { 0x093A, 0x093A }, { 0x093C, 0x093C }, { 0x0941, 0x0948 },
+  { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0E31, 0x0E31 },
+  { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E }, { 0x1AB0, 0x1AFF },
+  { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+  { 0x2060, 0x2064 }, { 0x20D0, 0x20FF }, { 0x302A, 0x302D },
+  { 0x3099, 0x309A }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+  { 0xFEFF, 0xFEFF }, { 0xE0100, 0xE01EF },
+};
+
+// Wide and fullwidth characters, which take two columns
+static const codepoint_range_t double_width[] = {
+  { 0x1100, 0x115F },   { 0x231A, 0x231B },   { 0x2329, 0x232A },
+  { 0x23E9, 0x23EC },   { 0x23F0, 0x23F0 },   { 0x23F3, 0x23F3 },
+  { 0x25FD, 0x25FE },   { 0x2614, 0x2615 },   { 0x2648, 0x2653 },
+  { 0x267F, 0x267F },   { 0x2693, 0x2693 },   { 0x26A1, 0x26A1 },
+  { 0x26AA, 0x26AB },   { 0x26BD, 0x26BE },   { 0x26C4, 0x26C5 },
+  { 0x26CE, 0x26CE },   { 0x26D4, 0x26D4 },   { 0x26EA, 0x26EA },
+  { 0x26F2, 0x26F3 },   { 0x26F5, 0x26F5 },   { 0x26FA, 0x26FA },
+  { 0x26FD, 0x26FD },   { 0x2705, 0x2705 },   { 0x270A, 0x270B },
+  { 0x2728, 0x2728 },   { 0x274C, 0x274C },   { 0x274E, 0x274E },
+  { 0x2753, 0x2755 },   { 0x2757, 0x2757 },   { 0x2795, 0x2797 },
+  { 0x27B0, 0x27B0 },   { 0x27BF, 0x27BF },   { 0x2B1B, 0x2B1C },
+  { 0x2B50, 0x2B50 },   { 0x2B55, 0x2B55 },   { 0x2E80, 0x303E },
+  { 0x3041, 0x3247 },   { 0x3250, 0x4DBF },   { 0x4E00, 0xA4C6 },
+  { 0xA960, 0xA97C },   { 0xAC00, 0xD7A3 },   { 0xF900, 0xFAFF },
+  { 0xFE10, 0xFE19 },   { 0xFE30, 0xFE6B },   { 0xFF00, 0xFF60 },
+  { 0xFFE0, 0xFFE6 },   { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18CD5 },
+  { 0x1B000, 0x1B2FB }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF },
+  { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A }, { 0x1F200, 0x1F251 },
+  { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C },
+  { 0x1F37E, 0x1F393 }, { 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 },
+  { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F43E },
+  { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D },
+  { 0x1F54B, 0x1F54E }, { 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A },
+  { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F },
+  { 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 },
+  { 0x1F6D5, 0x1F6D7 }, { 0x1F6EB, 0x1F6EC }, { 0x1F6F4, 0x1F6FC },
+  { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 },
+  { 0x1F947, 0x1F9FF }, { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD },
+  { 0x30000, 0x3FFFD },
+};
+
+/*
+ * Check whether codepoint lies in one of the count ranges.
+ */
+bool
+in_ranges(const codepoint_range_t* const ranges,
+          const size_t count,
+          const uint32_t codepoint);
+
+size_t
+decode_utf8_byte(utf8_decoder_t* const decoder,
+                 const char byte,
+                 utf8_char_t* const decoded)
+{
+  const unsigned char c = byte;
+  size_t count = 0;
+
+  if (decoder->needed > 0) {
+    if ((c & 0xC0) == 0x80) {
+      decoder->codepoint = decoder->codepoint << 6 | (c & 0x3F);
+      decoder->length++;
+      if (--decoder->needed > 0) {
+        return 0;
+      }
+
+      // Overlong encodings, surrogates and codepoints past U+10FFFF
+      // are malformed
+      uint32_t codepoint = decoder->codepoint;
+      if ((decoder->length == 3 && codepoint < 0x800) ||
+          (codepoint >= 0xD800 && codepoint <= 0xDFFF) ||
+          (decoder->length == 4 && codepoint < 0x10000) ||
+          codepoint > 0x10FFFF) {
+        codepoint = UTF8_REPLACEMENT;
+      }
+
+      decoded[0] = (utf8_char_t){ codepoint, decoder->length };
+      decoder->length = 0;
+      return 1;
+    }
+
+    count = finish_utf8(decoder, decoded);
+  }
+
+  // Leads of overlong two byte sequences, and of sequences past
+  // U+10FFFF, can never start a valid sequence
+  if (c < 0x80) {
+    decoded[count++] = (utf8_char_t){ c, 1 };
+  } else if (c >= 0xC2 && c <= 0xDF) {
+    *decoder = (utf8_decoder_t){ c & 0x1F, 1, 1 };
+  } else if (c >= 0xE0 && c <= 0xEF) {
+    *decoder = (utf8_decoder_t){ c & 0x0F, 1, 2 };
+  } else if (c >= 0xF0 && c <= 0xF4) {
+    *decoder = (utf8_decoder_t){ c & 0x07, 1, 3 };
+  } else {
+    decoded[count++] = (utf8_char_t){ UTF8_REPLACEMENT, 1 };
+  }
+
+  return count;
+}
+
+size_t
+finish_utf8(utf8_decoder_t* const decoder, utf8_char_t* const decoded)
+{
+  if (decoder->needed == 0) {
+    return 0;
+  }
+
+  decoded[0] = (utf8_char_t){ UTF8_REPLACEMENT, decoder->length };
+  *decoder = (utf8_decoder_t){ 0 };
+  return 1;
+}
+
+bool
+is_utf8_boundary(const utf8_decoder_t* const decoder)
+{
+  return decoder->needed == 0;
+}
+
+size_t
+encode_utf8(const uint32_t codepoint, char* const text)
+{
+  if (codepoint < 0x80) {
+    text[0] = codepoint;
+    return 1;
+  }
+  if (codepoint < 0x800) {
+    text[0] = 0xC0 | codepoint >> 6;
+    text[1] = 0x80 | (codepoint & 0x3F);
+    return 2;
+  }
+  if (codepoint < 0x10000) {
+    text[0] = 0xE0 | codepoint >> 12;
+    text[1] = 0x80 | (codepoint >> 6 & 0x3F);
+    text[2] = 0x80 | (codepoint & 0x3F);
+    return 3;
+  }
+
+  text[0] = 0xF0 | codepoint >> 18;
+  text[1] = 0x80 | (codepoint >> 12 & 0x3F);
+  text[2] = 0x80 | (codepoint >> 6 & 0x3F);
+  text[3] = 0x80 | (codepoint & 0x3F);
+  return 4;
+}
+
+size_t
+codepoint_width(const uint32_t codepoint)
+{
+  if (codepoint < 0x20 || codepoint == 0x7F) {
+    return 2;
+  }
+  if (codepoint < 0x300) {
+    return 1;
+  }
+  if (in_ranges(zero_width, sizeof(zero_width) / sizeof(zero_width[0]),
+                codepoint)) {
+    return 0;
+  }
+  if (in_ranges(double_width,
+                sizeof(double_width) / sizeof(double_width[0]),
+                codepoint)) {
+    return 2;
+  }
+
+  return 1;
+}
+
+bool
+in_ranges(const codepoint_range_t* const ranges,
+          const size_t count,
+          const uint32_t codepoint)
+{
+  size_t low = 0;
+  size_t high = count;
+
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (codepoint < ranges[middle].first) {
+      high = middle;
+    } else if (codepoint > ranges[middle].last) {
+      low = middle + 1;
+    } else {
+      return true;
+    }
+  }
+
+  return false;
+}